@@ -0,0 +1,386 @@
+// This C++ code is derived from the rust-lang book by Nicholas Matsakis and Aaron Turon.
+// Licensed under the MIT License. See LICENSE file for details.
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+
+#include "HttpConnection.h"
+#include "HttpParser.h"
+#include "Lifecycle.h"
+#include "Listener.h"
+#include "Proxy.h"
+#include "ResponseCache.h"
+#include "Server.h"
+#include "StaticFiles.h"
+#include "Routes.h"
+#include "Upstream.h"
+
+using boost::asio::ip::tcp;
+
+// One Session per accepted connection. Every operation on it is started from
+// a completion handler on the socket's strand, so no two handlers for the same
+// connection ever run concurrently even though io_context.run() is called from
+// several threads.
+class Session : public std::enable_shared_from_this<Session> {
+public:
+    Session(tcp::socket socket, ServerContext& context, UpstreamPool* upstreams)
+        : socket(std::move(socket)),
+          timeout_timer(this->socket.get_executor()),
+          delay_timer(this->socket.get_executor()),
+          parser(context.options.max_header_size, context.options.max_body_size),
+          context(context),
+          upstreams(upstreams),
+          deadline(context.options),
+          accepted(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~Session() {
+        context.metrics.connection_closed();
+    }
+
+    void start() {
+        context.log.connection();
+        context.metrics.connection_opened();
+        socket.native_non_blocking(true);
+        read_requests();
+    }
+
+private:
+    // Cancels whatever the socket is waiting for once the deadline passes; the
+    // weak pointer means a pending timer never keeps a finished session alive.
+    void start_timeout(std::chrono::steady_clock::time_point at) {
+        timeout_timer.expires_at(at);
+        timeout_timer.async_wait([weak = weak_from_this()](boost::system::error_code ec) {
+            // A timer that fired just as its operation completed may only run now, after it was re-armed
+            if (auto self = weak.lock(); self && !ec && self->timeout_timer.expiry() <= std::chrono::steady_clock::now()) {
+                self->socket.cancel();
+            }
+        });
+    }
+
+    void read_requests() {
+        start_timeout(deadline.update(parser, buffer.size()));
+        socket.async_read_some(buffer.prepare(4096),
+            [self = shared_from_this()](boost::system::error_code ec, std::size_t bytes_read) {
+                self->timeout_timer.cancel();
+                if (ec == boost::asio::error::operation_aborted && self->deadline.mid_request()) {
+                    // Too slow: answer with a 408 rather than just hanging up
+                    self->result = self->parser.time_out();
+                    self->read_done = std::chrono::steady_clock::now();
+                    self->process_requests();
+                    return;
+                }
+                if (ec) {
+                    if (ec != boost::asio::error::eof && ec != boost::asio::error::operation_aborted) {
+                        std::cerr << "Error: " << ec.message() << std::endl;
+                    }
+                    return;
+                }
+                self->buffer.commit(bytes_read);
+                self->result = self->parser.parse(self->buffer.data());
+                if (self->result == RequestParser::Result::Incomplete) {
+                    self->read_requests();
+                } else {
+                    self->read_done = std::chrono::steady_clock::now();
+                    self->process_requests();
+                }
+            });
+    }
+
+    // Answers every request the client has pipelined so far, then sends all the
+    // responses in one gathered write.
+    void process_requests() {
+        while (keep_alive && result != RequestParser::Result::Incomplete) {
+            const Request& request = parser.request();
+            if (result == RequestParser::Result::Error) {
+                // There's no telling where a malformed request ends, so answer it and hang up
+                keep_alive = false;
+                respond(error_route(parser.error()));
+                break;
+            }
+            bool proxied = upstreams != nullptr && upstreams->matches(request.path);
+            if (proxied && !batch.empty()) {
+                // The responses queued ahead of it go out first; writing them comes back here
+                write_responses();
+                return;
+            }
+            keep_alive = request.keep_alive && ++requests_served < options.max_requests && !context.draining();
+            if (proxied) {
+                forward();
+                return;
+            }
+
+            const Route& route = routes.find(request.method, request.path);
+            if (route.delay.count() > 0) {
+                // Simulate a slow response; the timer frees this thread for other connections while we wait.
+                // The request stays in the buffer (so its views stay valid) until the timer fires.
+                delay_timer.expires_after(route.delay);
+                delay_timer.async_wait([self = shared_from_this(), &route](boost::system::error_code ec) {
+                    if (!ec) {
+                        self->respond(route);
+                        self->process_requests();
+                    }
+                });
+                return;
+            }
+            respond(route);
+        }
+        write_responses();
+    }
+
+    // Queues the response to the current request, then moves on to the next one in the buffer
+    void respond(const Route& route) {
+        batch.add(context.respond(parser.request(), parser.consumed(), route), parser.request(), keep_alive);
+        ++batch_requests;
+        next_request();
+    }
+
+    void next_request() {
+        buffer.consume(parser.consumed());
+        parser.reset();
+        result = parser.parse(buffer.data());
+    }
+
+    // Streams the current request's response from a backend straight to the socket. The request stays
+    // in the buffer, where the exchange reads it from, until the response is through.
+    void forward() {
+        ProxyExchange::start(socket, *upstreams, parser.request(), keep_alive, options.write_timeout,
+            [self = shared_from_this()](const ProxyExchange::Outcome& outcome) {
+                self->forwarded(outcome);
+            });
+    }
+
+    void forwarded(const ProxyExchange::Outcome& outcome) {
+        if (!outcome.relayed) {
+            // No backend answered: send our own error page the usual way
+            respond(proxy_error_route(outcome.status));
+            process_requests();
+            return;
+        }
+        auto written = std::chrono::steady_clock::now();
+        context.log.request(parser.request(), outcome.status, outcome.bytes_out);
+        context.metrics.request(proxy_route_index, outcome.status, parser.consumed(), outcome.bytes_out);
+        if (first_write) {
+            context.metrics.first_byte(written - accepted);
+            first_write = false;
+        }
+        context.metrics.request_time(written - read_done);
+        keep_alive = outcome.keep_alive;
+        next_request();
+        if (keep_alive) {
+            continue_reading();
+        }
+    }
+
+    // Answers whatever is already buffered, or waits for the next request
+    void continue_reading() {
+        if (result != RequestParser::Result::Incomplete) {
+            process_requests();
+        } else {
+            deadline.restart();
+            read_requests();
+        }
+    }
+
+    // Writes the batch one segment at a time: its buffers in one gathered write, then its file body, if any
+    void write_responses(std::size_t segment_index = 0) {
+        if (segment_index == batch.segments().size()) {
+            auto written = std::chrono::steady_clock::now();
+            if (first_write) {
+                context.metrics.first_byte(written - accepted);
+                first_write = false;
+            }
+            context.metrics.request_time(written - read_done, batch_requests);
+            batch_requests = 0;
+            batch.clear();
+            arena.reset();
+            if (keep_alive) {
+                continue_reading();
+            }
+            return;
+        }
+
+        start_timeout(std::chrono::steady_clock::now() + options.write_timeout);
+        boost::asio::async_write(socket, batch.segments()[segment_index].buffers,
+            [self = shared_from_this(), segment_index](boost::system::error_code ec, std::size_t) {
+                self->timeout_timer.cancel();
+                if (ec) {
+                    std::cerr << "Error: " << ec.message() << std::endl;
+                    return;
+                }
+                self->file_offset = static_cast<off_t>(self->batch.segments()[segment_index].body_offset);
+                self->send_file_body(segment_index);
+            });
+    }
+
+    // Sends the segment's file body with sendfile(2), waiting for the socket to drain whenever it fills up
+    void send_file_body(std::size_t segment_index) {
+        const ResponseBatch::Segment& segment = batch.segments()[segment_index];
+        std::size_t end = segment.body_offset + segment.body_size;
+        while (segment.body_fd >= 0 && static_cast<std::size_t>(file_offset) < end) {
+            boost::system::error_code ec;
+            std::size_t sent = send_file_some(socket, segment.body_fd, file_offset,
+                                              end - static_cast<std::size_t>(file_offset), ec);
+            if (ec == boost::asio::error::would_block) {
+                start_timeout(std::chrono::steady_clock::now() + options.write_timeout);
+                socket.async_wait(tcp::socket::wait_write,
+                    [self = shared_from_this(), segment_index](boost::system::error_code ec) {
+                        self->timeout_timer.cancel();
+                        if (!ec) {
+                            self->send_file_body(segment_index);
+                        }
+                    });
+                return;
+            }
+            if (ec || sent == 0) {
+                std::cerr << "Error: " << (ec ? ec.message() : "file body shrank while sending") << std::endl;
+                return;
+            }
+        }
+        write_responses(segment_index + 1);
+    }
+
+    tcp::socket socket;
+    boost::asio::steady_timer timeout_timer;
+    boost::asio::steady_timer delay_timer;
+    ReceiveBuffer buffer;
+    RequestParser parser;
+    RequestParser::Result result = RequestParser::Result::Incomplete;
+    ServerContext& context;
+    UpstreamPool* upstreams;
+
+    const ConnectionOptions& options = context.options;
+    ReadDeadline deadline;
+    std::size_t requests_served = 0;
+    bool keep_alive = true;
+    ConnectionArena arena;
+    ResponseBatch batch{arena.get()};
+    off_t file_offset = 0;
+
+    std::chrono::steady_clock::time_point accepted;
+    std::chrono::steady_clock::time_point read_done;
+    std::size_t batch_requests = 0;
+    bool first_write = true;
+};
+
+// Accepts until shutdown closes acceptor. Its handlers run on accept_strand,
+// which is also where it's closed.
+void do_accept(tcp::acceptor& acceptor, boost::asio::strand<boost::asio::io_context::executor_type>& accept_strand,
+               ServerContext& context, UpstreamPool* upstreams) {
+    // Each connection gets its own strand so its handlers are serialized without a lock
+    acceptor.async_accept(boost::asio::make_strand(acceptor.get_executor()), boost::asio::bind_executor(accept_strand,
+        [&acceptor, &accept_strand, &context, upstreams](boost::system::error_code ec, tcp::socket socket) {
+            if (!ec) {
+                std::make_shared<Session>(std::move(socket), context, upstreams)->start();
+            } else if (ec != boost::asio::error::operation_aborted) {
+                std::cerr << "Accept error: " << ec.message() << std::endl;
+            }
+            if (acceptor.is_open()) {
+                do_accept(acceptor, accept_strand, context, upstreams);
+            }
+        }));
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        if (argc < 2) {
+            std::cerr << "Usage: " << argv[0] << " <number_of_threads> [--reload] [--log=off|connections|requests]"
+                      << " [--docroot=<dir>] " << connection_options_usage << " " << proxy_options_usage << std::endl;
+            return 1;
+        }
+
+        int num_threads = std::stoi(argv[1]);
+        if (num_threads <= 0) {
+            std::cerr << "The number of threads must be a positive integer." << std::endl;
+            return 1;
+        }
+
+        bool reload = false;
+        LogLevel log_level = LogLevel::Connections;
+        std::string docroot;
+        ConnectionOptions options;
+        ProxyOptions proxy_options;
+        for (int i = 2; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--reload") {
+                reload = true;
+            } else if (arg.starts_with("--log=")) {
+                log_level = parse_log_level(arg.substr(6));
+            } else if (arg.starts_with("--docroot=")) {
+                docroot = arg.substr(10);
+            } else if (parse_connection_option(arg, options)) {
+                // Timeouts and size limits
+            } else if (parse_proxy_option(arg, proxy_options)) {
+                // Where to forward requests under the --proxy prefix
+            } else {
+                std::cerr << "Unknown option " << arg << std::endl;
+                return 1;
+            }
+        }
+
+        // Before any other thread starts, so the signals it handles are blocked in all of them
+        Lifecycle lifecycle(argv, options.drain_timeout);
+
+        ResponseCache cache(reload);
+        cache.add("hello", "HTTP/1.1 200 OK", "../src/util/hello.html");
+        cache.add("not_found", "HTTP/1.1 404 NOT FOUND", "../src/util/404.html");
+        cache.add("bad_request", "HTTP/1.1 400 Bad Request", "../src/util/400.html");
+        cache.add("request_timeout", "HTTP/1.1 408 Request Timeout", "../src/util/408.html");
+        cache.add("body_too_large", "HTTP/1.1 413 Content Too Large", "../src/util/413.html");
+        cache.add("header_too_large", "HTTP/1.1 431 Request Header Fields Too Large", "../src/util/431.html");
+        cache.add("bad_gateway", "HTTP/1.1 502 Bad Gateway", "../src/util/502.html");
+        cache.add("unavailable", "HTTP/1.1 503 Service Unavailable", "../src/util/503.html");
+        cache.add("gateway_timeout", "HTTP/1.1 504 Gateway Timeout", "../src/util/504.html");
+
+        AccessLog log(std::cout, log_level);
+        Metrics metrics(route_labels());
+        // Paths without a route of their own are looked up under the document root
+        std::unique_ptr<StaticFiles> files;
+        if (!docroot.empty()) {
+            files = std::make_unique<StaticFiles>(docroot);
+        }
+        ServerContext context{cache, log, metrics, files.get(), options, &lifecycle};
+
+        boost::asio::io_context io_context(num_threads);
+        std::unique_ptr<UpstreamPool> upstreams;
+        if (!proxy_options.backends.empty()) {
+            upstreams = std::make_unique<UpstreamPool>(io_context, proxy_options);
+            upstreams->start_health_checks();
+        }
+        tcp::acceptor acceptor = open_acceptor(io_context, 7878);
+        auto accept_strand = boost::asio::make_strand(io_context);
+        do_accept(acceptor, accept_strand, context, upstreams.get());
+        lifecycle.on_stop([&] {
+            boost::asio::post(accept_strand, [&acceptor] { acceptor.close(); });
+            if (upstreams) {
+                upstreams->stop();
+            }
+        });
+        lifecycle.ready();
+
+        std::cout << "Asynchronous Server Running with " << num_threads << " threads..." << std::endl;
+
+        // Every thread runs the same io_context; whichever is free picks up the next ready handler.
+        // They return once shutdown has closed the acceptor and every session has ended.
+        std::vector<std::thread> threads;
+        for (int i = 0; i < num_threads; ++i) {
+            threads.emplace_back([&io_context] { io_context.run(); });
+        }
+        if (!lifecycle.drain([&metrics] { return metrics.open_connections() == 0; })) {
+            abandon_connections(context);
+        }
+
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+    catch (std::exception& e) {
+        std::cerr << "Exception: " << e.what() << std::endl;
+    }
+
+    return 0;
+}
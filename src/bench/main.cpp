@@ -0,0 +1,357 @@
+// Load generator for the servers in this repository. Opens many connections
+// from a few threads with Boost.Asio and reports throughput and latency
+// percentiles, so the server modes can be compared on the same machine.
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+
+using boost::asio::ip::tcp;
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string host = "127.0.0.1";
+    std::string port = "7878";
+    std::string path = "/";
+    std::size_t connections = 64;
+    std::size_t threads = std::max(1u, std::thread::hardware_concurrency() / 2);
+    std::chrono::seconds duration{10};
+    std::size_t pipeline = 1;
+    bool keep_alive = true;
+    // Requests per second across all connections; 0 sends the next request as soon as the last one is answered
+    double rate = 0;
+};
+
+// What one connection measured; only touched from that connection's strand until the run is over.
+struct Stats {
+    std::vector<std::uint32_t> latencies_us;
+    std::uint64_t errors = 0;
+    std::uint64_t non_2xx = 0;
+    std::uint64_t bytes = 0;
+};
+
+// One connection's request loop. In closed-loop mode it keeps `pipeline`
+// requests in flight and sends the next burst when they're all answered. In
+// open-loop mode it sends one request every `interval` no matter how slow the
+// server is, and measures each latency from when the request *should* have
+// gone out, so a stalled server can't hide its stall by delaying our sends
+// (coordinated omission).
+class Client : public std::enable_shared_from_this<Client> {
+public:
+    Client(boost::asio::any_io_executor executor, const tcp::resolver::results_type& endpoints,
+           const Options& options, Clock::time_point first_send, Clock::duration interval)
+        : socket(executor),
+          timer(executor),
+          endpoints(endpoints),
+          options(options),
+          next_send(first_send),
+          interval(interval)
+    {
+        std::string one = "GET " + options.path + " HTTP/1.1\r\nHost: " + options.host + "\r\n"
+                        + (options.keep_alive ? "" : "Connection: close\r\n") + "\r\n";
+        std::size_t depth = open_loop() ? 1 : options.pipeline;
+        for (std::size_t i = 0; i < depth; ++i) {
+            request += one;
+        }
+        sent_at.resize(depth);
+    }
+
+    void start() {
+        connect();
+    }
+
+    const Stats& stats() const { return results; }
+
+private:
+    bool open_loop() const { return interval != Clock::duration::zero(); }
+
+    void connect() {
+        boost::asio::async_connect(socket, endpoints,
+            [self = shared_from_this()](boost::system::error_code ec, const tcp::endpoint&) {
+                if (ec) {
+                    self->fail();
+                    return;
+                }
+                self->socket.set_option(tcp::no_delay(true));
+                self->send();
+            });
+    }
+
+    void send() {
+        if (!open_loop()) {
+            std::fill(sent_at.begin(), sent_at.end(), Clock::now());
+            write();
+            return;
+        }
+
+        // Wait for this request's slot; if we're already behind, send at once but still
+        // charge the request for the time it spent waiting to be sent.
+        sent_at[0] = next_send;
+        next_send += interval;
+        if (sent_at[0] <= Clock::now()) {
+            write();
+            return;
+        }
+        timer.expires_at(sent_at[0]);
+        timer.async_wait([self = shared_from_this()](boost::system::error_code ec) {
+            if (!ec) {
+                self->write();
+            }
+        });
+    }
+
+    void write() {
+        boost::asio::async_write(socket, boost::asio::buffer(request),
+            [self = shared_from_this()](boost::system::error_code ec, std::size_t) {
+                if (ec) {
+                    self->fail();
+                    return;
+                }
+                self->answered = 0;
+                self->read_head();
+            });
+    }
+
+    void read_head() {
+        boost::asio::async_read_until(socket, buffer, "\r\n\r\n",
+            [self = shared_from_this()](boost::system::error_code ec, std::size_t head_size) {
+                if (ec) {
+                    self->fail();
+                    return;
+                }
+                self->parse_head(head_size);
+            });
+    }
+
+    void parse_head(std::size_t head_size) {
+        std::string_view head(static_cast<const char*>(buffer.data().data()), head_size);
+        int status = 0;
+        if (head.size() > 12) {
+            std::from_chars(head.data() + 9, head.data() + 12, status);
+        }
+        if (status < 200 || status > 299) {
+            ++results.non_2xx;
+        }
+
+        std::size_t content_length = 0;
+        server_closing = false;
+        for (std::size_t pos = head.find("\r\n"); pos + 2 < head.size(); ) {
+            std::size_t end = head.find("\r\n", pos + 2);
+            std::string_view line = head.substr(pos + 2, end - pos - 2);
+            pos = end;
+            auto lower_starts_with = [line](std::string_view prefix) {
+                return line.size() >= prefix.size() && std::equal(prefix.begin(), prefix.end(), line.begin(),
+                    [](char a, char b) { return a == std::tolower(static_cast<unsigned char>(b)); });
+            };
+            if (lower_starts_with("content-length:")) {
+                std::string_view value = line.substr(15);
+                value.remove_prefix(std::min(value.find_first_not_of(' '), value.size()));
+                std::from_chars(value.data(), value.data() + value.size(), content_length);
+            } else if (lower_starts_with("connection:") && line.find("close") != std::string_view::npos) {
+                server_closing = true;
+            }
+        }
+
+        std::size_t total = head_size + content_length;
+        if (buffer.size() >= total) {
+            complete(total);
+            return;
+        }
+        boost::asio::async_read(socket, buffer, boost::asio::transfer_exactly(total - buffer.size()),
+            [self = shared_from_this(), total](boost::system::error_code ec, std::size_t) {
+                if (ec) {
+                    self->fail();
+                    return;
+                }
+                self->complete(total);
+            });
+    }
+
+    void complete(std::size_t response_size) {
+        auto latency = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - sent_at[answered]);
+        results.latencies_us.push_back(static_cast<std::uint32_t>(latency.count()));
+        results.bytes += response_size;
+        buffer.consume(response_size);
+
+        // A server closing the connection (say, at its keep-alive request limit) won't answer
+        // the rest of a pipelined burst; those requests are resent on a new connection.
+        if (!options.keep_alive || server_closing) {
+            reconnect();
+            return;
+        }
+        if (++answered < sent_at.size()) {
+            read_head();
+            return;
+        }
+        send();
+    }
+
+    void reconnect() {
+        boost::system::error_code ignored;
+        socket.close(ignored);
+        buffer.consume(buffer.size());
+        connect();
+    }
+
+    // Counted, then retried on a fresh connection after a short pause so a dead server isn't hammered
+    void fail() {
+        ++results.errors;
+        boost::system::error_code ignored;
+        socket.close(ignored);
+        buffer.consume(buffer.size());
+        timer.expires_after(std::chrono::milliseconds(10));
+        timer.async_wait([self = shared_from_this()](boost::system::error_code ec) {
+            if (!ec) {
+                self->connect();
+            }
+        });
+    }
+
+    tcp::socket socket;
+    boost::asio::steady_timer timer;
+    const tcp::resolver::results_type& endpoints;
+    const Options& options;
+
+    std::string request;
+    boost::asio::streambuf buffer;
+    std::vector<Clock::time_point> sent_at;
+    std::size_t answered = 0;
+    bool server_closing = false;
+
+    Clock::time_point next_send;
+    Clock::duration interval;
+    Stats results;
+};
+
+void report(const Options& options, const std::vector<std::shared_ptr<Client>>& clients) {
+    Stats total;
+    for (const auto& client : clients) {
+        const Stats& stats = client->stats();
+        total.latencies_us.insert(total.latencies_us.end(), stats.latencies_us.begin(), stats.latencies_us.end());
+        total.errors += stats.errors;
+        total.non_2xx += stats.non_2xx;
+        total.bytes += stats.bytes;
+    }
+    std::sort(total.latencies_us.begin(), total.latencies_us.end());
+
+    double seconds = static_cast<double>(options.duration.count());
+    std::size_t count = total.latencies_us.size();
+    auto percentile = [&total, count](double p) {
+        if (count == 0) {
+            return 0.0;
+        }
+        std::size_t index = std::min(count - 1, static_cast<std::size_t>(p / 100.0 * static_cast<double>(count)));
+        return total.latencies_us[index] / 1000.0;
+    };
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << count << " requests in " << seconds << " s, " << count / seconds << " requests/s, "
+              << total.bytes / seconds / (1024 * 1024) << " MiB/s" << std::endl;
+    std::cout << "Errors: " << total.errors << ", non-2xx responses: " << total.non_2xx << std::endl;
+    std::cout << "Latency (ms): p50 " << percentile(50) << "  p90 " << percentile(90) << "  p99 " << percentile(99)
+              << "  p99.9 " << percentile(99.9) << "  max " << (count ? total.latencies_us.back() / 1000.0 : 0.0)
+              << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        Options options;
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            auto value = [&arg](std::size_t prefix) { return arg.substr(prefix); };
+            if (arg.starts_with("--host=")) {
+                options.host = value(7);
+            } else if (arg.starts_with("--port=")) {
+                options.port = value(7);
+            } else if (arg.starts_with("--path=")) {
+                options.path = value(7);
+            } else if (arg.starts_with("--connections=")) {
+                options.connections = std::stoul(value(14));
+            } else if (arg.starts_with("--threads=")) {
+                options.threads = std::stoul(value(10));
+            } else if (arg.starts_with("--duration=")) {
+                options.duration = std::chrono::seconds(std::stoul(value(11)));
+            } else if (arg.starts_with("--pipeline=")) {
+                options.pipeline = std::stoul(value(11));
+            } else if (arg.starts_with("--rate=")) {
+                options.rate = std::stod(value(7));
+            } else if (arg == "--no-keep-alive") {
+                options.keep_alive = false;
+            } else {
+                std::cerr << "Usage: " << argv[0] << " [--host=127.0.0.1] [--port=7878] [--path=/]"
+                          << " [--connections=64] [--threads=<n>] [--duration=<seconds>] [--pipeline=<depth>]"
+                          << " [--rate=<requests per second>] [--no-keep-alive]" << std::endl;
+                return 1;
+            }
+        }
+        if (options.connections == 0 || options.threads == 0 || options.pipeline == 0 || options.rate < 0) {
+            std::cerr << "--connections, --threads and --pipeline must be positive, and --rate not negative." << std::endl;
+            return 1;
+        }
+        if (options.pipeline > 1 && (options.rate > 0 || !options.keep_alive)) {
+            std::cerr << "--pipeline can't be combined with --rate or --no-keep-alive." << std::endl;
+            return 1;
+        }
+
+        boost::asio::io_context io_context(static_cast<int>(options.threads));
+        tcp::resolver resolver(io_context);
+        tcp::resolver::results_type endpoints = resolver.resolve(options.host, options.port);
+
+        // In open-loop mode each connection carries an equal share of the rate, with
+        // their schedules staggered so the requests don't all go out in bursts.
+        Clock::duration interval = Clock::duration::zero();
+        if (options.rate > 0) {
+            interval = std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(static_cast<double>(options.connections) / options.rate));
+        }
+        Clock::time_point start = Clock::now();
+        std::vector<std::shared_ptr<Client>> clients;
+        for (std::size_t i = 0; i < options.connections; ++i) {
+            Clock::time_point first_send = start + interval * static_cast<long>(i) / static_cast<long>(options.connections);
+            clients.push_back(std::make_shared<Client>(boost::asio::make_strand(io_context), endpoints, options,
+                                                       first_send, interval));
+            clients.back()->start();
+        }
+
+        // Requests still in flight at the deadline are abandoned rather than waited for
+        boost::asio::steady_timer deadline(io_context, start + options.duration);
+        deadline.async_wait([&io_context](boost::system::error_code) { io_context.stop(); });
+
+        std::cout << "Running " << options.duration.count() << " s against " << options.host << ":" << options.port
+                  << options.path << " with " << options.connections << " connections on " << options.threads
+                  << " threads";
+        if (options.rate > 0) {
+            std::cout << " at " << options.rate << " requests/s";
+        } else if (options.pipeline > 1) {
+            std::cout << ", pipelining " << options.pipeline;
+        }
+        std::cout << (options.keep_alive ? "" : ", one request per connection") << "..." << std::endl;
+
+        std::vector<std::thread> threads;
+        for (std::size_t i = 1; i < options.threads; ++i) {
+            threads.emplace_back([&io_context] { io_context.run(); });
+        }
+        io_context.run();
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+
+        report(options, clients);
+    }
+    catch (std::exception& e) {
+        std::cerr << "Exception: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,257 @@
+// This C++ code is derived from the rust-lang book by Nicholas Matsakis and Aaron Turon.
+// Licensed under the MIT License. See LICENSE file for details.
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+
+#include "HttpConnection.h"
+#include "HttpParser.h"
+#include "Lifecycle.h"
+#include "Listener.h"
+#include "ResponseCache.h"
+#include "Server.h"
+#include "StaticFiles.h"
+#include "Routes.h"
+
+using boost::asio::awaitable;
+using boost::asio::co_spawn;
+using boost::asio::detached;
+using boost::asio::use_awaitable;
+using boost::asio::ip::tcp;
+
+// Cancels whatever socket is waiting for once at passes. The weak pointer
+// means a pending timer never outlives the connection's use of it.
+void start_timeout(boost::asio::steady_timer& timer, const std::shared_ptr<tcp::socket>& socket,
+                   std::chrono::steady_clock::time_point at) {
+    timer.expires_at(at);
+    timer.async_wait([weak = std::weak_ptr<tcp::socket>(socket), &timer](boost::system::error_code ec) {
+        // A timer that fired just as its operation completed may only run now, after it was re-armed
+        if (auto socket = weak.lock(); socket && !ec && timer.expiry() <= std::chrono::steady_clock::now()) {
+            socket->cancel();
+        }
+    });
+}
+
+// Sends a segment's file body with sendfile(2), suspending whenever the socket's send buffer is full
+awaitable<void> send_file_body(const std::shared_ptr<tcp::socket>& socket, const ResponseBatch::Segment& segment,
+                               boost::asio::steady_timer& timer, std::chrono::milliseconds timeout) {
+    off_t offset = static_cast<off_t>(segment.body_offset);
+    std::size_t remaining = segment.body_fd >= 0 ? segment.body_size : 0;
+    socket->native_non_blocking(true);
+    while (remaining > 0) {
+        boost::system::error_code ec;
+        std::size_t sent = send_file_some(*socket, segment.body_fd, offset, remaining, ec);
+        if (ec == boost::asio::error::would_block) {
+            start_timeout(timer, socket, std::chrono::steady_clock::now() + timeout);
+            co_await socket->async_wait(tcp::socket::wait_write, use_awaitable);
+            timer.cancel();
+            continue;
+        }
+        if (ec) {
+            throw boost::system::system_error(ec);
+        }
+        if (sent == 0) {
+            throw std::runtime_error("File body shrank while sending");
+        }
+        remaining -= sent;
+    }
+}
+
+// The same routing logic as the blocking servers, but every read, write and
+// wait suspends the coroutine instead of the thread running it.
+awaitable<void> handle_connection(tcp::socket socket, ServerContext& context) {
+    auto accepted = std::chrono::steady_clock::now();
+    context.log.connection();
+    context.metrics.connection_opened();
+
+    // Shared so that a pending timeout can tell whether the connection still exists
+    auto connection = std::make_shared<tcp::socket>(std::move(socket));
+    boost::asio::steady_timer timeout_timer(connection->get_executor());
+
+    try {
+        const ConnectionOptions& options = context.options;
+        ReceiveBuffer buffer;
+        ConnectionArena arena;
+        RequestParser parser(options.max_header_size, options.max_body_size);
+        ReadDeadline deadline(options);
+        std::size_t requests_served = 0;
+        bool keep_alive = true;
+        bool first_write = true;
+
+        while (keep_alive) {
+            RequestParser::Result result = parser.parse(buffer.data());
+            if (result == RequestParser::Result::Incomplete) {
+                start_timeout(timeout_timer, connection, deadline.update(parser, buffer.size()));
+                boost::system::error_code ec;
+                std::size_t bytes_read = co_await connection->async_read_some(
+                    buffer.prepare(4096), boost::asio::redirect_error(use_awaitable, ec));
+                timeout_timer.cancel();
+                if (ec == boost::asio::error::operation_aborted && deadline.mid_request()) {
+                    // Too slow: answer with a 408 rather than just hanging up
+                    result = parser.time_out();
+                } else if (ec) {
+                    break;
+                } else {
+                    buffer.commit(bytes_read);
+                    continue;
+                }
+            }
+
+            // Answer every request the client has pipelined so far, then send all the responses in one write.
+            // The last batch is gone by now, so its arena space can be reused.
+            auto read_done = std::chrono::steady_clock::now();
+            arena.reset();
+            ResponseBatch batch(arena.get());
+            std::size_t batch_requests = 0;
+            while (keep_alive && result != RequestParser::Result::Incomplete) {
+                const Request& request = parser.request();
+                ++batch_requests;
+                if (result == RequestParser::Result::Error) {
+                    // There's no telling where a malformed request ends, so answer it and hang up
+                    keep_alive = false;
+                    batch.add(context.respond(request, 0, error_route(parser.error())), request, keep_alive);
+                    break;
+                }
+                keep_alive = request.keep_alive && ++requests_served < options.max_requests && !context.draining();
+
+                const Route& route = routes.find(request.method, request.path);
+                if (route.delay.count() > 0) {
+                    // Simulate a slow response by waiting without holding a thread
+                    boost::asio::steady_timer timer(connection->get_executor(), route.delay);
+                    co_await timer.async_wait(use_awaitable);
+                }
+
+                batch.add(context.respond(request, parser.consumed(), route), request, keep_alive);
+                buffer.consume(parser.consumed());
+                parser.reset();
+                result = parser.parse(buffer.data());
+            }
+            for (const ResponseBatch::Segment& segment : batch.segments()) {
+                start_timeout(timeout_timer, connection, std::chrono::steady_clock::now() + options.write_timeout);
+                co_await boost::asio::async_write(*connection, segment.buffers, use_awaitable);
+                timeout_timer.cancel();
+                co_await send_file_body(connection, segment, timeout_timer, options.write_timeout);
+            }
+            deadline.restart();
+
+            auto written = std::chrono::steady_clock::now();
+            if (first_write) {
+                context.metrics.first_byte(written - accepted);
+                first_write = false;
+            }
+            context.metrics.request_time(written - read_done, batch_requests);
+        }
+    }
+    catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+    }
+    context.metrics.connection_closed();
+}
+
+// Accepts until shutdown closes acceptor
+awaitable<void> listener(tcp::acceptor& acceptor, ServerContext& context) {
+    while (acceptor.is_open()) {
+        // Each connection runs on its own strand, so its coroutine never resumes on two threads at once
+        boost::system::error_code ec;
+        tcp::socket socket = co_await acceptor.async_accept(
+            boost::asio::make_strand(acceptor.get_executor()), boost::asio::redirect_error(use_awaitable, ec));
+        if (ec) {
+            if (ec != boost::asio::error::operation_aborted) {
+                // Errors like EMFILE persist until something changes, so retrying at once would only spin
+                std::cerr << "Accept error: " << ec.message() << std::endl;
+                boost::asio::steady_timer backoff(acceptor.get_executor(), std::chrono::milliseconds(100));
+                co_await backoff.async_wait(use_awaitable);
+            }
+            continue;
+        }
+        auto executor = socket.get_executor();
+        co_spawn(executor, handle_connection(std::move(socket), context), detached);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        if (argc < 2) {
+            std::cerr << "Usage: " << argv[0] << " <number_of_threads> [--reload] [--log=off|connections|requests]"
+                      << " [--docroot=<dir>] " << connection_options_usage << std::endl;
+            return 1;
+        }
+
+        int num_threads = std::stoi(argv[1]);
+        if (num_threads <= 0) {
+            std::cerr << "The number of threads must be a positive integer." << std::endl;
+            return 1;
+        }
+
+        bool reload = false;
+        LogLevel log_level = LogLevel::Connections;
+        std::string docroot;
+        ConnectionOptions options;
+        for (int i = 2; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--reload") {
+                reload = true;
+            } else if (arg.starts_with("--log=")) {
+                log_level = parse_log_level(arg.substr(6));
+            } else if (arg.starts_with("--docroot=")) {
+                docroot = arg.substr(10);
+            } else if (parse_connection_option(arg, options)) {
+                // Timeouts and size limits
+            } else {
+                std::cerr << "Unknown option " << arg << std::endl;
+                return 1;
+            }
+        }
+
+        // Before any other thread starts, so the signals it handles are blocked in all of them
+        Lifecycle lifecycle(argv, options.drain_timeout);
+
+        ResponseCache cache(reload);
+        cache.add("hello", "HTTP/1.1 200 OK", "../src/util/hello.html");
+        cache.add("not_found", "HTTP/1.1 404 NOT FOUND", "../src/util/404.html");
+        cache.add("bad_request", "HTTP/1.1 400 Bad Request", "../src/util/400.html");
+        cache.add("request_timeout", "HTTP/1.1 408 Request Timeout", "../src/util/408.html");
+        cache.add("body_too_large", "HTTP/1.1 413 Content Too Large", "../src/util/413.html");
+        cache.add("header_too_large", "HTTP/1.1 431 Request Header Fields Too Large", "../src/util/431.html");
+
+        AccessLog log(std::cout, log_level);
+        Metrics metrics(route_labels());
+        // Paths without a route of their own are looked up under the document root
+        std::unique_ptr<StaticFiles> files;
+        if (!docroot.empty()) {
+            files = std::make_unique<StaticFiles>(docroot);
+        }
+        ServerContext context{cache, log, metrics, files.get(), options, &lifecycle};
+
+        boost::asio::io_context io_context(num_threads);
+        tcp::acceptor acceptor = open_acceptor(io_context, 7878);
+        // The listener runs on its own strand, which is also where shutdown closes the acceptor
+        auto accept_strand = boost::asio::make_strand(io_context);
+        co_spawn(accept_strand, listener(acceptor, context), detached);
+        lifecycle.on_stop([&] { boost::asio::post(accept_strand, [&acceptor] { acceptor.close(); }); });
+        lifecycle.ready();
+
+        std::cout << "Coroutine Server Running with " << num_threads << " threads..." << std::endl;
+
+        // The threads return once shutdown has closed the acceptor and every connection has ended
+        std::vector<std::thread> threads;
+        for (int i = 0; i < num_threads; ++i) {
+            threads.emplace_back([&io_context] { io_context.run(); });
+        }
+        if (!lifecycle.drain([&metrics] { return metrics.open_connections() == 0; })) {
+            abandon_connections(context);
+        }
+
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+    catch (std::exception& e) {
+        std::cerr << "Exception: " << e.what() << std::endl;
+    }
+
+    return 0;
+}
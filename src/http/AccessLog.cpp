@@ -0,0 +1,188 @@
+#include "AccessLog.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+std::atomic<std::uint64_t> next_log_id{1};
+
+// Which log the calling thread last wrote to, and its ring there. Logs are
+// told apart by id rather than address, since a new log may reuse a freed one's.
+// The ring is handed back when the thread exits or moves on to another log,
+// through a flag it shares with the ring, so it's safe whichever goes first.
+struct LocalRing {
+    std::uint64_t log_id = 0;
+    void* ring = nullptr;
+    std::shared_ptr<std::atomic<bool>> owned;
+
+    void release() {
+        if (owned) {
+            owned->store(false, std::memory_order_release);
+            owned.reset();
+        }
+    }
+    ~LocalRing() { release(); }
+};
+thread_local LocalRing local;
+
+}
+
+LogLevel parse_log_level(std::string_view name) {
+    if (name == "off") {
+        return LogLevel::Off;
+    }
+    if (name == "connections") {
+        return LogLevel::Connections;
+    }
+    if (name == "requests") {
+        return LogLevel::Requests;
+    }
+    throw std::invalid_argument("--log must be off, connections or requests");
+}
+
+AccessLog::AccessLog(std::ostream& out, LogLevel level, std::chrono::milliseconds flush_interval)
+    : out(out),
+      level(level),
+      flush_interval(flush_interval),
+      id(next_log_id.fetch_add(1))
+{
+    if (level != LogLevel::Off) {
+        writer = std::thread([this] {
+            while (!stopping.load(std::memory_order_acquire)) {
+                std::this_thread::sleep_for(this->flush_interval);
+                flush();
+            }
+        });
+    }
+}
+
+AccessLog::~AccessLog() {
+    stopping.store(true, std::memory_order_release);
+    if (writer.joinable()) {
+        writer.join();
+    }
+    flush();
+}
+
+AccessLog::Ring& AccessLog::local_ring() {
+    if (local.log_id != id) {
+        local.release();
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        // Take over a ring whose thread has gone, so workers coming and going
+        // don't leave the log with ever more rings; whatever it still holds
+        // is drained as usual. Rings are only claimed under the lock.
+        auto it = std::find_if(rings.begin(), rings.end(), [](const std::unique_ptr<Ring>& ring) {
+            return !ring->owned->load(std::memory_order_acquire);
+        });
+        if (it == rings.end()) {
+            rings.push_back(std::make_unique<Ring>());
+            it = rings.end() - 1;
+        }
+        (*it)->owned->store(true, std::memory_order_relaxed);
+        local.log_id = id;
+        local.ring = it->get();
+        local.owned = (*it)->owned;
+    }
+    return *static_cast<Ring*>(local.ring);
+}
+
+void AccessLog::append(const Record& record) {
+    Ring& ring = local_ring();
+    std::size_t head = ring.head.load(std::memory_order_relaxed);
+    if (head - ring.tail.load(std::memory_order_acquire) == Ring::capacity) {
+        dropped_records.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    ring.records[head % Ring::capacity] = record;
+    ring.head.store(head + 1, std::memory_order_release);
+}
+
+void AccessLog::connection() {
+    if (!enabled(LogLevel::Connections)) {
+        return;
+    }
+    Record record{};
+    record.kind = LogLevel::Connections;
+    record.time = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    record.thread = std::this_thread::get_id();
+    append(record);
+}
+
+void AccessLog::request(const Request& request, const CachedResponse& response) {
+    if (enabled(LogLevel::Requests)) {
+        this->request(request, response.status(), response.header_size + response.body_size);
+    }
+}
+
+void AccessLog::request(const Request& request, std::uint16_t status, std::size_t bytes) {
+    if (!enabled(LogLevel::Requests)) {
+        return;
+    }
+    Record record{};
+    record.kind = LogLevel::Requests;
+    record.time = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    record.thread = std::this_thread::get_id();
+    record.status = status;
+    record.bytes = static_cast<std::uint32_t>(bytes);
+    // Long methods and paths are truncated rather than making records variable-sized
+    record.method_size = static_cast<std::uint8_t>(std::min(request.method.size(), sizeof(record.method)));
+    std::copy_n(request.method.data(), record.method_size, record.method);
+    record.path_size = static_cast<std::uint8_t>(std::min(request.path.size(), sizeof(record.path)));
+    std::copy_n(request.path.data(), record.path_size, record.path);
+    append(record);
+}
+
+void AccessLog::format(const Record& record, std::string& line) {
+    if (record.time != formatted_time) {
+        std::ostringstream ss;
+        ss << std::put_time(std::localtime(&record.time), "%Y-%m-%d %X");
+        formatted_timestamp = ss.str();
+        formatted_time = record.time;
+    }
+
+    std::ostringstream thread;
+    thread << record.thread;
+    if (record.kind == LogLevel::Connections) {
+        line += "Thread ID: " + thread.str() + " - Handling connection at " + formatted_timestamp + "\n";
+        return;
+    }
+    line += formatted_timestamp + " " + thread.str() + " \"";
+    line.append(record.method, record.method_size);
+    line += ' ';
+    line.append(record.path, record.path_size);
+    line += "\" " + std::to_string(record.status) + " " + std::to_string(record.bytes) + "\n";
+}
+
+std::size_t AccessLog::ring_count() const {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    return rings.size();
+}
+
+void AccessLog::flush() {
+    std::lock_guard<std::mutex> flush_lock(flush_mutex);
+    std::string batch;
+    {
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        for (const std::unique_ptr<Ring>& ring : rings) {
+            std::size_t tail = ring->tail.load(std::memory_order_relaxed);
+            std::size_t head = ring->head.load(std::memory_order_acquire);
+            for (; tail != head; ++tail) {
+                format(ring->records[tail % Ring::capacity], batch);
+            }
+            ring->tail.store(tail, std::memory_order_release);
+        }
+    }
+
+    std::uint64_t drops = dropped();
+    if (drops != reported_drops) {
+        batch += std::to_string(drops - reported_drops) + " log records dropped\n";
+        reported_drops = drops;
+    }
+    if (!batch.empty()) {
+        out.write(batch.data(), static_cast<std::streamsize>(batch.size()));
+        out.flush();
+    }
+}
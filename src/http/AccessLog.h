@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "HttpParser.h"
+#include "ResponseCache.h"
+
+// Off logs nothing, Connections logs one line per accepted connection (what
+// the servers have always printed) and Requests adds one line per request.
+enum class LogLevel { Off, Connections, Requests };
+
+// Parses the value of a --log= option; throws std::invalid_argument for anything else.
+LogLevel parse_log_level(std::string_view name);
+
+// Logging that never makes a worker wait on the output stream or on another
+// worker. Each thread appends fixed-size records to its own lock-free ring;
+// a background thread drains every ring in batches, formats the records
+// (reformatting the timestamp at most once a second) and writes each batch to
+// out in one call. Records are dropped and counted, never waited for, when a
+// ring is full.
+class AccessLog {
+public:
+    explicit AccessLog(std::ostream& out, LogLevel level = LogLevel::Connections,
+                       std::chrono::milliseconds flush_interval = std::chrono::milliseconds(20));
+    AccessLog(const AccessLog&) = delete;
+    AccessLog& operator=(const AccessLog&) = delete;
+    ~AccessLog();
+
+    bool enabled(LogLevel at) const { return at <= level && level != LogLevel::Off; }
+
+    void connection();
+    void request(const Request& request, const CachedResponse& response);
+    // For responses that weren't cached, such as ones relayed from a backend
+    void request(const Request& request, std::uint16_t status, std::size_t bytes);
+
+    // Writes out everything logged so far; called by the background thread and the destructor
+    void flush();
+
+    std::uint64_t dropped() const { return dropped_records.load(std::memory_order_relaxed); }
+    // Rings handed out so far, never more than threads logging at once
+    std::size_t ring_count() const;
+
+private:
+    struct Record {
+        LogLevel kind;
+        std::time_t time;
+        std::thread::id thread;
+        std::uint16_t status;
+        std::uint32_t bytes;
+        std::uint8_t method_size;
+        std::uint8_t path_size;
+        char method[8];
+        char path[72];
+    };
+
+    // Single-producer/single-consumer ring owned by one logging thread at a
+    // time; once that thread is done with it, the next new one takes it over
+    struct Ring {
+        static constexpr std::size_t capacity = 1024;
+        alignas(64) std::atomic<std::size_t> head{0};
+        alignas(64) std::atomic<std::size_t> tail{0};
+        std::array<Record, capacity> records;
+        std::shared_ptr<std::atomic<bool>> owned = std::make_shared<std::atomic<bool>>(false);
+    };
+
+    Ring& local_ring();
+    void append(const Record& record);
+    void format(const Record& record, std::string& line);
+
+    std::ostream& out;
+    LogLevel level;
+    std::chrono::milliseconds flush_interval;
+    std::uint64_t id;
+
+    mutable std::mutex rings_mutex;
+    std::vector<std::unique_ptr<Ring>> rings;
+    std::atomic<std::uint64_t> dropped_records{0};
+    std::uint64_t reported_drops = 0;
+
+    std::mutex flush_mutex;
+    std::time_t formatted_time = 0;
+    std::string formatted_timestamp;
+
+    std::atomic<bool> stopping{false};
+    std::thread writer;
+};
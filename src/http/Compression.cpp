@@ -0,0 +1,161 @@
+#include "Compression.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <stdexcept>
+
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+namespace {
+
+std::string_view trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+    return s;
+}
+
+bool iequals(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+        return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+    });
+}
+
+// Parses "q=0.5" style weights as thousandths; anything malformed counts as 1
+int parse_qvalue(std::string_view params) {
+    while (!params.empty()) {
+        auto semicolon = params.find(';');
+        std::string_view param = trim(params.substr(0, semicolon));
+        params.remove_prefix(semicolon == std::string_view::npos ? params.size() : semicolon + 1);
+        if (param.size() < 2 || (param[0] != 'q' && param[0] != 'Q') || param[1] != '=') {
+            continue;
+        }
+        // qvalue is a 0 or 1 with up to three decimals (RFC 9110 section 12.4.2)
+        std::string_view value = param.substr(2);
+        const char* value_end = value.data() + value.size();
+        int whole = 0;
+        auto [end, ec] = std::from_chars(value.data(), value_end, whole);
+        if (ec != std::errc() || whole < 0 || whole > 1) {
+            return 1000;
+        }
+        int thousandths = whole * 1000;
+        if (end != value_end) {
+            if (*end != '.' || value_end - (end + 1) > 3) {
+                return 1000;
+            }
+            int scale = 100;
+            for (const char* p = end + 1; p < value_end; ++p, scale /= 10) {
+                if (!std::isdigit(static_cast<unsigned char>(*p))) {
+                    return 1000;
+                }
+                thousandths += (*p - '0') * scale;
+            }
+        }
+        return std::min(thousandths, 1000);
+    }
+    return 1000;
+}
+
+std::string gzip(std::string_view data) {
+    z_stream stream{};
+    // 15 window bits plus 16 selects the gzip wrapper rather than raw zlib
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::runtime_error("deflateInit2 failed");
+    }
+    std::string out(deflateBound(&stream, data.size()), '\0');
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    stream.avail_in = static_cast<uInt>(data.size());
+    stream.next_out = reinterpret_cast<Bytef*>(out.data());
+    stream.avail_out = static_cast<uInt>(out.size());
+    int result = deflate(&stream, Z_FINISH);
+    deflateEnd(&stream);
+    if (result != Z_STREAM_END) {
+        throw std::runtime_error("gzip compression failed");
+    }
+    out.resize(stream.total_out);
+    return out;
+}
+
+}
+
+bool can_encode([[maybe_unused]] Encoding encoding) {
+#ifdef HAVE_BROTLI
+    return true;
+#else
+    return encoding != Encoding::Brotli;
+#endif
+}
+
+std::string compress(std::string_view data, Encoding encoding) {
+    switch (encoding) {
+    case Encoding::Identity:
+        return std::string(data);
+    case Encoding::Gzip:
+        return gzip(data);
+    case Encoding::Brotli:
+#ifdef HAVE_BROTLI
+    {
+        std::string out(BrotliEncoderMaxCompressedSize(data.size()), '\0');
+        std::size_t size = out.size();
+        if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, data.size(),
+                                   reinterpret_cast<const uint8_t*>(data.data()), &size,
+                                   reinterpret_cast<uint8_t*>(out.data()))) {
+            throw std::runtime_error("Brotli compression failed");
+        }
+        out.resize(size);
+        return out;
+    }
+#else
+        throw std::runtime_error("Built without Brotli support");
+#endif
+    }
+    throw std::invalid_argument("Unknown encoding");
+}
+
+Encoding negotiate_encoding(std::string_view accept_encoding, bool have_brotli, bool have_gzip) {
+    // -1 means the client didn't mention the coding (so "*" decides)
+    int brotli = -1, gzip = -1, any = -1;
+    while (!accept_encoding.empty()) {
+        auto comma = accept_encoding.find(',');
+        std::string_view item = trim(accept_encoding.substr(0, comma));
+        accept_encoding.remove_prefix(comma == std::string_view::npos ? accept_encoding.size() : comma + 1);
+
+        auto semicolon = item.find(';');
+        std::string_view coding = trim(item.substr(0, semicolon));
+        int q = semicolon == std::string_view::npos ? 1000 : parse_qvalue(item.substr(semicolon + 1));
+        if (iequals(coding, "br")) {
+            brotli = q;
+        } else if (iequals(coding, "gzip") || iequals(coding, "x-gzip")) {
+            gzip = q;
+        } else if (coding == "*") {
+            any = q;
+        }
+    }
+    if (brotli < 0) brotli = any;
+    if (gzip < 0) gzip = any;
+    if (!have_brotli) brotli = 0;
+    if (!have_gzip) gzip = 0;
+
+    if (brotli > 0 && brotli >= gzip) {
+        return Encoding::Brotli;
+    }
+    if (gzip > 0) {
+        return Encoding::Gzip;
+    }
+    return Encoding::Identity;
+}
+
+std::string_view encoding_name(Encoding encoding) {
+    switch (encoding) {
+    case Encoding::Brotli:
+        return "br";
+    case Encoding::Gzip:
+        return "gzip";
+    case Encoding::Identity:
+        break;
+    }
+    return "identity";
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+// Content codings we can precompress responses with, in order of preference.
+enum class Encoding { Identity, Brotli, Gzip };
+
+// Whether this build can produce the encoding; Brotli is optional at build time.
+bool can_encode(Encoding encoding);
+
+// Compresses data at the highest compression level, since responses are
+// compressed once at load time and served many times. Throws
+// std::runtime_error if the encoder fails or isn't available.
+std::string compress(std::string_view data, Encoding encoding);
+
+// Picks the coding for a response from the client's Accept-Encoding header
+// (RFC 9110 section 12.5.3), choosing only among available codings: the one
+// with the highest q-value wins, Brotli beats gzip on a tie, and identity is
+// used when nothing else is acceptable.
+Encoding negotiate_encoding(std::string_view accept_encoding, bool have_brotli, bool have_gzip);
+
+// The Content-Encoding token, e.g. "br"
+std::string_view encoding_name(Encoding encoding);
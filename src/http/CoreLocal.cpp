@@ -0,0 +1,57 @@
+#include "CoreLocal.h"
+
+#include <cerrno>
+#include <iostream>
+
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+// Pins the calling thread and returns the CPU, before anything else is constructed
+int pin_to(std::size_t index) {
+    static const std::vector<int> cpus = allowed_cpus();
+    int cpu = cpus.empty() ? -1 : cpus[index % cpus.size()];
+    if (cpu >= 0 && !pin_thread(cpu)) {
+        std::cerr << "Could not pin a thread to CPU " << cpu << std::endl;
+    }
+    return cpu;
+}
+
+}
+
+std::vector<int> allowed_cpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (::sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    return cpus;
+}
+
+bool pin_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (::sched_setaffinity(0, sizeof(set), &set) != 0) {
+        return false;
+    }
+    // MPOL_LOCAL: allocate on the node of whichever CPU we run on, which is now always this one.
+    // Fails harmlessly (ENOSYS) on kernels built without NUMA.
+    long result = ::syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0);
+    return result == 0 || errno == ENOSYS;
+}
+
+CoreLocal::CoreLocal(std::size_t index, const ServerContext& shared)
+    : pinned_cpu(pin_to(index)),
+      cache(shared.cache),
+      local_context{cache, shared.log, shared.metrics, shared.files, shared.options, shared.lifecycle}
+{
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "ResponseCache.h"
+#include "Server.h"
+
+// The CPUs this process may run on (its affinity mask), lowest first
+std::vector<int> allowed_cpus();
+
+// Pins the calling thread to cpu and has the kernel allocate its memory on
+// that CPU's NUMA node from now on, whatever policy the process started
+// with. False if either was refused.
+bool pin_thread(int cpu);
+
+// What a --per-core serving thread keeps to itself. Constructed on that
+// thread: it pins it to the index-th allowed CPU (wrapping around if there
+// are more threads than CPUs), then replicates the shared response cache,
+// so the responses it serves are in memory local to its core. The
+// connection state, receive buffers and metrics shard the thread allocates
+// afterwards are already per-thread and land on the same node.
+class CoreLocal {
+public:
+    CoreLocal(std::size_t index, const ServerContext& shared);
+    CoreLocal(const CoreLocal&) = delete;
+    CoreLocal& operator=(const CoreLocal&) = delete;
+
+    ServerContext& context() { return local_context; }
+    int cpu() const { return pinned_cpu; }
+
+private:
+    int pinned_cpu;
+    ResponseCache cache;
+    ServerContext local_context;
+};
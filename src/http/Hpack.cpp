@@ -0,0 +1,371 @@
+#include "Hpack.h"
+
+#include <algorithm>
+#include <array>
+#include <utility>
+
+namespace {
+
+// RFC 7541 appendix A; index 1 is the first entry
+constexpr std::array<std::pair<std::string_view, std::string_view>, 61> static_table{{
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"}, {":path", "/index.html"},
+    {":scheme", "http"}, {":scheme", "https"}, {":status", "200"}, {":status", "204"}, {":status", "206"},
+    {":status", "304"}, {":status", "400"}, {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""},
+    {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""}, {"date", ""},
+    {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""}, {"if-match", ""},
+    {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""},
+    {"last-modified", ""}, {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""}, {"retry-after", ""},
+    {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""}, {"transfer-encoding", ""},
+    {"user-agent", ""}, {"vary", ""}, {"via", ""}, {"www-authenticate", ""},
+}};
+
+// Each field costs this much on top of its name and value (RFC 7541 section 4.1)
+constexpr std::size_t entry_overhead = 32;
+
+std::size_t entry_size(std::string_view name, std::string_view value) {
+    return name.size() + value.size() + entry_overhead;
+}
+
+struct HuffmanCode {
+    std::uint32_t code;
+    std::uint8_t bits;
+};
+
+// RFC 7541 appendix B, by symbol; 256 is EOS
+constexpr HuffmanCode huffman_codes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+    {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+    {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+    {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+    {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+    {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+    {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+    {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+    {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+    {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+    {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+    {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+// The codes as a binary tree, walked a bit at a time: node 0 is the root, and
+// a node with a symbol is a leaf
+struct HuffmanTree {
+    struct Node {
+        std::int16_t child[2] = {-1, -1};
+        std::int16_t symbol = -1;
+    };
+    std::vector<Node> nodes;
+
+    HuffmanTree() {
+        nodes.emplace_back();
+        for (std::int16_t symbol = 0; symbol < 257; ++symbol) {
+            std::size_t node = 0;
+            for (int bit = huffman_codes[symbol].bits - 1; bit >= 0; --bit) {
+                int branch = (huffman_codes[symbol].code >> bit) & 1;
+                if (nodes[node].child[branch] < 0) {
+                    nodes[node].child[branch] = static_cast<std::int16_t>(nodes.size());
+                    nodes.emplace_back();
+                }
+                node = static_cast<std::size_t>(nodes[node].child[branch]);
+            }
+            nodes[node].symbol = symbol;
+        }
+    }
+};
+
+// An integer with a prefix_bits-bit prefix (RFC 7541 section 5.1), read from data at pos
+bool decode_integer(std::string_view data, std::size_t& pos, int prefix_bits, std::uint64_t& value) {
+    if (pos >= data.size()) {
+        return false;
+    }
+    std::uint64_t mask = (1u << prefix_bits) - 1;
+    value = static_cast<std::uint8_t>(data[pos++]) & mask;
+    if (value < mask) {
+        return true;
+    }
+    for (int shift = 0; pos < data.size() && shift <= 28; shift += 7) {
+        auto byte = static_cast<std::uint8_t>(data[pos++]);
+        value += static_cast<std::uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool decode_string(std::string_view data, std::size_t& pos, std::string& out) {
+    if (pos >= data.size()) {
+        return false;
+    }
+    bool huffman = (static_cast<std::uint8_t>(data[pos]) & 0x80) != 0;
+    std::uint64_t length = 0;
+    if (!decode_integer(data, pos, 7, length) || length > data.size() - pos) {
+        return false;
+    }
+    std::string_view bytes = data.substr(pos, length);
+    pos += length;
+    if (huffman) {
+        return huffman_decode(bytes, out);
+    }
+    out.assign(bytes);
+    return true;
+}
+
+// flags fills the bits above the prefix
+void encode_integer(std::string& out, std::uint8_t flags, int prefix_bits, std::size_t value) {
+    std::size_t mask = (1u << prefix_bits) - 1;
+    if (value < mask) {
+        out.push_back(static_cast<char>(flags | value));
+        return;
+    }
+    out.push_back(static_cast<char>(flags | mask));
+    value -= mask;
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+void encode_string(std::string& out, std::string_view value) {
+    encode_integer(out, 0, 7, value.size());
+    out.append(value);
+}
+
+// Fields whose values change from one response to the next, so indexing them would only push out ones that don't
+bool volatile_field(std::string_view name) {
+    return name == "content-length" || name == "content-range" || name == "date" || name == "last-modified"
+        || name == "etag" || name == "age" || name == "expires" || name == "set-cookie";
+}
+
+}
+
+void HpackTable::add(std::string_view name, std::string_view value) {
+    std::size_t size = entry_size(name, value);
+    if (size > max_size) {
+        // An entry bigger than the whole table empties it (RFC 7541 section 4.4)
+        entries.clear();
+        used = 0;
+        return;
+    }
+    evict(size);
+    entries.push_front({std::string(name), std::string(value)});
+    used += size;
+}
+
+void HpackTable::resize(std::size_t new_max_size) {
+    max_size = new_max_size;
+    evict(0);
+}
+
+void HpackTable::evict(std::size_t room) {
+    while (!entries.empty() && used + room > max_size) {
+        used -= entry_size(entries.back().name, entries.back().value);
+        entries.pop_back();
+    }
+}
+
+bool HpackDecoder::field(std::size_t index, HeaderField& out) const {
+    if (index == 0) {
+        return false;
+    }
+    if (index <= static_table.size()) {
+        out.name = static_table[index - 1].first;
+        out.value = static_table[index - 1].second;
+        return true;
+    }
+    index -= static_table.size() + 1;
+    if (index >= table.size()) {
+        return false;
+    }
+    out = table[index];
+    return true;
+}
+
+bool HpackDecoder::decode(std::string_view block, std::vector<HeaderField>& fields, std::size_t max_list_size) {
+    too_large = false;
+    std::size_t list_size = 0;
+    bool any_field = false;
+    std::size_t pos = 0;
+    while (pos < block.size()) {
+        auto first = static_cast<std::uint8_t>(block[pos]);
+        HeaderField decoded;
+        std::uint64_t index = 0;
+        if (first & 0x80) {
+            // Indexed field
+            if (!decode_integer(block, pos, 7, index) || !field(index, decoded)) {
+                return false;
+            }
+        } else if ((first & 0xe0) == 0x20) {
+            // Dynamic table size update, only allowed before the block's first field
+            if (any_field || !decode_integer(block, pos, 5, index) || index > limit) {
+                return false;
+            }
+            table.resize(index);
+            continue;
+        } else {
+            // Literal, with incremental indexing (01), without (0000) or never indexed (0001)
+            bool add = (first & 0x40) != 0;
+            if (!decode_integer(block, pos, add ? 6 : 4, index)) {
+                return false;
+            }
+            if (index != 0 ? !field(index, decoded) : !decode_string(block, pos, decoded.name)) {
+                return false;
+            }
+            if (!decode_string(block, pos, decoded.value)) {
+                return false;
+            }
+            if (add) {
+                table.add(decoded.name, decoded.value);
+            }
+        }
+        any_field = true;
+        // Past the limit the block is still decoded to the end, since the table has to stay in step
+        list_size += entry_size(decoded.name, decoded.value);
+        too_large = too_large || list_size > max_list_size;
+        if (!too_large) {
+            fields.push_back(std::move(decoded));
+        }
+    }
+    return !too_large;
+}
+
+void HpackEncoder::set_max_table_size(std::size_t size) {
+    pending_size = std::min<std::size_t>(size, 4096);
+}
+
+void HpackEncoder::begin(std::string& out) {
+    if (pending_size != SIZE_MAX) {
+        table.resize(pending_size);
+        encode_integer(out, 0x20, 5, pending_size);
+        pending_size = SIZE_MAX;
+    }
+}
+
+void HpackEncoder::encode(std::string_view name, std::string_view value, std::string& out) {
+    std::size_t name_index = 0;
+    for (std::size_t i = 0; i < static_table.size(); ++i) {
+        if (static_table[i].first != name) {
+            continue;
+        }
+        if (static_table[i].second == value) {
+            encode_integer(out, 0x80, 7, i + 1);
+            return;
+        }
+        name_index = name_index != 0 ? name_index : i + 1;
+    }
+    for (std::size_t i = 0; i < table.size(); ++i) {
+        if (table[i].name != name) {
+            continue;
+        }
+        if (table[i].value == value) {
+            encode_integer(out, 0x80, 7, static_table.size() + 1 + i);
+            return;
+        }
+        name_index = name_index != 0 ? name_index : static_table.size() + 1 + i;
+    }
+
+    bool add = !volatile_field(name);
+    if (add) {
+        encode_integer(out, 0x40, 6, name_index);
+    } else {
+        encode_integer(out, 0x00, 4, name_index);
+    }
+    if (name_index == 0) {
+        encode_string(out, name);
+    }
+    encode_string(out, value);
+    if (add) {
+        table.add(name, value);
+    }
+}
+
+bool huffman_decode(std::string_view data, std::string& out) {
+    static const HuffmanTree tree;
+    out.clear();
+    std::size_t node = 0;
+    int depth = 0;
+    bool ones = true;
+    for (char c : data) {
+        auto byte = static_cast<std::uint8_t>(c);
+        for (int bit = 7; bit >= 0; --bit) {
+            int branch = (byte >> bit) & 1;
+            std::int16_t next = tree.nodes[node].child[branch];
+            if (next < 0) {
+                return false;
+            }
+            node = static_cast<std::size_t>(next);
+            ++depth;
+            ones = ones && branch == 1;
+            std::int16_t symbol = tree.nodes[node].symbol;
+            if (symbol >= 0) {
+                if (symbol == 256) {
+                    return false;
+                }
+                out.push_back(static_cast<char>(symbol));
+                node = 0;
+                depth = 0;
+                ones = true;
+            }
+        }
+    }
+    // What's left over must be padding: fewer than 8 bits of the EOS code, which is all ones
+    return depth < 8 && ones;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// One decoded header field. HTTP/2 names are always lower case.
+struct HeaderField {
+    std::string name;
+    std::string value;
+};
+
+// HPACK's dynamic table (RFC 7541 section 2.3.2): the most recently added
+// field first, each counted as its name and value plus 32 bytes, evicting
+// from the back to stay within max_size.
+class HpackTable {
+public:
+    explicit HpackTable(std::size_t max_size = 4096) : max_size(max_size) {}
+
+    void add(std::string_view name, std::string_view value);
+    void resize(std::size_t new_max_size);
+
+    std::size_t size() const { return entries.size(); }
+    std::size_t capacity() const { return max_size; }
+    // 0 is the newest entry
+    const HeaderField& operator[](std::size_t i) const { return entries[i]; }
+
+private:
+    void evict(std::size_t room);
+
+    std::deque<HeaderField> entries;
+    std::size_t used = 0;
+    std::size_t max_size;
+};
+
+// Decodes the header blocks of one connection, all in order: each block
+// changes the dynamic table the next ones refer to.
+class HpackDecoder {
+public:
+    // max_table_size is the SETTINGS_HEADER_TABLE_SIZE we advertise; the
+    // client may shrink the table below it, never grow it past.
+    explicit HpackDecoder(std::size_t max_table_size = 4096) : table(max_table_size), limit(max_table_size) {}
+
+    // Appends block's fields to fields. False on a compression error, after
+    // which the connection can't go on (it's a connection error), or once
+    // the fields' total size, counted as SETTINGS_MAX_HEADER_LIST_SIZE
+    // counts it, passes max_list_size; list_too_large() tells the two apart.
+    bool decode(std::string_view block, std::vector<HeaderField>& fields, std::size_t max_list_size = SIZE_MAX);
+    bool list_too_large() const { return too_large; }
+
+private:
+    bool field(std::size_t index, HeaderField& out) const;
+
+    HpackTable table;
+    std::size_t limit;
+    bool too_large = false;
+};
+
+// Encodes the header blocks of one connection. Fields worth remembering go
+// into the dynamic table, so the next response that repeats them costs a
+// byte each; values that differ every time (dates, lengths) never do.
+// Strings go out as they are, without Huffman coding.
+class HpackEncoder {
+public:
+    // Applies the client's SETTINGS_HEADER_TABLE_SIZE; the next block starts by saying so
+    void set_max_table_size(std::size_t size);
+
+    // Starts a new header block in out
+    void begin(std::string& out);
+    void encode(std::string_view name, std::string_view value, std::string& out);
+
+private:
+    HpackTable table{4096};
+    std::size_t pending_size = SIZE_MAX;
+};
+
+// Huffman-decodes an HPACK string (RFC 7541 appendix B); false if it's malformed
+bool huffman_decode(std::string_view data, std::string& out);
@@ -0,0 +1,937 @@
+#include "Http2.h"
+
+#include "ResponseHead.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+
+#include <unistd.h>
+
+namespace {
+
+enum FrameType : std::uint8_t {
+    DATA = 0x0,
+    HEADERS = 0x1,
+    PRIORITY = 0x2,
+    RST_STREAM = 0x3,
+    SETTINGS = 0x4,
+    PUSH_PROMISE = 0x5,
+    PING = 0x6,
+    GOAWAY = 0x7,
+    WINDOW_UPDATE = 0x8,
+    CONTINUATION = 0x9,
+    // RFC 9218 section 7.1
+    PRIORITY_UPDATE = 0x10,
+};
+
+constexpr std::uint8_t END_STREAM = 0x1;
+constexpr std::uint8_t ACK = 0x1;
+constexpr std::uint8_t END_HEADERS = 0x4;
+constexpr std::uint8_t PADDED = 0x8;
+constexpr std::uint8_t PRIORITY_FLAG = 0x20;
+
+enum ErrorCode : std::uint32_t {
+    NO_ERROR = 0x0,
+    PROTOCOL_ERROR = 0x1,
+    INTERNAL_ERROR = 0x2,
+    FLOW_CONTROL_ERROR = 0x3,
+    STREAM_CLOSED = 0x5,
+    FRAME_SIZE_ERROR = 0x6,
+    REFUSED_STREAM = 0x7,
+    COMPRESSION_ERROR = 0x9,
+    ENHANCE_YOUR_CALM = 0xb,
+};
+
+enum Setting : std::uint16_t {
+    HEADER_TABLE_SIZE = 0x1,
+    ENABLE_PUSH = 0x2,
+    MAX_CONCURRENT_STREAMS = 0x3,
+    INITIAL_WINDOW_SIZE = 0x4,
+    MAX_FRAME_SIZE = 0x5,
+    MAX_HEADER_LIST_SIZE = 0x6,
+    // RFC 9218 section 2.1: we don't take RFC 7540 priorities
+    NO_RFC7540_PRIORITIES = 0x9,
+};
+
+constexpr std::size_t frame_header_size = 9;
+// The largest frame we take, which is the least a client may send: we never raise SETTINGS_MAX_FRAME_SIZE
+constexpr std::size_t max_frame_size = 16384;
+constexpr std::int64_t max_window = 0x7fffffff;
+// Replies the client provokes (PING and SETTINGS acks, WINDOW_UPDATEs) queue up
+// without bound if it sends without reading. Legitimately, output waiting to be
+// sent stays within what produce() is asked for plus a read's worth of
+// replies; past this it's a flood (CVE-2019-9512, CVE-2019-9515).
+constexpr std::size_t max_unsent_output = 256 * 1024;
+
+std::uint32_t read32(std::string_view data, std::size_t pos = 0) {
+    auto byte = [&](std::size_t i) { return static_cast<std::uint32_t>(static_cast<unsigned char>(data[pos + i])); };
+    return byte(0) << 24 | byte(1) << 16 | byte(2) << 8 | byte(3);
+}
+
+void put32(std::string& out, std::uint32_t value) {
+    out += static_cast<char>(value >> 24);
+    out += static_cast<char>(value >> 16);
+    out += static_cast<char>(value >> 8);
+    out += static_cast<char>(value);
+}
+
+std::string payload32(std::uint32_t value) {
+    std::string payload;
+    put32(payload, value);
+    return payload;
+}
+
+void put_setting(std::string& out, std::uint16_t id, std::uint32_t value) {
+    out += static_cast<char>(id >> 8);
+    out += static_cast<char>(id);
+    put32(out, value);
+}
+
+void frame_header(std::string& out, std::size_t size, std::uint8_t type, std::uint8_t flags, std::uint32_t stream) {
+    out += static_cast<char>(size >> 16);
+    out += static_cast<char>(size >> 8);
+    out += static_cast<char>(size);
+    out += static_cast<char>(type);
+    out += static_cast<char>(flags);
+    put32(out, stream & 0x7fffffff);
+}
+
+// Headers that only mean something to one HTTP/1.1 connection, which HTTP/2 forbids (RFC 9113 section 8.2.2)
+bool connection_specific(std::string_view name) {
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection"
+        || name == "transfer-encoding" || name == "upgrade";
+}
+
+std::string lower(std::string_view name) {
+    std::string result(name);
+    std::transform(result.begin(), result.end(), result.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return result;
+}
+
+std::string_view trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+        s.remove_prefix(1);
+    }
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+// A priority header or PRIORITY_UPDATE value, a structured field dictionary
+// like "u=1, i" (RFC 9218 section 4); members we don't know are skipped.
+void parse_priority(std::string_view value, std::uint8_t& urgency, bool& incremental) {
+    while (!value.empty()) {
+        std::size_t comma = value.find(',');
+        std::string_view member = trim(value.substr(0, comma));
+        value = comma == std::string_view::npos ? std::string_view() : value.substr(comma + 1);
+        if (member.size() == 3 && member.starts_with("u=") && member[2] >= '0' && member[2] <= '7') {
+            urgency = static_cast<std::uint8_t>(member[2] - '0');
+        } else if (member == "i" || member == "i=?1") {
+            incremental = true;
+        } else if (member == "i=?0") {
+            incremental = false;
+        }
+    }
+}
+
+// HTTP2-Settings is base64url, padding left off (RFC 7540 section 3.2.1)
+bool base64url_decode(std::string_view text, std::string& out) {
+    std::uint32_t bits = 0;
+    int count = 0;
+    for (char c : text) {
+        int value;
+        if (c >= 'A' && c <= 'Z') {
+            value = c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            value = c - 'a' + 26;
+        } else if (c >= '0' && c <= '9') {
+            value = c - '0' + 52;
+        } else if (c == '-') {
+            value = 62;
+        } else if (c == '_') {
+            value = 63;
+        } else if (c == '=') {
+            break;
+        } else {
+            return false;
+        }
+        bits = bits << 6 | static_cast<std::uint32_t>(value);
+        count += 6;
+        if (count >= 8) {
+            count -= 8;
+            out += static_cast<char>(bits >> count);
+        }
+    }
+    return true;
+}
+
+}
+
+bool wants_h2c(const Request& request) {
+    if (request.minor_version != 1 || !request.body.empty() || request.header("http2-settings").empty()) {
+        return false;
+    }
+    std::string_view upgrade = request.header("upgrade");
+    while (!upgrade.empty()) {
+        std::size_t comma = upgrade.find(',');
+        if (lower(trim(upgrade.substr(0, comma))) == "h2c") {
+            return true;
+        }
+        upgrade = comma == std::string_view::npos ? std::string_view() : upgrade.substr(comma + 1);
+    }
+    return false;
+}
+
+Http2Session::Http2Session(Http2Limits limits)
+    : limits(limits),
+      reset_budget(2 * static_cast<std::int64_t>(limits.max_concurrent_streams))
+{
+    // Our preface; the client has to acknowledge it, but needn't wait to send its requests
+    std::string payload;
+    put_setting(payload, MAX_CONCURRENT_STREAMS, limits.max_concurrent_streams);
+    put_setting(payload, MAX_HEADER_LIST_SIZE, static_cast<std::uint32_t>(limits.max_header_list_size));
+    put_setting(payload, NO_RFC7540_PRIORITIES, 1);
+    frame(SETTINGS, 0, 0, payload);
+}
+
+bool Http2Session::upgrade(std::string_view settings_header, const Request& request, std::size_t request_size) {
+    std::string payload;
+    if (!base64url_decode(settings_header, payload) || !settings(payload)) {
+        return false;
+    }
+
+    auto stream = std::make_unique<Stream>();
+    stream->id = 1;
+    stream->remote_closed = true;
+    stream->window = peer_initial_window;
+    stream->wire_size = request_size;
+    std::vector<HeaderField>& fields = stream->fields;
+    fields.push_back({":method", std::string(request.method)});
+    fields.push_back({":scheme", "http"});
+    fields.push_back({":path", std::string(request.target)});
+    fields.push_back({":authority", std::string(request.header("host"))});
+    for (std::size_t i = 0; i < request.header_count; ++i) {
+        std::string name = lower(request.headers[i].name);
+        if (!connection_specific(name) && name != "host" && name != "http2-settings" && name != "te") {
+            fields.push_back({std::move(name), std::string(request.headers[i].value)});
+        }
+    }
+    if (!open(*stream)) {
+        return false;
+    }
+    last_stream = 1;
+    Stream& opened = *streams.emplace(1, std::move(stream)).first->second;
+    ready(opened);
+    return true;
+}
+
+bool Http2Session::receive(std::string_view data) {
+    if (failed) {
+        return false;
+    }
+    in.append(data);
+    std::size_t pos = 0;
+    if (!preface_received) {
+        std::size_t n = std::min(in.size(), http2_preface.size());
+        if (in.compare(0, n, http2_preface, 0, n) != 0) {
+            connection_error(PROTOCOL_ERROR);
+            return false;
+        }
+        if (n < http2_preface.size()) {
+            return true;
+        }
+        preface_received = true;
+        pos = n;
+    }
+
+    while (!failed && in.size() - pos >= frame_header_size) {
+        std::string_view head(in.data() + pos, frame_header_size);
+        std::size_t size = read32(head) >> 8;
+        auto type = static_cast<std::uint8_t>(head[3]);
+        auto flags = static_cast<std::uint8_t>(head[4]);
+        std::uint32_t id = read32(head, 5) & 0x7fffffff;
+        if (size > max_frame_size) {
+            connection_error(FRAME_SIZE_ERROR);
+            break;
+        }
+        if (in.size() - pos - frame_header_size < size) {
+            break;
+        }
+        std::string_view payload(in.data() + pos + frame_header_size, size);
+        pos += frame_header_size + size;
+        handle(type, flags, id, payload);
+    }
+    in.erase(0, pos);
+    return !failed;
+}
+
+void Http2Session::handle(std::uint8_t type, std::uint8_t flags, std::uint32_t id, std::string_view payload) {
+    if (!settings_received && (type != SETTINGS || (flags & ACK))) {
+        // The client's preface ends with a SETTINGS frame
+        connection_error(PROTOCOL_ERROR);
+        return;
+    }
+    if (continuing != 0 && (type != CONTINUATION || id != continuing)) {
+        connection_error(PROTOCOL_ERROR);
+        return;
+    }
+
+    switch (type) {
+    case DATA:
+        data(flags, id, payload);
+        break;
+    case HEADERS:
+        headers(flags, id, payload);
+        break;
+    case CONTINUATION:
+        if (continuing == 0) {
+            connection_error(PROTOCOL_ERROR);
+            return;
+        }
+        header_block.append(payload);
+        header_block_wire += frame_header_size + payload.size();
+        // However well it was compressed, a block this big can't be within the list size; a flood of
+        // CONTINUATIONs is cut off here rather than decoded
+        if (header_block.size() > limits.max_header_list_size + max_frame_size) {
+            connection_error(ENHANCE_YOUR_CALM);
+            return;
+        }
+        if (flags & END_HEADERS) {
+            continuing = 0;
+            end_headers(id, continuing_end_stream);
+        }
+        break;
+    case PRIORITY:
+        if (id == 0) {
+            connection_error(PROTOCOL_ERROR);
+        } else if (payload.size() != 5) {
+            stream_error(id, FRAME_SIZE_ERROR);
+        }
+        break;
+    case RST_STREAM: {
+        if (id == 0 || id > last_stream) {
+            connection_error(PROTOCOL_ERROR);
+            return;
+        }
+        if (payload.size() != 4) {
+            connection_error(FRAME_SIZE_ERROR);
+            return;
+        }
+        auto it = streams.find(id);
+        if (it == streams.end()) {
+            return;
+        }
+        // Opening streams and resetting them before they're answered costs us work and the client nothing
+        if (!it->second->responded && --reset_budget < 0) {
+            connection_error(ENHANCE_YOUR_CALM);
+            return;
+        }
+        streams.erase(it);
+        break;
+    }
+    case SETTINGS:
+        if (id != 0) {
+            connection_error(PROTOCOL_ERROR);
+        } else if (flags & ACK) {
+            if (!payload.empty()) {
+                connection_error(FRAME_SIZE_ERROR);
+            }
+        } else if (settings(payload)) {
+            settings_received = true;
+            reply(SETTINGS, ACK, 0, {});
+        }
+        break;
+    case PUSH_PROMISE:
+        // Clients can't push
+        connection_error(PROTOCOL_ERROR);
+        break;
+    case PING:
+        if (id != 0) {
+            connection_error(PROTOCOL_ERROR);
+        } else if (payload.size() != 8) {
+            connection_error(FRAME_SIZE_ERROR);
+        } else if (!(flags & ACK)) {
+            reply(PING, ACK, 0, payload);
+        }
+        break;
+    case GOAWAY:
+        if (id != 0) {
+            connection_error(PROTOCOL_ERROR);
+        } else if (payload.size() < 8) {
+            connection_error(FRAME_SIZE_ERROR);
+        } else {
+            going_away = true;
+        }
+        break;
+    case WINDOW_UPDATE:
+        window_update(id, payload);
+        break;
+    case PRIORITY_UPDATE:
+        if (id != 0) {
+            connection_error(PROTOCOL_ERROR);
+        } else {
+            priority_update(payload);
+        }
+        break;
+    default:
+        // Unknown frame types are ignored (RFC 9113 section 4.1)
+        break;
+    }
+}
+
+void Http2Session::data(std::uint8_t flags, std::uint32_t id, std::string_view payload) {
+    if (id == 0 || id > last_stream) {
+        connection_error(PROTOCOL_ERROR);
+        return;
+    }
+    std::size_t size = payload.size();
+    if (flags & PADDED) {
+        std::size_t padding = payload.empty() ? SIZE_MAX : static_cast<unsigned char>(payload[0]);
+        if (padding >= payload.size()) {
+            connection_error(PROTOCOL_ERROR);
+            return;
+        }
+        payload = payload.substr(1, payload.size() - 1 - padding);
+    }
+    // Flow control counts the whole frame, padding and all. Whatever we take, we read at once, so the
+    // window is given straight back; it's the body limit, not the window, that bounds a request.
+    if (size > 0 && !reply(WINDOW_UPDATE, 0, 0, payload32(static_cast<std::uint32_t>(size)))) {
+        return;
+    }
+
+    auto it = streams.find(id);
+    if (it == streams.end()) {
+        // For a stream we've reset, still in flight when the client heard
+        return;
+    }
+    Stream& stream = *it->second;
+    if (stream.remote_closed) {
+        stream_error(id, STREAM_CLOSED);
+        return;
+    }
+    stream.wire_size += frame_header_size + size;
+    bool end_stream = flags & END_STREAM;
+    if (stream.problem == Problem::None) {
+        if (stream.body.size() + payload.size() > limits.max_body_size) {
+            // Answered now; the rest of the body isn't wanted
+            stream.problem = Problem::BodyTooLarge;
+            stream.body.clear();
+            ready(stream);
+        } else {
+            stream.body.append(payload);
+            if (size > 0 && !end_stream && !reply(WINDOW_UPDATE, 0, id, payload32(static_cast<std::uint32_t>(size)))) {
+                return;
+            }
+        }
+    }
+    if (end_stream) {
+        stream.remote_closed = true;
+        ready(stream);
+    }
+}
+
+void Http2Session::headers(std::uint8_t flags, std::uint32_t id, std::string_view payload) {
+    if (id == 0 || id % 2 == 0) {
+        connection_error(PROTOCOL_ERROR);
+        return;
+    }
+    std::size_t size = payload.size();
+    std::size_t padding = 0;
+    if (flags & PADDED) {
+        if (payload.empty()) {
+            connection_error(PROTOCOL_ERROR);
+            return;
+        }
+        padding = static_cast<unsigned char>(payload[0]);
+        payload.remove_prefix(1);
+    }
+    if (flags & PRIORITY_FLAG) {
+        // An RFC 7540 dependency and weight, which we skip
+        if (payload.size() < 5) {
+            connection_error(FRAME_SIZE_ERROR);
+            return;
+        }
+        payload.remove_prefix(5);
+    }
+    if (padding > payload.size()) {
+        connection_error(PROTOCOL_ERROR);
+        return;
+    }
+    payload.remove_suffix(padding);
+
+    header_block.assign(payload);
+    header_block_wire = frame_header_size + size;
+    if (flags & END_HEADERS) {
+        end_headers(id, flags & END_STREAM);
+    } else {
+        continuing = id;
+        continuing_end_stream = flags & END_STREAM;
+    }
+}
+
+void Http2Session::end_headers(std::uint32_t id, bool end_stream) {
+    // Every block is decoded, even one we then drop, or the dynamic table would fall out of step with the client's
+    std::vector<HeaderField> fields;
+    bool decoded = decoder.decode(header_block, fields, limits.max_header_list_size);
+    header_block.clear();
+    if (!decoded && !decoder.list_too_large()) {
+        connection_error(COMPRESSION_ERROR);
+        return;
+    }
+
+    auto it = streams.find(id);
+    if (it != streams.end()) {
+        // Trailers, which must end the stream; we don't use them
+        Stream& stream = *it->second;
+        if (stream.remote_closed) {
+            connection_error(STREAM_CLOSED);
+        } else if (!end_stream) {
+            stream_error(id, PROTOCOL_ERROR);
+        } else {
+            stream.wire_size += header_block_wire;
+            stream.remote_closed = true;
+            ready(stream);
+        }
+        return;
+    }
+    if (id <= last_stream) {
+        // A stream that's already closed
+        connection_error(STREAM_CLOSED);
+        return;
+    }
+    last_stream = id;
+    if (going_away) {
+        return;
+    }
+    if (streams.size() >= limits.max_concurrent_streams) {
+        stream_error(id, REFUSED_STREAM);
+        return;
+    }
+
+    auto stream = std::make_unique<Stream>();
+    stream->id = id;
+    stream->fields = std::move(fields);
+    stream->wire_size = header_block_wire;
+    stream->remote_closed = end_stream;
+    stream->window = peer_initial_window;
+    if (!decoded) {
+        stream->problem = Problem::HeadTooLarge;
+    }
+    Stream& opened = *streams.emplace(id, std::move(stream)).first->second;
+    // A head cut short may be missing anything, so it's only answered, not judged
+    if (!open(opened) && opened.problem != Problem::HeadTooLarge) {
+        stream_error(id, PROTOCOL_ERROR);
+        return;
+    }
+    if (opened.problem != Problem::None || opened.remote_closed) {
+        ready(opened);
+    }
+}
+
+// Builds stream's request from its fields, checking them as RFC 9113
+// section 8.3 asks; false if it's malformed.
+bool Http2Session::open(Stream& stream) {
+    Request& request = stream.request;
+    std::string_view scheme;
+    std::string_view authority;
+    bool regular = false;
+    for (const HeaderField& field : stream.fields) {
+        std::string_view name = field.name;
+        if (name.starts_with(':')) {
+            // Pseudo-headers come first, once each
+            if (regular) {
+                return false;
+            }
+            std::string_view* slot = name == ":method" ? &request.method
+                : name == ":path" ? &request.target
+                : name == ":scheme" ? &scheme
+                : name == ":authority" ? &authority
+                : nullptr;
+            if (slot == nullptr || !slot->empty()) {
+                return false;
+            }
+            *slot = field.value;
+            continue;
+        }
+        regular = true;
+        if (std::any_of(name.begin(), name.end(), [](char c) { return c >= 'A' && c <= 'Z'; })
+            || connection_specific(name) || (name == "te" && field.value != "trailers")) {
+            return false;
+        }
+        if (name == "priority") {
+            parse_priority(field.value, stream.urgency, stream.incremental);
+        } else if (name == "content-length" && stream.problem == Problem::None) {
+            // A body that's announced as too big is refused before it arrives, as HTTP/1.1's is
+            std::size_t length = 0;
+            auto [end, error] = std::from_chars(field.value.data(), field.value.data() + field.value.size(), length);
+            if (error == std::errc() && end == field.value.data() + field.value.size() && length > limits.max_body_size) {
+                stream.problem = Problem::BodyTooLarge;
+            }
+        }
+        if (request.header_count == Request::max_headers) {
+            stream.problem = Problem::HeadTooLarge;
+            continue;
+        }
+        request.headers[request.header_count++] = {name, field.value};
+    }
+    if (request.method.empty() || scheme.empty() || request.target.empty()) {
+        return false;
+    }
+    // The router and logs know the authority as Host
+    if (!authority.empty() && request.header("host").empty() && request.header_count < Request::max_headers) {
+        request.headers[request.header_count++] = {"host", authority};
+    }
+    std::size_t question = request.target.find('?');
+    request.path = request.target.substr(0, question);
+    request.query = question == std::string_view::npos ? std::string_view() : request.target.substr(question + 1);
+    request.minor_version = 1;
+    request.keep_alive = true;
+    return true;
+}
+
+bool Http2Session::settings(std::string_view payload) {
+    if (payload.size() % 6 != 0) {
+        connection_error(FRAME_SIZE_ERROR);
+        return false;
+    }
+    for (std::size_t pos = 0; pos < payload.size(); pos += 6) {
+        auto id = static_cast<std::uint16_t>(static_cast<unsigned char>(payload[pos]) << 8
+                                             | static_cast<unsigned char>(payload[pos + 1]));
+        std::uint32_t value = read32(payload, pos + 2);
+        switch (id) {
+        case HEADER_TABLE_SIZE:
+            encoder.set_max_table_size(value);
+            break;
+        case ENABLE_PUSH:
+            // We never push, whatever it says, but it has to say 0 or 1
+            if (value > 1) {
+                connection_error(PROTOCOL_ERROR);
+                return false;
+            }
+            break;
+        case INITIAL_WINDOW_SIZE: {
+            if (value > max_window) {
+                connection_error(FLOW_CONTROL_ERROR);
+                return false;
+            }
+            // Applies to the streams already open too (RFC 9113 section 6.9.2)
+            std::int64_t delta = static_cast<std::int64_t>(value) - peer_initial_window;
+            peer_initial_window = value;
+            for (auto& [stream_id, stream] : streams) {
+                stream->window += delta;
+                if (stream->window > max_window) {
+                    connection_error(FLOW_CONTROL_ERROR);
+                    return false;
+                }
+            }
+            break;
+        }
+        case MAX_FRAME_SIZE:
+            if (value < 16384 || value > 16777215) {
+                connection_error(PROTOCOL_ERROR);
+                return false;
+            }
+            peer_max_frame = value;
+            break;
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
+void Http2Session::window_update(std::uint32_t id, std::string_view payload) {
+    if (payload.size() != 4) {
+        connection_error(FRAME_SIZE_ERROR);
+        return;
+    }
+    std::uint32_t increment = read32(payload) & 0x7fffffff;
+    if (id == 0) {
+        connection_window += increment;
+        if (increment == 0) {
+            connection_error(PROTOCOL_ERROR);
+        } else if (connection_window > max_window) {
+            connection_error(FLOW_CONTROL_ERROR);
+        }
+        return;
+    }
+    auto it = streams.find(id);
+    if (it == streams.end()) {
+        if (id > last_stream) {
+            connection_error(PROTOCOL_ERROR);
+        }
+        // Otherwise it's for a stream we've finished with, which may be in flight yet
+        return;
+    }
+    it->second->window += increment;
+    if (increment == 0) {
+        stream_error(id, PROTOCOL_ERROR);
+    } else if (it->second->window > max_window) {
+        stream_error(id, FLOW_CONTROL_ERROR);
+    }
+}
+
+void Http2Session::priority_update(std::string_view payload) {
+    if (payload.size() < 4) {
+        connection_error(FRAME_SIZE_ERROR);
+        return;
+    }
+    std::uint32_t id = read32(payload) & 0x7fffffff;
+    if (id == 0) {
+        connection_error(PROTOCOL_ERROR);
+        return;
+    }
+    // One for a stream not opened yet would have to be kept for it; clients send the header instead
+    auto it = streams.find(id);
+    if (it != streams.end()) {
+        parse_priority(payload.substr(4), it->second->urgency, it->second->incremental);
+    }
+}
+
+void Http2Session::ready(Stream& stream) {
+    if (stream.dispatched) {
+        return;
+    }
+    stream.dispatched = true;
+    stream.request.body = stream.body;
+    arrived.push_back(stream.id);
+}
+
+std::vector<std::uint32_t> Http2Session::take_requests() {
+    std::vector<std::uint32_t> taken;
+    for (std::uint32_t id : arrived) {
+        // Leaving out any the client has reset since
+        if (streams.count(id)) {
+            taken.push_back(id);
+        }
+    }
+    arrived.clear();
+    return taken;
+}
+
+const Request& Http2Session::request(std::uint32_t id) const {
+    return streams.at(id)->request;
+}
+
+Http2Session::Problem Http2Session::problem(std::uint32_t id) const {
+    return streams.at(id)->problem;
+}
+
+std::size_t Http2Session::request_size(std::uint32_t id) const {
+    return streams.at(id)->wire_size;
+}
+
+void Http2Session::respond(std::uint32_t id, std::shared_ptr<const CachedResponse> response) {
+    auto it = streams.find(id);
+    if (it == streams.end() || it->second->responded) {
+        return;
+    }
+    Stream& stream = *it->second;
+
+    // The cached head is HTTP/1.1's: a status line, then a header per line
+    std::string block;
+    encoder.begin(block);
+    encoder.encode(":status", std::to_string(response->status()), block);
+    // What ResponseBatch adds to HTTP/1.1 heads
+    char date[DateClock::size];
+    DateClock::instance().read(date);
+    encoder.encode("server", server_name, block);
+    encoder.encode("date", std::string_view(date, sizeof(date)), block);
+    std::string_view head = response->header();
+    std::size_t pos = head.find("\r\n");
+    while (pos != std::string_view::npos && pos + 2 < head.size()) {
+        pos += 2;
+        std::size_t end = head.find("\r\n", pos);
+        std::string_view line = head.substr(pos, end - pos);
+        pos = end;
+        std::size_t colon = line.find(':');
+        if (line.empty() || colon == std::string_view::npos) {
+            continue;
+        }
+        std::string name = lower(line.substr(0, colon));
+        if (!connection_specific(name)) {
+            encoder.encode(name, trim(line.substr(colon + 1)), block);
+        }
+    }
+
+    stream.responded = true;
+    stream.response = std::move(response);
+    if (stream.request.method != "HEAD") {
+        if (stream.response->has_file_body()) {
+            stream.body_fd = stream.response->body_fd;
+            stream.body_offset = stream.response->body_offset;
+            stream.remaining = stream.response->body_size;
+        } else {
+            stream.body_data = stream.response->body();
+            stream.remaining = stream.body_data.size();
+        }
+    }
+
+    // The block goes out in one piece, in HEADERS and as many CONTINUATIONs as the client's frame size needs
+    bool end_stream = stream.remaining == 0;
+    std::string_view rest = block;
+    std::size_t first = std::min(rest.size(), peer_max_frame);
+    frame(HEADERS, (end_stream ? END_STREAM : 0) | (first == rest.size() ? END_HEADERS : 0), id, rest.substr(0, first));
+    rest.remove_prefix(first);
+    while (!rest.empty()) {
+        std::size_t size = std::min(rest.size(), peer_max_frame);
+        frame(CONTINUATION, size == rest.size() ? END_HEADERS : 0, id, rest.substr(0, size));
+        rest.remove_prefix(size);
+    }
+    if (end_stream) {
+        finish(stream);
+    }
+}
+
+void Http2Session::produce(std::size_t budget) {
+    // After an h2c upgrade, bodies wait for the client's preface: until then it may not be ready to take them
+    if (!settings_received) {
+        return;
+    }
+    while (!failed && output().size() < budget && connection_window > 0) {
+        Stream* stream = next_to_send();
+        if (stream == nullptr) {
+            break;
+        }
+        std::size_t size = std::min({stream->remaining, peer_max_frame, static_cast<std::size_t>(stream->window),
+                                     static_cast<std::size_t>(connection_window)});
+        std::size_t start = out.size();
+        frame_header(out, size, DATA, size == stream->remaining ? END_STREAM : 0, stream->id);
+        if (stream->body_fd >= 0) {
+            std::size_t at = out.size();
+            out.resize(at + size);
+            std::size_t done = 0;
+            while (done < size) {
+                ssize_t n = ::pread(stream->body_fd, out.data() + at + done, size - done,
+                                      static_cast<off_t>(stream->body_offset + done));
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    break;
+                }
+                done += static_cast<std::size_t>(n);
+            }
+            if (done < size) {
+                // The file is unreadable or has shrunk: this stream can't be finished, the others can
+                out.resize(start);
+                stream_error(stream->id, INTERNAL_ERROR);
+                continue;
+            }
+            stream->body_offset += size;
+        } else {
+            out.append(stream->body_data.substr(0, size));
+            stream->body_data.remove_prefix(size);
+        }
+        stream->remaining -= size;
+        stream->window -= static_cast<std::int64_t>(size);
+        connection_window -= static_cast<std::int64_t>(size);
+        if (stream->incremental) {
+            last_served[stream->urgency] = stream->id;
+        }
+        if (stream->remaining == 0) {
+            finish(*stream);
+        }
+    }
+}
+
+// The next stream a DATA frame goes to: the most urgent with something to
+// send and room to send it; among equals, the non-incremental one opened
+// first, or else the incremental one after the last served.
+Http2Session::Stream* Http2Session::next_to_send() {
+    for (std::uint8_t urgency = 0; urgency < 8; ++urgency) {
+        Stream* first_incremental = nullptr;
+        Stream* next_incremental = nullptr;
+        for (auto& [id, stream] : streams) {
+            if (!stream->responded || stream->remaining == 0 || stream->window <= 0 || stream->urgency != urgency) {
+                continue;
+            }
+            if (!stream->incremental) {
+                return stream.get();
+            }
+            if (first_incremental == nullptr) {
+                first_incremental = stream.get();
+            }
+            if (next_incremental == nullptr && id > last_served[urgency]) {
+                next_incremental = stream.get();
+            }
+        }
+        if (first_incremental != nullptr) {
+            return next_incremental != nullptr ? next_incremental : first_incremental;
+        }
+    }
+    return nullptr;
+}
+
+void Http2Session::finish(Stream& stream) {
+    if (!stream.remote_closed) {
+        // Answered before the request was all here, as a 413 is: the rest needn't be sent (RFC 9113 section 8.1)
+        frame(RST_STREAM, 0, stream.id, payload32(NO_ERROR));
+    }
+    if (stream.responded) {
+        reset_budget = std::min(reset_budget + 1, 2 * static_cast<std::int64_t>(limits.max_concurrent_streams));
+    }
+    streams.erase(stream.id);
+}
+
+void Http2Session::sent(std::size_t size) {
+    out_offset += size;
+    if (out_offset == out.size()) {
+        out.clear();
+        out_offset = 0;
+    } else if (out_offset > 64 * 1024) {
+        out.erase(0, out_offset);
+        out_offset = 0;
+    }
+}
+
+void Http2Session::shutdown() {
+    going_away = true;
+    if (!goaway_sent) {
+        goaway_sent = true;
+        std::string payload;
+        put32(payload, last_stream);
+        put32(payload, NO_ERROR);
+        frame(GOAWAY, 0, 0, payload);
+    }
+}
+
+bool Http2Session::finished() const {
+    return failed || (going_away && streams.empty());
+}
+
+void Http2Session::frame(std::uint8_t type, std::uint8_t flags, std::uint32_t stream, std::string_view payload) {
+    frame_header(out, payload.size(), type, flags, stream);
+    out.append(payload);
+}
+
+bool Http2Session::reply(std::uint8_t type, std::uint8_t flags, std::uint32_t stream, std::string_view payload) {
+    if (output().size() > max_unsent_output) {
+        connection_error(ENHANCE_YOUR_CALM);
+        return false;
+    }
+    frame(type, flags, stream, payload);
+    return true;
+}
+
+void Http2Session::connection_error(std::uint32_t code) {
+    if (failed) {
+        return;
+    }
+    std::string payload;
+    put32(payload, last_stream);
+    put32(payload, code);
+    frame(GOAWAY, 0, 0, payload);
+    goaway_sent = true;
+    going_away = true;
+    failed = true;
+}
+
+void Http2Session::stream_error(std::uint32_t id, std::uint32_t code) {
+    frame(RST_STREAM, 0, id, payload32(code));
+    streams.erase(id);
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Hpack.h"
+#include "HttpParser.h"
+#include "ResponseCache.h"
+
+// What a client sends first on an HTTP/2 connection (RFC 9113 section 3.4)
+inline constexpr std::string_view http2_preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+// Whether request asks to switch its connection to h2c (RFC 7540 section
+// 3.2), which only a plaintext HTTP/1.1 request without a body can
+bool wants_h2c(const Request& request);
+
+// What we allow a client: streams open at once, and per request the size
+// of its decoded header list and its body, as ConnectionOptions bounds them
+// for HTTP/1.1.
+struct Http2Limits {
+    std::uint32_t max_concurrent_streams = 100;
+    std::size_t max_header_list_size = 8 * 1024;
+    std::size_t max_body_size = 1024 * 1024;
+};
+
+// The server side of one HTTP/2 connection (RFC 9113), as a state machine
+// with no I/O of its own: receive() takes whatever arrived, output() is what
+// should be sent next.
+//
+// A stream's request is handed out by take_requests() once it's complete
+// and answered with respond(), in any order. Response bodies are framed by
+// produce(), within the client's flow control windows, and streams are
+// served by RFC 9218 priority, from the priority header or a
+// PRIORITY_UPDATE frame: the most urgent first, non-incremental ones one at
+// a time in stream order and incremental ones interleaved frame by frame.
+// RFC 7540's priority tree is deprecated and ignored.
+//
+// A request too big to take is still handed out, with problem() saying
+// why, so it gets the same 431 or 413 as over HTTP/1.1. A client that keeps
+// provoking replies (pings, settings, window updates) without reading them
+// is cut off with ENHANCE_YOUR_CALM; callers should stop passing receive()
+// more while output() is large.
+class Http2Session {
+public:
+    enum class Problem { None, HeadTooLarge, BodyTooLarge };
+
+    explicit Http2Session(Http2Limits limits = {});
+
+    // For an h2c upgrade: settings is the request's HTTP2-Settings header,
+    // and request itself, which must have no body, becomes stream 1. False
+    // if settings can't be decoded.
+    bool upgrade(std::string_view settings, const Request& request, std::size_t request_size);
+
+    // Takes bytes from the client, preface first. False once the connection
+    // has failed; output() then ends with the GOAWAY that says why.
+    bool receive(std::string_view data);
+
+    // Streams whose requests have arrived since the last call, oldest first
+    std::vector<std::uint32_t> take_requests();
+    // For a stream take_requests() returned that hasn't been answered yet
+    const Request& request(std::uint32_t stream) const;
+    Problem problem(std::uint32_t stream) const;
+    // The bytes its frames took up on the wire
+    std::size_t request_size(std::uint32_t stream) const;
+    // Answers stream with response, without its body for HEAD. The stream
+    // may be gone afterwards, request view and all. Does nothing if the
+    // client has reset it in the meantime.
+    void respond(std::uint32_t stream, std::shared_ptr<const CachedResponse> response);
+
+    // Frames response bodies until at least budget bytes are waiting to be
+    // sent, or flow control or a lack of bodies stops it
+    void produce(std::size_t budget);
+    std::string_view output() const { return std::string_view(out).substr(out_offset); }
+    void sent(std::size_t size);
+
+    // Starts a graceful close: GOAWAY tells the client no new streams will be
+    // taken, and the ones already open are still answered
+    void shutdown();
+    // The connection has failed, or is closing and has no streams left; close once output() is sent
+    bool finished() const;
+    std::size_t open_streams() const { return streams.size(); }
+
+private:
+    struct Stream {
+        std::uint32_t id = 0;
+        std::vector<HeaderField> fields;
+        std::string body;
+        Request request;
+        std::size_t wire_size = 0;
+        Problem problem = Problem::None;
+        // END_STREAM has arrived
+        bool remote_closed = false;
+        bool dispatched = false;
+
+        bool responded = false;
+        std::shared_ptr<const CachedResponse> response;
+        std::string_view body_data;
+        int body_fd = -1;
+        std::size_t body_offset = 0;
+        std::size_t remaining = 0;
+        // What the client's flow control lets us send on this stream
+        std::int64_t window = 0;
+        std::uint8_t urgency = 3;
+        bool incremental = false;
+    };
+
+    void frame(std::uint8_t type, std::uint8_t flags, std::uint32_t stream, std::string_view payload);
+    // A frame the client's own frame calls for; false, after a GOAWAY, once too much is already waiting to be sent
+    bool reply(std::uint8_t type, std::uint8_t flags, std::uint32_t stream, std::string_view payload);
+    void handle(std::uint8_t type, std::uint8_t flags, std::uint32_t stream, std::string_view payload);
+    void data(std::uint8_t flags, std::uint32_t id, std::string_view payload);
+    void headers(std::uint8_t flags, std::uint32_t id, std::string_view payload);
+    void end_headers(std::uint32_t id, bool end_stream);
+    bool open(Stream& stream);
+    bool settings(std::string_view payload);
+    void window_update(std::uint32_t id, std::string_view payload);
+    void priority_update(std::string_view payload);
+    void ready(Stream& stream);
+    void finish(Stream& stream);
+    Stream* next_to_send();
+
+    void connection_error(std::uint32_t code);
+    void stream_error(std::uint32_t id, std::uint32_t code);
+
+    Http2Limits limits;
+    HpackDecoder decoder;
+    HpackEncoder encoder;
+    std::map<std::uint32_t, std::unique_ptr<Stream>> streams;
+    std::vector<std::uint32_t> arrived;
+
+    std::string in;
+    bool preface_received = false;
+    bool settings_received = false;
+    std::uint32_t last_stream = 0;
+    // A header block arriving in pieces: the stream it's for, or 0
+    std::uint32_t continuing = 0;
+    bool continuing_end_stream = false;
+    std::string header_block;
+    std::size_t header_block_wire = 0;
+
+    std::int64_t connection_window = 65535;
+    std::int64_t peer_initial_window = 65535;
+    std::size_t peer_max_frame = 16384;
+    // Resets of streams not yet answered that the client may send before it's cut off
+    std::int64_t reset_budget;
+    // The last incremental stream served at each urgency, for round robin
+    std::uint32_t last_served[8] = {};
+
+    std::string out;
+    std::size_t out_offset = 0;
+    // No new streams are taken: we've sent GOAWAY, or the client has
+    bool going_away = false;
+    bool goaway_sent = false;
+    bool failed = false;
+};
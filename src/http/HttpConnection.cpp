@@ -0,0 +1,238 @@
+#include "HttpConnection.h"
+
+#include "ResponseHead.h"
+
+#include <array>
+#include <cerrno>
+#include <span>
+#include <string>
+#include <type_traits>
+
+#include <poll.h>
+#include <sys/sendfile.h>
+
+namespace {
+
+constexpr std::string_view end_of_headers = "\r\n";
+// How a head ends, by ResponseBatch::tails index
+constexpr std::array<std::string_view, 3> connection_endings{
+    "\r\n", "Connection: close\r\n\r\n", "Connection: keep-alive\r\n\r\n"};
+constexpr std::string_view server_line = "Server: ";
+constexpr std::string_view date_line = "\r\nDate: ";
+
+// Waits until socket is ready for events, or throws timed_out after timeout
+void wait_for(boost::asio::ip::tcp::socket& socket, short events, std::chrono::milliseconds timeout) {
+    pollfd fd{socket.native_handle(), events, 0};
+    int ready;
+    do {
+        ready = ::poll(&fd, 1, static_cast<int>(timeout.count()));
+    } while (ready < 0 && errno == EINTR);
+    if (ready == 0) {
+        throw boost::system::system_error(boost::asio::error::timed_out);
+    }
+}
+
+// Writes all of buffers to a non-blocking socket
+void write_buffers(boost::asio::ip::tcp::socket& socket, const std::pmr::vector<boost::asio::const_buffer>& buffers,
+                   std::chrono::milliseconds timeout) {
+    std::size_t first = 0;
+    std::size_t first_offset = 0;
+    while (first < buffers.size()) {
+        std::array<boost::asio::const_buffer, 64> pending;
+        std::size_t count = 0;
+        for (std::size_t i = first; i < buffers.size() && count < pending.size(); ++i) {
+            pending[count++] = buffers[i] + (i == first ? first_offset : 0);
+        }
+
+        boost::system::error_code ec;
+        std::size_t written = socket.write_some(std::span(pending.data(), count), ec);
+        if (ec == boost::asio::error::would_block) {
+            wait_for(socket, POLLOUT, timeout);
+            continue;
+        }
+        if (ec) {
+            throw boost::system::system_error(ec);
+        }
+        // Skip past whatever went out, which may end partway through a buffer
+        while (first < buffers.size() && written >= buffers[first].size() - first_offset) {
+            written -= buffers[first].size() - first_offset;
+            first_offset = 0;
+            ++first;
+        }
+        first_offset += written;
+    }
+}
+
+}
+
+bool parse_connection_option(std::string_view arg, ConnectionOptions& options) {
+    auto value = [&arg](std::string_view name, auto& field) {
+        if (!arg.starts_with(name)) {
+            return false;
+        }
+        std::size_t number = std::stoul(std::string(arg.substr(name.size())));
+        if constexpr (std::is_same_v<std::decay_t<decltype(field)>, std::chrono::milliseconds>) {
+            field = std::chrono::milliseconds(number);
+        } else {
+            field = number;
+        }
+        return true;
+    };
+    return value("--idle-timeout=", options.idle_timeout)
+        || value("--header-timeout=", options.header_timeout)
+        || value("--body-timeout=", options.body_timeout)
+        || value("--write-timeout=", options.write_timeout)
+        || value("--drain-timeout=", options.drain_timeout)
+        || value("--max-header-size=", options.max_header_size)
+        || value("--max-body-size=", options.max_body_size);
+}
+
+ReadDeadline::clock::time_point ReadDeadline::update(const RequestParser& parser, std::size_t buffered,
+                                                     clock::time_point now) {
+    if (stage == Stage::Idle && buffered > 0) {
+        stage = Stage::Header;
+        deadline = now + options.header_timeout;
+    }
+    if (stage == Stage::Header && parser.head_complete()) {
+        stage = Stage::Body;
+        deadline = now + options.body_timeout;
+    }
+    return deadline;
+}
+
+ResponseBatch::ResponseBatch(std::pmr::memory_resource* resource)
+    : responses(resource),
+      segment_list(resource),
+      tails{std::pmr::string(resource), std::pmr::string(resource), std::pmr::string(resource)}
+{
+}
+
+void ResponseBatch::add(std::shared_ptr<const CachedResponse> response, const Request& request, bool keep_alive) {
+    std::size_t ending = 0;
+    if (!keep_alive) {
+        ending = 1;
+    } else if (request.minor_version == 0) {
+        ending = 2;
+    }
+    std::pmr::string& tail = tails[ending];
+    if (tail.empty()) {
+        std::string_view connection = connection_endings[ending];
+        tail.reserve(server_line.size() + server_name.size() + date_line.size() + DateClock::size + 2
+                     + connection.size());
+        tail.append(server_line).append(server_name).append(date_line);
+        tail.resize(tail.size() + DateClock::size);
+        DateClock::instance().read(tail.data() + tail.size() - DateClock::size);
+        tail.append("\r\n").append(connection);
+    }
+
+    // Append to the current run of buffers unless it ends in a file body that has to be sent first
+    if (segment_list.empty() || segment_list.back().body_fd >= 0) {
+        segment_list.emplace_back();
+    }
+    Segment& segment = segment_list.back();
+
+    // The cached header ends in the blank line; send everything before it and
+    // let the tail (plus its own blank line) take its place.
+    std::string_view header = response->header();
+    header.remove_suffix(end_of_headers.size());
+    segment.buffers.emplace_back(header.data(), header.size());
+    segment.buffers.emplace_back(tail.data(), tail.size());
+    // A HEAD response says how big its body would be and leaves it out
+    if (request.method == "HEAD") {
+        responses.push_back(std::move(response));
+        return;
+    }
+    if (response->has_file_body()) {
+        segment.body_fd = response->body_fd;
+        segment.body_offset = response->body_offset;
+        segment.body_size = response->body_size;
+    } else if (!response->body().empty()) {
+        segment.buffers.emplace_back(response->body().data(), response->body().size());
+    }
+
+    responses.push_back(std::move(response));
+}
+
+void ResponseBatch::clear() {
+    std::pmr::vector<Segment>(segment_list.get_allocator()).swap(segment_list);
+    std::pmr::vector<std::shared_ptr<const CachedResponse>>(responses.get_allocator()).swap(responses);
+    for (std::pmr::string& tail : tails) {
+        std::pmr::string(tail.get_allocator()).swap(tail);
+    }
+}
+
+std::size_t send_file_some(boost::asio::ip::tcp::socket& socket, int fd, off_t& offset, std::size_t count,
+                           boost::system::error_code& ec) {
+    while (true) {
+        ssize_t n = ::sendfile(socket.native_handle(), fd, &offset, count);
+        if (n >= 0) {
+            ec = {};
+            return static_cast<std::size_t>(n);
+        }
+        if (errno != EINTR) {
+            ec = boost::system::error_code(errno, boost::asio::error::get_system_category());
+            return 0;
+        }
+    }
+}
+
+void write_batch(boost::asio::ip::tcp::socket& socket, const ResponseBatch& batch, std::chrono::milliseconds timeout) {
+    // Non-blocking, so that sendfile(2) returns instead of blocking too and
+    // every wait for the client goes through poll(2) with the timeout
+    socket.non_blocking(true);
+    for (const ResponseBatch::Segment& segment : batch.segments()) {
+        write_buffers(socket, segment.buffers, timeout);
+
+        off_t offset = static_cast<off_t>(segment.body_offset);
+        std::size_t remaining = segment.body_fd >= 0 ? segment.body_size : 0;
+        while (remaining > 0) {
+            boost::system::error_code ec;
+            std::size_t sent = send_file_some(socket, segment.body_fd, offset, remaining, ec);
+            if (ec == boost::asio::error::would_block) {
+                wait_for(socket, POLLOUT, timeout);
+                continue;
+            }
+            if (ec) {
+                throw boost::system::system_error(ec);
+            }
+            if (sent == 0) {
+                throw std::runtime_error("File body shrank while sending");
+            }
+            remaining -= sent;
+        }
+    }
+}
+
+RequestParser::Result read_request(boost::asio::ip::tcp::socket& socket, ReceiveBuffer& buffer,
+                                   RequestParser& parser, ReadDeadline& deadline) {
+    while (true) {
+        RequestParser::Result result = parser.parse(buffer.data());
+        if (result != RequestParser::Result::Incomplete) {
+            return result;
+        }
+
+        auto now = ReadDeadline::clock::now();
+        auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline.update(parser, buffer.size(), now) - now);
+        pollfd fd{socket.native_handle(), POLLIN, 0};
+        int ready = remaining.count() > 0 ? ::poll(&fd, 1, static_cast<int>(remaining.count())) : 0;
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready == 0) {
+            return deadline.mid_request() ? parser.time_out() : RequestParser::Result::Incomplete;
+        }
+        if (ready < 0) {
+            return RequestParser::Result::Incomplete;
+        }
+
+        boost::system::error_code ec;
+        std::size_t n = socket.read_some(buffer.prepare(4096), ec);
+        if (ec == boost::asio::error::would_block) {
+            continue;
+        }
+        if (ec) {
+            return RequestParser::Result::Incomplete;
+        }
+        buffer.commit(n);
+    }
+}
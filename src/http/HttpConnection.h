@@ -0,0 +1,157 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+
+#include "HttpParser.h"
+#include "ReceiveBuffer.h"
+#include "ResponseCache.h"
+
+// Limits on one connection. Reading a request has three deadlines, one per
+// stage: idle_timeout until its first byte arrives, header_timeout from then
+// until its head is complete and body_timeout from then until its body is.
+// Unlike a timeout per read, that bounds how long a client trickling bytes
+// can hold a worker. A request that misses one gets a 408; a client that
+// never starts one is just hung up on. write_timeout bounds each write, and
+// each wait for the client to make room for more. drain_timeout is how long
+// open connections get to finish once shutdown starts.
+struct ConnectionOptions {
+    std::chrono::milliseconds idle_timeout = std::chrono::seconds(5);
+    std::chrono::milliseconds header_timeout = std::chrono::seconds(10);
+    std::chrono::milliseconds body_timeout = std::chrono::seconds(30);
+    std::chrono::milliseconds write_timeout = std::chrono::seconds(30);
+    std::chrono::milliseconds drain_timeout = std::chrono::seconds(10);
+    std::size_t max_requests = 100;
+    std::size_t max_header_size = 8 * 1024;
+    std::size_t max_body_size = 1024 * 1024;
+};
+
+// Applies one of the --*-timeout=<ms>, --max-header-size=<bytes> or
+// --max-body-size=<bytes> options; false if arg isn't one of them.
+bool parse_connection_option(std::string_view arg, ConnectionOptions& options);
+
+inline constexpr std::string_view connection_options_usage =
+    "[--idle-timeout=<ms>] [--header-timeout=<ms>] [--body-timeout=<ms>] [--write-timeout=<ms>]"
+    " [--drain-timeout=<ms>] [--max-header-size=<bytes>] [--max-body-size=<bytes>]";
+
+// Tracks which of ConnectionOptions' read deadlines applies to the request
+// being read. Every server drives one through restart() and update(), then
+// waits for data in its own way until the deadline update() returns.
+class ReadDeadline {
+public:
+    using clock = std::chrono::steady_clock;
+
+    explicit ReadDeadline(const ConnectionOptions& options) : options(options) { restart(); }
+
+    // Starts waiting for the next request
+    void restart(clock::time_point now = clock::now()) {
+        stage = Stage::Idle;
+        deadline = now + options.idle_timeout;
+    }
+
+    // Moves on to the next stage as the request arrives; buffered is how
+    // many bytes of it have been read. Returns when reading has to stop.
+    clock::time_point update(const RequestParser& parser, std::size_t buffered, clock::time_point now = clock::now());
+
+    // Whether part of a request has arrived, so giving up on it merits a 408
+    bool mid_request() const { return stage != Stage::Idle; }
+
+private:
+    enum class Stage { Idle, Header, Body };
+
+    ConnectionOptions options;
+    Stage stage = Stage::Idle;
+    clock::time_point deadline;
+};
+
+// Responses queued on one connection, split into segments: a run of
+// in-memory buffers that go out in one gathered write, optionally followed by
+// a body sent straight from its file with sendfile(2). Buffers reference the
+// cached responses rather than copying them; the batch keeps those alive.
+//
+// The batch's own bookkeeping comes from resource, normally the connection's
+// arena, so queueing responses doesn't touch the global heap.
+//
+// Cached heads hold everything fixed about a response. What each one still
+// needs, Server, Date and the Connection header, goes in as a tail formatted
+// once per batch from DateClock, so a response adds no buffers and no
+// formatting of its own.
+class ResponseBatch {
+public:
+    struct Segment {
+        using allocator_type = std::pmr::polymorphic_allocator<>;
+
+        explicit Segment(const allocator_type& allocator = {}) : buffers(allocator) {}
+        Segment(Segment&& other, const allocator_type& allocator)
+            : buffers(std::move(other.buffers), allocator), body_fd(other.body_fd), body_offset(other.body_offset),
+              body_size(other.body_size) {}
+
+        std::pmr::vector<boost::asio::const_buffer> buffers;
+        int body_fd = -1;
+        std::size_t body_offset = 0;
+        std::size_t body_size = 0;
+    };
+
+    explicit ResponseBatch(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+    // Queues response with the Connection header that tells the client whether
+    // we're keeping the connection open, and without its body if request is a
+    // HEAD. Nothing refers to request afterwards.
+    void add(std::shared_ptr<const CachedResponse> response, const Request& request, bool keep_alive);
+
+    const std::pmr::vector<Segment>& segments() const { return segment_list; }
+    bool empty() const { return segment_list.empty(); }
+
+    // Drops every response and hands all storage back to the memory resource,
+    // so the caller may reset an arena right afterwards.
+    void clear();
+
+private:
+    std::pmr::vector<std::shared_ptr<const CachedResponse>> responses;
+    std::pmr::vector<Segment> segment_list;
+    // Indexed by how the Connection header ends the head: left out, close or keep-alive
+    std::array<std::pmr::string, 3> tails;
+};
+
+// Per-connection scratch memory for ResponseBatch and friends: a monotonic
+// arena whose first few KiB live inline in the connection itself. reset()
+// rewinds it between batches, once nothing allocated from it is in use.
+class ConnectionArena {
+public:
+    static constexpr std::size_t inline_size = 4096;
+
+    ConnectionArena() : resource(storage, sizeof(storage)) {}
+    ConnectionArena(const ConnectionArena&) = delete;
+    ConnectionArena& operator=(const ConnectionArena&) = delete;
+
+    std::pmr::memory_resource* get() { return &resource; }
+    void reset() { resource.release(); }
+
+private:
+    alignas(std::max_align_t) std::byte storage[inline_size];
+    std::pmr::monotonic_buffer_resource resource;
+};
+
+// Sends as much of fd[offset, offset + count) as the socket accepts without
+// blocking, advancing offset. Sets ec to would_block when the socket is full.
+std::size_t send_file_some(boost::asio::ip::tcp::socket& socket, int fd, off_t& offset, std::size_t count,
+                           boost::system::error_code& ec);
+
+// Blocking servers: writes every segment of batch, throwing on failure,
+// including when the client takes nothing for timeout. Leaves the socket in
+// non-blocking mode.
+void write_batch(boost::asio::ip::tcp::socket& socket, const ResponseBatch& batch,
+                 std::chrono::milliseconds timeout = ConnectionOptions{}.write_timeout);
+
+// Blocking servers: reads into buffer until parser has a complete request or
+// has found it malformed. Returns Incomplete if the client closes the
+// connection or never starts a request before the deadline, and Error (with
+// a Timeout error) if it starts one but doesn't finish it in time.
+RequestParser::Result read_request(boost::asio::ip::tcp::socket& socket, ReceiveBuffer& buffer,
+                                   RequestParser& parser, ReadDeadline& deadline);
@@ -0,0 +1,304 @@
+#include "HttpParser.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+bool iequals(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+        return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+    });
+}
+
+std::string_view trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+    return s;
+}
+
+// Header values are comma-separated token lists, e.g. "Connection: keep-alive, Upgrade"
+bool has_token(std::string_view value, std::string_view token) {
+    while (!value.empty()) {
+        auto comma = value.find(',');
+        if (iequals(trim(value.substr(0, comma)), token)) {
+            return true;
+        }
+        if (comma == std::string_view::npos) {
+            break;
+        }
+        value.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+// Splits off the next space-separated word of the request line, tolerating repeated spaces
+std::string_view next_word(std::string_view& line) {
+    while (!line.empty() && line.front() == ' ') line.remove_prefix(1);
+    auto end = line.find(' ');
+    std::string_view word = line.substr(0, end);
+    line.remove_prefix(end == std::string_view::npos ? line.size() : end);
+    return word;
+}
+
+// Returns the position of the next CRLF in data at or after from, or npos
+std::size_t find_crlf(std::string_view data, std::size_t from) {
+    const char* end = data.data() + data.size();
+    for (const char* p = data.data() + from; p < end; ++p) {
+        p = find_char(p, end, '\r');
+        if (p + 1 >= end) {
+            break;
+        }
+        if (p[1] == '\n') {
+            return static_cast<std::size_t>(p - data.data());
+        }
+    }
+    return std::string_view::npos;
+}
+
+}
+
+const char* find_char(const char* begin, const char* end, char c) {
+    const char* p = begin;
+#ifdef __SSE2__
+    const __m128i needle = _mm_set1_epi8(c);
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; p < end; ++p) {
+        if (*p == c) {
+            return p;
+        }
+    }
+    return end;
+}
+
+std::string_view Request::header(std::string_view name) const {
+    for (std::size_t i = 0; i < header_count; ++i) {
+        if (iequals(headers[i].name, name)) {
+            return headers[i].value;
+        }
+    }
+    return {};
+}
+
+RequestParser::RequestParser(std::size_t max_head_size, std::size_t max_body_size)
+    : max_head_size(max_head_size),
+      max_body_size(max_body_size)
+{
+}
+
+void RequestParser::reset() {
+    current = Request();
+    scanned = 0;
+    head_start = 0;
+    head_size = 0;
+    consumed_size = 0;
+    failure = Error::None;
+    chunked = false;
+    content_length = 0;
+    chunk_offset = 0;
+    chunked_body.clear();
+}
+
+RequestParser::Result RequestParser::fail(Error error) {
+    failure = error;
+    return Result::Error;
+}
+
+RequestParser::Result RequestParser::time_out() {
+    return fail(Error::Timeout);
+}
+
+RequestParser::Result RequestParser::parse(std::string_view data) {
+    if (head_size == 0) {
+        // Empty lines ahead of the request line are ignored (RFC 9112 section 2.2), e.g. the
+        // CRLF some clients send after a POST body; they count towards consumed()
+        while (data.substr(head_start, 2) == "\r\n") {
+            head_start += 2;
+        }
+        // Resume just before where the last call stopped, in case "\r\n\r\n" straddles the boundary
+        std::size_t from = std::max(scanned > 3 ? scanned - 3 : 0, head_start);
+        std::size_t end = std::string_view::npos;
+        for (std::size_t crlf = find_crlf(data, from); crlf != std::string_view::npos; crlf = find_crlf(data, crlf + 2)) {
+            if (data.substr(crlf + 2, 2) == "\r\n") {
+                end = crlf;
+                break;
+            }
+        }
+        if (end == std::string_view::npos) {
+            scanned = data.size();
+            return data.size() > max_head_size ? fail(Error::HeadTooLarge) : Result::Incomplete;
+        }
+        if (end + 4 > max_head_size) {
+            return fail(Error::HeadTooLarge);
+        }
+        head_size = end + 4;
+        chunk_offset = head_size;
+    }
+
+    // The head is re-parsed on every call rather than kept across calls, since
+    // the caller's buffer may have moved while the body was still arriving.
+    if (!parse_head(data.substr(head_start, head_size - head_start))) {
+        return fail(failure == Error::None ? Error::Malformed : failure);
+    }
+
+    if (chunked) {
+        return parse_chunked(data);
+    }
+    if (data.size() - head_size < content_length) {
+        return Result::Incomplete;
+    }
+    current.body = data.substr(head_size, content_length);
+    consumed_size = head_size + content_length;
+    return Result::Complete;
+}
+
+bool RequestParser::parse_head(std::string_view head) {
+    current.header_count = 0;
+
+    std::size_t line_end = find_crlf(head, 0);
+    std::string_view line = head.substr(0, line_end);
+    current.method = next_word(line);
+    current.target = next_word(line);
+    std::string_view version = next_word(line);
+    if (current.method.empty() || current.target.empty() || !trim(line).empty()) {
+        return false;
+    }
+    if (version.size() != 8 || !version.starts_with("HTTP/1.") || (version[7] != '0' && version[7] != '1')) {
+        return false;
+    }
+    current.minor_version = version[7] - '0';
+
+    auto question = current.target.find('?');
+    current.path = current.target.substr(0, question);
+    current.query = question == std::string_view::npos ? std::string_view() : current.target.substr(question + 1);
+
+    bool close = false;
+    bool keep_alive = false;
+    chunked = false;
+    content_length = 0;
+    bool has_length = false;
+    std::size_t hosts = 0;
+
+    std::size_t pos = line_end + 2;
+    while (pos < head.size() - 2) {
+        std::size_t end = find_crlf(head, pos);
+        line = head.substr(pos, end - pos);
+        pos = end + 2;
+
+        const char* colon = find_char(line.data(), line.data() + line.size(), ':');
+        std::size_t name_size = static_cast<std::size_t>(colon - line.data());
+        if (name_size == 0 || name_size == line.size() || line.front() == ' ' || line.front() == '\t'
+            || line[name_size - 1] == ' ' || line[name_size - 1] == '\t') {
+            return false;
+        }
+        if (current.header_count == Request::max_headers) {
+            return false;
+        }
+        Header& header = current.headers[current.header_count++];
+        header.name = line.substr(0, name_size);
+        header.value = trim(line.substr(name_size + 1));
+
+        if (iequals(header.name, "Host")) {
+            ++hosts;
+        } else if (iequals(header.name, "Connection")) {
+            close = close || has_token(header.value, "close");
+            keep_alive = keep_alive || has_token(header.value, "keep-alive");
+        } else if (iequals(header.name, "Transfer-Encoding")) {
+            // chunked must be the final coding; we don't decode any others
+            if (!iequals(header.value, "chunked")) {
+                return false;
+            }
+            chunked = true;
+        } else if (iequals(header.name, "Content-Length")) {
+            std::size_t value = 0;
+            auto [end_ptr, ec] = std::from_chars(header.value.data(), header.value.data() + header.value.size(), value);
+            if (ec != std::errc() || end_ptr != header.value.data() + header.value.size()) {
+                return false;
+            }
+            // Lengths that disagree leave no telling where the body ends (RFC 9112 section 6.3)
+            if (has_length && value != content_length) {
+                return false;
+            }
+            content_length = value;
+            has_length = true;
+            if (content_length > max_body_size) {
+                failure = Error::BodyTooLarge;
+                return false;
+            }
+        }
+    }
+
+    // HTTP/1.1 requests must name exactly one host, and no request may name two (RFC 9112 section 3.2)
+    if (hosts > 1 || (hosts == 0 && current.minor_version == 1)) {
+        return false;
+    }
+
+    // A request framed both ways is how requests get smuggled past a proxy that reads the other one
+    if (chunked && has_length) {
+        return false;
+    }
+
+    // HTTP/1.1 connections persist unless the client says otherwise; HTTP/1.0 ones only on request
+    current.keep_alive = current.minor_version == 0 ? keep_alive && !close : !close;
+    return true;
+}
+
+RequestParser::Result RequestParser::parse_chunked(std::string_view data) {
+    while (true) {
+        std::size_t line_end = find_crlf(data, chunk_offset);
+        if (line_end == std::string_view::npos) {
+            return data.size() - chunk_offset > 64 ? fail(Error::Malformed) : Result::Incomplete;
+        }
+
+        // chunk-size in hex, optionally followed by ";extensions" we ignore
+        std::string_view size_line = data.substr(chunk_offset, line_end - chunk_offset);
+        std::size_t chunk_size = 0;
+        auto [end_ptr, ec] = std::from_chars(size_line.data(), size_line.data() + size_line.size(), chunk_size, 16);
+        if (ec != std::errc() || (end_ptr != size_line.data() + size_line.size() && *end_ptr != ';')) {
+            return fail(Error::Malformed);
+        }
+
+        std::size_t chunk_start = line_end + 2;
+        if (chunk_size == 0) {
+            // Skip any trailer fields up to the blank line that ends the message
+            std::size_t pos = chunk_start;
+            while (true) {
+                std::size_t end = find_crlf(data, pos);
+                if (end == std::string_view::npos) {
+                    return Result::Incomplete;
+                }
+                if (end == pos) {
+                    current.body = chunked_body;
+                    consumed_size = end + 2;
+                    return Result::Complete;
+                }
+                pos = end + 2;
+            }
+        }
+
+        // Compared before adding anything, so a size near SIZE_MAX can't wrap around
+        if (chunk_size > max_body_size - chunked_body.size()) {
+            return fail(Error::BodyTooLarge);
+        }
+        if (data.size() - chunk_start < chunk_size + 2) {
+            return Result::Incomplete;
+        }
+        if (data.substr(chunk_start + chunk_size, 2) != "\r\n") {
+            return fail(Error::Malformed);
+        }
+        chunked_body.append(data.substr(chunk_start, chunk_size));
+        chunk_offset = chunk_start + chunk_size + 2;
+    }
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+struct Header {
+    std::string_view name;
+    std::string_view value;
+};
+
+// A parsed HTTP/1.x request. Every view points into the buffer that was
+// handed to RequestParser::parse() (or, for chunked bodies, into the parser
+// itself), so it's only valid until that buffer is consumed or modified.
+struct Request {
+    static constexpr std::size_t max_headers = 64;
+
+    std::string_view method;
+    std::string_view target;
+    std::string_view path;
+    std::string_view query;
+    int minor_version = 1;
+    std::array<Header, max_headers> headers;
+    std::size_t header_count = 0;
+    std::string_view body;
+    bool keep_alive = true;
+
+    // Case-insensitive lookup of the first header called name; empty if absent.
+    std::string_view header(std::string_view name) const;
+};
+
+// Incremental parser for one request at a time. Call parse() with everything
+// received so far; it returns Incomplete until the whole request (head and
+// body) has arrived. Only the search for the head's end resumes where the last
+// call stopped; the head itself is parsed again on each call. After Complete,
+// request() is valid and consumed() bytes of the buffer belong to it; call
+// reset() before parsing the next request. After Error, error() says what was
+// wrong with it.
+class RequestParser {
+public:
+    enum class Result { Complete, Incomplete, Error };
+    // Timeout is never found by parse() itself; readers report it with time_out()
+    enum class Error { None, Malformed, HeadTooLarge, BodyTooLarge, Timeout };
+
+    explicit RequestParser(std::size_t max_head_size = 8 * 1024, std::size_t max_body_size = 1024 * 1024);
+
+    Result parse(std::string_view data);
+
+    const Request& request() const { return current; }
+    std::size_t consumed() const { return consumed_size; }
+    Error error() const { return failure; }
+    // Whether the request's head has arrived in full; only its body can still be missing
+    bool head_complete() const { return head_size != 0; }
+    // Gives up on a request that didn't arrive in time
+    Result time_out();
+    void reset();
+
+private:
+    bool parse_head(std::string_view head);
+    Result parse_chunked(std::string_view data);
+    Result fail(Error error);
+
+    std::size_t max_head_size;
+    std::size_t max_body_size;
+
+    Request current;
+    std::size_t scanned = 0;
+    // Where the request line starts, after any empty lines; head_size counts from the buffer's start
+    std::size_t head_start = 0;
+    std::size_t head_size = 0;
+    std::size_t consumed_size = 0;
+    Error failure = Error::None;
+
+    bool chunked = false;
+    std::size_t content_length = 0;
+    std::size_t chunk_offset = 0;
+    std::string chunked_body;
+};
+
+// Returns a pointer to the first c in [begin, end), or end. Scans 16 bytes at a
+// time with SSE2 where available.
+const char* find_char(const char* begin, const char* end, char c);
@@ -0,0 +1,268 @@
+#include "Lifecycle.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Listener.h"
+
+extern char** environ;
+
+namespace {
+
+// How long a restarted process gets to call ready() before we give up on it
+constexpr int restart_timeout_ms = 30000;
+
+}
+
+Lifecycle::Lifecycle(char** argv, std::chrono::milliseconds drain_timeout)
+    : argv(argv),
+      drain_timeout(drain_timeout)
+{
+    // A client that hangs up mid-sendfile(2) would otherwise kill the process
+    ::signal(SIGPIPE, SIG_IGN);
+
+    // SIGUSR1 only wakes the signal thread up to exit
+    sigemptyset(&signals);
+    for (int signal : {SIGTERM, SIGINT, SIGHUP, SIGUSR2, SIGUSR1}) {
+        sigaddset(&signals, signal);
+    }
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    if (::pipe2(wake_pipe, O_CLOEXEC) != 0) {
+        throw std::system_error(errno, std::generic_category(), "pipe2");
+    }
+    signal_fd = ::signalfd(-1, &signals, SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "signalfd");
+    }
+    signal_thread = std::thread([this] { handle_signals(); });
+}
+
+Lifecycle::~Lifecycle() {
+    destroying.store(true);
+    pthread_kill(signal_thread.native_handle(), SIGUSR1);
+    signal_thread.join();
+    ::close(signal_fd);
+    ::close(wake_pipe[0]);
+    ::close(wake_pipe[1]);
+}
+
+void Lifecycle::handle_signals() {
+    while (true) {
+        // While a restart is under way, its ready pipe is waited on together with the signals,
+        // so a SIGTERM in the meantime is handled straight away
+        pollfd fds[2] = {{signal_fd, POLLIN, 0}, {restart_ready_fd, POLLIN, 0}};
+        bool restarting = restart_pid > 0;
+        int timeout = -1;
+        if (restarting) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                restart_deadline - std::chrono::steady_clock::now());
+            timeout = static_cast<int>(std::max<std::chrono::milliseconds::rep>(left.count(), 0));
+        }
+        int ready = ::poll(fds, restarting ? 2 : 1, timeout);
+        if (ready < 0) {
+            continue;
+        }
+        if (restarting && (ready == 0 || fds[1].revents != 0)) {
+            char byte = 0;
+            bool started = ready > 0 && ::read(restart_ready_fd, &byte, 1) == 1;
+            finish_restart(started);
+            if (started) {
+                stop();
+            } else {
+                std::cerr << "Restart failed; still serving" << std::endl;
+            }
+        }
+        if ((fds[0].revents & POLLIN) == 0) {
+            continue;
+        }
+
+        signalfd_siginfo info;
+        if (::read(signal_fd, &info, sizeof(info)) != static_cast<ssize_t>(sizeof(info))) {
+            continue;
+        }
+        int signal = static_cast<int>(info.ssi_signo);
+        if (signal == SIGUSR1) {
+            if (destroying.load()) {
+                if (restart_pid > 0) {
+                    finish_restart(false);
+                }
+                return;
+            }
+        } else if (signal == SIGTERM || signal == SIGINT) {
+            // A new process still starting up would otherwise carry on serving after we've stopped
+            if (restart_pid > 0) {
+                finish_restart(false);
+            }
+            stop();
+        } else if (!stopping() && restart_pid <= 0) {
+            start_restart();
+        }
+    }
+}
+
+void Lifecycle::stop() {
+    std::vector<std::function<void()>> callbacks;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping()) {
+            drain_cut_short = true;
+            changed.notify_all();
+            return;
+        }
+        stop_time = std::chrono::steady_clock::now();
+        stop_requested.store(true, std::memory_order_release);
+        callbacks = stop_callbacks;
+    }
+    changed.notify_all();
+    char byte = 0;
+    [[maybe_unused]] ssize_t n = ::write(wake_pipe[1], &byte, 1);
+    for (const auto& callback : callbacks) {
+        callback();
+    }
+}
+
+void Lifecycle::on_stop(std::function<void()> callback) {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop_callbacks.push_back(std::move(callback));
+}
+
+bool Lifecycle::accept(boost::asio::ip::tcp::acceptor& acceptor, boost::asio::ip::tcp::socket& socket) const {
+    // Non-blocking, since another thread or process sharing the listener may take a connection first
+    acceptor.non_blocking(true);
+    while (!stopping()) {
+        pollfd fds[2] = {{acceptor.native_handle(), POLLIN, 0}, {wake_pipe[0], POLLIN, 0}};
+        if (::poll(fds, 2, -1) < 0 && errno != EINTR) {
+            throw std::system_error(errno, std::generic_category(), "poll");
+        }
+        if (stopping()) {
+            break;
+        }
+        boost::system::error_code ec;
+        acceptor.accept(socket, ec);
+        if (!ec) {
+            return true;
+        }
+        if (ec != boost::asio::error::would_block && ec != boost::asio::error::try_again
+            && ec != boost::asio::error::connection_aborted) {
+            throw boost::system::system_error(ec);
+        }
+    }
+    return false;
+}
+
+void Lifecycle::ready() {
+    close_unclaimed_listeners();
+    if (const char* fd = std::getenv("RESTART_READY_FD")) {
+        int ready_fd = std::atoi(fd);
+        char byte = 1;
+        [[maybe_unused]] ssize_t n = ::write(ready_fd, &byte, 1);
+        ::close(ready_fd);
+        ::unsetenv("RESTART_READY_FD");
+    }
+}
+
+bool Lifecycle::drain(const std::function<bool()>& idle) {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this] { return stopping(); });
+    auto deadline = stop_time + drain_timeout;
+    while (!idle()) {
+        if (drain_cut_short || std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+        changed.wait_for(lock, std::chrono::milliseconds(10));
+    }
+    return true;
+}
+
+void Lifecycle::start_restart() {
+    std::vector<int> sockets = listening_sockets();
+    int ready_pipe[2];
+    if (::pipe2(ready_pipe, O_CLOEXEC) != 0) {
+        return;
+    }
+
+    // Everything the child needs is built before fork(), since a multithreaded
+    // process may only make async-signal-safe calls between fork() and exec().
+    // It gets the listeners as descriptors 3, 4, ... and the ready pipe after them.
+    std::vector<int> sources = sockets;
+    sources.push_back(ready_pipe[1]);
+    std::vector<int> staged(sources.size());
+    int first_free = 3 + static_cast<int>(sources.size());
+
+    // By its real path rather than /proc/self/exe, which would leave the new process named "exe"
+    std::error_code ec;
+    std::string executable = std::filesystem::read_symlink("/proc/self/exe", ec);
+    if (ec) {
+        ::close(ready_pipe[0]);
+        ::close(ready_pipe[1]);
+        return;
+    }
+    std::string listen_fds = "LISTEN_FDS=" + std::to_string(sockets.size());
+    std::string ready_fd = "RESTART_READY_FD=" + std::to_string(3 + sockets.size());
+    std::vector<char*> env;
+    for (char** entry = environ; *entry != nullptr; ++entry) {
+        std::string_view variable = *entry;
+        if (!variable.starts_with("LISTEN_FDS=") && !variable.starts_with("LISTEN_PID=")
+            && !variable.starts_with("RESTART_READY_FD=")) {
+            env.push_back(*entry);
+        }
+    }
+    env.push_back(listen_fds.data());
+    env.push_back(ready_fd.data());
+    env.push_back(nullptr);
+
+    pid_t pid = ::fork();
+    if (pid == 0) {
+        // Copy first, so moving one descriptor into place can't clobber another still to move
+        for (std::size_t i = 0; i < sources.size(); ++i) {
+            staged[i] = ::fcntl(sources[i], F_DUPFD_CLOEXEC, first_free);
+            if (staged[i] < 0) {
+                ::_exit(127);
+            }
+        }
+        for (std::size_t i = 0; i < staged.size(); ++i) {
+            if (::dup2(staged[i], 3 + static_cast<int>(i)) < 0) {
+                ::_exit(127);
+            }
+        }
+        // Connections stay with this process; a copy in the new one would keep them open after we close them
+        ::close_range(first_free, ~0U, 0);
+        ::sigprocmask(SIG_UNBLOCK, &signals, nullptr);
+        ::execve(executable.c_str(), argv, env.data());
+        ::_exit(127);
+    }
+    ::close(ready_pipe[1]);
+    if (pid < 0) {
+        ::close(ready_pipe[0]);
+        return;
+    }
+
+    // Keep serving until the new process is accepting, so no connection waits on it starting up;
+    // handle_signals() waits for it to say so
+    restart_pid = pid;
+    restart_ready_fd = ready_pipe[0];
+    restart_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(restart_timeout_ms);
+}
+
+void Lifecycle::finish_restart(bool started) {
+    ::close(restart_ready_fd);
+    if (!started) {
+        ::kill(restart_pid, SIGKILL);
+        ::waitpid(restart_pid, nullptr, 0);
+    }
+    restart_pid = -1;
+    restart_ready_fd = -1;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+
+#include <signal.h>
+
+// Graceful shutdown and hot restart, driven by signals.
+//
+// SIGTERM or SIGINT stops the server: accept loops end, requests already
+// arriving are answered with "Connection: close", and drain() gives open
+// connections up to drain_timeout to finish. A second signal cuts the drain
+// short.
+//
+// SIGHUP or SIGUSR2 restarts it without refusing or resetting a connection:
+// the binary is run again with the same arguments, inheriting every
+// listening socket, and once the new process calls ready() this one stops as
+// above. If the new process doesn't get that far, this one keeps serving.
+//
+// Construct it at the top of main, before any other thread starts: the
+// signals are blocked in every thread and handled on one of its own.
+class Lifecycle {
+public:
+    explicit Lifecycle(char** argv, std::chrono::milliseconds drain_timeout = std::chrono::seconds(10));
+    ~Lifecycle();
+    Lifecycle(const Lifecycle&) = delete;
+    Lifecycle& operator=(const Lifecycle&) = delete;
+
+    bool stopping() const { return stop_requested.load(std::memory_order_acquire); }
+
+    // Starts shutdown, as SIGTERM does
+    void stop();
+
+    // Runs callback on the signal thread when shutdown starts, e.g. to close
+    // an asynchronous server's acceptor. Call before serving starts.
+    void on_stop(std::function<void()> callback);
+
+    // Blocking servers: accepts the next connection into socket, or returns
+    // false once shutdown has started.
+    bool accept(boost::asio::ip::tcp::acceptor& acceptor, boost::asio::ip::tcp::socket& socket) const;
+
+    // Call once every listener is open and accepting. If a restart started
+    // this process, the old one starts draining now.
+    void ready();
+
+    // Waits for shutdown to start, then until idle() holds, polling it; false
+    // if drain_timeout (or a second signal) ended the wait first.
+    bool drain(const std::function<bool()>& idle);
+
+private:
+    void handle_signals();
+    // Starts the new process for a restart; handle_signals() then waits for its ready() alongside signals
+    void start_restart();
+    // Ends the restart under way, killing the new process unless it started
+    void finish_restart(bool started);
+
+    char** argv;
+    std::chrono::milliseconds drain_timeout;
+    sigset_t signals;
+
+    std::atomic<bool> stop_requested{false};
+    std::atomic<bool> destroying{false};
+    // Written to when shutdown starts, so accept() can wait on it alongside the listener
+    int wake_pipe[2] = {-1, -1};
+    int signal_fd = -1;
+
+    // The restart under way, if any; only the signal thread touches these
+    pid_t restart_pid = -1;
+    int restart_ready_fd = -1;
+    std::chrono::steady_clock::time_point restart_deadline;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::chrono::steady_clock::time_point stop_time;
+    bool drain_cut_short = false;
+    std::vector<std::function<void()>> stop_callbacks;
+
+    std::thread signal_thread;
+};
@@ -0,0 +1,99 @@
+#include "Listener.h"
+
+#include <cstdlib>
+#include <mutex>
+#include <string>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using boost::asio::ip::tcp;
+
+namespace {
+
+// Boost.Asio has no named option for SO_REUSEPORT
+using reuse_port_option = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
+// Inherited sockets follow the systemd convention: LISTEN_FDS of them, starting at descriptor 3
+constexpr int first_inherited_fd = 3;
+
+struct Listeners {
+    std::mutex mutex;
+    std::vector<int> open;
+    std::vector<int> inherited;
+
+    Listeners() {
+        const char* count = std::getenv("LISTEN_FDS");
+        for (int i = 0; count != nullptr && i < std::atoi(count); ++i) {
+            // So they don't leak into anything we exec ourselves
+            ::fcntl(first_inherited_fd + i, F_SETFD, FD_CLOEXEC);
+            inherited.push_back(first_inherited_fd + i);
+        }
+        ::unsetenv("LISTEN_FDS");
+    }
+
+    // An inherited socket listening on port, or -1
+    int claim(unsigned short port) {
+        for (auto it = inherited.begin(); it != inherited.end(); ++it) {
+            sockaddr_in address{};
+            socklen_t size = sizeof(address);
+            if (::getsockname(*it, reinterpret_cast<sockaddr*>(&address), &size) == 0
+                && address.sin_family == AF_INET && ntohs(address.sin_port) == port) {
+                int fd = *it;
+                inherited.erase(it);
+                return fd;
+            }
+        }
+        return -1;
+    }
+};
+
+Listeners& listeners() {
+    static Listeners instance;
+    return instance;
+}
+
+}
+
+tcp::acceptor open_acceptor(boost::asio::io_context& io_context, unsigned short port, bool reuse_port) {
+    Listeners& registry = listeners();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    tcp::acceptor acceptor(io_context);
+    if (int fd = registry.claim(port); fd >= 0) {
+        // Already bound and listening, with the options below set by whoever opened it
+        acceptor.assign(tcp::v4(), fd);
+    } else {
+        tcp::endpoint endpoint(tcp::v4(), port);
+        acceptor.open(endpoint.protocol());
+        acceptor.set_option(tcp::acceptor::reuse_address(true));
+        // Accepted sockets inherit this on Linux. We already coalesce each batch of
+        // responses ourselves, and Nagle would otherwise hold back the tail of a
+        // batch the kernel splits until the client's delayed ACK, ~40 ms later.
+        acceptor.set_option(tcp::no_delay(true));
+        if (reuse_port) {
+            acceptor.set_option(reuse_port_option(true));
+        }
+        acceptor.bind(endpoint);
+        acceptor.listen();
+    }
+    registry.open.push_back(acceptor.native_handle());
+    return acceptor;
+}
+
+std::vector<int> listening_sockets() {
+    Listeners& registry = listeners();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    return registry.open;
+}
+
+void close_unclaimed_listeners() {
+    Listeners& registry = listeners();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (int fd : registry.inherited) {
+        ::close(fd);
+    }
+    registry.inherited.clear();
+}
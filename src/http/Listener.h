@@ -0,0 +1,24 @@
+#pragma once
+
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+
+// Opens a listening socket on port, with TCP_NODELAY for the connections it
+// accepts. With reuse_port, SO_REUSEPORT is set
+// before binding so several acceptors (in this process or others) can listen
+// on the same port and the kernel spreads new connections between them.
+//
+// A process started by a hot restart (see Lifecycle) takes over its
+// predecessor's listening sockets instead, one per call, so connections
+// waiting in their accept queues are never refused or reset.
+boost::asio::ip::tcp::acceptor open_acceptor(boost::asio::io_context& io_context, unsigned short port,
+                                             bool reuse_port = false);
+
+// The descriptors of every listening socket open_acceptor has returned
+std::vector<int> listening_sockets();
+
+// Closes inherited listening sockets that no open_acceptor call took over,
+// e.g. after restarting with fewer --reuseport threads, so the kernel stops
+// queueing connections on them.
+void close_unclaimed_listeners();
@@ -0,0 +1,231 @@
+#include "Metrics.h"
+
+#include "ResponseHead.h"
+
+#include <algorithm>
+#include <bit>
+
+namespace {
+
+std::atomic<std::uint64_t> next_metrics_id{1};
+
+// The Metrics instance the calling thread last recorded into, and its shard there
+struct LocalShard {
+    std::uint64_t metrics_id = 0;
+    void* shard = nullptr;
+};
+thread_local LocalShard local;
+
+// Only the owning thread writes a shard, so a plain load and store is enough;
+// readers may see a slightly stale value but never a torn one.
+void add(std::atomic<std::uint64_t>& counter, std::uint64_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+std::size_t status_index(std::uint16_t status) {
+    const auto& statuses = Metrics::tracked_statuses;
+    return static_cast<std::size_t>(std::find(statuses.begin(), statuses.end(), status) - statuses.begin());
+}
+
+std::string format_seconds(std::uint64_t micros) {
+    std::string s = std::to_string(micros / 1000000) + "." + std::to_string(1000000 + micros % 1000000).substr(1);
+    while (s.back() == '0') s.pop_back();
+    if (s.back() == '.') s.pop_back();
+    return s;
+}
+
+}
+
+std::size_t Metrics::Histogram::bucket(std::uint64_t micros) {
+    if (micros < sub_buckets) {
+        return static_cast<std::size_t>(micros);
+    }
+    std::size_t exponent = static_cast<std::size_t>(std::bit_width(micros)) - 1;
+    if (exponent >= max_exponent) {
+        return num_buckets - 1;
+    }
+    std::size_t sub = static_cast<std::size_t>(micros >> (exponent - 2)) & (sub_buckets - 1);
+    return sub_buckets + (exponent - 2) * sub_buckets + sub;
+}
+
+std::uint64_t Metrics::Histogram::upper_bound(std::size_t bucket) {
+    if (bucket < sub_buckets) {
+        return bucket;
+    }
+    std::size_t exponent = (bucket - sub_buckets) / sub_buckets + 2;
+    std::uint64_t sub = (bucket - sub_buckets) % sub_buckets;
+    return ((sub_buckets + sub + 1) << (exponent - 2)) - 1;
+}
+
+Metrics::Metrics(std::vector<std::string> route_labels)
+    : route_labels(std::move(route_labels)),
+      id(next_metrics_id.fetch_add(1))
+{
+}
+
+Metrics::Shard& Metrics::local_shard() {
+    if (local.metrics_id != id) {
+        std::lock_guard<std::mutex> lock(shards_mutex);
+        // A thread switching between several Metrics finds its old shard again
+        auto it = std::find_if(shards.begin(), shards.end(), [](const std::unique_ptr<Shard>& shard) {
+            return shard->owner == std::this_thread::get_id();
+        });
+        if (it == shards.end()) {
+            shards.push_back(std::make_unique<Shard>(route_labels.size() * (tracked_statuses.size() + 1)));
+            it = shards.end() - 1;
+        }
+        local = {id, it->get()};
+    }
+    return *static_cast<Shard*>(local.shard);
+}
+
+void Metrics::connection_opened() {
+    add(local_shard().connections_opened, 1);
+}
+
+void Metrics::connection_closed() {
+    add(local_shard().connections_closed, 1);
+}
+
+std::uint64_t Metrics::open_connections() const {
+    std::lock_guard<std::mutex> lock(shards_mutex);
+    std::uint64_t opened = 0, closed = 0;
+    for (const std::unique_ptr<Shard>& shard : shards) {
+        opened += shard->connections_opened.load(std::memory_order_relaxed);
+        closed += shard->connections_closed.load(std::memory_order_relaxed);
+    }
+    // A close can be seen before its open when they were counted on different threads
+    return opened > closed ? opened - closed : 0;
+}
+
+void Metrics::request(std::size_t route_index, std::uint16_t status, std::size_t bytes_in, std::size_t bytes_out) {
+    Shard& shard = local_shard();
+    add(shard.requests[route_index * (tracked_statuses.size() + 1) + status_index(status)], 1);
+    add(shard.bytes_in, bytes_in);
+    add(shard.bytes_out, bytes_out);
+}
+
+void Metrics::observe(Histogram& histogram, std::chrono::steady_clock::duration elapsed, std::size_t count) {
+    auto micros = static_cast<std::uint64_t>(
+        std::max<std::int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count()));
+    add(histogram.counts[Histogram::bucket(micros)], count);
+    add(histogram.sum_micros, micros * count);
+}
+
+void Metrics::first_byte(std::chrono::steady_clock::duration elapsed) {
+    observe(local_shard().first_byte, elapsed, 1);
+}
+
+void Metrics::request_time(std::chrono::steady_clock::duration elapsed, std::size_t count) {
+    observe(local_shard().request_time, elapsed, count);
+}
+
+void Metrics::add_gauge(std::string name, std::string help, std::function<double()> read) {
+    std::lock_guard<std::mutex> lock(shards_mutex);
+    gauges.push_back({std::move(name), std::move(help), std::move(read)});
+}
+
+void Metrics::add_counters(std::string name, std::string help, std::string label,
+                           std::function<std::vector<double>()> read, std::vector<std::string> label_values) {
+    std::lock_guard<std::mutex> lock(shards_mutex);
+    counter_families.push_back({std::move(name), std::move(help), std::move(label), std::move(read),
+                                std::move(label_values)});
+}
+
+void Metrics::render_histogram(std::string& out, const std::string& name, const std::string& help,
+                               Histogram Shard::*histogram) const {
+    std::array<std::uint64_t, Histogram::num_buckets> counts{};
+    std::uint64_t sum = 0;
+    for (const std::unique_ptr<Shard>& shard : shards) {
+        const Histogram& h = (*shard).*histogram;
+        for (std::size_t i = 0; i < Histogram::num_buckets; ++i) {
+            counts[i] += h.counts[i].load(std::memory_order_relaxed);
+        }
+        sum += h.sum_micros.load(std::memory_order_relaxed);
+    }
+
+    out += "# HELP " + name + " " + help + "\n# TYPE " + name + " histogram\n";
+    std::uint64_t cumulative = 0;
+    for (std::size_t i = 0; i + 1 < Histogram::num_buckets; ++i) {
+        cumulative += counts[i];
+        // Bucket i holds whole microseconds up to and including its upper bound
+        out += name + "_bucket{le=\"" + format_seconds(Histogram::upper_bound(i) + 1) + "\"} "
+             + std::to_string(cumulative) + "\n";
+    }
+    cumulative += counts[Histogram::num_buckets - 1];
+    out += name + "_bucket{le=\"+Inf\"} " + std::to_string(cumulative) + "\n";
+    out += name + "_sum " + format_seconds(sum) + "\n";
+    out += name + "_count " + std::to_string(cumulative) + "\n";
+}
+
+std::string Metrics::render() const {
+    std::lock_guard<std::mutex> lock(shards_mutex);
+    std::size_t series = route_labels.size() * (tracked_statuses.size() + 1);
+    std::vector<std::uint64_t> requests(series);
+    std::uint64_t opened = 0, closed = 0, bytes_in = 0, bytes_out = 0;
+    for (const std::unique_ptr<Shard>& shard : shards) {
+        for (std::size_t i = 0; i < series; ++i) {
+            requests[i] += shard->requests[i].load(std::memory_order_relaxed);
+        }
+        opened += shard->connections_opened.load(std::memory_order_relaxed);
+        closed += shard->connections_closed.load(std::memory_order_relaxed);
+        bytes_in += shard->bytes_in.load(std::memory_order_relaxed);
+        bytes_out += shard->bytes_out.load(std::memory_order_relaxed);
+    }
+
+    std::string out;
+    out += "# HELP http_requests_total Requests answered, by route and status.\n";
+    out += "# TYPE http_requests_total counter\n";
+    for (std::size_t route = 0; route < route_labels.size(); ++route) {
+        for (std::size_t status = 0; status <= tracked_statuses.size(); ++status) {
+            std::uint64_t count = requests[route * (tracked_statuses.size() + 1) + status];
+            if (count == 0) {
+                continue;
+            }
+            std::string code = status < tracked_statuses.size() ? std::to_string(tracked_statuses[status]) : "other";
+            out += "http_requests_total{route=\"" + route_labels[route] + "\",status=\"" + code + "\"} "
+                 + std::to_string(count) + "\n";
+        }
+    }
+
+    out += "# HELP http_connections_total Connections accepted.\n# TYPE http_connections_total counter\n";
+    out += "http_connections_total " + std::to_string(opened) + "\n";
+    out += "# HELP http_connections_in_flight Connections currently open.\n# TYPE http_connections_in_flight gauge\n";
+    // Shards are read one after another, so a close may be seen before its open
+    out += "http_connections_in_flight " + std::to_string(opened > closed ? opened - closed : 0) + "\n";
+    out += "# HELP http_request_bytes_total Request bytes read.\n# TYPE http_request_bytes_total counter\n";
+    out += "http_request_bytes_total " + std::to_string(bytes_in) + "\n";
+    out += "# HELP http_response_bytes_total Response bytes written.\n# TYPE http_response_bytes_total counter\n";
+    out += "http_response_bytes_total " + std::to_string(bytes_out) + "\n";
+
+    render_histogram(out, "http_first_byte_seconds", "Time from accept to the first response byte.",
+                     &Shard::first_byte);
+    render_histogram(out, "http_request_duration_seconds", "Time from reading a request to writing its response.",
+                     &Shard::request_time);
+
+    for (const Gauge& gauge : gauges) {
+        out += "# HELP " + gauge.name + " " + gauge.help + "\n# TYPE " + gauge.name + " gauge\n";
+        out += gauge.name + " " + std::to_string(gauge.read()) + "\n";
+    }
+    for (const CounterFamily& family : counter_families) {
+        out += "# HELP " + family.name + " " + family.help + "\n# TYPE " + family.name + " counter\n";
+        std::vector<double> values = family.read();
+        for (std::size_t i = 0; i < values.size(); ++i) {
+            std::string value = i < family.label_values.size() ? family.label_values[i] : std::to_string(i);
+            out += family.name + "{" + family.label + "=\"" + value + "\"} " + std::to_string(values[i]) + "\n";
+        }
+    }
+    return out;
+}
+
+std::shared_ptr<const CachedResponse> Metrics::response() const {
+    std::string body = render();
+    auto response = std::make_shared<CachedResponse>();
+    response->bytes = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: ";
+    append_decimal(response->bytes, body.size());
+    response->bytes.append("\r\n\r\n");
+    response->header_size = response->bytes.size();
+    response->body_size = body.size();
+    response->bytes += body;
+    return response;
+}
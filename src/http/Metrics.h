@@ -0,0 +1,113 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ResponseCache.h"
+
+// Server-wide counters and latency histograms, rendered in the Prometheus
+// text format for /metrics. Every thread that records anything gets its own
+// shard, written with plain relaxed loads and stores because nobody else
+// writes to it; render() adds the shards up. Recording therefore never
+// takes a lock or a contended cache line after a thread's first call.
+class Metrics {
+public:
+    // HTTP status codes with their own series; anything else is counted as "other"
+    static constexpr std::array<std::uint16_t, 14> tracked_statuses = {
+        200, 204, 206, 304, 400, 404, 408, 413, 416, 431, 500, 502, 503, 504,
+    };
+
+    // route_labels[i] names the route with index i, as given to request()
+    explicit Metrics(std::vector<std::string> route_labels);
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    void connection_opened();
+    void connection_closed();
+    // Connections opened and not yet closed, e.g. to tell when a drain is done
+    std::uint64_t open_connections() const;
+    void request(std::size_t route_index, std::uint16_t status, std::size_t bytes_in, std::size_t bytes_out);
+
+    // Time from accepting a connection to the first byte of its first response
+    void first_byte(std::chrono::steady_clock::duration elapsed);
+    // Time from a request being read to its response being written, for count requests at once
+    void request_time(std::chrono::steady_clock::duration elapsed, std::size_t count = 1);
+
+    // Adds a value sampled when rendering, such as a pool's queue depth. Call
+    // before serving starts; read must stay valid for the Metrics' lifetime.
+    void add_gauge(std::string name, std::string help, std::function<double()> read);
+    // The same for a family of counters told apart by label, such as one per
+    // pool worker: read returns them all, and the i-th gets
+    // label="label_values[i]", or label="i" past the end of label_values.
+    void add_counters(std::string name, std::string help, std::string label,
+                      std::function<std::vector<double>()> read, std::vector<std::string> label_values = {});
+
+    std::string render() const;
+
+    // render() as a complete response, for the /metrics route
+    std::shared_ptr<const CachedResponse> response() const;
+
+private:
+    // HDR-style log-linear buckets over microseconds: four sub-buckets per
+    // power of two, so every bucket is within 25% of its value, up to 2^26 us
+    // (~67 s). The last bucket catches everything slower.
+    struct Histogram {
+        static constexpr std::size_t sub_buckets = 4;
+        static constexpr std::size_t max_exponent = 26;
+        static constexpr std::size_t num_buckets = sub_buckets * (max_exponent - 1) + 1;
+
+        static std::size_t bucket(std::uint64_t micros);
+        static std::uint64_t upper_bound(std::size_t bucket);
+
+        std::array<std::atomic<std::uint64_t>, num_buckets> counts{};
+        std::atomic<std::uint64_t> sum_micros{0};
+    };
+
+    struct alignas(64) Shard {
+        explicit Shard(std::size_t series) : requests(new std::atomic<std::uint64_t>[series]()) {}
+
+        std::thread::id owner = std::this_thread::get_id();
+        std::unique_ptr<std::atomic<std::uint64_t>[]> requests;
+        std::atomic<std::uint64_t> connections_opened{0};
+        std::atomic<std::uint64_t> connections_closed{0};
+        std::atomic<std::uint64_t> bytes_in{0};
+        std::atomic<std::uint64_t> bytes_out{0};
+        Histogram first_byte;
+        Histogram request_time;
+    };
+
+    struct Gauge {
+        std::string name;
+        std::string help;
+        std::function<double()> read;
+    };
+
+    struct CounterFamily {
+        std::string name;
+        std::string help;
+        std::string label;
+        std::function<std::vector<double>()> read;
+        std::vector<std::string> label_values;
+    };
+
+    Shard& local_shard();
+    static void observe(Histogram& histogram, std::chrono::steady_clock::duration elapsed, std::size_t count);
+    void render_histogram(std::string& out, const std::string& name, const std::string& help,
+                          Histogram Shard::*histogram) const;
+
+    std::vector<std::string> route_labels;
+    std::uint64_t id;
+
+    mutable std::mutex shards_mutex;
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::vector<Gauge> gauges;
+    std::vector<CounterFamily> counter_families;
+};
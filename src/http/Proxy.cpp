@@ -0,0 +1,317 @@
+#include "Proxy.h"
+
+#include <algorithm>
+#include <cctype>
+
+namespace {
+
+constexpr std::size_t read_size = 16 * 1024;
+
+bool iequals(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+        return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+    });
+}
+
+// Methods a server may be sent twice with the same effect as once (RFC 9110 section 9.2.2)
+bool is_idempotent(std::string_view method) {
+    return method == "GET" || method == "HEAD" || method == "OPTIONS" || method == "PUT" || method == "DELETE";
+}
+
+void append_header(std::string& head, std::string_view name, std::string_view value) {
+    head.append(name).append(": ").append(value).append("\r\n");
+}
+
+}
+
+void ProxyExchange::start(tcp::socket& client, UpstreamPool& pool, const Request& request, bool keep_alive,
+                          std::chrono::milliseconds write_timeout, Completion completion) {
+    auto exchange = std::make_shared<ProxyExchange>(client, pool, request, keep_alive, write_timeout,
+                                                    std::move(completion));
+    exchange->backend = pool.acquire();
+    if (exchange->backend == nullptr) {
+        exchange->outcome.status = 503;
+        exchange->completion(exchange->outcome);
+        return;
+    }
+
+    // The request as the backend sees it: our hop-by-hop headers dropped, the body (already de-chunked by
+    // the parser) framed by Content-Length, and the client's address added to X-Forwarded-For
+    std::string& head = exchange->request_head;
+    head.append(request.method).append(" ").append(request.target);
+    head.append(request.minor_version == 0 ? " HTTP/1.0\r\n" : " HTTP/1.1\r\n");
+    bool has_host = false;
+    std::string forwarded_for;
+    for (std::size_t i = 0; i < request.header_count; ++i) {
+        const Header& header = request.headers[i];
+        if (iequals(header.name, "X-Forwarded-For")) {
+            forwarded_for.append(header.value).append(", ");
+            continue;
+        }
+        if (is_hop_by_hop(header.name) || iequals(header.name, "Content-Length") || iequals(header.name, "Expect")) {
+            continue;
+        }
+        has_host = has_host || iequals(header.name, "Host");
+        append_header(head, header.name, header.value);
+    }
+    if (!has_host) {
+        append_header(head, "Host", exchange->backend->name);
+    }
+    boost::system::error_code ec;
+    tcp::endpoint peer = client.remote_endpoint(ec);
+    if (!ec) {
+        append_header(head, "X-Forwarded-For", forwarded_for + peer.address().to_string());
+    }
+    if (!request.body.empty() || !request.header("Content-Length").empty()
+        || !request.header("Transfer-Encoding").empty()) {
+        append_header(head, "Content-Length", std::to_string(request.body.size()));
+    }
+    if (request.minor_version == 0) {
+        // Otherwise an HTTP/1.0 backend closes the connection after answering
+        append_header(head, "Connection", "keep-alive");
+    }
+    head.append("\r\n");
+
+    exchange->upstream = pool.take_idle(*exchange->backend);
+    exchange->reused = exchange->upstream.has_value();
+    exchange->connect();
+}
+
+ProxyExchange::ProxyExchange(tcp::socket& client, UpstreamPool& pool, const Request& request, bool keep_alive,
+                             std::chrono::milliseconds write_timeout, Completion completion)
+    : client(client),
+      pool(pool),
+      request(request),
+      write_timeout(write_timeout),
+      completion(std::move(completion)),
+      timer(client.get_executor()),
+      buffer(read_size)
+{
+    outcome.keep_alive = keep_alive;
+}
+
+void ProxyExchange::arm(std::chrono::milliseconds timeout) {
+    timer.expires_after(timeout);
+    timer.async_wait([weak = weak_from_this()](boost::system::error_code ec) {
+        // Whatever was waiting when it went off is cancelled; a timer re-armed or done with since doesn't count
+        auto self = weak.lock();
+        if (!self || ec || self->finished || self->timer.expiry() > std::chrono::steady_clock::now()) {
+            return;
+        }
+        self->timed_out = true;
+        boost::system::error_code ignored;
+        if (self->upstream) {
+            self->upstream->cancel(ignored);
+        }
+        self->client.cancel(ignored);
+    });
+}
+
+void ProxyExchange::connect() {
+    if (reused) {
+        send_request();
+        return;
+    }
+    upstream.emplace(pool.connection());
+    arm(pool.options().timeout);
+    upstream->async_connect(backend->endpoint, boost::asio::bind_executor(client.get_executor(),
+        [self = shared_from_this()](boost::system::error_code ec) {
+            if (ec) {
+                // Refused or unreachable: take the backend out of rotation until it passes a health check
+                self->retry_or_fail(!self->timed_out);
+                return;
+            }
+            self->upstream->set_option(tcp::no_delay(true), ec);
+            self->send_request();
+        }));
+}
+
+void ProxyExchange::send_request() {
+    arm(pool.options().timeout);
+    std::array<boost::asio::const_buffer, 2> buffers{
+        boost::asio::buffer(request_head), boost::asio::buffer(request.body.data(), request.body.size())};
+    boost::asio::async_write(*upstream, buffers, boost::asio::bind_executor(client.get_executor(),
+        [self = shared_from_this()](boost::system::error_code ec, std::size_t) {
+            if (ec) {
+                self->retry_or_fail(false);
+                return;
+            }
+            self->request_sent = true;
+            self->read_head();
+        }));
+}
+
+void ProxyExchange::read_head() {
+    if (buffered == buffer.size()) {
+        // A head bigger than the parser allows; it'll have said so already
+        retry_or_fail(false);
+        return;
+    }
+    arm(pool.options().timeout);
+    upstream->async_read_some(boost::asio::buffer(buffer.data() + buffered, buffer.size() - buffered),
+        boost::asio::bind_executor(client.get_executor(),
+        [self = shared_from_this()](boost::system::error_code ec, std::size_t bytes_read) {
+            if (ec) {
+                self->retry_or_fail(false);
+                return;
+            }
+            self->buffered += bytes_read;
+            bool head_request = self->request.method == "HEAD";
+            while (true) {
+                auto result = self->parser.parse(std::string_view(self->buffer.data(), self->buffered), head_request);
+                if (result == ResponseHeadParser::Result::Incomplete) {
+                    self->read_head();
+                    return;
+                }
+                if (result == ResponseHeadParser::Result::Error || self->parser.status() == 101) {
+                    self->retry_or_fail(false);
+                    return;
+                }
+                if (self->parser.status() >= 200) {
+                    break;
+                }
+                // An interim response such as 100 Continue: the client already sent its body, so drop it
+                std::size_t head_size = self->parser.head_size();
+                std::copy(self->buffer.begin() + static_cast<std::ptrdiff_t>(head_size),
+                          self->buffer.begin() + static_cast<std::ptrdiff_t>(self->buffered), self->buffer.begin());
+                self->buffered -= head_size;
+                self->parser.reset();
+            }
+            self->send_head();
+        }));
+}
+
+void ProxyExchange::send_head() {
+    using Framing = ResponseHeadParser::Framing;
+    remaining = parser.content_length();
+    outcome.relayed = true;
+    outcome.status = parser.status();
+    // Only the backend closing the connection marks the end of the body, so the client's must close too
+    outcome.keep_alive = outcome.keep_alive && parser.framing() != Framing::Close;
+
+    response_head.append("HTTP/1.1 ").append(std::to_string(parser.status()));
+    if (!parser.reason().empty()) {
+        response_head.append(" ").append(parser.reason());
+    }
+    response_head.append("\r\n");
+    for (std::size_t i = 0; i < parser.header_count(); ++i) {
+        if (!is_hop_by_hop(parser.header(i).name)) {
+            append_header(response_head, parser.header(i).name, parser.header(i).value);
+        }
+    }
+    if (parser.framing() == Framing::Chunked) {
+        // Relayed still chunked, exactly as it arrives
+        append_header(response_head, "Transfer-Encoding", "chunked");
+    }
+    if (!outcome.keep_alive) {
+        append_header(response_head, "Connection", "close");
+    } else if (request.minor_version == 0) {
+        append_header(response_head, "Connection", "keep-alive");
+    }
+    response_head.append("\r\n");
+
+    // Whatever of the body came in with the head goes in the same write
+    std::size_t body_part = take_body(parser.head_size(), buffered - parser.head_size());
+    std::array<boost::asio::const_buffer, 2> buffers{
+        boost::asio::buffer(response_head), boost::asio::buffer(buffer.data() + parser.head_size(), body_part)};
+    outcome.bytes_out = response_head.size() + body_part;
+    arm(write_timeout);
+    boost::asio::async_write(client, buffers, [self = shared_from_this()](boost::system::error_code ec, std::size_t) {
+        if (ec) {
+            self->outcome.keep_alive = false;
+            self->finish(false);
+            return;
+        }
+        self->relay_body();
+    });
+}
+
+void ProxyExchange::relay_body() {
+    if (body_done || chunks.failed()) {
+        // A backend that sent more than it said, or garbled its chunks, isn't sent anything else
+        outcome.keep_alive = outcome.keep_alive && body_done;
+        finish(body_done && !overran && parser.keep_alive());
+        return;
+    }
+    arm(pool.options().timeout);
+    upstream->async_read_some(boost::asio::buffer(buffer), boost::asio::bind_executor(client.get_executor(),
+        [self = shared_from_this()](boost::system::error_code ec, std::size_t bytes_read) {
+            if (ec == boost::asio::error::eof && self->parser.framing() == ResponseHeadParser::Framing::Close) {
+                self->finish(false);
+                return;
+            }
+            if (ec) {
+                // Cut off mid-body: all the client can be told is by closing its connection too
+                self->outcome.keep_alive = false;
+                self->finish(false);
+                return;
+            }
+            std::size_t body_part = self->take_body(0, bytes_read);
+            self->outcome.bytes_out += body_part;
+            self->arm(self->write_timeout);
+            boost::asio::async_write(self->client, boost::asio::buffer(self->buffer.data(), body_part),
+                [self](boost::system::error_code ec, std::size_t) {
+                    if (ec) {
+                        self->outcome.keep_alive = false;
+                        self->finish(false);
+                        return;
+                    }
+                    self->relay_body();
+                });
+        }));
+}
+
+std::size_t ProxyExchange::take_body(std::size_t offset, std::size_t size) {
+    std::size_t taken = size;
+    switch (parser.framing()) {
+    case ResponseHeadParser::Framing::None:
+        taken = 0;
+        body_done = true;
+        break;
+    case ResponseHeadParser::Framing::Length:
+        taken = std::min(remaining, size);
+        remaining -= taken;
+        body_done = remaining == 0;
+        break;
+    case ResponseHeadParser::Framing::Chunked:
+        taken = chunks.scan(std::string_view(buffer.data() + offset, size));
+        body_done = chunks.done();
+        break;
+    case ResponseHeadParser::Framing::Close:
+        break;
+    }
+    overran = overran || taken < size;
+    return taken;
+}
+
+void ProxyExchange::retry_or_fail(bool backend_failed) {
+    // Once the whole request has been written the backend may have acted on it before
+    // closing, so only a request that's safe to repeat is sent again
+    if (reused && buffered == 0 && !timed_out && (!request_sent || is_idempotent(request.method))) {
+        // The backend closed the pooled connection on us; one retry on a fresh one
+        boost::system::error_code ignored;
+        upstream->close(ignored);
+        upstream.reset();
+        reused = false;
+        request_sent = false;
+        connect();
+        return;
+    }
+    outcome.status = timed_out ? 504 : 502;
+    finish(false, backend_failed);
+}
+
+void ProxyExchange::finish(bool reusable, bool backend_failed) {
+    finished = true;
+    timer.cancel();
+    if (reusable) {
+        pool.release(*backend, std::move(upstream), backend_failed);
+    } else {
+        if (upstream) {
+            boost::system::error_code ignored;
+            upstream->close(ignored);
+        }
+        pool.release(*backend, std::nullopt, backend_failed);
+    }
+    completion(outcome);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+
+#include "HttpParser.h"
+#include "Upstream.h"
+
+// Forwards one request to a backend and streams the response back to the
+// client as it arrives: the head once it's complete, then the body one read
+// at a time, each written out before the next is read. Nothing is buffered
+// beyond one read, whatever the size of the body. The request already sits
+// parsed in the client's receive buffer, body included (bounded by
+// --max-body-size), and is sent on in one gathered write.
+//
+// A pooled connection the backend closed while the request was on its way
+// is retried once on a new one. Once the request has been written in full,
+// that's only done for idempotent methods: the backend may have acted on
+// it, and a POST mustn't happen twice. Every handler runs on the client socket's
+// executor, the caller's strand, so the caller mustn't touch the client
+// socket until the completion runs.
+class ProxyExchange : public std::enable_shared_from_this<ProxyExchange> {
+public:
+    using tcp = boost::asio::ip::tcp;
+
+    struct Outcome {
+        // Whether any response reached the client. If none did, status is
+        // what to answer with instead: 503 when no backend is healthy, 504
+        // when it took too long, 502 for anything else.
+        bool relayed = false;
+        std::uint16_t status = 0;
+        std::size_t bytes_out = 0;
+        // Whether the client connection can take another request
+        bool keep_alive = false;
+    };
+    using Completion = std::function<void(const Outcome&)>;
+
+    // request must stay valid until completion runs
+    static void start(tcp::socket& client, UpstreamPool& pool, const Request& request, bool keep_alive,
+                      std::chrono::milliseconds write_timeout, Completion completion);
+
+    ProxyExchange(tcp::socket& client, UpstreamPool& pool, const Request& request, bool keep_alive,
+                  std::chrono::milliseconds write_timeout, Completion completion);
+
+private:
+    void connect();
+    void send_request();
+    void read_head();
+    void send_head();
+    void relay_body();
+    std::size_t take_body(std::size_t offset, std::size_t size);
+
+    void arm(std::chrono::milliseconds timeout);
+    void retry_or_fail(bool backend_failed);
+    void finish(bool reusable, bool backend_failed = false);
+
+    tcp::socket& client;
+    UpstreamPool& pool;
+    const Request& request;
+    std::chrono::milliseconds write_timeout;
+    Completion completion;
+
+    UpstreamPool::Backend* backend = nullptr;
+    std::optional<tcp::socket> upstream;
+    bool reused = false;
+    // The whole request has reached the backend's socket
+    bool request_sent = false;
+    bool timed_out = false;
+    bool finished = false;
+    boost::asio::steady_timer timer;
+
+    std::string request_head;
+    std::vector<char> buffer;
+    std::size_t buffered = 0;
+    ResponseHeadParser parser;
+    ChunkedScanner chunks;
+    std::size_t remaining = 0;
+    bool body_done = false;
+    bool overran = false;
+    std::string response_head;
+    Outcome outcome;
+};
@@ -0,0 +1,59 @@
+#include "ReceiveBuffer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+// Blocks go back to the free list of whichever thread closes the connection,
+// which on the async servers needn't be the one that opened it. No locking
+// either way; the lists just even out.
+thread_local std::vector<std::unique_ptr<char[]>> free_blocks;
+
+}
+
+ReceiveBuffer::~ReceiveBuffer() {
+    if (storage && capacity == block_size && free_blocks.size() < max_free_blocks) {
+        free_blocks.push_back(std::move(storage));
+    }
+}
+
+boost::asio::mutable_buffer ReceiveBuffer::prepare(std::size_t n) {
+    if (!storage) {
+        if (free_blocks.empty()) {
+            storage = std::make_unique_for_overwrite<char[]>(block_size);
+        } else {
+            storage = std::move(free_blocks.back());
+            free_blocks.pop_back();
+        }
+        capacity = block_size;
+    }
+
+    if (capacity - end < n) {
+        std::size_t held = end - begin;
+        if (capacity - held >= n) {
+            // Slide the unconsumed bytes to the front rather than growing
+            std::memmove(storage.get(), storage.get() + begin, held);
+        } else {
+            std::size_t grown = std::max(capacity * 2, held + n);
+            auto bigger = std::make_unique_for_overwrite<char[]>(grown);
+            std::memcpy(bigger.get(), storage.get() + begin, held);
+            if (capacity == block_size && free_blocks.size() < max_free_blocks) {
+                free_blocks.push_back(std::move(storage));
+            }
+            storage = std::move(bigger);
+            capacity = grown;
+        }
+        begin = 0;
+        end = held;
+    }
+    return boost::asio::mutable_buffer(storage.get() + end, n);
+}
+
+void ReceiveBuffer::consume(std::size_t n) {
+    begin += std::min(n, end - begin);
+    if (begin == end) {
+        begin = end = 0;
+    }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include <boost/asio/buffer.hpp>
+
+// A connection's receive buffer, with the same prepare/commit/consume
+// interface as boost::asio::streambuf. Its storage is a fixed-size block
+// taken from a per-thread free list on first use and handed back when the
+// connection closes, so a busy server recycles the same few blocks instead of
+// allocating a new buffer per connection. A request bigger than a block (a
+// large body) moves to a private heap buffer for the rest of the connection.
+class ReceiveBuffer {
+public:
+    // Room for the largest request head we accept plus a full read behind it
+    static constexpr std::size_t block_size = 16 * 1024;
+    // Blocks each thread keeps for reuse; any more are freed
+    static constexpr std::size_t max_free_blocks = 64;
+
+    ReceiveBuffer() = default;
+    ReceiveBuffer(const ReceiveBuffer&) = delete;
+    ReceiveBuffer& operator=(const ReceiveBuffer&) = delete;
+    // For a connection handed from one thread to another; the block is freed to whichever thread ends up with it
+    ReceiveBuffer(ReceiveBuffer&& other) noexcept
+        : storage(std::move(other.storage)),
+          capacity(std::exchange(other.capacity, 0)),
+          begin(std::exchange(other.begin, 0)),
+          end(std::exchange(other.end, 0))
+    {
+    }
+    ~ReceiveBuffer();
+
+    // Bytes received and not yet consumed
+    std::string_view data() const { return std::string_view(storage.get() + begin, end - begin); }
+    std::size_t size() const { return end - begin; }
+
+    // Space for the next n bytes to be read, moving or growing the storage if needed
+    boost::asio::mutable_buffer prepare(std::size_t n);
+    void commit(std::size_t n) { end += n; }
+    void consume(std::size_t n);
+
+private:
+    std::unique_ptr<char[]> storage;
+    std::size_t capacity = 0;
+    std::size_t begin = 0;
+    std::size_t end = 0;
+};
@@ -0,0 +1,231 @@
+#include "ResponseCache.h"
+
+#include "Compression.h"
+#include "ResponseHead.h"
+#include "StaticFiles.h"
+
+#include <charconv>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+CachedResponse::~CachedResponse() {
+    if (body_fd >= 0) {
+        ::close(body_fd);
+    }
+}
+
+std::uint16_t CachedResponse::status() const {
+    // "HTTP/1.1 200 OK\r\n..."
+    std::uint16_t code = 0;
+    if (header_size > 12) {
+        std::from_chars(bytes.data() + 9, bytes.data() + 12, code);
+    }
+    return code;
+}
+
+ResponseCache::ResponseCache(bool reload_on_change, std::chrono::milliseconds check_interval,
+                             std::size_t sendfile_threshold)
+    : reload_on_change(reload_on_change),
+      check_interval(check_interval),
+      sendfile_threshold(sendfile_threshold),
+      next_check(0)
+{
+}
+
+namespace {
+
+// Reads all of fd from the start, whether or not it will end up in a response
+std::string read_file(int fd, std::size_t size, const std::string& filename) {
+    std::string contents(size, '\0');
+    std::size_t read_so_far = 0;
+    while (read_so_far < size) {
+        ssize_t n = ::pread(fd, contents.data() + read_so_far, size - read_so_far, static_cast<off_t>(read_so_far));
+        if (n <= 0) {
+            throw std::runtime_error("Could not read file " + filename);
+        }
+        read_so_far += static_cast<std::size_t>(n);
+    }
+    return contents;
+}
+
+// Every variant of a negotiated response says so, or a shared cache could
+// hand a gzip body to a client that never asked for one.
+std::shared_ptr<const CachedResponse> encoded_response(const std::string& head, std::string_view body,
+                                                       Encoding encoding) {
+    std::string compressed = compress(body, encoding);
+    if (compressed.size() >= body.size()) {
+        return nullptr;
+    }
+    auto response = std::make_shared<CachedResponse>();
+    response->bytes = head;
+    response->bytes.append("\r\nContent-Encoding: ").append(encoding_name(encoding));
+    response->bytes.append("\r\nVary: Accept-Encoding\r\nContent-Length: ");
+    append_decimal(response->bytes, compressed.size());
+    response->bytes.append("\r\n\r\n");
+    response->header_size = response->bytes.size();
+    response->body_size = compressed.size();
+    response->bytes += compressed;
+    return response;
+}
+
+// A deep copy of original and its variants; a file body gets its own descriptor
+std::shared_ptr<const CachedResponse> copy_response(const CachedResponse& original) {
+    auto copy = std::make_shared<CachedResponse>();
+    copy->bytes = original.bytes;
+    copy->header_size = original.header_size;
+    if (original.body_fd >= 0) {
+        copy->body_fd = ::fcntl(original.body_fd, F_DUPFD_CLOEXEC, 0);
+        if (copy->body_fd < 0) {
+            throw std::runtime_error("Could not duplicate a cached file descriptor");
+        }
+    }
+    copy->body_offset = original.body_offset;
+    copy->body_size = original.body_size;
+    copy->body_owner = original.body_owner;
+    copy->external_body = original.external_body;
+    if (original.brotli) {
+        copy->brotli = copy_response(*original.brotli);
+    }
+    if (original.gzip) {
+        copy->gzip = copy_response(*original.gzip);
+    }
+    return copy;
+}
+
+}
+
+ResponseCache::ResponseCache(const ResponseCache& other)
+    : reload_on_change(other.reload_on_change),
+      check_interval(other.check_interval),
+      sendfile_threshold(other.sendfile_threshold),
+      next_check(0)
+{
+    std::lock_guard<std::mutex> lock(other.reload_mutex);
+    for (const auto& [name, entry] : other.entries) {
+        auto replica = std::make_unique<Entry>();
+        replica->status_line = entry->status_line;
+        replica->filename = entry->filename;
+        replica->mtime = entry->mtime;
+        replica->response.store(copy_response(*entry->response.load(std::memory_order_acquire)));
+        entries[name] = std::move(replica);
+    }
+}
+
+std::shared_ptr<const CachedResponse> ResponseCache::load(const std::string& status_line, const std::string& filename) const {
+    auto response = std::make_shared<CachedResponse>();
+    response->body_fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (response->body_fd < 0 || ::fstat(response->body_fd, &info) != 0) {
+        throw std::runtime_error("Could not open file " + filename);
+    }
+    response->body_size = static_cast<std::size_t>(info.st_size);
+
+    // Huge files are only ever streamed, so they're never read into memory here either
+    bool precompress = response->body_size <= max_precompress_size;
+    std::string body;
+    if (precompress || response->body_size < sendfile_threshold) {
+        body = read_file(response->body_fd, response->body_size, filename);
+    }
+    // What every variant's head starts with; ResponseBatch adds Server, Date and Connection
+    std::string head = status_line + "\r\nContent-Type: " + std::string(content_type(filename));
+    if (precompress && can_encode(Encoding::Brotli)) {
+        response->brotli = encoded_response(head, body, Encoding::Brotli);
+    }
+    if (precompress) {
+        response->gzip = encoded_response(head, body, Encoding::Gzip);
+    }
+
+    bool negotiated = response->brotli || response->gzip;
+    response->bytes = head + (negotiated ? "\r\nVary: Accept-Encoding" : "") + "\r\nContent-Length: ";
+    append_decimal(response->bytes, response->body_size);
+    response->bytes.append("\r\n\r\n");
+    response->header_size = response->bytes.size();
+    if (response->body_size >= sendfile_threshold) {
+        return response;
+    }
+
+    // Small bodies live right behind the header so the whole response is one buffer
+    response->bytes += body;
+    ::close(response->body_fd);
+    response->body_fd = -1;
+    return response;
+}
+
+void ResponseCache::add(const std::string& name, const std::string& status_line, const std::string& filename) {
+    auto entry = std::make_unique<Entry>();
+    entry->status_line = status_line;
+    entry->filename = filename;
+    entry->mtime = std::filesystem::last_write_time(filename);
+    entry->response.store(load(status_line, filename));
+    entries[name] = std::move(entry);
+}
+
+std::shared_ptr<const CachedResponse> ResponseCache::get(std::string_view name) const {
+    if (reload_on_change) {
+        maybe_reload();
+    }
+
+    auto it = entries.find(name);
+    if (it == entries.end()) {
+        throw std::out_of_range("No cached response named " + std::string(name));
+    }
+    return it->second->response.load(std::memory_order_acquire);
+}
+
+std::shared_ptr<const CachedResponse> ResponseCache::get(std::string_view name, std::string_view accept_encoding) const {
+    std::shared_ptr<const CachedResponse> response = get(name);
+    if (accept_encoding.empty() || (!response->brotli && !response->gzip)) {
+        return response;
+    }
+    switch (negotiate_encoding(accept_encoding, response->brotli != nullptr, response->gzip != nullptr)) {
+    case Encoding::Brotli:
+        return response->brotli;
+    case Encoding::Gzip:
+        return response->gzip;
+    case Encoding::Identity:
+        break;
+    }
+    return response;
+}
+
+void ResponseCache::maybe_reload() const {
+    auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+    if (now < next_check.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    // Only one thread pays for the stat() calls; everyone else keeps serving
+    // the current responses.
+    std::unique_lock<std::mutex> lock(reload_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return;
+    }
+    next_check.store(now + check_interval.count(), std::memory_order_relaxed);
+    reload_locked();
+}
+
+void ResponseCache::reload_changed() const {
+    std::lock_guard<std::mutex> lock(reload_mutex);
+    reload_locked();
+}
+
+void ResponseCache::reload_locked() const {
+    for (const auto& [name, entry] : entries) {
+        std::error_code ec;
+        auto mtime = std::filesystem::last_write_time(entry->filename, ec);
+        if (ec || mtime == entry->mtime) {
+            continue;
+        }
+
+        try {
+            entry->response.store(load(entry->status_line, entry->filename), std::memory_order_release);
+            entry->mtime = mtime;
+        }
+        catch (std::exception&) {
+            // Keep serving the previous version if the file is mid-write or gone.
+        }
+    }
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// A complete HTTP response (status line, headers and body) serialized once
+// so it can be written to a socket as-is by any number of threads. Bodies at
+// or above the cache's sendfile threshold aren't copied into bytes at all:
+// the file stays open and is sent from the page cache with sendfile(2),
+// starting body_offset bytes in.
+struct CachedResponse {
+    std::string bytes;
+    std::size_t header_size = 0;
+    int body_fd = -1;
+    std::size_t body_offset = 0;
+    std::size_t body_size = 0;
+
+    // Set when the body is memory owned by something else, such as an mmap'd
+    // file, instead of living in bytes behind the header.
+    std::shared_ptr<const void> body_owner;
+    std::string_view external_body;
+
+    // Precompressed copies of this response, kept only when they came out
+    // smaller. They're always held in memory, whatever their size.
+    std::shared_ptr<const CachedResponse> brotli;
+    std::shared_ptr<const CachedResponse> gzip;
+
+    CachedResponse() = default;
+    CachedResponse(const CachedResponse&) = delete;
+    CachedResponse& operator=(const CachedResponse&) = delete;
+    ~CachedResponse();
+
+    std::string_view header() const { return std::string_view(bytes).substr(0, header_size); }
+    std::string_view body() const { return body_owner ? external_body : std::string_view(bytes).substr(header_size); }
+    bool has_file_body() const { return body_fd >= 0; }
+    std::uint16_t status() const;
+};
+
+// Loads the files we serve once at startup and keeps them as pre-serialized
+// responses. Lookups never touch the filesystem unless reload_on_change is
+// set, in which case files are re-checked at most once per check_interval
+// and swapped in atomically when their modification time changes. Each
+// file is compressed with Brotli and gzip as it's loaded, so negotiating
+// Accept-Encoding costs a header scan and no compression at request time.
+class ResponseCache {
+public:
+    static constexpr std::size_t default_sendfile_threshold = 64 * 1024;
+    // Larger files are sent as they are rather than compressed
+    static constexpr std::size_t max_precompress_size = 8 * 1024 * 1024;
+
+    explicit ResponseCache(bool reload_on_change = false,
+                           std::chrono::milliseconds check_interval = std::chrono::seconds(1),
+                           std::size_t sendfile_threshold = default_sendfile_threshold);
+    // A replica: every response is copied into memory the calling thread
+    // allocates, so with first-touch placement it sits on that thread's NUMA node
+    ResponseCache(const ResponseCache& other);
+    ResponseCache& operator=(const ResponseCache&) = delete;
+
+    void add(const std::string& name, const std::string& status_line, const std::string& filename);
+
+    std::shared_ptr<const CachedResponse> get(std::string_view name) const;
+    // The variant of name best matching the client's Accept-Encoding header
+    std::shared_ptr<const CachedResponse> get(std::string_view name, std::string_view accept_encoding) const;
+
+    void reload_changed() const;
+
+private:
+    struct Entry {
+        std::string status_line;
+        std::string filename;
+        std::filesystem::file_time_type mtime;
+        std::atomic<std::shared_ptr<const CachedResponse>> response;
+    };
+
+    struct NameHash {
+        using is_transparent = void;
+        std::size_t operator()(std::string_view name) const { return std::hash<std::string_view>{}(name); }
+    };
+
+    std::shared_ptr<const CachedResponse> load(const std::string& status_line, const std::string& filename) const;
+    void maybe_reload() const;
+    void reload_locked() const;
+
+    std::unordered_map<std::string, std::unique_ptr<Entry>, NameHash, std::equal_to<>> entries;
+
+    bool reload_on_change;
+    std::chrono::steady_clock::duration check_interval;
+    std::size_t sendfile_threshold;
+    mutable std::atomic<std::chrono::steady_clock::rep> next_check;
+    mutable std::mutex reload_mutex;
+};
@@ -0,0 +1,74 @@
+#include "ResponseHead.h"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#include "StaticFiles.h"
+
+const DateClock& DateClock::instance() {
+    // Leaked on purpose: workers still answering at exit keep reading it
+    static const DateClock* clock = new DateClock();
+    return *clock;
+}
+
+DateClock::DateClock() {
+    publish(std::time(nullptr));
+    std::thread([this] { run(); }).detach();
+}
+
+void DateClock::run() {
+    using clock = std::chrono::system_clock;
+    while (true) {
+        // Just past each second boundary, so the value is never a second behind for long
+        auto next = std::chrono::ceil<std::chrono::seconds>(clock::now() + std::chrono::milliseconds(1));
+        std::this_thread::sleep_until(next);
+        publish(clock::to_time_t(clock::now()));
+    }
+}
+
+void DateClock::publish(std::time_t time) {
+    std::string value = format_http_date(time);
+    char bytes[sizeof(words)] = {};
+    std::memcpy(bytes, value.data(), std::min(value.size(), size));
+
+    // The only writer, so a relaxed load is enough to find the count
+    std::uint64_t count = sequence.load(std::memory_order_relaxed);
+    sequence.store(count + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (std::size_t i = 0; i < words.size(); ++i) {
+        std::uint64_t word;
+        std::memcpy(&word, bytes + i * 8, 8);
+        words[i].store(word, std::memory_order_relaxed);
+    }
+    sequence.store(count + 2, std::memory_order_release);
+}
+
+void DateClock::read(char* out) const {
+    char bytes[sizeof(words)];
+    while (true) {
+        std::uint64_t before = sequence.load(std::memory_order_acquire);
+        for (std::size_t i = 0; i < words.size(); ++i) {
+            std::uint64_t word = words[i].load(std::memory_order_relaxed);
+            std::memcpy(bytes + i * 8, &word, 8);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (before % 2 == 0 && sequence.load(std::memory_order_relaxed) == before) {
+            break;
+        }
+    }
+    std::memcpy(out, bytes, size);
+}
+
+std::string DateClock::now() const {
+    std::string value(size, '\0');
+    read(value.data());
+    return value;
+}
+
+void append_decimal(std::string& out, std::size_t value) {
+    char digits[20];
+    out.append(digits, std::to_chars(digits, digits + sizeof(digits), value).ptr);
+}
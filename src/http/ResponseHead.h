@@ -0,0 +1,42 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <string_view>
+
+// What every response says it comes from
+inline constexpr std::string_view server_name = "cpp-web-servers";
+
+// The Date header's value (RFC 9110 section 6.6.1), formatted once a second
+// by a thread of its own so a response only has to copy it. Readers never
+// wait on the writer: a sequence count tells them when they've raced an
+// update, and they read again.
+class DateClock {
+public:
+    // "Sun, 06 Nov 1994 08:49:37 GMT"
+    static constexpr std::size_t size = 29;
+
+    // The clock every server shares, started the first time it's asked for
+    // and never stopped, so it outlives whatever thread reads it last
+    static const DateClock& instance();
+
+    // Writes the current value, size bytes of it, to out
+    void read(char* out) const;
+    std::string now() const;
+
+private:
+    DateClock();
+    void run();
+    void publish(std::time_t time);
+
+    // Odd while an update is being written
+    std::atomic<std::uint64_t> sequence{0};
+    std::array<std::atomic<std::uint64_t>, (size + 7) / 8> words{};
+};
+
+// Appends value in decimal, without the temporary std::to_string makes
+void append_decimal(std::string& out, std::size_t value);
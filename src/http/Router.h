@@ -0,0 +1,70 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Cached routes answer with the named response from the ResponseCache;
+// Metrics renders the server's counters at request time; Static looks the
+// path up under the document root, if the server has one, and falls back to
+// the named response when there's no such file. Proxy routes are never in
+// a table: they stand for requests under a --proxy prefix that couldn't be
+// forwarded, and name the error response to send instead.
+enum class Handler { Cached, Metrics, Static, Proxy };
+
+// Blocking routes tie up whichever thread answers them, so a server with a
+// pool for them answers them there rather than on the thread that read the
+// request; servers that never block a thread treat both alike.
+enum class Work { Fast, Blocking };
+
+// What to do with a request: answer through handler, optionally after a delay
+// (only /sleep uses one, to simulate a slow handler). Each server waits in its
+// own way: a blocking sleep, a timer or a co_await.
+struct Route {
+    std::string_view method;
+    std::string_view path;
+    std::string_view response;
+    std::chrono::milliseconds delay{0};
+    Handler handler = Handler::Cached;
+    Work work = Work::Fast;
+};
+
+// A fixed set of routes keyed on method + path. The constructor searches, at
+// compile time when the router is constexpr, for a hash seed that gives every
+// route its own slot, so find() hashes the path once, compares one candidate
+// and never allocates. A HEAD without a route of its own gets the GET route
+// for its path; unknown requests get the fallback route.
+template<std::size_t N>
+class Router {
+public:
+    constexpr Router(const std::array<Route, N>& routes, const Route& fallback);
+
+    constexpr const Route& find(std::string_view method, std::string_view path) const;
+
+    // Routes are numbered 0..N-1 in table order; the fallback, and any route
+    // not in the table, is N. For indexing per-route counters.
+    static constexpr std::size_t size() { return N + 1; }
+    constexpr std::size_t index(const Route& route) const;
+    constexpr const Route& at(std::size_t index) const { return index < N ? routes[index] : fallback; }
+
+private:
+    // At least twice as many slots as routes keeps the seed search short
+    static constexpr std::size_t table_size = std::size_t(1) << std::bit_width(2 * N - 1);
+    static constexpr std::uint8_t empty_slot = 0xff;
+    static_assert(N > 0 && N < empty_slot, "a Router holds between 1 and 254 routes");
+
+    static constexpr std::uint32_t hash(std::uint32_t seed, std::string_view method, std::string_view path);
+
+    std::array<Route, N> routes;
+    Route fallback;
+    std::uint32_t seed = 0;
+    std::array<std::uint8_t, table_size> slots{};
+};
+
+template<std::size_t N>
+Router(const std::array<Route, N>&, const Route&) -> Router<N>;
+
+#include "Router.tpp"
@@ -0,0 +1,59 @@
+#include <stdexcept>
+
+// FNV-1a over method, a separator and path, starting from a seed-dependent basis
+template<std::size_t N>
+constexpr std::uint32_t Router<N>::hash(std::uint32_t seed, std::string_view method, std::string_view path) {
+    std::uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+    auto mix = [&h](char c) {
+        h ^= static_cast<unsigned char>(c);
+        h *= 16777619u;
+    };
+    for (char c : method) mix(c);
+    mix(' ');
+    for (char c : path) mix(c);
+    return h ^ (h >> 15);
+}
+
+template<std::size_t N>
+constexpr Router<N>::Router(const std::array<Route, N>& routes, const Route& fallback)
+    : routes(routes),
+      fallback(fallback)
+{
+    for (; seed < 1u << 16; ++seed) {
+        slots.fill(empty_slot);
+        bool collision = false;
+        for (std::size_t i = 0; i < N && !collision; ++i) {
+            std::size_t slot = hash(seed, routes[i].method, routes[i].path) & (table_size - 1);
+            collision = slots[slot] != empty_slot;
+            slots[slot] = static_cast<std::uint8_t>(i);
+        }
+        if (!collision) {
+            return;
+        }
+    }
+    // Also what a duplicate route ends up as; in a constant expression this is a compile error
+    throw std::logic_error("No perfect hash seed for these routes");
+}
+
+template<std::size_t N>
+constexpr std::size_t Router<N>::index(const Route& route) const {
+    for (std::size_t i = 0; i < N; ++i) {
+        if (&routes[i] == &route) {
+            return i;
+        }
+    }
+    return N;
+}
+
+template<std::size_t N>
+constexpr const Route& Router<N>::find(std::string_view method, std::string_view path) const {
+    std::uint8_t slot = slots[hash(seed, method, path) & (table_size - 1)];
+    if (slot != empty_slot && routes[slot].method == method && routes[slot].path == path) {
+        return routes[slot];
+    }
+    // HEAD is answered wherever GET is (RFC 9110 section 9.3.2), unless it has a route of its own
+    if (method == "HEAD") {
+        return find("GET", path);
+    }
+    return fallback;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "HttpParser.h"
+#include "Router.h"
+
+// Every server's routes, in one place. Responses are names in the ResponseCache.
+inline constexpr Router routes(std::array{
+    Route{"GET", "/", "hello"},
+    Route{"GET", "/sleep", "hello", std::chrono::seconds(5), Handler::Cached, Work::Blocking},
+    Route{"GET", "/metrics", "", std::chrono::milliseconds(0), Handler::Metrics},
+}, Route{"", "", "not_found", std::chrono::milliseconds(0), Handler::Static});
+
+// What requests the parser gives up on get; all counted under the fallback route
+inline constexpr Route bad_request_route{"", "", "bad_request"};
+inline constexpr Route request_timeout_route{"", "", "request_timeout"};
+inline constexpr Route body_too_large_route{"", "", "body_too_large"};
+inline constexpr Route header_too_large_route{"", "", "header_too_large"};
+// For a blocking request when there's no room left to queue it
+inline constexpr Route overloaded_route{"", "", "unavailable"};
+
+// Answers to proxied requests no backend responded to, counted under "proxy"
+inline constexpr Route bad_gateway_route{"", "", "bad_gateway", std::chrono::milliseconds(0), Handler::Proxy};
+inline constexpr Route gateway_timeout_route{"", "", "gateway_timeout", std::chrono::milliseconds(0), Handler::Proxy};
+inline constexpr Route no_backend_route{"", "", "unavailable", std::chrono::milliseconds(0), Handler::Proxy};
+
+constexpr const Route& proxy_error_route(std::uint16_t status) {
+    switch (status) {
+    case 503:
+        return no_backend_route;
+    case 504:
+        return gateway_timeout_route;
+    default:
+        return bad_gateway_route;
+    }
+}
+
+// Where a route's requests are counted: its index in the table, or after
+// every route for proxied requests
+inline constexpr std::size_t proxy_route_index = routes.size();
+
+constexpr std::size_t route_index(const Route& route) {
+    return route.handler == Handler::Proxy ? proxy_route_index : routes.index(route);
+}
+
+constexpr const Route& error_route(RequestParser::Error error) {
+    switch (error) {
+    case RequestParser::Error::Timeout:
+        return request_timeout_route;
+    case RequestParser::Error::BodyTooLarge:
+        return body_too_large_route;
+    case RequestParser::Error::HeadTooLarge:
+        return header_too_large_route;
+    default:
+        return bad_request_route;
+    }
+}
+
+// Metrics labels for route_index(), e.g. "GET /sleep"
+inline std::vector<std::string> route_labels() {
+    std::vector<std::string> labels;
+    for (std::size_t i = 0; i + 1 < routes.size(); ++i) {
+        labels.push_back(std::string(routes.at(i).method) + " " + std::string(routes.at(i).path));
+    }
+    labels.push_back("unmatched");
+    labels.push_back("proxy");
+    return labels;
+}
@@ -0,0 +1,30 @@
+#include "Server.h"
+
+#include <cstdlib>
+#include <iostream>
+
+#include "Routes.h"
+
+std::shared_ptr<const CachedResponse> ServerContext::respond(const Request& request, std::size_t request_size,
+                                                             const Route& route) {
+    std::shared_ptr<const CachedResponse> response;
+    if (route.handler == Handler::Metrics) {
+        response = metrics.response();
+    } else if (route.handler == Handler::Static && files != nullptr) {
+        response = files->get(request);
+    }
+    if (!response) {
+        response = cache.get(route.response, request.header("Accept-Encoding"));
+    }
+    log.request(request, *response);
+    metrics.request(route_index(route), response->status(), request_size,
+                    response->header_size + response->body_size);
+    return response;
+}
+
+void abandon_connections(ServerContext& context) {
+    std::cerr << "Drain timed out; closing " << context.metrics.open_connections() << " connections" << std::endl;
+    context.log.flush();
+    std::cout.flush();
+    std::_Exit(0);
+}
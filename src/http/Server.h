@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+
+#include "AccessLog.h"
+#include "HttpConnection.h"
+#include "HttpParser.h"
+#include "Lifecycle.h"
+#include "Metrics.h"
+#include "ResponseCache.h"
+#include "Router.h"
+#include "StaticFiles.h"
+
+// What every connection handler needs, shared by all of a server's threads.
+struct ServerContext {
+    const ResponseCache& cache;
+    AccessLog& log;
+    Metrics& metrics;
+    // The --docroot files, if any
+    const StaticFiles* files = nullptr;
+    ConnectionOptions options;
+    Lifecycle* lifecycle = nullptr;
+
+    // Once shutdown starts, every response closes its connection
+    bool draining() const { return lifecycle != nullptr && lifecycle->stopping(); }
+
+    // Produces the response to request per route, logging and counting it.
+    // request_size is how many bytes the request took up on the wire.
+    std::shared_ptr<const CachedResponse> respond(const Request& request, std::size_t request_size,
+                                                  const Route& route);
+};
+
+// For when a drain times out: the connections still open are cut off by
+// exiting, since the threads serving them can't be joined.
+[[noreturn]] void abandon_connections(ServerContext& context);
@@ -0,0 +1,482 @@
+#include "StaticFiles.h"
+
+#include "ResponseHead.h"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+std::string_view trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+    return s;
+}
+
+int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+std::int64_t mtime_ns(const struct stat& info) {
+    return static_cast<std::int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+}
+
+// An mmap'd file body, unmapped once the last response using it is gone
+struct Mapping {
+    void* data;
+    std::size_t size;
+
+    Mapping(void* data, std::size_t size) : data(data), size(size) {}
+    Mapping(const Mapping&) = delete;
+    Mapping& operator=(const Mapping&) = delete;
+    ~Mapping() { ::munmap(data, size); }
+};
+
+// If-None-Match uses the weak comparison, so W/"x" matches "x"
+bool etag_matches(std::string_view list, std::string_view etag) {
+    while (!list.empty()) {
+        auto comma = list.find(',');
+        std::string_view candidate = trim(list.substr(0, comma));
+        list.remove_prefix(comma == std::string_view::npos ? list.size() : comma + 1);
+        if (candidate == "*") {
+            return true;
+        }
+        if (candidate.starts_with("W/")) {
+            candidate.remove_prefix(2);
+        }
+        if (candidate == etag) {
+            return true;
+        }
+    }
+    return false;
+}
+
+constexpr std::array<std::pair<std::string_view, std::string_view>, 22> content_types{{
+    {".css", "text/css; charset=utf-8"},
+    {".gif", "image/gif"},
+    {".htm", "text/html; charset=utf-8"},
+    {".html", "text/html; charset=utf-8"},
+    {".ico", "image/x-icon"},
+    {".jpeg", "image/jpeg"},
+    {".jpg", "image/jpeg"},
+    {".js", "text/javascript; charset=utf-8"},
+    {".json", "application/json"},
+    {".md", "text/markdown; charset=utf-8"},
+    {".mp3", "audio/mpeg"},
+    {".mp4", "video/mp4"},
+    {".pdf", "application/pdf"},
+    {".png", "image/png"},
+    {".svg", "image/svg+xml"},
+    {".txt", "text/plain; charset=utf-8"},
+    {".wasm", "application/wasm"},
+    {".webm", "video/webm"},
+    {".webp", "image/webp"},
+    {".woff", "font/woff"},
+    {".woff2", "font/woff2"},
+    {".xml", "application/xml"},
+}};
+
+}
+
+struct StaticFiles::File {
+    std::filesystem::path path;
+    std::size_t size = 0;
+    std::int64_t mtime = 0;
+    std::time_t last_modified = 0;
+    std::string etag;
+    std::string_view content_type;
+    // "\r\nETag: ...\r\nLast-Modified: ...", shared by every response header
+    std::string validators;
+    // The 200 header, for files too big to keep mapped
+    std::string header;
+    // Null when the file is too big to keep mapped
+    std::shared_ptr<const CachedResponse> ok;
+    std::shared_ptr<const CachedResponse> not_modified;
+    std::shared_ptr<const CachedResponse> range_not_satisfiable;
+    mutable std::atomic<std::chrono::steady_clock::rep> next_check{0};
+
+    // What the entry counts against the cache size
+    std::size_t cached_size() const {
+        return header.size() + not_modified->bytes.size() + range_not_satisfiable->bytes.size() + (ok ? size : 0);
+    }
+
+    bool matches(const Request& request) const {
+        std::string_view if_none_match = request.header("If-None-Match");
+        if (!if_none_match.empty()) {
+            return etag_matches(if_none_match, etag);
+        }
+        std::string_view if_modified_since = request.header("If-Modified-Since");
+        if (!if_modified_since.empty()) {
+            std::optional<std::time_t> since = parse_http_date(if_modified_since);
+            return since && last_modified <= *since;
+        }
+        return false;
+    }
+
+    // If-Range wants the whole file unless the validator it names is still current
+    bool range_applies(const Request& request) const {
+        std::string_view if_range = trim(request.header("If-Range"));
+        if (if_range.empty()) {
+            return true;
+        }
+        if (if_range.front() == '"') {
+            return if_range == etag;
+        }
+        std::optional<std::time_t> date = parse_http_date(if_range);
+        return date && *date == last_modified;
+    }
+};
+
+StaticFiles::StaticFiles(const std::filesystem::path& root, std::size_t cache_size, std::size_t max_file_size,
+                         std::chrono::milliseconds check_interval)
+    : root(std::filesystem::canonical(root)),
+      cache_size(cache_size),
+      max_file_size(max_file_size),
+      check_interval(check_interval)
+{
+    if (!std::filesystem::is_directory(this->root)) {
+        throw std::invalid_argument(root.string() + " is not a directory");
+    }
+}
+
+std::optional<std::string> StaticFiles::normalize(std::string_view path) {
+    if (path.empty() || path.front() != '/') {
+        return std::nullopt;
+    }
+
+    std::string decoded;
+    decoded.reserve(path.size());
+    for (std::size_t i = 0; i < path.size(); ++i) {
+        char c = path[i];
+        if (c == '%') {
+            int high = i + 2 < path.size() ? hex_digit(path[i + 1]) : -1;
+            int low = high >= 0 ? hex_digit(path[i + 2]) : -1;
+            if (low < 0) {
+                return std::nullopt;
+            }
+            c = static_cast<char>(high * 16 + low);
+            i += 2;
+        }
+        if (c == '\0') {
+            return std::nullopt;
+        }
+        decoded += c;
+    }
+
+    // Rebuilt one segment at a time so an encoded "/../" can't slip through either
+    std::string normalized;
+    normalized.reserve(decoded.size());
+    std::string_view rest = decoded;
+    while (!rest.empty()) {
+        auto slash = rest.find('/');
+        std::string_view segment = rest.substr(0, slash);
+        rest.remove_prefix(slash == std::string_view::npos ? rest.size() : slash + 1);
+        if (segment.empty() || segment == ".") {
+            continue;
+        }
+        if (segment == "..") {
+            return std::nullopt;
+        }
+        normalized.append("/").append(segment);
+    }
+    if (normalized.empty()) {
+        normalized = "/";
+    }
+    return normalized;
+}
+
+std::optional<std::filesystem::path> StaticFiles::resolve(std::string_view path) const {
+    std::optional<std::string> normalized = normalize(path);
+    if (!normalized) {
+        return std::nullopt;
+    }
+    return resolve_normalized(*normalized);
+}
+
+std::optional<std::filesystem::path> StaticFiles::resolve_normalized(std::string_view normalized) const {
+    std::filesystem::path relative = std::filesystem::path(normalized).relative_path();
+    std::error_code ec;
+    std::filesystem::path full = std::filesystem::canonical(root / relative, ec);
+    if (!ec && std::filesystem::is_directory(full, ec)) {
+        full = std::filesystem::canonical(full / "index.html", ec);
+    }
+    if (ec || !std::filesystem::is_regular_file(full, ec)) {
+        return std::nullopt;
+    }
+    // canonical() has followed any symlinks, so what's left must still be under the root
+    auto [root_end, full_end] = std::mismatch(root.begin(), root.end(), full.begin(), full.end());
+    if (root_end != root.end()) {
+        return std::nullopt;
+    }
+    return full;
+}
+
+std::shared_ptr<const StaticFiles::File> StaticFiles::load(const std::filesystem::path& path) const {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+        ::close(fd);
+        return nullptr;
+    }
+
+    auto file = std::make_shared<File>();
+    file->path = path;
+    file->size = static_cast<std::size_t>(info.st_size);
+    file->mtime = mtime_ns(info);
+    file->last_modified = info.st_mtim.tv_sec;
+
+    char etag[48];
+    std::snprintf(etag, sizeof(etag), "\"%zx-%llx\"", file->size, static_cast<unsigned long long>(file->mtime));
+    file->etag = etag;
+    file->content_type = content_type(path);
+    file->validators = "\r\nETag: " + file->etag + "\r\nLast-Modified: " + format_http_date(file->last_modified);
+    file->header = "HTTP/1.1 200 OK\r\nContent-Type: " + std::string(file->content_type) + file->validators
+                 + "\r\nAccept-Ranges: bytes\r\nContent-Length: " + std::to_string(file->size) + "\r\n\r\n";
+
+    auto not_modified = std::make_shared<CachedResponse>();
+    not_modified->bytes = "HTTP/1.1 304 Not Modified" + file->validators + "\r\n\r\n";
+    not_modified->header_size = not_modified->bytes.size();
+    file->not_modified = std::move(not_modified);
+
+    auto range_not_satisfiable = std::make_shared<CachedResponse>();
+    range_not_satisfiable->bytes = "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */"
+                                 + std::to_string(file->size) + "\r\nContent-Length: 0\r\n\r\n";
+    range_not_satisfiable->header_size = range_not_satisfiable->bytes.size();
+    file->range_not_satisfiable = std::move(range_not_satisfiable);
+
+    if (file->size <= max_file_size) {
+        auto ok = std::make_shared<CachedResponse>();
+        ok->bytes = file->header;
+        ok->header_size = ok->bytes.size();
+        ok->body_size = file->size;
+        if (file->size > 0) {
+            void* data = ::mmap(nullptr, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                ok->body_owner = std::make_shared<Mapping>(data, file->size);
+                ok->external_body = std::string_view(static_cast<const char*>(data), file->size);
+                file->ok = std::move(ok);
+            }
+        } else {
+            file->ok = std::move(ok);
+        }
+    }
+    ::close(fd);
+
+    file->next_check.store((std::chrono::steady_clock::now() + check_interval).time_since_epoch().count(),
+                           std::memory_order_relaxed);
+    return file;
+}
+
+std::shared_ptr<const StaticFiles::File> StaticFiles::lookup(std::string_view request_path) const {
+    // Keyed on the normalized path, so "/x", "/./x" and "//%78" share a slot and a mapping
+    std::optional<std::string> normalized = normalize(request_path);
+    if (!normalized) {
+        return nullptr;
+    }
+    std::string_view path = *normalized;
+    auto now = std::chrono::steady_clock::now();
+    std::shared_ptr<const File> file;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = slots.find(path);
+        if (it != slots.end()) {
+            lru.splice(lru.begin(), lru, it->second.position);
+            file = it->second.file;
+            if (now.time_since_epoch().count() < file->next_check.load(std::memory_order_relaxed)) {
+                return file;
+            }
+        }
+    }
+
+    // Missing or due for a check. The filesystem work happens outside the
+    // lock; if two threads race here, the last one to finish wins the slot.
+    std::optional<std::filesystem::path> resolved = resolve_normalized(path);
+    std::shared_ptr<const File> fresh;
+    if (resolved) {
+        struct stat info;
+        if (file && file->path == *resolved && ::stat(resolved->c_str(), &info) == 0
+            && static_cast<std::size_t>(info.st_size) == file->size && mtime_ns(info) == file->mtime) {
+            file->next_check.store((now + check_interval).time_since_epoch().count(), std::memory_order_relaxed);
+            return file;
+        }
+        fresh = load(*resolved);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = slots.find(path);
+    if (it != slots.end()) {
+        total_bytes -= it->second.file->cached_size();
+        auto position = it->second.position;
+        slots.erase(it);
+        lru.erase(position);
+    }
+    if (!fresh || fresh->cached_size() > cache_size) {
+        return fresh;
+    }
+    lru.emplace_front(path);
+    slots.emplace(lru.front(), Slot{fresh, lru.begin()});
+    total_bytes += fresh->cached_size();
+    while (total_bytes > cache_size) {
+        auto victim = slots.find(lru.back());
+        total_bytes -= victim->second.file->cached_size();
+        slots.erase(victim);
+        lru.pop_back();
+    }
+    return fresh;
+}
+
+std::shared_ptr<const CachedResponse> StaticFiles::get(const Request& request) const {
+    // HEAD gets the same response; ResponseBatch leaves its body out
+    if (request.method != "GET" && request.method != "HEAD") {
+        return nullptr;
+    }
+    std::shared_ptr<const File> file = lookup(request.path);
+    if (!file) {
+        return nullptr;
+    }
+    if (file->matches(request)) {
+        return file->not_modified;
+    }
+
+    ByteRange range;
+    std::string_view range_header = request.header("Range");
+    if (!range_header.empty() && file->range_applies(request)) {
+        range = parse_range(range_header, file->size);
+    }
+    if (range.status == ByteRange::Status::Unsatisfiable) {
+        return file->range_not_satisfiable;
+    }
+    if (range.status == ByteRange::Status::Whole && file->ok) {
+        return file->ok;
+    }
+
+    auto response = std::make_shared<CachedResponse>();
+    if (range.status == ByteRange::Status::Partial) {
+        std::string& head = response->bytes;
+        head.reserve(160 + file->content_type.size() + file->validators.size());
+        head.append("HTTP/1.1 206 Partial Content\r\nContent-Type: ").append(file->content_type);
+        head.append(file->validators).append("\r\nContent-Range: bytes ");
+        append_decimal(head, range.offset);
+        head += '-';
+        append_decimal(head, range.offset + range.length - 1);
+        head += '/';
+        append_decimal(head, file->size);
+        head.append("\r\nContent-Length: ");
+        append_decimal(head, range.length);
+        head.append("\r\n\r\n");
+    } else {
+        range = ByteRange{ByteRange::Status::Whole, 0, file->size};
+        response->bytes = file->header;
+    }
+    response->header_size = response->bytes.size();
+    response->body_offset = range.offset;
+    response->body_size = range.length;
+
+    if (file->ok) {
+        // A slice of the mapping, which the response keeps alive
+        response->body_owner = file->ok->body_owner;
+        response->external_body = file->ok->body().substr(range.offset, range.length);
+        response->body_offset = 0;
+        return response;
+    }
+    // Too big to keep mapped: a descriptor of its own to sendfile from
+    response->body_fd = ::open(file->path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (response->body_fd < 0) {
+        return nullptr;
+    }
+    return response;
+}
+
+std::size_t StaticFiles::cached_bytes() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return total_bytes;
+}
+
+ByteRange parse_range(std::string_view range, std::size_t size) {
+    range = trim(range);
+    if (range.size() < 6 || !std::equal(range.begin(), range.begin() + 6, "bytes=", [](char a, char b) {
+            return std::tolower(static_cast<unsigned char>(a)) == b;
+        })) {
+        return {};
+    }
+    range.remove_prefix(6);
+    auto dash = range.find('-');
+    if (range.find(',') != std::string_view::npos || dash == std::string_view::npos) {
+        return {};
+    }
+    std::string_view first_text = trim(range.substr(0, dash));
+    std::string_view last_text = trim(range.substr(dash + 1));
+
+    auto parse = [](std::string_view text, std::size_t& value) {
+        auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+        return !text.empty() && ec == std::errc() && end == text.data() + text.size();
+    };
+    std::size_t first = 0;
+    std::size_t last = 0;
+    if (first_text.empty()) {
+        // "bytes=-n" is the last n bytes
+        if (!parse(last_text, last)) {
+            return {};
+        }
+        if (last == 0 || size == 0) {
+            return {ByteRange::Status::Unsatisfiable};
+        }
+        std::size_t length = std::min(last, size);
+        return {ByteRange::Status::Partial, size - length, length};
+    }
+    if (!parse(first_text, first) || (!last_text.empty() && (!parse(last_text, last) || last < first))) {
+        return {};
+    }
+    if (first >= size) {
+        return {ByteRange::Status::Unsatisfiable};
+    }
+    last = last_text.empty() ? size - 1 : std::min(last, size - 1);
+    return {ByteRange::Status::Partial, first, last - first + 1};
+}
+
+std::string_view content_type(const std::filesystem::path& path) {
+    std::string extension = path.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    auto it = std::lower_bound(content_types.begin(), content_types.end(), extension,
+                               [](const auto& entry, const std::string& key) { return entry.first < key; });
+    if (it != content_types.end() && it->first == extension) {
+        return it->second;
+    }
+    return "application/octet-stream";
+}
+
+std::string format_http_date(std::time_t time) {
+    std::tm tm;
+    ::gmtime_r(&time, &tm);
+    char buffer[32];
+    std::size_t size = std::strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return std::string(buffer, size);
+}
+
+std::optional<std::time_t> parse_http_date(std::string_view date) {
+    std::string copy(date);
+    std::tm tm{};
+    const char* end = ::strptime(copy.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == nullptr || *end != '\0') {
+        return std::nullopt;
+    }
+    return ::timegm(&tm);
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <ctime>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "HttpParser.h"
+#include "ResponseCache.h"
+
+// Serves files under a document root. Files up to max_file_size are mmap'd
+// once and kept, with their serialized headers and a matching 304 response,
+// in an LRU cache of at most cache_size bytes shared by every thread; bigger
+// files are opened per request and sent with sendfile(2), so memory per
+// download doesn't depend on the file's size. Single byte ranges are served
+// as 206s straight from the mapping or the file. An entry is re-checked
+// against the filesystem at most once per check_interval, so a hit costs a
+// hash lookup and no system calls.
+class StaticFiles {
+public:
+    static constexpr std::size_t default_cache_size = 64 * 1024 * 1024;
+    static constexpr std::size_t default_max_file_size = 4 * 1024 * 1024;
+
+    explicit StaticFiles(const std::filesystem::path& root,
+                         std::size_t cache_size = default_cache_size,
+                         std::size_t max_file_size = default_max_file_size,
+                         std::chrono::milliseconds check_interval = std::chrono::seconds(1));
+
+    // The response to a GET or HEAD for request.path, honouring If-None-Match,
+    // If-Modified-Since, Range and If-Range; nullptr if there's no such file
+    // under the root.
+    std::shared_ptr<const CachedResponse> get(const Request& request) const;
+
+    // Maps a request path to a regular file under the root. Percent-escapes
+    // are decoded, directories map to their index.html, and anything that
+    // would leave the root, whether by ".." or a symlink, is rejected.
+    std::optional<std::filesystem::path> resolve(std::string_view path) const;
+
+    std::size_t cached_bytes() const;
+
+private:
+    struct File;
+
+    // A request path with its percent-escapes decoded and its empty and "."
+    // segments dropped, e.g. "/a/b" for "//a/./%62"; nullopt for anything
+    // malformed or with a ".." segment
+    static std::optional<std::string> normalize(std::string_view path);
+    std::optional<std::filesystem::path> resolve_normalized(std::string_view normalized) const;
+
+    std::shared_ptr<const File> load(const std::filesystem::path& path) const;
+    std::shared_ptr<const File> lookup(std::string_view path) const;
+
+    std::filesystem::path root;
+    std::size_t cache_size;
+    std::size_t max_file_size;
+    std::chrono::steady_clock::duration check_interval;
+
+    struct Slot {
+        std::shared_ptr<const File> file;
+        std::list<std::string>::iterator position;
+    };
+
+    // Most recently used at the front
+    mutable std::mutex mutex;
+    mutable std::list<std::string> lru;
+    mutable std::unordered_map<std::string_view, Slot> slots;
+    mutable std::size_t total_bytes = 0;
+};
+
+// What a Range header asks of a body of size bytes. Whole covers headers we
+// ignore and serve a 200 for: absent, malformed, or asking for several
+// ranges, which would need a multipart/byteranges body.
+struct ByteRange {
+    enum class Status { Whole, Partial, Unsatisfiable };
+
+    Status status = Status::Whole;
+    std::size_t offset = 0;
+    std::size_t length = 0;
+};
+ByteRange parse_range(std::string_view range, std::size_t size);
+
+// e.g. "text/html; charset=utf-8" for "index.html"; application/octet-stream if unknown
+std::string_view content_type(const std::filesystem::path& path);
+
+// RFC 9110 IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+std::string format_http_date(std::time_t time);
+// Parses an IMF-fixdate; nullopt if malformed
+std::optional<std::time_t> parse_http_date(std::string_view date);
@@ -0,0 +1,325 @@
+#include "Tls.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+
+#include <openssl/err.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace {
+
+// The most plaintext one TLS record carries
+constexpr std::size_t record_size = 16 * 1024;
+
+// Distinguishes this server's cached sessions from any other's
+constexpr unsigned char session_id_context[] = "multi-server";
+
+// In ALPN wire format, most preferred first: each name after its length
+constexpr unsigned char alpn_protocols[] = "\x02h2\x08http/1.1";
+
+int select_protocol(SSL*, const unsigned char** out, unsigned char* out_size, const unsigned char* offered,
+                    unsigned int offered_size, void*) {
+    unsigned char* selected = nullptr;
+    if (SSL_select_next_proto(&selected, out_size, alpn_protocols, sizeof(alpn_protocols) - 1, offered,
+                              offered_size) != OPENSSL_NPN_NEGOTIATED) {
+        // Nothing in common: carry on without ALPN rather than fail the handshake
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+}
+
+bool parse_tls_option(std::string_view arg, TlsOptions& options) {
+    auto number = [&arg](std::string_view name) { return std::stoul(std::string(arg.substr(name.size()))); };
+    if (arg.starts_with("--tls-cert=")) {
+        options.certificate = arg.substr(11);
+    } else if (arg.starts_with("--tls-key=")) {
+        options.private_key = arg.substr(10);
+    } else if (arg.starts_with("--tls-port=")) {
+        unsigned long port = number("--tls-port=");
+        if (port == 0 || port > 65535) {
+            throw std::invalid_argument("--tls-port must be between 1 and 65535");
+        }
+        options.port = static_cast<unsigned short>(port);
+    } else if (arg.starts_with("--tls-session-timeout=")) {
+        options.session_timeout = std::chrono::seconds(number("--tls-session-timeout="));
+    } else if (arg == "--no-ktls") {
+        options.ktls = false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+TlsSession::TlsSession(SSL* ssl, int fd)
+    : ssl(ssl, SSL_free),
+      fd(fd)
+{
+    SSL_set_fd(ssl, fd);
+    SSL_set_accept_state(ssl);
+}
+
+TlsSession::~TlsSession() {
+    if (!failed && SSL_is_init_finished(ssl.get())) {
+        // Best effort: a client that has stopped reading just doesn't get it
+        SSL_shutdown(ssl.get());
+    }
+    ERR_clear_error();
+}
+
+bool TlsSession::handshake(std::chrono::steady_clock::time_point deadline) {
+    while (true) {
+        int result = SSL_do_handshake(ssl.get());
+        if (result == 1) {
+            return true;
+        }
+        int error = SSL_get_error(ssl.get(), result);
+        auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (remaining.count() <= 0 || !wait(error, static_cast<int>(remaining.count()))) {
+            failed = true;
+            return false;
+        }
+    }
+}
+
+bool TlsSession::kernel_sends() const {
+#ifndef OPENSSL_NO_KTLS
+    return BIO_get_ktls_send(SSL_get_wbio(ssl.get())) > 0;
+#else
+    return false;
+#endif
+}
+
+bool TlsSession::kernel_receives() const {
+#ifndef OPENSSL_NO_KTLS
+    return BIO_get_ktls_recv(SSL_get_rbio(ssl.get())) > 0;
+#else
+    return false;
+#endif
+}
+
+bool TlsSession::resumed() const {
+    return SSL_session_reused(ssl.get()) == 1;
+}
+
+std::string_view TlsSession::protocol() const {
+    const unsigned char* name = nullptr;
+    unsigned int size = 0;
+    SSL_get0_alpn_selected(ssl.get(), &name, &size);
+    return name ? std::string_view(reinterpret_cast<const char*>(name), size) : std::string_view();
+}
+
+bool TlsSession::wait(int error, int timeout_ms) {
+    short events = 0;
+    if (error == SSL_ERROR_WANT_READ) {
+        events = POLLIN;
+    } else if (error == SSL_ERROR_WANT_WRITE) {
+        events = POLLOUT;
+    } else {
+        // The connection is done for; what OpenSSL queued about it mustn't confuse the worker's next one
+        failed = failed || error != SSL_ERROR_ZERO_RETURN;
+        ERR_clear_error();
+        return false;
+    }
+    pollfd ready_fd{fd, events, 0};
+    int ready;
+    do {
+        ready = ::poll(&ready_fd, 1, timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+    return ready > 0;
+}
+
+RequestParser::Result TlsSession::read_request(ReceiveBuffer& buffer, RequestParser& parser, ReadDeadline& deadline) {
+    while (true) {
+        RequestParser::Result result = parser.parse(buffer.data());
+        if (result != RequestParser::Result::Incomplete) {
+            return result;
+        }
+
+        boost::asio::mutable_buffer space = buffer.prepare(4096);
+        std::size_t n = 0;
+        int read = SSL_read_ex(ssl.get(), space.data(), space.size(), &n);
+        if (read == 1) {
+            buffer.commit(n);
+            continue;
+        }
+        int error = SSL_get_error(ssl.get(), read);
+        auto now = ReadDeadline::clock::now();
+        auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline.update(parser, buffer.size(), now) - now);
+        bool waiting = error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE;
+        if (!waiting) {
+            // The client closed the connection, or broke the protocol
+            wait(error, 0);
+            return RequestParser::Result::Incomplete;
+        }
+        if (remaining.count() <= 0 || !wait(error, static_cast<int>(remaining.count()))) {
+            return deadline.mid_request() ? parser.time_out() : RequestParser::Result::Incomplete;
+        }
+    }
+}
+
+void TlsSession::write_batch(boost::asio::ip::tcp::socket& socket, const ResponseBatch& batch,
+                             std::chrono::milliseconds timeout) {
+    if (kernel_sends()) {
+        // The kernel adds the records as the bytes go out, so plain writes and sendfile(2) stay zero-copy
+        ::write_batch(socket, batch, timeout);
+        return;
+    }
+
+    record.reserve(record_size);
+    for (const ResponseBatch::Segment& segment : batch.segments()) {
+        for (const boost::asio::const_buffer& buffer : segment.buffers) {
+            const char* data = static_cast<const char*>(buffer.data());
+            std::size_t size = buffer.size();
+            while (size > 0) {
+                std::size_t taken = std::min(size, record_size - record.size());
+                record.insert(record.end(), data, data + taken);
+                data += taken;
+                size -= taken;
+                if (record.size() == record_size) {
+                    flush(timeout);
+                }
+            }
+        }
+
+        off_t offset = static_cast<off_t>(segment.body_offset);
+        std::size_t remaining = segment.body_fd >= 0 ? segment.body_size : 0;
+        while (remaining > 0) {
+            std::size_t filled = record.size();
+            record.resize(record_size);
+            ssize_t n = ::pread(segment.body_fd, record.data() + filled,
+                                std::min(remaining, record_size - filled), offset);
+            record.resize(filled + static_cast<std::size_t>(std::max<ssize_t>(n, 0)));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                throw boost::system::system_error(errno, boost::asio::error::get_system_category());
+            }
+            if (n == 0) {
+                throw std::runtime_error("File body shrank while sending");
+            }
+            offset += n;
+            remaining -= static_cast<std::size_t>(n);
+            if (record.size() == record_size) {
+                flush(timeout);
+            }
+        }
+    }
+    flush(timeout);
+}
+
+std::size_t TlsSession::read_some(char* data, std::size_t size, boost::system::error_code& ec) {
+    std::size_t n = 0;
+    int result = SSL_read_ex(ssl.get(), data, size, &n);
+    ec = result == 1 ? boost::system::error_code() : transfer_error(SSL_get_error(ssl.get(), result));
+    return n;
+}
+
+std::size_t TlsSession::write_some(const char* data, std::size_t size, boost::system::error_code& ec) {
+    // A record at a time, so a write never has to wait for the whole of a large output
+    size = unsent > 0 ? unsent : std::min(size, record_size);
+    std::size_t written = 0;
+    int result = SSL_write_ex(ssl.get(), data, size, &written);
+    if (result == 1) {
+        unsent = 0;
+        ec = {};
+        return written;
+    }
+    unsent = size;
+    ec = transfer_error(SSL_get_error(ssl.get(), result));
+    return 0;
+}
+
+bool TlsSession::pending() const {
+    return SSL_pending(ssl.get()) > 0;
+}
+
+boost::system::error_code TlsSession::transfer_error(int error) {
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+        return boost::asio::error::would_block;
+    }
+    wait(error, 0);
+    return boost::asio::error::eof;
+}
+
+void TlsSession::flush(std::chrono::milliseconds timeout) {
+    write_all(record.data(), record.size(), timeout);
+    record.clear();
+}
+
+void TlsSession::write_all(const char* data, std::size_t size, std::chrono::milliseconds timeout) {
+    while (size > 0) {
+        std::size_t written = 0;
+        int result = SSL_write_ex(ssl.get(), data, size, &written);
+        if (result == 1) {
+            data += written;
+            size -= written;
+            continue;
+        }
+        int error = SSL_get_error(ssl.get(), result);
+        if (!wait(error, static_cast<int>(timeout.count()))) {
+            bool timed_out = error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE;
+            failed = true;
+            throw boost::system::system_error(timed_out ? boost::asio::error::timed_out
+                                                        : boost::asio::error::connection_reset);
+        }
+    }
+}
+
+TlsServer::TlsServer(const TlsOptions& options)
+    : ssl_context(boost::asio::ssl::context::tls_server)
+{
+    SSL_CTX* context = ssl_context.native_handle();
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    ssl_context.use_certificate_chain_file(options.certificate);
+    ssl_context.use_private_key_file(options.private_key, boost::asio::ssl::context::pem);
+
+    long flags = SSL_OP_NO_RENEGOTIATION;
+#ifdef SSL_OP_ENABLE_KTLS
+    if (options.ktls) {
+        flags |= SSL_OP_ENABLE_KTLS;
+    }
+#endif
+    SSL_CTX_set_options(context, flags);
+    // An idle keep-alive connection gives its read and write buffers back
+    // write_some() may be retried from a buffer that has since moved
+    SSL_CTX_set_mode(context, SSL_MODE_RELEASE_BUFFERS | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    // Tickets are on by default, under keys this context generated; the cache covers clients that resume by session ID
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(context, session_id_context, sizeof(session_id_context) - 1);
+    SSL_CTX_set_timeout(context, static_cast<long>(options.session_timeout.count()));
+
+    SSL_CTX_set_alpn_select_cb(context, select_protocol, nullptr);
+}
+
+std::unique_ptr<TlsSession> TlsServer::accept(boost::asio::ip::tcp::socket& socket, std::chrono::milliseconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    boost::system::error_code ec;
+    socket.non_blocking(true, ec);
+    SSL* ssl = ec ? nullptr : SSL_new(ssl_context.native_handle());
+    if (ssl == nullptr) {
+        ++failed;
+        return nullptr;
+    }
+    auto session = std::make_unique<TlsSession>(ssl, socket.native_handle());
+    if (!session->handshake(deadline)) {
+        ++failed;
+        return nullptr;
+    }
+    ++(session->resumed() ? resumed : full);
+    kernel_send += session->kernel_sends();
+    kernel_receive += session->kernel_receives();
+    return session;
+}
+
+TlsStats TlsServer::stats() const {
+    return {full.load(std::memory_order_relaxed), resumed.load(std::memory_order_relaxed),
+            failed.load(std::memory_order_relaxed), kernel_send.load(std::memory_order_relaxed),
+            kernel_receive.load(std::memory_order_relaxed)};
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+
+#include "HttpConnection.h"
+#include "HttpParser.h"
+#include "ReceiveBuffer.h"
+
+// HTTPS on a port of its own, from a PEM certificate chain and private key.
+// Sessions can be resumed, from the session cache or a ticket, for up to
+// session_timeout. With ktls, OpenSSL hands record encryption to the kernel
+// once the handshake is done, wherever the kernel supports the cipher.
+struct TlsOptions {
+    std::string certificate;
+    std::string private_key;
+    unsigned short port = 8443;
+    bool ktls = true;
+    std::chrono::seconds session_timeout = std::chrono::hours(2);
+
+    bool enabled() const { return !certificate.empty(); }
+};
+
+// Applies one of --tls-cert=<pem>, --tls-key=<pem>, --tls-port=<port>,
+// --tls-session-timeout=<s> or --no-ktls; false if arg isn't one of them.
+bool parse_tls_option(std::string_view arg, TlsOptions& options);
+
+inline constexpr std::string_view tls_options_usage =
+    "[--tls-cert=<pem> --tls-key=<pem>] [--tls-port=<port>] [--tls-session-timeout=<s>] [--no-ktls]";
+
+// The TLS side of one connection, run by OpenSSL straight on the socket's
+// descriptor rather than through asio's ssl::stream, whose memory BIOs keep
+// records in userspace and so rule out kTLS. Both directions are
+// non-blocking and every wait goes through poll(2), like the rest of the
+// blocking servers' I/O.
+//
+// Once the kernel encrypts what's sent, responses go out exactly as they do
+// in plaintext, file bodies with sendfile(2) included. Otherwise they're
+// encrypted here, 16 KiB records at a time. Reads always go through OpenSSL,
+// which takes records the kernel has decrypted just the same.
+class TlsSession {
+public:
+    TlsSession(SSL* ssl, int fd);
+    TlsSession(const TlsSession&) = delete;
+    TlsSession& operator=(const TlsSession&) = delete;
+    // Sends close_notify, unless the connection has already failed
+    ~TlsSession();
+
+    // Runs the server side of the handshake; false if it fails or doesn't finish before deadline
+    bool handshake(std::chrono::steady_clock::time_point deadline);
+
+    bool kernel_sends() const;
+    bool kernel_receives() const;
+    bool resumed() const;
+    // The protocol ALPN settled on; empty if the client didn't ask for one
+    std::string_view protocol() const;
+
+    // The same contracts as the plaintext read_request() and write_batch().
+    // socket is the one the session runs on, needed for sendfile(2).
+    RequestParser::Result read_request(ReceiveBuffer& buffer, RequestParser& parser, ReadDeadline& deadline);
+    void write_batch(boost::asio::ip::tcp::socket& socket, const ResponseBatch& batch,
+                     std::chrono::milliseconds timeout);
+
+    // Non-blocking, for a connection that reads and writes as it goes, like
+    // HTTP/2: ec is would_block when the socket has to be waited for, eof
+    // once the connection is over. What write_some() didn't take has to be
+    // offered again, from the same start, before anything else.
+    std::size_t read_some(char* data, std::size_t size, boost::system::error_code& ec);
+    std::size_t write_some(const char* data, std::size_t size, boost::system::error_code& ec);
+    // Whether read_some() has decrypted bytes to return without the socket being readable
+    bool pending() const;
+
+private:
+    // Waits for whatever the last OpenSSL call returned error for; false on
+    // timeout or if error wasn't a want-read or want-write
+    bool wait(int error, int timeout_ms);
+    void write_all(const char* data, std::size_t size, std::chrono::milliseconds timeout);
+    void flush(std::chrono::milliseconds timeout);
+    boost::system::error_code transfer_error(int error);
+
+    std::unique_ptr<SSL, decltype(&SSL_free)> ssl;
+    // Just the descriptor, so the socket object can move with its connection
+    int fd;
+    bool failed = false;
+    // Small responses (and file bodies, without kTLS) are gathered into full records
+    std::vector<char> record;
+    // The size of the write_some() OpenSSL is waiting to retry
+    std::size_t unsent = 0;
+};
+
+// What TlsServer::accept() has done so far
+struct TlsStats {
+    std::size_t full = 0;
+    std::size_t resumed = 0;
+    std::size_t failed = 0;
+    std::size_t kernel_send = 0;
+    std::size_t kernel_receive = 0;
+};
+
+// The ssl::context every worker shares, and with it the session cache and
+// ticket keys, so any worker can resume a session another one started.
+// ALPN offers h2 and http/1.1, in that order.
+class TlsServer {
+public:
+    explicit TlsServer(const TlsOptions& options);
+
+    // Sets socket non-blocking and runs the handshake on it, giving up after
+    // timeout; nullptr if it fails. The session runs on socket's
+    // descriptor, so it mustn't outlive it.
+    std::unique_ptr<TlsSession> accept(boost::asio::ip::tcp::socket& socket, std::chrono::milliseconds timeout);
+
+    TlsStats stats() const;
+    boost::asio::ssl::context& context() { return ssl_context; }
+
+private:
+    boost::asio::ssl::context ssl_context;
+    std::atomic<std::size_t> full{0};
+    std::atomic<std::size_t> resumed{0};
+    std::atomic<std::size_t> failed{0};
+    std::atomic<std::size_t> kernel_send{0};
+    std::atomic<std::size_t> kernel_receive{0};
+};
@@ -0,0 +1,474 @@
+#include "Upstream.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <iostream>
+#include <stdexcept>
+
+#include <sys/socket.h>
+
+namespace {
+
+bool iequals(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+        return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+    });
+}
+
+std::string_view trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+    return s;
+}
+
+bool has_token(std::string_view value, std::string_view token) {
+    while (!value.empty()) {
+        auto comma = value.find(',');
+        if (iequals(trim(value.substr(0, comma)), token)) {
+            return true;
+        }
+        if (comma == std::string_view::npos) {
+            break;
+        }
+        value.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+// The last coding in a Transfer-Encoding list, the one that delimits the body
+std::string_view last_token(std::string_view value) {
+    auto comma = value.rfind(',');
+    return trim(comma == std::string_view::npos ? value : value.substr(comma + 1));
+}
+
+int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+}
+
+bool parse_proxy_option(std::string_view arg, ProxyOptions& options) {
+    auto number = [&arg](std::string_view name) {
+        return std::stoul(std::string(arg.substr(name.size())));
+    };
+    if (arg.starts_with("--proxy=")) {
+        std::string_view spec = arg.substr(8);
+        auto equals = spec.find('=');
+        if (equals == std::string_view::npos || !spec.starts_with('/')) {
+            throw std::invalid_argument("--proxy must be <prefix>=<host:port>[,<host:port>...]");
+        }
+        options.prefix = spec.substr(0, equals);
+        options.backends.clear();
+        std::string_view list = spec.substr(equals + 1);
+        while (!list.empty()) {
+            auto comma = list.find(',');
+            options.backends.emplace_back(list.substr(0, comma));
+            list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+        }
+        if (options.backends.empty()) {
+            throw std::invalid_argument("--proxy needs at least one backend");
+        }
+    } else if (arg.starts_with("--proxy-balance=")) {
+        std::string_view name = arg.substr(16);
+        if (name == "round-robin") {
+            options.balance = Balance::RoundRobin;
+        } else if (name == "least-connections") {
+            options.balance = Balance::LeastConnections;
+        } else {
+            throw std::invalid_argument("--proxy-balance must be round-robin or least-connections");
+        }
+    } else if (arg.starts_with("--proxy-health=")) {
+        options.health_path = arg.substr(15);
+    } else if (arg.starts_with("--proxy-health-interval=")) {
+        options.health_interval = std::chrono::milliseconds(number("--proxy-health-interval="));
+    } else if (arg.starts_with("--proxy-timeout=")) {
+        options.timeout = std::chrono::milliseconds(number("--proxy-timeout="));
+    } else if (arg.starts_with("--proxy-max-idle=")) {
+        options.max_idle = number("--proxy-max-idle=");
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool is_hop_by_hop(std::string_view name) {
+    return iequals(name, "Connection") || iequals(name, "Keep-Alive") || iequals(name, "Proxy-Connection")
+        || iequals(name, "TE") || iequals(name, "Trailer") || iequals(name, "Transfer-Encoding")
+        || iequals(name, "Upgrade");
+}
+
+ResponseHeadParser::Result ResponseHeadParser::parse(std::string_view data, bool head_request) {
+    // Resume the search for the blank line a few bytes back, in case it straddles two reads
+    std::size_t end = data.find("\r\n\r\n", scanned < 3 ? 0 : scanned - 3);
+    if (end == std::string_view::npos) {
+        scanned = data.size();
+        return data.size() > max_head_size ? Result::Error : Result::Incomplete;
+    }
+    size = end + 4;
+    if (size > max_head_size) {
+        return Result::Error;
+    }
+    std::string_view head = data.substr(0, end + 2);
+
+    // HTTP/1.x SSS reason
+    std::size_t line_end = head.find("\r\n");
+    std::string_view line = head.substr(0, line_end);
+    if (line.size() < 12 || !line.starts_with("HTTP/1.") || (line[7] != '0' && line[7] != '1') || line[8] != ' ') {
+        return Result::Error;
+    }
+    auto [status_end, ec] = std::from_chars(line.data() + 9, line.data() + 12, status_code);
+    if (ec != std::errc() || status_end != line.data() + 12 || status_code < 100 || status_code > 999
+        || (line.size() > 12 && line[12] != ' ')) {
+        return Result::Error;
+    }
+    reason_phrase = line.size() > 13 ? line.substr(13) : std::string_view();
+    bool http_1_0 = line[7] == '0';
+
+    bool close = false;
+    bool keep_alive = false;
+    bool chunked = false;
+    bool encoded = false;
+    bool has_length = false;
+    count = 0;
+    std::size_t pos = line_end + 2;
+    while (pos < head.size()) {
+        std::size_t next = head.find("\r\n", pos);
+        line = head.substr(pos, next - pos);
+        pos = next + 2;
+
+        auto colon = line.find(':');
+        if (colon == 0 || colon == std::string_view::npos || line.front() == ' ' || line.front() == '\t') {
+            return Result::Error;
+        }
+        if (count == headers.size()) {
+            return Result::Error;
+        }
+        Header& header = headers[count++];
+        header.name = line.substr(0, colon);
+        header.value = trim(line.substr(colon + 1));
+
+        if (iequals(header.name, "Connection")) {
+            close = close || has_token(header.value, "close");
+            keep_alive = keep_alive || has_token(header.value, "keep-alive");
+        } else if (iequals(header.name, "Transfer-Encoding")) {
+            encoded = true;
+            chunked = iequals(last_token(header.value), "chunked");
+        } else if (iequals(header.name, "Content-Length")) {
+            std::size_t value = 0;
+            auto [value_end, value_ec] = std::from_chars(header.value.data(), header.value.data() + header.value.size(), value);
+            if (value_ec != std::errc() || value_end != header.value.data() + header.value.size()
+                || (has_length && value != length)) {
+                return Result::Error;
+            }
+            length = value;
+            has_length = true;
+        }
+    }
+
+    persistent = http_1_0 ? keep_alive && !close : !close;
+    if (head_request || status_code < 200 || status_code == 204 || status_code == 304) {
+        body_framing = Framing::None;
+    } else if (chunked) {
+        body_framing = Framing::Chunked;
+    } else if (has_length && !encoded) {
+        body_framing = Framing::Length;
+    } else {
+        // Read until the backend closes, so the connection can't be reused
+        body_framing = Framing::Close;
+        persistent = false;
+    }
+    return Result::Complete;
+}
+
+void ResponseHeadParser::reset() {
+    scanned = 0;
+    size = 0;
+    status_code = 0;
+    reason_phrase = {};
+    body_framing = Framing::None;
+    length = 0;
+    persistent = true;
+    count = 0;
+}
+
+std::size_t ChunkedScanner::scan(std::string_view data) {
+    std::size_t i = 0;
+    while (i < data.size() && state != State::Done && state != State::Failed) {
+        char c = data[i];
+        switch (state) {
+        case State::Size:
+            if (int digit = hex_digit(c); digit >= 0) {
+                if (remaining >> 56) {
+                    state = State::Failed;
+                    break;
+                }
+                remaining = remaining * 16 + static_cast<std::uint64_t>(digit);
+                size_digits = true;
+            } else if (size_digits && (c == ';' || c == ' ' || c == '\t')) {
+                state = State::Extension;
+            } else if (size_digits && c == '\r') {
+                state = State::SizeEnd;
+            } else {
+                state = State::Failed;
+                break;
+            }
+            ++i;
+            break;
+        case State::Extension:
+            if (c == '\r') {
+                state = State::SizeEnd;
+            }
+            ++i;
+            break;
+        case State::SizeEnd:
+            if (c != '\n') {
+                state = State::Failed;
+                break;
+            }
+            size_digits = false;
+            state = remaining == 0 ? State::TrailerStart : State::Data;
+            ++i;
+            break;
+        case State::Data: {
+            // The bulk of the body: skip the rest of the chunk, or all we have of it, at once
+            std::size_t take = static_cast<std::size_t>(std::min<std::uint64_t>(remaining, data.size() - i));
+            remaining -= take;
+            i += take;
+            if (remaining == 0) {
+                state = State::DataCr;
+            }
+            break;
+        }
+        case State::DataCr:
+            state = c == '\r' ? State::DataLf : State::Failed;
+            i += state == State::Failed ? 0 : 1;
+            break;
+        case State::DataLf:
+            state = c == '\n' ? State::Size : State::Failed;
+            i += state == State::Failed ? 0 : 1;
+            break;
+        case State::TrailerStart:
+            state = c == '\r' ? State::TrailerEnd : State::Trailer;
+            ++i;
+            break;
+        case State::Trailer:
+            if (c == '\n') {
+                state = State::TrailerStart;
+            }
+            ++i;
+            break;
+        case State::TrailerEnd:
+            state = c == '\n' ? State::Done : State::Failed;
+            i += state == State::Failed ? 0 : 1;
+            break;
+        case State::Done:
+        case State::Failed:
+            break;
+        }
+    }
+    return i;
+}
+
+// One health check in flight: connect, ask for health_path, read the status line
+struct UpstreamPool::HealthCheck {
+    HealthCheck(boost::asio::any_io_executor executor, std::string request)
+        : socket(executor), deadline(executor), request(std::move(request)) {}
+
+    tcp::socket socket;
+    boost::asio::steady_timer deadline;
+    std::string request;
+    boost::asio::streambuf response;
+};
+
+struct UpstreamPool::HealthState {
+    explicit HealthState(boost::asio::any_io_executor executor) : timer(executor) {}
+
+    boost::asio::steady_timer timer;
+    std::weak_ptr<HealthCheck> in_flight;
+};
+
+UpstreamPool::UpstreamPool(boost::asio::io_context& io_context, ProxyOptions options)
+    : io_context(io_context),
+      config(std::move(options)),
+      strand(boost::asio::make_strand(io_context))
+{
+    tcp::resolver resolver(io_context);
+    for (const std::string& name : config.backends) {
+        auto colon = name.rfind(':');
+        if (colon == std::string::npos) {
+            throw std::invalid_argument("Backend " + name + " must be <host:port>");
+        }
+        auto backend = std::make_unique<Backend>();
+        backend->name = name;
+        backend->endpoint = *resolver.resolve(name.substr(0, colon), name.substr(colon + 1)).begin();
+        backends.push_back(std::move(backend));
+        health.push_back(std::make_unique<HealthState>(strand));
+    }
+}
+
+UpstreamPool::~UpstreamPool() = default;
+
+bool UpstreamPool::matches(std::string_view path) const {
+    const std::string& prefix = config.prefix;
+    if (!path.starts_with(prefix)) {
+        return false;
+    }
+    return path.size() == prefix.size() || prefix.ends_with('/') || path[prefix.size()] == '/'
+        || path[prefix.size()] == '?';
+}
+
+UpstreamPool::Backend* UpstreamPool::acquire() {
+    Backend* chosen = nullptr;
+    if (config.balance == Balance::RoundRobin) {
+        // Each turn that lands on a failing backend passes to the next, so the healthy ones share its share
+        for (std::size_t i = 0; i < backends.size() && chosen == nullptr; ++i) {
+            Backend& candidate = *backends[next.fetch_add(1, std::memory_order_relaxed) % backends.size()];
+            if (candidate.healthy.load(std::memory_order_relaxed)) {
+                chosen = &candidate;
+            }
+        }
+    } else {
+        // Starting from the next backend in turn, so ties are spread round-robin
+        std::size_t start = next.fetch_add(1, std::memory_order_relaxed);
+        for (std::size_t i = 0; i < backends.size(); ++i) {
+            Backend& candidate = *backends[(start + i) % backends.size()];
+            if (candidate.healthy.load(std::memory_order_relaxed)
+                && (chosen == nullptr || candidate.active.load(std::memory_order_relaxed)
+                                             < chosen->active.load(std::memory_order_relaxed))) {
+                chosen = &candidate;
+            }
+        }
+    }
+    if (chosen != nullptr) {
+        chosen->active.fetch_add(1, std::memory_order_relaxed);
+    }
+    return chosen;
+}
+
+std::optional<UpstreamPool::tcp::socket> UpstreamPool::take_idle(Backend& backend) {
+    std::lock_guard<std::mutex> lock(backend.idle_mutex);
+    while (!backend.idle.empty()) {
+        tcp::socket socket = std::move(backend.idle.back());
+        backend.idle.pop_back();
+        // An idle connection has nothing to read: anything there is the backend hanging up (or junk)
+        char byte;
+        if (::recv(socket.native_handle(), &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0
+            && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return socket;
+        }
+        boost::system::error_code ignored;
+        socket.close(ignored);
+    }
+    return std::nullopt;
+}
+
+UpstreamPool::tcp::socket UpstreamPool::connection() {
+    return tcp::socket(io_context);
+}
+
+void UpstreamPool::release(Backend& backend, std::optional<tcp::socket> connection, bool failed) {
+    backend.active.fetch_sub(1, std::memory_order_relaxed);
+    if (failed) {
+        backend.healthy.store(false, std::memory_order_relaxed);
+    }
+    if (!connection || !connection->is_open() || failed) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(backend.idle_mutex);
+    if (backend.idle.size() < config.max_idle && !stopped.load(std::memory_order_relaxed)) {
+        backend.idle.push_back(std::move(*connection));
+    }
+}
+
+void UpstreamPool::start_health_checks() {
+    boost::asio::post(strand, [this] {
+        for (std::size_t i = 0; i < backends.size(); ++i) {
+            check(i);
+        }
+    });
+}
+
+void UpstreamPool::stop() {
+    stopped.store(true, std::memory_order_relaxed);
+    boost::asio::post(strand, [this] {
+        for (auto& state : health) {
+            state->timer.cancel();
+            if (auto check = state->in_flight.lock()) {
+                boost::system::error_code ignored;
+                check->socket.close(ignored);
+                check->deadline.cancel();
+            }
+        }
+    });
+    for (auto& backend : backends) {
+        std::lock_guard<std::mutex> lock(backend->idle_mutex);
+        backend->idle.clear();
+    }
+}
+
+void UpstreamPool::schedule(std::size_t index) {
+    if (stopped.load(std::memory_order_relaxed)) {
+        return;
+    }
+    HealthState& state = *health[index];
+    state.timer.expires_after(config.health_interval);
+    state.timer.async_wait([this, index](boost::system::error_code ec) {
+        if (!ec && !stopped.load(std::memory_order_relaxed)) {
+            check(index);
+        }
+    });
+}
+
+void UpstreamPool::check(std::size_t index) {
+    Backend& backend = *backends[index];
+    auto probe = std::make_shared<HealthCheck>(strand, "GET " + config.health_path + " HTTP/1.1\r\nHost: "
+                                               + backend.name + "\r\nConnection: close\r\n\r\n");
+    health[index]->in_flight = probe;
+
+    // Every step ends here once, with the verdict; the deadline hangs up on a backend too slow to give one
+    auto finish = [this, index, probe](bool passed) {
+        probe->deadline.cancel();
+        boost::system::error_code ignored;
+        probe->socket.close(ignored);
+        Backend& backend = *backends[index];
+        if (passed != backend.healthy.load(std::memory_order_relaxed)) {
+            std::cerr << "Backend " << backend.name << (passed ? " is healthy again" : " failed its health check")
+                      << std::endl;
+            backend.healthy.store(passed, std::memory_order_relaxed);
+        }
+        schedule(index);
+    };
+    probe->deadline.expires_after(std::min(config.timeout, config.health_interval));
+    probe->deadline.async_wait([probe](boost::system::error_code ec) {
+        if (!ec) {
+            boost::system::error_code ignored;
+            probe->socket.close(ignored);
+        }
+    });
+    probe->socket.async_connect(backend.endpoint, [probe, finish](boost::system::error_code ec) {
+        if (ec) {
+            finish(false);
+            return;
+        }
+        boost::asio::async_write(probe->socket, boost::asio::buffer(probe->request),
+            [probe, finish](boost::system::error_code ec, std::size_t) {
+                if (ec) {
+                    finish(false);
+                    return;
+                }
+                boost::asio::async_read_until(probe->socket, probe->response, "\r\n",
+                    [probe, finish](boost::system::error_code ec, std::size_t) {
+                        // "HTTP/1.1 200 OK": healthy unless it answers with a 5xx
+                        std::string_view line(static_cast<const char*>(probe->response.data().data()),
+                                              probe->response.size());
+                        finish(!ec && line.size() >= 12 && line.starts_with("HTTP/1.") && line[9] >= '1'
+                               && line[9] <= '4');
+                    });
+            });
+    });
+}
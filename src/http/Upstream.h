@@ -0,0 +1,173 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+
+#include "HttpParser.h"
+
+// Where --proxy sends requests: every path under prefix goes to one of
+// backends, chosen per balance among those passing their health checks.
+// health_path is requested from each backend every health_interval; a
+// backend that answers it with anything below 500 is healthy. timeout bounds
+// each step of a forwarded exchange with a backend (connecting, sending the
+// request, each read of the response) and max_idle how many idle keep-alive
+// connections are kept per backend.
+enum class Balance { RoundRobin, LeastConnections };
+
+struct ProxyOptions {
+    std::string prefix;
+    std::vector<std::string> backends;
+    Balance balance = Balance::RoundRobin;
+    std::string health_path = "/";
+    std::chrono::milliseconds health_interval = std::chrono::seconds(2);
+    std::chrono::milliseconds timeout = std::chrono::seconds(30);
+    std::size_t max_idle = 32;
+};
+
+// Applies one of --proxy=<prefix>=<host:port>[,<host:port>...],
+// --proxy-balance=round-robin|least-connections, --proxy-health=<path>,
+// --proxy-health-interval=<ms>, --proxy-timeout=<ms> or --proxy-max-idle=<n>;
+// false if arg isn't one of them. Throws std::invalid_argument for bad values.
+bool parse_proxy_option(std::string_view arg, ProxyOptions& options);
+
+inline constexpr std::string_view proxy_options_usage =
+    "[--proxy=<prefix>=<host:port>[,<host:port>...]] [--proxy-balance=round-robin|least-connections]"
+    " [--proxy-health=<path>] [--proxy-health-interval=<ms>] [--proxy-timeout=<ms>] [--proxy-max-idle=<n>]";
+
+// Incremental parser for the head of a backend's response. parse() takes
+// everything received so far and returns Complete once the blank line has
+// arrived, after which the fields describe the response and head_size()
+// bytes of the data were its head. 1xx interim responses are reported like
+// any other; the caller skips them with reset() and parses on.
+class ResponseHeadParser {
+public:
+    enum class Result { Complete, Incomplete, Error };
+    // How the body is delimited: not at all (HEAD, 204, 304), by
+    // Content-Length, by chunked encoding or by the backend closing
+    enum class Framing { None, Length, Chunked, Close };
+
+    explicit ResponseHeadParser(std::size_t max_head_size = 16 * 1024) : max_head_size(max_head_size) {}
+
+    Result parse(std::string_view data, bool head_request);
+
+    std::uint16_t status() const { return status_code; }
+    std::string_view reason() const { return reason_phrase; }
+    std::size_t head_size() const { return size; }
+    Framing framing() const { return body_framing; }
+    std::size_t content_length() const { return length; }
+    // The backend may be sent another request on this connection afterwards
+    bool keep_alive() const { return persistent; }
+    std::size_t header_count() const { return count; }
+    const Header& header(std::size_t i) const { return headers[i]; }
+
+    void reset();
+
+private:
+    std::size_t max_head_size;
+    std::size_t scanned = 0;
+    std::size_t size = 0;
+    std::uint16_t status_code = 0;
+    std::string_view reason_phrase;
+    Framing body_framing = Framing::None;
+    std::size_t length = 0;
+    bool persistent = true;
+    std::array<Header, Request::max_headers> headers;
+    std::size_t count = 0;
+};
+
+// Finds where a chunked body ends without decoding it, so it can be relayed
+// as it arrives. scan() returns how many of the bytes given belong to the
+// body; done() once the last chunk and trailers have been seen.
+class ChunkedScanner {
+public:
+    std::size_t scan(std::string_view data);
+    bool done() const { return state == State::Done; }
+    bool failed() const { return state == State::Failed; }
+
+private:
+    enum class State { Size, Extension, SizeEnd, Data, DataCr, DataLf, TrailerStart, Trailer, TrailerEnd, Done, Failed };
+
+    State state = State::Size;
+    std::uint64_t remaining = 0;
+    bool size_digits = false;
+};
+
+// True for headers that describe one connection rather than the message and
+// so are never forwarded (RFC 9110 section 7.6.1).
+bool is_hop_by_hop(std::string_view name);
+
+// The backends behind one --proxy prefix and the idle connections to each.
+// Safe to use from any thread: a backend is chosen with atomics, and the
+// idle connections are kept under a per-backend lock. Health checks run on
+// the pool's own strand until stop().
+class UpstreamPool {
+public:
+    using tcp = boost::asio::ip::tcp;
+
+    struct Backend {
+        std::string name;
+        tcp::endpoint endpoint;
+        std::atomic<std::size_t> active{0};
+        std::atomic<bool> healthy{true};
+
+        std::mutex idle_mutex;
+        std::vector<tcp::socket> idle;
+    };
+
+    // Resolves every backend now; throws if one doesn't resolve
+    UpstreamPool(boost::asio::io_context& io_context, ProxyOptions options);
+    UpstreamPool(const UpstreamPool&) = delete;
+    UpstreamPool& operator=(const UpstreamPool&) = delete;
+    ~UpstreamPool();
+
+    const ProxyOptions& options() const { return config; }
+    // Whether path is the prefix or below it: /api matches /api and /api/users, not /apiary
+    bool matches(std::string_view path) const;
+
+    // Chooses a healthy backend and counts a request against it until
+    // release(); nullptr if every backend is failing its health checks.
+    Backend* acquire();
+    // An idle connection to backend that the backend hasn't closed, if any
+    std::optional<tcp::socket> take_idle(Backend& backend);
+    // A new, unconnected socket that release() can keep once it's done
+    tcp::socket connection();
+    // Ends a request acquire() started, keeping connection for the next one
+    // if it's still usable. failed marks the backend down until its next
+    // health check passes.
+    void release(Backend& backend, std::optional<tcp::socket> connection, bool failed = false);
+
+    // Checks every backend now and then every health_interval
+    void start_health_checks();
+    // Stops the checks and closes the idle connections, so the io_context can run out of work
+    void stop();
+
+    std::size_t size() const { return backends.size(); }
+    Backend& backend(std::size_t i) { return *backends[i]; }
+
+private:
+    struct HealthCheck;
+    struct HealthState;
+    void check(std::size_t index);
+    void schedule(std::size_t index);
+
+    boost::asio::io_context& io_context;
+    ProxyOptions config;
+    std::vector<std::unique_ptr<Backend>> backends;
+    std::atomic<std::size_t> next{0};
+    std::atomic<bool> stopped{false};
+
+    // Health checks and their timers only run here
+    boost::asio::strand<boost::asio::io_context::executor_type> strand;
+    std::vector<std::unique_ptr<HealthState>> health;
+};
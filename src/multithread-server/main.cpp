@@ -1,71 +1,596 @@
 // This C++ code is derived from the rust-lang book by Nicholas Matsakis and Aaron Turon.
 // Licensed under the MIT License. See LICENSE file for details.
+#include <algorithm>
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 #include <boost/asio.hpp>
-#include <fstream>
-#include <iomanip>
+#include <poll.h>
 
+#include "CoreLocal.h"
+#include "Http2.h"
+#include "HttpConnection.h"
+#include "HttpParser.h"
+#include "Lifecycle.h"
+#include "Listener.h"
+#include "ResponseCache.h"
+#include "Server.h"
+#include "StaticFiles.h"
+#include "Routes.h"
+#include "Task.h"
 #include "ThreadPool.h"
+#include "Tls.h"
+#include "WorkStealingPool.h"
+#ifdef HAVE_IO_URING
+#include "UringServer.h"
+#endif
 
 using boost::asio::ip::tcp;
 
-std::string read_file_to_string(const std::string& filename) {
-    std::ifstream file(filename);
-    if (!file.is_open()) {
-        throw std::runtime_error("Could not open file " + filename);
+// A connection between requests: everything needed to carry on serving it,
+// whichever thread picks it up next.
+struct Connection {
+    tcp::socket socket;
+    std::chrono::steady_clock::time_point accepted{};
+    ReceiveBuffer buffer{};
+    std::size_t requests_served = 0;
+    bool first_write = true;
+    // When the request at the front of buffer finished arriving
+    std::chrono::steady_clock::time_point read_done{};
+    // Set for connections on the TLS port; last, so close_notify goes out before the socket closes
+    std::unique_ptr<TlsSession> tls{};
+};
+
+// Writes batch on connection, through its TLS session if it has one
+void write_responses(Connection& connection, const ResponseBatch& batch, std::chrono::milliseconds timeout) {
+    if (connection.tls) {
+        connection.tls->write_batch(connection.socket, batch, timeout);
+    } else {
+        write_batch(connection.socket, batch, timeout);
+    }
+}
+
+// What's sent before the first HTTP/2 frame when a request upgrades to h2c
+constexpr std::string_view switching_to_h2c =
+    "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+
+// Serves HTTP/2 on connection until it closes, all on the calling worker:
+// the streams share the one socket, so unlike HTTP/1.1 requests they can't
+// be handed between pools. A route's delay holds back just its own stream.
+// greeting goes out ahead of session's frames.
+void serve_http2(Connection& connection, ServerContext& context, Http2Session& session,
+                 std::string_view greeting = {}) {
+    using clock = std::chrono::steady_clock;
+    struct Deferred {
+        clock::time_point arrived;
+        clock::time_point due;
+        std::uint32_t stream;
+        std::shared_ptr<const CachedResponse> response;
+    };
+
+    // Enough to fill a socket buffer or two of frames before waiting for the client
+    constexpr std::size_t output_budget = 64 * 1024;
+    const ConnectionOptions& options = context.options;
+    TlsSession* tls = connection.tls.get();
+    std::vector<Deferred> deferred;
+    std::string pending(greeting);
+    std::vector<char> chunk(16 * 1024);
+    auto last_read = clock::now();
+    auto last_write = last_read;
+    boost::system::error_code ec;
+    connection.socket.non_blocking(true, ec);
+
+    while (!ec) {
+        bool closed = false;
+        // While the client isn't taking what we have for it, what it sends waits in the socket, not in our memory
+        auto backlogged = [&] { return pending.size() + session.output().size() > output_budget; };
+        while (!backlogged()) {
+            std::size_t n = tls ? tls->read_some(chunk.data(), chunk.size(), ec)
+                                : connection.socket.read_some(boost::asio::buffer(chunk), ec);
+            if (ec == boost::asio::error::would_block) {
+                break;
+            }
+            if (ec) {
+                // The client has closed, or broken the connection
+                closed = true;
+                break;
+            }
+            last_read = clock::now();
+            if (!session.receive(std::string_view(chunk.data(), n))) {
+                break;
+            }
+        }
+        ec = {};
+
+        auto now = clock::now();
+        for (std::uint32_t stream : session.take_requests()) {
+            const Request& request = session.request(stream);
+            Http2Session::Problem problem = session.problem(stream);
+            const Route& route =
+                problem == Http2Session::Problem::HeadTooLarge ? header_too_large_route
+                : problem == Http2Session::Problem::BodyTooLarge ? body_too_large_route
+                : routes.find(request.method, request.path);
+            auto response = context.respond(request, session.request_size(stream), route);
+            if (route.delay.count() > 0) {
+                deferred.push_back({now, now + route.delay, stream, std::move(response)});
+            } else {
+                session.respond(stream, std::move(response));
+                context.metrics.request_time(clock::now() - now, 1);
+            }
+            if (++connection.requests_served >= options.max_requests) {
+                session.shutdown();
+            }
+        }
+        for (auto it = deferred.begin(); it != deferred.end();) {
+            if (it->due <= now) {
+                session.respond(it->stream, std::move(it->response));
+                context.metrics.request_time(clock::now() - it->arrived, 1);
+                it = deferred.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (context.draining() || (session.open_streams() == 0 && now - last_read >= options.idle_timeout)) {
+            // GOAWAY; the connection closes once the streams still open are answered
+            session.shutdown();
+        }
+
+        // Whatever the client's flow control lets through, until the socket is full
+        session.produce(output_budget);
+        while (!pending.empty() || !session.output().empty()) {
+            std::string_view output = pending.empty() ? session.output() : std::string_view(pending);
+            std::size_t n = tls ? tls->write_some(output.data(), output.size(), ec)
+                                : connection.socket.write_some(boost::asio::buffer(output.data(), output.size()), ec);
+            if (ec) {
+                break;
+            }
+            last_write = clock::now();
+            // Our SETTINGS go out before any request has arrived; the first byte that counts is a response's
+            if (connection.first_write && connection.requests_served > deferred.size()) {
+                context.metrics.first_byte(last_write - connection.accepted);
+                connection.first_write = false;
+            }
+            if (!pending.empty()) {
+                pending.erase(0, n);
+            } else {
+                session.sent(n);
+                session.produce(output_budget);
+            }
+        }
+        bool writing = ec == boost::asio::error::would_block;
+        if (closed || (ec && !writing) || (!writing && session.finished())) {
+            break;
+        }
+        ec = {};
+
+        // Sleep until the client sends or makes room, a delayed response is due, or a timeout passes.
+        // Streams left waiting on a client that neither sends nor reads get as long as a write; delayed ones wait on
+        // us, not the client.
+        now = clock::now();
+        auto wake = now + options.idle_timeout;
+        if (writing || session.open_streams() > deferred.size()) {
+            wake = std::max(last_read, last_write) + options.write_timeout;
+            if (now >= wake) {
+                break;
+            }
+        } else if (session.open_streams() == 0) {
+            wake = last_read + options.idle_timeout;
+        }
+        for (const Deferred& waiting : deferred) {
+            wake = std::min(wake, waiting.due);
+        }
+        if (tls && tls->pending()) {
+            continue;
+        }
+        auto timeout = std::chrono::ceil<std::chrono::milliseconds>(wake - now);
+        short events = static_cast<short>((backlogged() ? 0 : POLLIN) | (writing ? POLLOUT : 0));
+        pollfd ready{connection.socket.native_handle(), events, 0};
+        if (::poll(&ready, 1, static_cast<int>(std::max<std::int64_t>(timeout.count(), 0))) < 0 && errno != EINTR) {
+            break;
+        }
     }
+}
 
-    std::stringstream buffer;
-    buffer << file.rdbuf();
-    return buffer.str();
+// HTTP/2 gets the same limits on a request as HTTP/1.1
+Http2Limits http2_limits(const ConnectionOptions& options) {
+    Http2Limits limits;
+    limits.max_header_list_size = options.max_header_size;
+    limits.max_body_size = options.max_body_size;
+    return limits;
 }
 
-void handle_connection(tcp::socket socket) {
-    auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-    std::stringstream ss;
-    ss << std::put_time(std::localtime(&now), "%Y-%m-%d %X");
-    std::cout << "Worker Thread ID: " << std::this_thread::get_id() << " - Handling request at " << ss.str() << std::endl;
+// Why serve_connection() stopped
+enum class Served {
+    Closed,   // the connection is done with
+    Blocking, // the next request, still in the buffer, is for a blocking route
+    Batch,    // one batch answered and the connection still open
+};
 
+// Reads and answers requests on connection until it closes. With
+// hand_off_blocking, stops short of a request for a blocking route, once
+// everything before it has been written, and leaves it in the buffer. With
+// one_batch, answers just the requests already buffered, as one batch.
+// Switches to HTTP/2 when ALPN settles on h2, and on plaintext connections
+// for an h2c upgrade or a client that starts with the HTTP/2 preface.
+Served serve_connection(Connection& connection, ServerContext& context, bool hand_off_blocking, bool one_batch) {
     try {
-        boost::asio::streambuf buffer;
-        std::istream input_stream(&buffer);
-        boost::asio::read_until(socket, buffer, "\r\n");
-        std::string request_line;
-        std::getline(input_stream, request_line);
-        if (!request_line.empty() && request_line.back() == '\r') {
-            request_line.pop_back();
-        }
-
-        std::string status_line;
-        std::string filename;
-        if (request_line == "GET / HTTP/1.1") {
-            status_line = "HTTP/1.1 200 OK";
-            filename = "../src/util/hello.html";
-        } else if (request_line == "GET /sleep HTTP/1.1") {
-            // Simulate a slow response by sleeping for 5 seconds
-            std::this_thread::sleep_for(std::chrono::seconds(5));
-            status_line = "HTTP/1.1 200 OK";
-            filename = "../src/util/hello.html";
-        } else {
-            status_line = "HTTP/1.1 404 NOT FOUND";
-            filename = "../src/util/404.html";
+        const ConnectionOptions& options = context.options;
+        if (connection.tls && connection.tls->protocol() == "h2") {
+            Http2Session session(http2_limits(options));
+            serve_http2(connection, context, session);
+            return Served::Closed;
         }
+        ReceiveBuffer& buffer = connection.buffer;
+        ConnectionArena arena;
+        RequestParser parser(options.max_header_size, options.max_body_size);
+        ReadDeadline deadline(options);
+        bool keep_alive = true;
+
+        while (keep_alive) {
+            RequestParser::Result result;
+            if (one_batch) {
+                result = parser.parse(buffer.data());
+            } else {
+                deadline.restart();
+                result = connection.tls ? connection.tls->read_request(buffer, parser, deadline)
+                                        : read_request(connection.socket, buffer, parser, deadline);
+                if (result == RequestParser::Result::Incomplete) {
+                    break;
+                }
+                connection.read_done = std::chrono::steady_clock::now();
+            }
+
+            // Answer every request the client has pipelined so far, then send all the responses in one write.
+            // The last batch is gone by now, so its arena space can be reused.
+            arena.reset();
+            ResponseBatch batch(arena.get());
+            std::size_t batch_requests = 0;
+            bool blocking = false;
+            while (keep_alive && result != RequestParser::Result::Incomplete) {
+                const Request& request = parser.request();
+                if (result == RequestParser::Result::Error && !connection.tls && connection.requests_served == 0
+                    && buffer.data().starts_with(http2_preface.substr(0, 16))) {
+                    // HTTP/2 with prior knowledge: its preface starts out looking like an HTTP/1.x request line
+                    Http2Session session(http2_limits(options));
+                    session.receive(buffer.data());
+                    buffer.consume(buffer.size());
+                    serve_http2(connection, context, session);
+                    return Served::Closed;
+                }
+                if (result == RequestParser::Result::Error) {
+                    // There's no telling where a malformed request ends, so answer it and hang up
+                    ++batch_requests;
+                    keep_alive = false;
+                    batch.add(context.respond(request, 0, error_route(parser.error())), request, keep_alive);
+                    break;
+                }
 
-        std::string contents = read_file_to_string(filename);
-        std::string length = std::to_string(contents.size());
-        std::string response = status_line + "\r\nContent-Length: " + length + "\r\n\r\n" + contents;
-        boost::asio::write(socket, boost::asio::buffer(response));
+                if (!connection.tls && !one_batch && batch_requests == 0 && wants_h2c(request)) {
+                    Http2Session session(http2_limits(options));
+                    if (session.upgrade(request.header("http2-settings"), request, parser.consumed())) {
+                        // The request is answered on stream 1; whatever follows it is HTTP/2
+                        buffer.consume(parser.consumed());
+                        session.receive(buffer.data());
+                        buffer.consume(buffer.size());
+                        serve_http2(connection, context, session, switching_to_h2c);
+                        return Served::Closed;
+                    }
+                }
+                const Route& route = routes.find(request.method, request.path);
+                if (route.work == Work::Blocking && hand_off_blocking) {
+                    blocking = true;
+                    break;
+                }
+                ++batch_requests;
+                keep_alive = request.keep_alive && ++connection.requests_served < options.max_requests
+                             && !context.draining();
+                if (route.delay.count() > 0) {
+                    // Simulate a slow response by sleeping
+                    std::this_thread::sleep_for(route.delay);
+                }
+
+                batch.add(context.respond(request, parser.consumed(), route), request, keep_alive);
+                buffer.consume(parser.consumed());
+                parser.reset();
+                result = parser.parse(buffer.data());
+            }
+            if (batch_requests > 0) {
+                write_responses(connection, batch, options.write_timeout);
+
+                auto written = std::chrono::steady_clock::now();
+                if (connection.first_write) {
+                    context.metrics.first_byte(written - connection.accepted);
+                    connection.first_write = false;
+                }
+                context.metrics.request_time(written - connection.read_done, batch_requests);
+            }
+            if (blocking) {
+                return Served::Blocking;
+            }
+            if (one_batch) {
+                return keep_alive ? Served::Batch : Served::Closed;
+            }
+        }
     }
     catch (std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
     }
+    return Served::Closed;
+}
+
+// Serves a connection start to finish on the calling thread
+void handle_connection(tcp::socket socket, ServerContext& context, std::chrono::steady_clock::time_point accepted) {
+    context.log.connection();
+    context.metrics.connection_opened();
+    Connection connection{std::move(socket), accepted};
+    serve_connection(connection, context, false, false);
+    context.metrics.connection_closed();
+}
+
+// The pools a connection moves between: pool reads and answers requests,
+// and with --blocking-threads, blocking answers those for blocking routes.
+// tls, with --tls-cert, runs the handshakes for connections to the TLS port.
+// A connection that reaches one is handed to blocking with that request
+// still unread in its buffer, and back to pool, ahead of new connections,
+// once blocking has answered what was buffered.
+template<class Pool>
+struct Pools {
+    Pool& pool;
+    ThreadPool* blocking;
+    TlsServer* tls;
+    ServerContext& context;
+};
+
+template<class Pool>
+void serve_pooled(Pools<Pool>& pools, Connection& connection, std::unique_ptr<Connection> owned = nullptr);
+
+// A connection waiting for a blocking worker
+template<class Pool>
+struct BlockingTask {
+    std::unique_ptr<Connection> connection;
+    Pools<Pool>* pools;
+
+    void operator()() {
+        ServerContext& context = pools->context;
+        if (serve_connection(*connection, context, false, true) == Served::Closed) {
+            context.metrics.connection_closed();
+            return;
+        }
+        auto resume = [connection = std::move(connection), pools = pools]() mutable {
+            Connection& resumed = *connection;
+            serve_pooled(*pools, resumed, std::move(connection));
+        };
+        if constexpr (std::is_same_v<Pool, ThreadPool>) {
+            pools->pool.execute(std::move(resume), Priority::High);
+        } else {
+            pools->pool.execute(std::move(resume));
+        }
+    }
+};
+
+// Serves connection on a worker of pools.pool until it closes or reaches a
+// blocking request. owned holds it once it's been moved to the heap for a handoff.
+template<class Pool>
+void serve_pooled(Pools<Pool>& pools, Connection& connection, std::unique_ptr<Connection> owned) {
+    ServerContext& context = pools.context;
+    if (serve_connection(connection, context, pools.blocking != nullptr, false) == Served::Blocking) {
+        if (!owned) {
+            owned = std::make_unique<Connection>(std::move(connection));
+        }
+        BlockingTask<Pool> task{std::move(owned), &pools};
+        if (pools.blocking->execute(std::move(task))) {
+            return;
+        }
+        // Rejected tasks are left intact, so the request is still there to be answered with a 503
+        Connection& rejected = *task.connection;
+        RequestParser parser(context.options.max_header_size, context.options.max_body_size);
+        parser.parse(rejected.buffer.data());
+        ResponseBatch unavailable;
+        unavailable.add(context.respond(parser.request(), parser.consumed(), overloaded_route), parser.request(),
+                        false);
+        try {
+            write_responses(rejected, unavailable, context.options.write_timeout);
+        }
+        catch (std::exception&) {
+            // Hanging up is all that's left either way
+        }
+    }
+    context.metrics.connection_closed();
+}
+
+// The unit of work handed to the pool: one accepted connection. A named type
+// rather than a lambda so the accept loop can still reach the socket if the
+// pool rejects it.
+template<class Pool>
+struct ConnectionTask {
+    tcp::socket socket;
+    Pools<Pool>* pools;
+    std::chrono::steady_clock::time_point accepted;
+    bool tls = false;
+
+    void operator()() {
+        ServerContext& context = pools->context;
+        context.log.connection();
+        context.metrics.connection_opened();
+        Connection connection{std::move(socket), accepted};
+        if (tls) {
+            // The handshake has as long as a request head would
+            connection.tls = pools->tls->accept(connection.socket, context.options.header_timeout);
+            if (!connection.tls) {
+                context.metrics.connection_closed();
+                return;
+            }
+        }
+        serve_pooled(*pools, connection);
+    }
+};
+static_assert(Task::stores_inline<ConnectionTask<ThreadPool>>);
+
+// Accepts connections until shutdown, handing each one to a worker in pool.
+// With blocking_threads > 0, blocking routes are answered by a pool of their
+// own, which queues up to blocking_queue connections and answers the rest with
+// a 503. With tls, a second thread accepts HTTPS connections on tls_port.
+template<class Pool>
+void serve(Pool& pool, boost::asio::io_context& io_context, tcp::acceptor& acceptor, ServerContext& context,
+           size_t blocking_threads, size_t blocking_queue, TlsServer* tls, unsigned short tls_port) {
+    context.metrics.add_gauge("pool_workers", "Worker threads in the pool.",
+                              [&pool] { return static_cast<double>(pool.size()); });
+    context.metrics.add_gauge("pool_busy_workers", "Workers running a task right now.",
+                              [&pool] { return static_cast<double>(pool.busy()); });
+    context.metrics.add_gauge("pool_utilization", "Fraction of workers running a task right now.",
+                              [&pool] { return static_cast<double>(pool.busy()) / static_cast<double>(pool.size()); });
+    context.metrics.add_gauge("pool_queued_tasks", "Connections waiting for a worker.",
+                              [&pool] { return static_cast<double>(pool.queued()); });
+    auto worker_seconds = [&pool](std::chrono::nanoseconds WorkerTimes::*field) {
+        std::vector<double> seconds;
+        for (const WorkerTimes& times : pool.worker_times()) {
+            seconds.push_back(std::chrono::duration<double>(times.*field).count());
+        }
+        return seconds;
+    };
+    context.metrics.add_counters("pool_worker_busy_seconds_total", "Time each worker has spent running tasks.",
+                                 "worker", [worker_seconds] { return worker_seconds(&WorkerTimes::busy); });
+    context.metrics.add_counters("pool_worker_idle_seconds_total", "Time each worker has spent waiting for a task.",
+                                 "worker", [worker_seconds] { return worker_seconds(&WorkerTimes::idle); });
+    if constexpr (requires { pool.resize_stats(); }) {
+        context.metrics.add_counters("pool_resizes_total", "Workers an adaptive pool has started and retired.",
+                                     "direction", [&pool] {
+                                         ResizeStats resizes = pool.resize_stats();
+                                         return std::vector<double>{static_cast<double>(resizes.grown),
+                                                                    static_cast<double>(resizes.shrunk)};
+                                     }, {"grow", "shrink"});
+    }
+
+    // Declared after pool, so it's gone before pool, which its workers hand connections back to
+    std::unique_ptr<ThreadPool> blocking;
+    if (blocking_threads > 0) {
+        blocking = std::make_unique<ThreadPool>(blocking_threads, blocking_queue, OverflowPolicy::Reject);
+        context.metrics.add_gauge("blocking_pool_busy_workers", "Blocking-route workers running a request right now.",
+                                  [&blocking] { return static_cast<double>(blocking->busy()); });
+        context.metrics.add_gauge("blocking_pool_queued_tasks", "Connections waiting for a blocking-route worker.",
+                                  [&blocking] { return static_cast<double>(blocking->queued()); });
+    }
+    Pools<Pool> pools{pool, blocking.get(), tls, context};
+
+    std::optional<tcp::acceptor> tls_acceptor;
+    if (tls) {
+        tls_acceptor.emplace(open_acceptor(io_context, tls_port));
+        context.metrics.add_counters("tls_handshakes_total", "TLS handshakes by how they ended.", "result", [tls] {
+            TlsStats stats = tls->stats();
+            return std::vector<double>{static_cast<double>(stats.full), static_cast<double>(stats.resumed),
+                                       static_cast<double>(stats.failed)};
+        }, {"full", "resumed", "failed"});
+        context.metrics.add_counters("tls_kernel_offload_total", "TLS connections the kernel encrypts or decrypts "
+                                     "for.", "direction", [tls] {
+            TlsStats stats = tls->stats();
+            return std::vector<double>{static_cast<double>(stats.kernel_send),
+                                       static_cast<double>(stats.kernel_receive)};
+        }, {"send", "receive"});
+    }
+
+    Lifecycle& lifecycle = *context.lifecycle;
+    auto accept_connections = [&](tcp::acceptor& listener, bool encrypted) {
+        tcp::socket socket(io_context);
+        while (lifecycle.accept(listener, socket)) {
+            // Use the thread pool to execute the connection handler. The socket is moved
+            // straight into the task, which is small enough to be stored without allocating.
+            ConnectionTask<Pool> task{std::move(socket), &pools, std::chrono::steady_clock::now(), encrypted};
+            if (!pool.execute(std::move(task)) && !encrypted) {
+                // Rejected tasks are left intact, so the socket is still ours to answer and close.
+                // A TLS client can't read a response before its handshake, so it's just closed. Written from
+                // the accept loop itself, so it must never block for long.
+                ResponseBatch unavailable;
+                unavailable.add(context.cache.get("unavailable"), Request(), false);
+                boost::system::error_code ec;
+                boost::asio::write(task.socket, unavailable.segments().front().buffers, ec);
+            }
+            socket = tcp::socket(io_context);
+        }
+    };
+    lifecycle.ready();
+    std::thread tls_accepts;
+    if (tls_acceptor) {
+        tls_accepts = std::thread([&] {
+            try {
+                accept_connections(*tls_acceptor, true);
+            }
+            catch (std::exception& e) {
+                std::cerr << "Exception: " << e.what() << std::endl;
+            }
+        });
+    }
+    accept_connections(acceptor, false);
+    if (tls_accepts.joinable()) {
+        tls_accepts.join();
+    }
+
+    // Queued connections are still served, each with a single response
+    // A connection moving between the pools is always counted in one of them: the worker handing it over is busy
+    // until it's queued in the other
+    if (!lifecycle.drain([&pool, &blocking] {
+            return pool.queued() == 0 && pool.busy() == 0
+                   && (!blocking || (blocking->queued() == 0 && blocking->busy() == 0));
+        })) {
+        abandon_connections(context);
+    }
+}
+
+// SO_REUSEPORT mode: every thread owns a listener on the same port and serves
+// what it accepts itself, so there's no shared accept lock and no handoff
+// through a queue. The kernel picks the listener for each new connection.
+// With per_core, each thread is pinned and serves from a CoreLocal context.
+void serve_sharded(int num_threads, ServerContext& context, bool per_core) {
+    // Every listener is open before ready(), so a restart hands over all of them
+    std::vector<boost::asio::io_context> io_contexts(num_threads);
+    std::vector<tcp::acceptor> acceptors;
+    for (boost::asio::io_context& io_context : io_contexts) {
+        acceptors.push_back(open_acceptor(io_context, 7878, true));
+    }
+    Lifecycle& lifecycle = *context.lifecycle;
+    lifecycle.ready();
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < acceptors.size(); ++i) {
+        threads.emplace_back([&acceptor = acceptors[i], i, per_core, &context, &lifecycle] {
+            try {
+                std::optional<CoreLocal> core;
+                if (per_core) {
+                    core.emplace(i, context);
+                }
+                ServerContext& thread_context = core ? core->context() : context;
+                tcp::socket socket(acceptor.get_executor());
+                while (lifecycle.accept(acceptor, socket)) {
+                    handle_connection(std::move(socket), thread_context, std::chrono::steady_clock::now());
+                    socket = tcp::socket(acceptor.get_executor());
+                }
+            }
+            catch (std::exception& e) {
+                std::cerr << "Exception: " << e.what() << std::endl;
+            }
+        });
+    }
+    if (!lifecycle.drain([&context] { return context.metrics.open_connections() == 0; })) {
+        abandon_connections(context);
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
 }
 
 int main(int argc, char* argv[]) {
     try {
-        if (argc != 2) {
-            std::cerr << "Usage: " << argv[0] << " <number_of_threads>" << std::endl;
+        if (argc < 2) {
+            std::cerr << "Usage: " << argv[0] << " <number_of_threads> [--pool=fifo|work-stealing]"
+                      << " [--queue-limit=<tasks>] [--overflow=block|reject|drop-oldest]"
+                      << " [--pool-max=<threads>] [--pool-target-wait=<ms>] [--pool-idle-timeout=<ms>]"
+                      << " [--blocking-threads=<n>] [--blocking-queue=<connections>]"
+                      << " [--reuseport] [--io-uring] [--per-core]"
+                      << " [--reload] [--log=off|connections|requests] [--docroot=<dir>] " << tls_options_usage
+                      << " " << connection_options_usage << std::endl;
             return 1;
         }
 
@@ -74,19 +599,157 @@ int main(int argc, char* argv[]) {
             std::cerr << "The number of threads must be a positive integer." << std::endl;
             return 1;
         }
-        ThreadPool pool(num_threads);
-        boost::asio::io_context io_context;
-        tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v4(), 7878));
 
-        std::cout << "Multithreaded Server Running with " << num_threads << " threads..." << std::endl;
-        while (true) {
-            auto socket = std::make_shared<tcp::socket>(io_context);
-            acceptor.accept(*socket);
+        bool reload = false;
+        bool reuseport = false;
+        bool io_uring = false;
+        bool per_core = false;
+        std::string pool_kind = "fifo";
+        size_t queue_limit = 0;
+        std::string overflow = "block";
+        PoolSizing sizing;
+        size_t blocking_threads = static_cast<size_t>(num_threads);
+        size_t blocking_queue = 256;
+        LogLevel log_level = LogLevel::Connections;
+        std::string docroot;
+        ConnectionOptions options;
+        TlsOptions tls_options;
+        for (int i = 2; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--reload") {
+                reload = true;
+            } else if (arg == "--reuseport") {
+                reuseport = true;
+            } else if (arg == "--io-uring") {
+                io_uring = true;
+            } else if (arg == "--per-core") {
+                // Shared-nothing: one pinned io_uring reactor per core, each with its own replica of the cache
+                io_uring = true;
+                per_core = true;
+            } else if (arg.starts_with("--pool=")) {
+                pool_kind = arg.substr(7);
+            } else if (arg.starts_with("--queue-limit=")) {
+                queue_limit = std::stoul(arg.substr(14));
+            } else if (arg.starts_with("--pool-max=")) {
+                // <number_of_threads> is then the least the pool shrinks to
+                sizing.max_threads = std::stoul(arg.substr(11));
+            } else if (arg.starts_with("--pool-target-wait=")) {
+                sizing.target_wait = std::chrono::milliseconds(std::stoul(arg.substr(19)));
+            } else if (arg.starts_with("--pool-idle-timeout=")) {
+                sizing.idle_timeout = std::chrono::milliseconds(std::stoul(arg.substr(20)));
+            } else if (arg.starts_with("--blocking-threads=")) {
+                // 0 answers blocking routes on the worker that read them, like any other
+                blocking_threads = std::stoul(arg.substr(19));
+            } else if (arg.starts_with("--blocking-queue=")) {
+                blocking_queue = std::stoul(arg.substr(17));
+            } else if (arg.starts_with("--log=")) {
+                log_level = parse_log_level(arg.substr(6));
+            } else if (arg.starts_with("--docroot=")) {
+                docroot = arg.substr(10);
+            } else if (parse_connection_option(arg, options)) {
+                // Timeouts and size limits
+            } else if (parse_tls_option(arg, tls_options)) {
+                // HTTPS on a second port
+            } else if (arg.starts_with("--overflow=")) {
+                overflow = arg.substr(11);
+            } else {
+                std::cerr << "Unknown option " << arg << std::endl;
+                return 1;
+            }
+        }
+        if (pool_kind != "fifo" && pool_kind != "work-stealing") {
+            std::cerr << "--pool must be fifo or work-stealing." << std::endl;
+            return 1;
+        }
+        OverflowPolicy policy = OverflowPolicy::Block;
+        if (overflow == "reject") {
+            policy = OverflowPolicy::Reject;
+        } else if (overflow == "drop-oldest") {
+            policy = OverflowPolicy::DropOldest;
+        } else if (overflow != "block") {
+            std::cerr << "--overflow must be block, reject or drop-oldest." << std::endl;
+            return 1;
+        }
+        if (sizing.max_threads > 0 && (pool_kind != "fifo" || sizing.max_threads < static_cast<size_t>(num_threads))) {
+            std::cerr << "--pool-max needs the fifo pool and at least <number_of_threads>." << std::endl;
+            return 1;
+        }
+        if ((reuseport || io_uring) && (queue_limit > 0 || pool_kind != "fifo" || sizing.max_threads > 0)) {
+            std::cerr << "--reuseport and --io-uring serve connections on the accepting threads and don't use a pool."
+                      << std::endl;
+            return 1;
+        }
+        if (tls_options.enabled() != !tls_options.private_key.empty()) {
+            std::cerr << "--tls-cert and --tls-key go together." << std::endl;
+            return 1;
+        }
+        if (tls_options.enabled() && (reuseport || io_uring)) {
+            std::cerr << "TLS is only served by the pooled modes." << std::endl;
+            return 1;
+        }
+        if (queue_limit > 0 && pool_kind != "fifo") {
+            std::cerr << "--queue-limit is only supported by the fifo pool." << std::endl;
+            return 1;
+        }
+
+        // Before any other thread starts, so the signals it handles are blocked in all of them
+        Lifecycle lifecycle(argv, options.drain_timeout);
+
+        // Every response we can send is loaded once here and shared read-only by all workers
+        ResponseCache cache(reload);
+        cache.add("hello", "HTTP/1.1 200 OK", "../src/util/hello.html");
+        cache.add("not_found", "HTTP/1.1 404 NOT FOUND", "../src/util/404.html");
+        cache.add("bad_request", "HTTP/1.1 400 Bad Request", "../src/util/400.html");
+        cache.add("request_timeout", "HTTP/1.1 408 Request Timeout", "../src/util/408.html");
+        cache.add("body_too_large", "HTTP/1.1 413 Content Too Large", "../src/util/413.html");
+        cache.add("header_too_large", "HTTP/1.1 431 Request Header Fields Too Large", "../src/util/431.html");
+        cache.add("unavailable", "HTTP/1.1 503 Service Unavailable", "../src/util/503.html");
+
+        AccessLog log(std::cout, log_level);
+        Metrics metrics(route_labels());
+        // Paths without a route of their own are looked up under the document root
+        std::unique_ptr<StaticFiles> files;
+        if (!docroot.empty()) {
+            files = std::make_unique<StaticFiles>(docroot);
+        }
+        ServerContext context{cache, log, metrics, files.get(), options, &lifecycle};
+
+        if (io_uring) {
+#ifdef HAVE_IO_URING
+            std::cout << "Multithreaded Server Running with " << num_threads << " io_uring rings..." << std::endl;
+            if (serve_io_uring(num_threads, context, per_core)) {
+                return 0;
+            }
+#else
+            std::cerr << "Built without io_uring support." << std::endl;
+#endif
+            std::cerr << "Falling back to --reuseport." << std::endl;
+            reuseport = true;
+        }
+        if (reuseport) {
+            std::cout << "Multithreaded Server Running with " << num_threads << " SO_REUSEPORT listeners..." << std::endl;
+            serve_sharded(num_threads, context, per_core);
+            return 0;
+        }
+
+        boost::asio::io_context io_context;
+        tcp::acceptor acceptor = open_acceptor(io_context, 7878);
+        // Loaded before serving starts, so a bad certificate or key stops the server straight away
+        std::unique_ptr<TlsServer> tls;
+        if (tls_options.enabled()) {
+            tls = std::make_unique<TlsServer>(tls_options);
+            std::cout << "Serving HTTPS on port " << tls_options.port << "..." << std::endl;
+        }
 
-            // Use the thread pool to execute the connection handler
-            pool.execute([socket]() mutable {
-                handle_connection(std::move(*socket));
-            });
+        std::cout << "Multithreaded Server Running with " << num_threads
+                  << (sizing.max_threads > 0 ? " to " + std::to_string(sizing.max_threads) : "") << " threads ("
+                  << pool_kind << " pool)..." << std::endl;
+        if (pool_kind == "work-stealing") {
+            WorkStealingPool pool(num_threads);
+            serve(pool, io_context, acceptor, context, blocking_threads, blocking_queue, tls.get(), tls_options.port);
+        } else {
+            ThreadPool pool(num_threads, queue_limit, policy, sizing);
+            serve(pool, io_context, acceptor, context, blocking_threads, blocking_queue, tls.get(), tls_options.port);
         }
     }
     catch (std::exception& e) {
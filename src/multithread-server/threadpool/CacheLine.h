@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+
+// How far apart two objects written by different threads must be to never
+// share a cache line. GCC warns when the standard constant is used in a
+// header, since it can change with -mtune and so break an ABI; the pools
+// aren't part of one, so that's fine here.
+#if defined(__cpp_lib_hardware_interference_size)
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winterference-size"
+#endif
+inline constexpr std::size_t cache_line_size = std::hardware_destructive_interference_size;
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#else
+inline constexpr std::size_t cache_line_size = 64;
+#endif
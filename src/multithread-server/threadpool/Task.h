@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// A move-only replacement for std::function<void()> with inline storage big
+// enough for a tcp::socket (80 bytes with Boost 1.74) plus a few pointers, so
+// handing a connection to a worker doesn't allocate. Callables that are too
+// big, over-aligned or throw on move fall back to the heap.
+class Task {
+public:
+    static constexpr std::size_t inline_size = 120;
+
+    template<class F>
+    static constexpr bool stores_inline = sizeof(F) <= inline_size
+        && alignof(F) <= alignof(std::max_align_t)
+        && std::is_nothrow_move_constructible_v<F>;
+
+    Task() noexcept = default;
+
+    template<class F, class = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+    Task(F&& f);
+
+    Task(Task&& other) noexcept;
+    Task& operator=(Task&& other) noexcept;
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task();
+
+    void operator()();
+    explicit operator bool() const noexcept { return ops != nullptr; }
+
+private:
+    struct Ops {
+        void (*invoke)(void* storage);
+        void (*move)(void* from, void* to) noexcept;
+        void (*destroy)(void* storage) noexcept;
+    };
+
+    template<class F>
+    static const Ops inline_ops;
+    template<class F>
+    static const Ops heap_ops;
+
+    void reset() noexcept;
+
+    alignas(std::max_align_t) unsigned char storage[inline_size];
+    const Ops* ops = nullptr;
+};
+
+#include "Task.tpp"
@@ -0,0 +1,65 @@
+template<class F>
+const Task::Ops Task::inline_ops = {
+    [](void* storage) { (*static_cast<F*>(storage))(); },
+    [](void* from, void* to) noexcept {
+        ::new (to) F(std::move(*static_cast<F*>(from)));
+        static_cast<F*>(from)->~F();
+    },
+    [](void* storage) noexcept { static_cast<F*>(storage)->~F(); },
+};
+
+// Heap-stored callables keep just their pointer in storage
+template<class F>
+const Task::Ops Task::heap_ops = {
+    [](void* storage) { (**static_cast<F**>(storage))(); },
+    [](void* from, void* to) noexcept { *static_cast<F**>(to) = *static_cast<F**>(from); },
+    [](void* storage) noexcept { delete *static_cast<F**>(storage); },
+};
+
+template<class F, class>
+Task::Task(F&& f) {
+    using Callable = std::decay_t<F>;
+    if constexpr (stores_inline<Callable>) {
+        ::new (static_cast<void*>(storage)) Callable(std::forward<F>(f));
+        ops = &inline_ops<Callable>;
+    } else {
+        ::new (static_cast<void*>(storage)) Callable*(new Callable(std::forward<F>(f)));
+        ops = &heap_ops<Callable>;
+    }
+}
+
+inline Task::Task(Task&& other) noexcept
+    : ops(other.ops)
+{
+    if (ops) {
+        ops->move(other.storage, storage);
+        other.ops = nullptr;
+    }
+}
+
+inline Task& Task::operator=(Task&& other) noexcept {
+    if (this != &other) {
+        reset();
+        ops = other.ops;
+        if (ops) {
+            ops->move(other.storage, storage);
+            other.ops = nullptr;
+        }
+    }
+    return *this;
+}
+
+inline Task::~Task() {
+    reset();
+}
+
+inline void Task::operator()() {
+    ops->invoke(storage);
+}
+
+inline void Task::reset() noexcept {
+    if (ops) {
+        ops->destroy(storage);
+        ops = nullptr;
+    }
+}
@@ -1,36 +1,166 @@
 #include "ThreadPool.h"
 
-ThreadPool::ThreadPool(size_t threads)
-    : stop(false)
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t threads, size_t max_queued, OverflowPolicy policy, PoolSizing sizing)
+    : max_queued(max_queued),
+      policy(policy),
+      min_workers(threads),
+      sizing(sizing)
 {
+    // An adaptive pool has a slot for every worker it may grow to; those past the first threads start empty
+    size_t slots = std::max(threads, sizing.max_threads);
+    for (size_t i = 0; i < slots; ++i) {
+        workers.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = threads; i < slots; ++i) {
+        workers[i]->clock.off();
+    }
     for (size_t i = 0; i < threads; ++i) {
-        workers.emplace_back(
-            [this] {
-                while (true) {
-                    std::function<void()> task;
-                    {
-                        std::unique_lock<std::mutex> lock(this->queue_mutex);
-                        this->condition.wait(lock, [this] { return this->stop || !this->tasks.empty(); });
-                        if (this->stop && this->tasks.empty())
-                            return;
-                        task = std::move(this->tasks.front());
-                        this->tasks.pop();
-                    }
-
-                    task();
-                }
-            }
-        );
+        workers[i]->active = true;
+        workers[i]->thread = std::thread([this, &worker = *workers[i]] { run(worker); });
+    }
+    live_workers.store(threads, std::memory_order_relaxed);
+    last_growth = clock::now();
+    if (slots > threads) {
+        resizer = std::thread([this] { resize(); });
     }
 }
 
 ThreadPool::~ThreadPool()
 {
     {
+        // Set under the lock so a worker can't check it and then miss the notify
         std::unique_lock<std::mutex> lock(queue_mutex);
-        stop = true;
+        stop.store(true, std::memory_order_relaxed);
     }
     condition.notify_all();
-    for (std::thread &worker : workers)
-        worker.join();
-}
\ No newline at end of file
+    not_full.notify_all();
+    resizer_wakeup.notify_all();
+    // The resizer first, so no worker is started after these joins
+    if (resizer.joinable())
+        resizer.join();
+    for (auto& worker : workers) {
+        if (worker->thread.joinable())
+            worker->thread.join();
+    }
+}
+
+void ThreadPool::run(Worker& worker)
+{
+    while (true) {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            ++idle_workers;
+            auto idle_since = clock::now();
+            while (!stop.load(std::memory_order_relaxed) && waiting() == 0) {
+                if (sizing.max_threads == 0) {
+                    condition.wait(lock);
+                    continue;
+                }
+                if (condition.wait_until(lock, idle_since + sizing.idle_timeout) == std::cv_status::timeout
+                    && waiting() == 0) {
+                    auto now = clock::now();
+                    if (should_retire(now)) {
+                        --idle_workers;
+                        ++resizes.shrunk;
+                        worker.active = false;
+                        live_workers.fetch_sub(1, std::memory_order_relaxed);
+                        worker.clock.off();
+                        return;
+                    }
+                    idle_since = now;
+                }
+            }
+            --idle_workers;
+            if (stop.load(std::memory_order_relaxed) && waiting() == 0)
+                return;
+            std::queue<QueuedTask>& queue = next_lane();
+            task = std::move(queue.front().task);
+            queue.pop();
+            // Still under the lock, so the task is never counted as neither queued nor busy
+            worker.clock.busy();
+        }
+        if (max_queued > 0 && policy == OverflowPolicy::Block)
+            not_full.notify_one();
+
+        task();
+        worker.clock.idle();
+    }
+}
+
+bool ThreadPool::should_retire(clock::time_point now) const
+{
+    return live_workers.load(std::memory_order_relaxed) > min_workers && now - last_growth >= sizing.idle_timeout;
+}
+
+// An adaptive pool's own thread: once every target_wait, starts a worker if
+// the oldest task has been queued for longer than that and nobody is free.
+void ThreadPool::resize()
+{
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    while (!stop.load(std::memory_order_relaxed)) {
+        resizer_wakeup.wait_for(lock, sizing.target_wait);
+        if (stop.load(std::memory_order_relaxed))
+            break;
+        auto now = clock::now();
+        auto oldest = now;
+        for (const auto& queue : lanes) {
+            if (!queue.empty())
+                oldest = std::min(oldest, queue.front().enqueued);
+        }
+        if (idle_workers > 0 || now - oldest <= sizing.target_wait)
+            continue;
+        auto slot = std::find_if(workers.begin(), workers.end(), [](const auto& worker) { return !worker->active; });
+        if (slot == workers.end())
+            continue;
+
+        Worker& worker = **slot;
+        worker.active = true;
+        live_workers.fetch_add(1, std::memory_order_relaxed);
+        ++resizes.grown;
+        last_growth = now;
+        lock.unlock();
+        // The thread that last had this slot has retired, or is just returning
+        if (worker.thread.joinable())
+            worker.thread.join();
+        worker.clock.idle();
+        worker.thread = std::thread([this, &worker] { run(worker); });
+        lock.lock();
+    }
+}
+
+size_t ThreadPool::queued() const
+{
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    return waiting();
+}
+
+size_t ThreadPool::busy() const
+{
+    size_t count = 0;
+    for (const auto& worker : workers)
+        count += worker->clock.running();
+    return count;
+}
+
+std::vector<WorkerTimes> ThreadPool::worker_times() const
+{
+    std::vector<WorkerTimes> times;
+    for (const auto& worker : workers)
+        times.push_back(worker->clock.times());
+    return times;
+}
+
+OverflowStats ThreadPool::overflow_stats() const
+{
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    return stats;
+}
+
+ResizeStats ThreadPool::resize_stats() const
+{
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    return resizes;
+}
@@ -1,27 +1,132 @@
 #pragma once
 
+#include <array>
 #include <vector>
 #include <thread>
 #include <queue>
-#include <functional>
+#include <chrono>
+#include <memory>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
 
+#include "CacheLine.h"
+#include "Task.h"
+#include "WorkerClock.h"
+
+// What execute() does when a bounded queue is already full.
+enum class OverflowPolicy {
+    Block,      // wait for a worker to take a task off the queue
+    Reject,     // refuse the new task; execute() returns false
+    DropOldest, // destroy the task that has waited longest to make room
+};
+
+// Which lane of the queue execute() puts a task in. Workers take High tasks
+// first, in order, and only then Normal ones. High is for work already
+// admitted, such as a connection coming back from another pool, so it's
+// never held up by the queue limit: a bounded pool bounds Normal alone.
+enum class Priority { High, Normal };
+
+// How many times each OverflowPolicy has fired.
+struct OverflowStats {
+    size_t blocked = 0;
+    size_t rejected = 0;
+    size_t dropped = 0;
+};
+
+// Lets a pool grow past the threads it starts with, up to max_threads:
+// whenever the oldest queued task has waited longer than target_wait, one
+// more worker is started, at most one per target_wait. A worker idle for
+// idle_timeout retires, down to the starting count, but only once
+// idle_timeout has passed since the pool last grew, so a load hovering
+// around the threshold doesn't make it flap. max_threads == 0 keeps the pool
+// at a fixed size.
+struct PoolSizing {
+    size_t max_threads = 0;
+    std::chrono::milliseconds target_wait{10};
+    std::chrono::milliseconds idle_timeout{5000};
+};
+
+// How many times an adaptive pool has started and retired a worker.
+struct ResizeStats {
+    size_t grown = 0;
+    size_t shrunk = 0;
+};
+
+// One FIFO queue per Priority under one lock, shared by every worker. What each worker
+// writes on its own (its busy flag and clock) sits in a slot of its own, and
+// the queue, the lock and the stop flag each get their own cache line, so
+// the only line workers fight over is the one they have to.
 class ThreadPool {
 public:
-    explicit ThreadPool(size_t threads);
+    // max_queued == 0 leaves the queue unbounded and policy unused.
+    explicit ThreadPool(size_t threads, size_t max_queued = 0, OverflowPolicy policy = OverflowPolicy::Block,
+                        PoolSizing sizing = {});
     ~ThreadPool();
 
+    // Returns false only when the task is rejected, in which case f is left
+    // untouched so the caller can still deal with whatever it captured.
     template<class F>
-    void execute(F&& f);
+    bool execute(F&& f, Priority priority = Priority::Normal);
+
+    OverflowStats overflow_stats() const;
+    ResizeStats resize_stats() const;
+
+    // For monitoring: worker count, tasks waiting in either lane, and workers running a task right now
+    size_t size() const { return live_workers.load(std::memory_order_relaxed); }
+    size_t queued() const;
+    size_t busy() const;
+    // How long each worker has spent running tasks and waiting for them, in
+    // worker order. An adaptive pool has a slot for each of max_threads,
+    // reused as workers come and go; a slot's time stops while it's empty.
+    std::vector<WorkerTimes> worker_times() const;
 
 private:
-    std::vector<std::thread> workers;
-    std::queue<std::function<void()>> tasks;
+    using clock = std::chrono::steady_clock;
+
+    struct alignas(cache_line_size) Worker {
+        WorkerClock clock;
+        std::thread thread;
+        // Under queue_mutex: whether a thread is serving from this slot
+        bool active = false;
+    };
+
+    struct QueuedTask {
+        Task task;
+        // Only recorded by an adaptive pool
+        clock::time_point enqueued;
+    };
+
+    // With the lock held: every queued task, and the lane the next one comes from
+    size_t waiting() const { return lanes[0].size() + lanes[1].size(); }
+    std::queue<QueuedTask>& next_lane() { return lanes[0].empty() ? lanes[1] : lanes[0]; }
+    std::queue<QueuedTask>& lane(Priority priority) { return lanes[static_cast<size_t>(priority)]; }
+
+    void run(Worker& worker);
+    void resize();
+    // With the lock held: whether a worker whose wait for a task timed out should retire
+    bool should_retire(clock::time_point now) const;
+
+    // Written once, at shutdown, and read by every execute() without the lock
+    alignas(cache_line_size) std::atomic<bool> stop{false};
+    const size_t max_queued;
+    const OverflowPolicy policy;
+    const size_t min_workers;
+    const PoolSizing sizing;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> live_workers{0};
+    std::thread resizer;
 
-    std::mutex queue_mutex;
+    // Everything execute() and the workers change under the lock
+    alignas(cache_line_size) mutable std::mutex queue_mutex;
+    std::array<std::queue<QueuedTask>, 2> lanes;
+    OverflowStats stats;
+    ResizeStats resizes;
+    size_t idle_workers = 0;
+    clock::time_point last_growth;
     std::condition_variable condition;
-    bool stop;
+    std::condition_variable not_full;
+    std::condition_variable resizer_wakeup;
 };
 
 #include "ThreadPool.tpp"
\ No newline at end of file
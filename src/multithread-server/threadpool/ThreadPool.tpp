@@ -1,11 +1,37 @@
 template<class F>
-void ThreadPool::execute(F&& f) {
+bool ThreadPool::execute(F&& f, Priority priority) {
+    // A dropped task is destroyed after unlocking; for a connection that means closing its socket
+    Task dropped;
+    // Nothing may call execute() once destruction starts, so this needn't be read under the lock
+    if (stop.load(std::memory_order_relaxed))
+        throw std::runtime_error("enqueue on stopped ThreadPool");
     {
         std::unique_lock<std::mutex> lock(queue_mutex);
-        if (stop)
-            throw std::runtime_error("enqueue on stopped ThreadPool");
+        std::queue<QueuedTask>& normal = lane(Priority::Normal);
 
-        tasks.emplace(std::forward<F>(f));
+        if (max_queued > 0 && priority == Priority::Normal && normal.size() >= max_queued) {
+            switch (policy) {
+            case OverflowPolicy::Block:
+                ++stats.blocked;
+                not_full.wait(lock, [this, &normal] {
+                    return stop.load(std::memory_order_relaxed) || normal.size() < max_queued;
+                });
+                if (stop.load(std::memory_order_relaxed))
+                    throw std::runtime_error("enqueue on stopped ThreadPool");
+                break;
+            case OverflowPolicy::Reject:
+                ++stats.rejected;
+                return false;
+            case OverflowPolicy::DropOldest:
+                ++stats.dropped;
+                dropped = std::move(normal.front().task);
+                normal.pop();
+                break;
+            }
+        }
+
+        lane(priority).push({Task(std::forward<F>(f)), sizing.max_threads > 0 ? clock::now() : clock::time_point()});
     }
     condition.notify_one();
+    return true;
 }
\ No newline at end of file
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+// Fixed-capacity Chase-Lev deque (Lê et al., "Correct and Efficient
+// Work-Stealing for Weak Memory Models"). The owning worker pushes and pops
+// at the bottom (LIFO, so it keeps working on what's hot in its cache) while
+// any other thread steals from the top (FIFO, the oldest work). Every
+// operation is lock-free; only the last element is contended with a CAS.
+template<class T>
+class WorkStealingDeque {
+public:
+    explicit WorkStealingDeque(std::size_t capacity_pow2 = 1024)
+        : mask(capacity_pow2 - 1),
+          buffer(new std::atomic<T*>[capacity_pow2])
+    {
+    }
+
+    // Owner only. Returns false when full so the caller can spill elsewhere.
+    bool push(T* item) {
+        std::int64_t b = bottom.load(std::memory_order_relaxed);
+        std::int64_t t = top.load(std::memory_order_acquire);
+        if (b - t > static_cast<std::int64_t>(mask)) {
+            return false;
+        }
+        buffer[b & mask].store(item, std::memory_order_relaxed);
+        // A release store rather than the paper's fence + relaxed store: same cost
+        // on x86, and pairs explicitly with the acquire load of bottom in steal()
+        bottom.store(b + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Owner only.
+    T* pop() {
+        std::int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t t = top.load(std::memory_order_relaxed);
+
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        T* item = buffer[b & mask].load(std::memory_order_relaxed);
+        if (t == b) {
+            // Racing thieves for the last element
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                item = nullptr;
+            }
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    // Any thread. Returns nullptr when empty or when another thief won the race.
+    T* steal() {
+        std::int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return nullptr;
+        }
+
+        T* item = buffer[t & mask].load(std::memory_order_relaxed);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return item;
+    }
+
+    bool empty() const {
+        return top.load(std::memory_order_acquire) >= bottom.load(std::memory_order_acquire);
+    }
+
+    // A snapshot that may already be stale; for monitoring only
+    std::size_t size() const {
+        std::int64_t n = bottom.load(std::memory_order_acquire) - top.load(std::memory_order_acquire);
+        return n > 0 ? static_cast<std::size_t>(n) : 0;
+    }
+
+private:
+    std::atomic<std::int64_t> top{0};
+    std::atomic<std::int64_t> bottom{0};
+    std::size_t mask;
+    std::unique_ptr<std::atomic<T*>[]> buffer;
+};
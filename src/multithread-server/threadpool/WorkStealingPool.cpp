@@ -0,0 +1,228 @@
+#include "WorkStealingPool.h"
+
+#include <algorithm>
+
+namespace {
+
+// The pool and worker index of the calling thread, so tasks submitted from
+// inside a task land on that worker's own deque.
+thread_local const WorkStealingPool* current_pool = nullptr;
+thread_local size_t current_index = 0;
+
+}
+
+WorkStealingPool::WorkStealingPool(size_t threads)
+    : searching(threads)
+{
+    // Every worker starts out searching; each one that finds nothing parks
+    for (size_t i = 0; i < threads; ++i) {
+        workers.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        workers[i]->thread = std::thread([this, i] { run(i); });
+    }
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    stop.store(true);
+    {
+        std::unique_lock<std::mutex> lock(park_mutex);
+        for (size_t index : parked) {
+            searching.fetch_add(1);
+            workers[index]->parked.store(false);
+            workers[index]->parked.notify_one();
+        }
+        parked.clear();
+        num_parked.store(0);
+    }
+    for (auto& worker : workers)
+        worker->thread.join();
+}
+
+bool WorkStealingPool::is_worker_thread() const {
+    return current_pool == this;
+}
+
+size_t WorkStealingPool::queued() const {
+    size_t total = injector.size() + overflow_size.load(std::memory_order_relaxed);
+    for (const auto& worker : workers) {
+        total += worker->deque.size();
+    }
+    return total;
+}
+
+size_t WorkStealingPool::busy() const {
+    size_t count = 0;
+    for (const auto& worker : workers) {
+        count += worker->clock.running();
+    }
+    return count;
+}
+
+std::vector<WorkerTimes> WorkStealingPool::worker_times() const {
+    std::vector<WorkerTimes> times;
+    for (const auto& worker : workers) {
+        times.push_back(worker->clock.times());
+    }
+    return times;
+}
+
+void WorkStealingPool::push(Task task) {
+    bool pushed;
+    if (is_worker_thread()) {
+        auto node = std::make_unique<Task>(std::move(task));
+        pushed = workers[current_index]->deque.push(node.get());
+        if (pushed) {
+            node.release();
+        } else {
+            task = std::move(*node);
+        }
+    } else {
+        pushed = injector.push(task);
+    }
+    if (!pushed) {
+        std::unique_lock<std::mutex> lock(overflow_mutex);
+        overflow.push_back(std::move(task));
+        overflow_size.fetch_add(1);
+    }
+
+    // Pairs with the fence in park(): either a parking worker sees this task,
+    // or we see it parked and wake it.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (searching.load() == 0) {
+        notify_one();
+    }
+}
+
+void WorkStealingPool::run(size_t index) {
+    current_pool = this;
+    current_index = index;
+    Worker& worker = *workers[index];
+    bool is_searching = true;
+
+    while (true) {
+        Task task;
+        if (find_task(index, task)) {
+            // The last searcher to find work hands the search on, so a burst
+            // wakes workers one at a time instead of all at once.
+            if (is_searching) {
+                is_searching = false;
+                if (searching.fetch_sub(1) == 1) {
+                    notify_one();
+                }
+            }
+            worker.clock.busy();
+            task();
+            worker.clock.idle();
+            continue;
+        }
+
+        if (is_searching) {
+            is_searching = false;
+            searching.fetch_sub(1);
+        }
+        if (stop.load() && !has_work()) {
+            return;
+        }
+        park(index);
+        is_searching = true;
+    }
+}
+
+bool WorkStealingPool::find_task(size_t index, Task& task) {
+    auto take = [&task](Task* node) {
+        task = std::move(*node);
+        delete node;
+        return true;
+    };
+
+    if (Task* node = workers[index]->deque.pop()) {
+        return take(node);
+    }
+    if (injector.pop(task)) {
+        return true;
+    }
+    if (overflow_size.load(std::memory_order_relaxed) > 0) {
+        std::unique_lock<std::mutex> lock(overflow_mutex);
+        if (!overflow.empty()) {
+            task = std::move(overflow.front());
+            overflow.pop_front();
+            overflow_size.fetch_sub(1);
+            return true;
+        }
+    }
+
+    // Steal the oldest task from someone else, starting at a different victim each time
+    thread_local uint32_t seed = static_cast<uint32_t>(index) * 2654435761u + 1;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    size_t start = seed % workers.size();
+    for (size_t i = 0; i < workers.size(); ++i) {
+        size_t victim = (start + i) % workers.size();
+        if (victim == index) {
+            continue;
+        }
+        if (Task* node = workers[victim]->deque.steal()) {
+            return take(node);
+        }
+    }
+    return false;
+}
+
+bool WorkStealingPool::has_work() const {
+    if (!injector.empty() || overflow_size.load() > 0) {
+        return true;
+    }
+    return std::any_of(workers.begin(), workers.end(), [](const auto& worker) { return !worker->deque.empty(); });
+}
+
+// Returns once this worker has been counted as searching again: after a
+// notify_one(), after finding work on the re-check, or when the pool stops.
+void WorkStealingPool::park(size_t index) {
+    Worker& worker = *workers[index];
+    {
+        std::unique_lock<std::mutex> lock(park_mutex);
+        if (stop.load()) {
+            searching.fetch_add(1);
+            return;
+        }
+        worker.parked.store(true);
+        parked.push_back(index);
+        num_parked.fetch_add(1);
+    }
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (has_work()) {
+        std::unique_lock<std::mutex> lock(park_mutex);
+        auto it = std::find(parked.begin(), parked.end(), index);
+        if (it != parked.end()) {
+            parked.erase(it);
+            num_parked.fetch_sub(1);
+            worker.parked.store(false);
+            searching.fetch_add(1);
+            return;
+        }
+        // Someone already claimed us in notify_one(); fall through to take the wake-up
+    }
+
+    worker.parked.wait(true);
+}
+
+void WorkStealingPool::notify_one() {
+    if (num_parked.load() == 0) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(park_mutex);
+    if (parked.empty()) {
+        return;
+    }
+    size_t index = parked.back();
+    parked.pop_back();
+    num_parked.fetch_sub(1);
+    searching.fetch_add(1);
+    workers[index]->parked.store(false);
+    workers[index]->parked.notify_one();
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "CacheLine.h"
+#include "MpmcQueue.h"
+#include "Task.h"
+#include "WorkStealingDeque.h"
+#include "WorkerClock.h"
+
+// A drop-in alternative to ThreadPool without a single shared lock. Each
+// worker owns a deque it pushes to and pops from without contention; tasks
+// submitted from outside the pool (such as the accept loop) go through a
+// lock-free injector queue, and idle workers steal from each other before
+// parking. Only one parked worker is woken per burst of work: while some
+// worker is already searching for tasks, execute() doesn't notify anyone.
+//
+// The injector holds Tasks by value, so handing a connection over from the
+// accept loop doesn't allocate. Tasks a worker submits itself go on its deque,
+// which needs a heap node per task because thieves read its slots racily.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(size_t threads);
+    ~WorkStealingPool();
+
+    // Always returns true; the injector spills into an unbounded overflow list
+    // rather than refusing work. The return type matches ThreadPool::execute.
+    template<class F>
+    bool execute(F&& f);
+
+    // For monitoring: worker count, an approximate count of tasks waiting, and
+    // workers running a task right now
+    size_t size() const { return workers.size(); }
+    size_t queued() const;
+    size_t busy() const;
+    // How long each worker has spent running tasks and waiting for them, in worker order
+    std::vector<WorkerTimes> worker_times() const;
+
+private:
+    struct alignas(cache_line_size) Worker {
+        WorkStealingDeque<Task> deque;
+        std::atomic<bool> parked{false};
+        WorkerClock clock;
+        std::thread thread;
+    };
+
+    bool is_worker_thread() const;
+    void push(Task task);
+    void run(size_t index);
+    bool find_task(size_t index, Task& task);
+    bool has_work() const;
+    void park(size_t index);
+    void notify_one();
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    MpmcQueue<Task> injector;
+
+    // Spill-over for when the injector or a local deque is full; rarely touched.
+    std::mutex overflow_mutex;
+    std::deque<Task> overflow;
+    std::atomic<size_t> overflow_size{0};
+
+    // Changed every time a worker parks, wakes or starts searching
+    alignas(cache_line_size) std::mutex park_mutex;
+    std::vector<size_t> parked;
+    std::atomic<size_t> num_parked{0};
+    std::atomic<size_t> searching{0};
+
+    // Written once, at shutdown, and read by every worker whenever it runs dry
+    alignas(cache_line_size) std::atomic<bool> stop{false};
+};
+
+#include "WorkStealingPool.tpp"
@@ -0,0 +1,9 @@
+template<class F>
+bool WorkStealingPool::execute(F&& f) {
+    // Workers may still submit follow-up work while the pool drains on destruction
+    if (stop.load(std::memory_order_relaxed) && !is_worker_thread())
+        throw std::runtime_error("enqueue on stopped WorkStealingPool");
+
+    push(Task(std::forward<F>(f)));
+    return true;
+}
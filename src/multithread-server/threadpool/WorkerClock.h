@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Time one pool worker has spent running tasks and waiting for them.
+struct WorkerTimes {
+    std::chrono::nanoseconds busy{0};
+    std::chrono::nanoseconds idle{0};
+};
+
+// A worker's busy/idle accounting. Only the worker itself calls busy(),
+// idle() and off(), at each change, so its stores are plain relaxed ones;
+// any thread may read times(), which includes the stretch in progress.
+// Time spent off (a pool slot with no thread in it) isn't counted at all.
+class WorkerClock {
+public:
+    using clock = std::chrono::steady_clock;
+
+    void busy() { change(State::Busy); }
+    void idle() { change(State::Idle); }
+    void off() { change(State::Off); }
+
+    bool running() const { return state.load(std::memory_order_relaxed) == State::Busy; }
+
+    WorkerTimes times() const {
+        WorkerTimes times{std::chrono::nanoseconds(busy_total.load(std::memory_order_relaxed)),
+                          std::chrono::nanoseconds(idle_total.load(std::memory_order_relaxed))};
+        State current = state.load(std::memory_order_relaxed);
+        std::chrono::nanoseconds stretch(now() - since.load(std::memory_order_relaxed));
+        if (current != State::Off && stretch.count() > 0) {
+            (current == State::Busy ? times.busy : times.idle) += stretch;
+        }
+        return times;
+    }
+
+private:
+    enum class State : std::uint8_t { Off, Idle, Busy };
+
+    static std::int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now().time_since_epoch()).count();
+    }
+
+    void change(State to) {
+        std::int64_t at = now();
+        State from = state.load(std::memory_order_relaxed);
+        if (from != State::Off) {
+            std::atomic<std::int64_t>& total = from == State::Busy ? busy_total : idle_total;
+            total.store(total.load(std::memory_order_relaxed) + (at - since.load(std::memory_order_relaxed)),
+                        std::memory_order_relaxed);
+        }
+        since.store(at, std::memory_order_relaxed);
+        state.store(to, std::memory_order_relaxed);
+    }
+
+    std::atomic<std::int64_t> busy_total{0};
+    std::atomic<std::int64_t> idle_total{0};
+    std::atomic<std::int64_t> since{now()};
+    std::atomic<State> state{State::Idle};
+};
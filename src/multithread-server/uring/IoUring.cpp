@@ -0,0 +1,175 @@
+#include "IoUring.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+[[noreturn]] void fail(const char* what, int error = errno) {
+    throw std::system_error(error, std::generic_category(), what);
+}
+
+void* map(int fd, std::size_t size, off_t offset) {
+    void* memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    if (memory == MAP_FAILED) {
+        fail("mmap io_uring");
+    }
+    return memory;
+}
+
+}
+
+IoUring::IoUring(unsigned entries, unsigned buffer_count, std::size_t buffer_size)
+    : buffer_count(buffer_count),
+      buffer_size(buffer_size)
+{
+    io_uring_params params{};
+    // Completions are only ever reaped by this thread, so there's no point
+    // running their task work anywhere but in our own io_uring_enter()
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    ring_fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+    if (ring_fd < 0 && errno == EINVAL) {
+        // Before Linux 6.1
+        params = {};
+        ring_fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+    }
+    if (ring_fd < 0) {
+        fail("io_uring_setup");
+    }
+    try {
+        constexpr unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+        if ((params.features & required) != required) {
+            fail("io_uring_setup", ENOSYS);
+        }
+        this->entries = params.sq_entries;
+
+        // One mapping for both queues; the submission entries themselves are separate
+        ring_memory_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                                    params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        ring_memory = map(ring_fd, ring_memory_size, IORING_OFF_SQ_RING);
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(map(ring_fd, sqes_size, IORING_OFF_SQES));
+
+        char* base = static_cast<char*>(ring_memory);
+        sq_head = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+        sq_local_tail = sq_submitted = *sq_tail;
+        // The indirection array is never used: slot i always holds entry i
+        unsigned* array = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+        for (unsigned i = 0; i < params.sq_entries; ++i) {
+            array[i] = i;
+        }
+        cq_head = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+
+        // The provided buffer ring: the kernel takes buffers from its head, we add them back at its tail
+        buffer_ring_size = buffer_count * sizeof(io_uring_buf);
+        void* memory = ::mmap(nullptr, buffer_ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (memory == MAP_FAILED) {
+            fail("mmap buffer ring");
+        }
+        buffer_ring = static_cast<io_uring_buf_ring*>(memory);
+        io_uring_buf_reg registration{};
+        registration.ring_addr = reinterpret_cast<std::uint64_t>(buffer_ring);
+        registration.ring_entries = buffer_count;
+        registration.bgid = buffer_group;
+        if (::syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+            fail("io_uring_register buffer ring");
+        }
+        buffers = std::make_unique<char[]>(buffer_count * buffer_size);
+        for (unsigned id = 0; id < buffer_count; ++id) {
+            recycle(static_cast<std::uint16_t>(id));
+        }
+    }
+    catch (...) {
+        release();
+        throw;
+    }
+}
+
+IoUring::~IoUring() {
+    release();
+}
+
+void IoUring::release() {
+    if (buffer_ring != nullptr) {
+        ::munmap(buffer_ring, buffer_ring_size);
+    }
+    if (sqes != nullptr) {
+        ::munmap(sqes, sqes_size);
+    }
+    if (ring_memory != nullptr) {
+        ::munmap(ring_memory, ring_memory_size);
+    }
+    if (ring_fd >= 0) {
+        ::close(ring_fd);
+    }
+    buffer_ring = nullptr;
+    sqes = nullptr;
+    ring_memory = nullptr;
+    ring_fd = -1;
+}
+
+io_uring_sqe& IoUring::prepare() {
+    if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == entries) {
+        submit(0, std::chrono::milliseconds(0));
+        if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == entries) {
+            // The kernel took none of them, most likely because too many completions are waiting
+            fail("io_uring submission queue full", EBUSY);
+        }
+    }
+    io_uring_sqe& sqe = sqes[sq_local_tail & sq_mask];
+    std::memset(&sqe, 0, sizeof(sqe));
+    ++sq_local_tail;
+    return sqe;
+}
+
+void IoUring::submit_and_wait(std::chrono::milliseconds timeout) {
+    submit(1, timeout);
+}
+
+void IoUring::submit(unsigned wait_for, std::chrono::milliseconds timeout) {
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    unsigned flags = 0;
+    __kernel_timespec ts{};
+    io_uring_getevents_arg arg{};
+    if (wait_for > 0) {
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        ts.tv_sec = timeout.count() / 1000;
+        ts.tv_nsec = (timeout.count() % 1000) * 1000000;
+        arg.ts = reinterpret_cast<std::uint64_t>(&ts);
+    }
+    long submitted = ::syscall(__NR_io_uring_enter, ring_fd, sq_local_tail - sq_submitted, wait_for, flags,
+                               wait_for > 0 ? &arg : nullptr, sizeof(arg));
+    if (submitted >= 0) {
+        sq_submitted += static_cast<unsigned>(submitted);
+        return;
+    }
+    // Timing out or being interrupted just means there's nothing to reap yet.
+    // Running out of memory for requests, or having the completion queue
+    // backed up, means what's left goes in next time, after reaping.
+    if (errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        fail("io_uring_enter");
+    }
+}
+
+void IoUring::recycle(std::uint16_t id) {
+    // The tail shares its slot with the first buffer's reserved field. The
+    // ring is indexed by hand since, compiled as C++, the header's flexible
+    // bufs array comes after an empty struct and so starts 8 bytes too late.
+    std::uint16_t tail = buffer_ring->tail;
+    io_uring_buf& slot = reinterpret_cast<io_uring_buf*>(buffer_ring)[tail & (buffer_count - 1)];
+    slot.addr = reinterpret_cast<std::uint64_t>(buffer(id));
+    slot.len = static_cast<std::uint32_t>(buffer_size);
+    slot.bid = id;
+    __atomic_store_n(&buffer_ring->tail, static_cast<std::uint16_t>(tail + 1), __ATOMIC_RELEASE);
+}
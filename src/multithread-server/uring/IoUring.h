@@ -0,0 +1,78 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include <linux/io_uring.h>
+
+// A minimal io_uring, set up with raw system calls rather than liburing: the
+// submission and completion queues mapped from the kernel, plus one group of
+// provided buffers that receives take from as data arrives, so a connection
+// waiting for its next request holds no buffer of its own.
+//
+// Not thread-safe; each ring belongs to one thread.
+class IoUring {
+public:
+    // The provided buffer group receives select from with IOSQE_BUFFER_SELECT
+    static constexpr std::uint16_t buffer_group = 0;
+
+    // Throws std::system_error if the kernel has no io_uring (or it's
+    // disabled) or lacks what we use of it: multishot accept and provided
+    // buffer rings, both Linux 5.19. buffer_count must be a power of two.
+    IoUring(unsigned entries, unsigned buffer_count, std::size_t buffer_size);
+    ~IoUring();
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    // A zeroed submission entry to fill in. If the queue is full, what's in it
+    // is submitted first.
+    io_uring_sqe& prepare();
+
+    // Submits everything prepared so far and waits up to timeout for at least
+    // one completion, all in one system call.
+    void submit_and_wait(std::chrono::milliseconds timeout);
+
+    // Calls handler(const io_uring_cqe&) for every completion posted so far.
+    // Each is copied out and its slot freed before the handler runs, so the
+    // handler may prepare and submit more.
+    template<class Handler>
+    void for_each_completion(Handler&& handler);
+
+    // The provided buffer a receive completed into, and how to give it back
+    char* buffer(std::uint16_t id) const { return buffers.get() + id * buffer_size; }
+    void recycle(std::uint16_t id);
+
+private:
+    void submit(unsigned wait_for, std::chrono::milliseconds timeout);
+    void release();
+
+    int ring_fd = -1;
+    unsigned entries = 0;
+
+    void* ring_memory = nullptr;
+    std::size_t ring_memory_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    std::size_t sqes_size = 0;
+
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned sq_mask = 0;
+    // Entries prepared but not yet published to the kernel
+    unsigned sq_local_tail = 0;
+    unsigned sq_submitted = 0;
+
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+
+    io_uring_buf_ring* buffer_ring = nullptr;
+    std::size_t buffer_ring_size = 0;
+    unsigned buffer_count = 0;
+    std::size_t buffer_size = 0;
+    std::unique_ptr<char[]> buffers;
+};
+
+#include "IoUring.tpp"
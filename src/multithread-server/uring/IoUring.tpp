@@ -0,0 +1,9 @@
+template<class Handler>
+void IoUring::for_each_completion(Handler&& handler) {
+    unsigned head = *cq_head;
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        io_uring_cqe cqe = cqes[head & cq_mask];
+        __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+        handler(static_cast<const io_uring_cqe&>(cqe));
+    }
+}
@@ -0,0 +1,547 @@
+#include "UringServer.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "CoreLocal.h"
+#include "IoUring.h"
+#include "Listener.h"
+#include "Routes.h"
+
+using boost::asio::ip::tcp;
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+constexpr unsigned ring_entries = 4096;
+// A receive's data is copied into its connection's ReceiveBuffer as soon as it
+// completes, so only the receives of one pass over the completions hold these
+constexpr unsigned receive_buffers = 256;
+constexpr std::size_t receive_buffer_size = 4096;
+// How long the ring waits for completions before checking deadlines and
+// shutdown again, and so roughly how late a deadline may be noticed
+constexpr std::chrono::milliseconds tick(100);
+
+// What a completion is for, in the low bits of its user_data; the rest points
+// at its Connection
+enum Op : std::uint64_t {
+    Accept = 1,
+    Receive,
+    Send,
+    Writable,
+    Delay,
+    Cancel,
+};
+constexpr std::uint64_t op_mask = 7;
+
+struct Connection {
+    Connection(int fd, const ConnectionOptions& options)
+        : fd(fd),
+          parser(options.max_header_size, options.max_body_size),
+          deadline(options),
+          accepted(clock::now())
+    {
+    }
+
+    int fd;
+    ReceiveBuffer buffer;
+    RequestParser parser;
+    RequestParser::Result result = RequestParser::Result::Incomplete;
+    ReadDeadline deadline;
+    // When the receive or send in flight gives up
+    clock::time_point expiry;
+    std::size_t requests_served = 0;
+    bool keep_alive = true;
+
+    ConnectionArena arena;
+    ResponseBatch batch{arena.get()};
+    std::size_t segment = 0;
+    std::vector<iovec> iovecs;
+    std::size_t first_iovec = 0;
+    msghdr message{};
+    off_t file_offset = 0;
+    __kernel_timespec delay{};
+    const Route* delayed_route = nullptr;
+
+    // Operations the kernel has and hasn't completed yet; the connection is
+    // only freed once there are none
+    unsigned in_flight = 0;
+    bool receiving = false;
+    bool sending = false;
+    bool timed_out = false;
+    bool closing = false;
+    std::size_t index = 0;
+
+    clock::time_point accepted;
+    clock::time_point read_done;
+    std::size_t batch_requests = 0;
+    bool first_write = true;
+};
+
+std::uint64_t tag(Connection* connection, Op op) {
+    return reinterpret_cast<std::uint64_t>(connection) | op;
+}
+
+// One thread's ring, listener and connections
+class Worker {
+public:
+    Worker(tcp::acceptor& acceptor, ServerContext& context)
+        : ring(ring_entries, receive_buffers, receive_buffer_size),
+          listener(acceptor.native_handle()),
+          context(context)
+    {
+    }
+
+    // Serves until shutdown has stopped the accept and every connection has closed
+    void run() {
+        accept();
+        while (accepting || !connections.empty()) {
+            ring.submit_and_wait(tick);
+            ring.for_each_completion([this](const io_uring_cqe& cqe) { complete(cqe); });
+            if (accepting && !cancelled_accept && context.draining()) {
+                cancel(tag(nullptr, Accept));
+                cancelled_accept = true;
+            }
+            expire(clock::now());
+        }
+    }
+
+private:
+    void complete(const io_uring_cqe& cqe) {
+        Op op = static_cast<Op>(cqe.user_data & op_mask);
+        Connection* connection = reinterpret_cast<Connection*>(cqe.user_data & ~op_mask);
+        if (op == Accept) {
+            accepted(cqe);
+            return;
+        }
+        if (op == Cancel) {
+            return;
+        }
+
+        Connection& c = *connection;
+        --c.in_flight;
+        switch (op) {
+        case Receive:
+            received(c, cqe);
+            break;
+        case Send:
+            sent(c, cqe);
+            break;
+        case Writable:
+            if (cqe.res < 0) {
+                close(c);
+            } else {
+                send_file_body(c);
+            }
+            break;
+        case Delay:
+            if (!c.closing) {
+                respond(c, *c.delayed_route);
+                process_requests(c);
+            }
+            break;
+        default:
+            break;
+        }
+        if (c.closing && c.in_flight == 0) {
+            destroy(c);
+        }
+    }
+
+    void accept() {
+        io_uring_sqe& sqe = ring.prepare();
+        sqe.opcode = IORING_OP_ACCEPT;
+        sqe.fd = listener;
+        sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe.accept_flags = SOCK_CLOEXEC;
+        sqe.user_data = tag(nullptr, Accept);
+        accepting = true;
+    }
+
+    void accepted(const io_uring_cqe& cqe) {
+        // A multishot accept stays armed until a completion says otherwise
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            accepting = false;
+        }
+        if (cqe.res >= 0) {
+            context.log.connection();
+            context.metrics.connection_opened();
+            connections.push_back(std::make_unique<Connection>(cqe.res, context.options));
+            Connection& c = *connections.back();
+            c.index = connections.size() - 1;
+            receive(c);
+        } else if (cqe.res != -ECANCELED) {
+            std::cerr << "Accept error: " << std::strerror(-cqe.res) << std::endl;
+        }
+        if (!accepting && !context.draining()) {
+            accept();
+        }
+    }
+
+    // Queues a receive into whichever provided buffer is free when data
+    // arrives. A linked one starts only once the send before it completes.
+    io_uring_sqe& prepare_receive(Connection& c) {
+        io_uring_sqe& sqe = ring.prepare();
+        sqe.opcode = IORING_OP_RECV;
+        sqe.fd = c.fd;
+        sqe.flags = IOSQE_BUFFER_SELECT;
+        sqe.buf_group = IoUring::buffer_group;
+        sqe.user_data = tag(&c, Receive);
+        ++c.in_flight;
+        c.receiving = true;
+        return sqe;
+    }
+
+    void receive(Connection& c) {
+        c.expiry = c.deadline.update(c.parser, c.buffer.size());
+        prepare_receive(c);
+    }
+
+    void received(Connection& c, const io_uring_cqe& cqe) {
+        c.receiving = false;
+        if (cqe.res > 0) {
+            auto id = static_cast<std::uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            boost::asio::mutable_buffer space = c.buffer.prepare(static_cast<std::size_t>(cqe.res));
+            std::memcpy(space.data(), ring.buffer(id), static_cast<std::size_t>(cqe.res));
+            ring.recycle(id);
+            c.buffer.commit(static_cast<std::size_t>(cqe.res));
+            if (c.closing) {
+                return;
+            }
+            c.timed_out = false;
+            c.result = c.parser.parse(c.buffer.data());
+            if (c.result == RequestParser::Result::Incomplete) {
+                receive(c);
+            } else {
+                c.read_done = clock::now();
+                process_requests(c);
+            }
+            return;
+        }
+        if (c.closing) {
+            return;
+        }
+        if (cqe.res == -ECANCELED && c.sending) {
+            // The link was broken by a short send; sent() receives again once the batch is out
+            return;
+        }
+        if (cqe.res == -ENOBUFS) {
+            // Every provided buffer was taken; they're handed back within this pass, so try again
+            receive(c);
+            return;
+        }
+        if (cqe.res == -ECANCELED && c.timed_out && c.deadline.mid_request()) {
+            // Too slow: answer with a 408 rather than just hanging up
+            c.result = c.parser.time_out();
+            c.read_done = clock::now();
+            process_requests(c);
+            return;
+        }
+        if (cqe.res < 0 && cqe.res != -ECANCELED) {
+            std::cerr << "Error: " << std::strerror(-cqe.res) << std::endl;
+        }
+        close(c);
+    }
+
+    // Answers every request the client has pipelined so far, then sends all the responses
+    void process_requests(Connection& c) {
+        while (c.keep_alive && c.result != RequestParser::Result::Incomplete) {
+            const Request& request = c.parser.request();
+            if (c.result == RequestParser::Result::Error) {
+                // There's no telling where a malformed request ends, so answer it and hang up
+                c.keep_alive = false;
+                respond(c, error_route(c.parser.error()));
+                break;
+            }
+            c.keep_alive = request.keep_alive && ++c.requests_served < context.options.max_requests
+                && !context.draining();
+
+            const Route& route = routes.find(request.method, request.path);
+            if (route.delay.count() > 0) {
+                // Simulate a slow response with a timeout in the ring; the request stays in the buffer until it fires
+                auto seconds = std::chrono::duration_cast<std::chrono::seconds>(route.delay);
+                c.delay.tv_sec = seconds.count();
+                c.delay.tv_nsec = std::chrono::nanoseconds(route.delay - seconds).count();
+                c.delayed_route = &route;
+                io_uring_sqe& sqe = ring.prepare();
+                sqe.opcode = IORING_OP_TIMEOUT;
+                sqe.fd = -1;
+                sqe.addr = reinterpret_cast<std::uint64_t>(&c.delay);
+                sqe.len = 1;
+                sqe.user_data = tag(&c, Delay);
+                ++c.in_flight;
+                return;
+            }
+            respond(c, route);
+        }
+        c.segment = 0;
+        send_segment(c);
+    }
+
+    // Queues the response to the current request, then moves on to the next one in the buffer
+    void respond(Connection& c, const Route& route) {
+        c.batch.add(context.respond(c.parser.request(), c.parser.consumed(), route), c.parser.request(), c.keep_alive);
+        ++c.batch_requests;
+        c.buffer.consume(c.parser.consumed());
+        c.parser.reset();
+        c.result = c.parser.parse(c.buffer.data());
+    }
+
+    // Sends the current segment's buffers in one sendmsg. After the last
+    // segment of a keep-alive batch, the next request's receive is linked
+    // behind it, so it starts without another trip through this loop.
+    void send_segment(Connection& c) {
+        const auto& segments = c.batch.segments();
+        if (c.segment == segments.size()) {
+            finish_batch(c);
+            return;
+        }
+        const ResponseBatch::Segment& segment = segments[c.segment];
+        c.iovecs.clear();
+        for (const boost::asio::const_buffer& buffer : segment.buffers) {
+            c.iovecs.push_back({const_cast<void*>(buffer.data()), buffer.size()});
+        }
+        c.first_iovec = 0;
+        bool link = c.keep_alive && !c.receiving && c.segment + 1 == segments.size() && segment.body_fd < 0;
+        submit_send(c, link);
+    }
+
+    void submit_send(Connection& c, bool link_receive) {
+        c.message = {};
+        c.message.msg_iov = c.iovecs.data() + c.first_iovec;
+        c.message.msg_iovlen = c.iovecs.size() - c.first_iovec;
+        c.expiry = clock::now() + context.options.write_timeout;
+        c.timed_out = false;
+
+        io_uring_sqe& sqe = ring.prepare();
+        sqe.opcode = IORING_OP_SENDMSG;
+        sqe.fd = c.fd;
+        sqe.addr = reinterpret_cast<std::uint64_t>(&c.message);
+        sqe.msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe.user_data = tag(&c, Send);
+        ++c.in_flight;
+        c.sending = true;
+        if (link_receive) {
+            sqe.flags |= IOSQE_IO_LINK;
+            prepare_receive(c);
+        }
+    }
+
+    void sent(Connection& c, const io_uring_cqe& cqe) {
+        c.sending = false;
+        if (cqe.res < 0) {
+            if (cqe.res != -ECANCELED) {
+                std::cerr << "Error: " << std::strerror(-cqe.res) << std::endl;
+            }
+            close(c);
+            return;
+        }
+        if (c.closing) {
+            return;
+        }
+
+        // Skip past whatever went out, which may end partway through a buffer
+        auto written = static_cast<std::size_t>(cqe.res);
+        while (c.first_iovec < c.iovecs.size() && written >= c.iovecs[c.first_iovec].iov_len) {
+            written -= c.iovecs[c.first_iovec++].iov_len;
+        }
+        if (c.first_iovec < c.iovecs.size()) {
+            iovec& partial = c.iovecs[c.first_iovec];
+            partial.iov_base = static_cast<char*>(partial.iov_base) + written;
+            partial.iov_len -= written;
+            submit_send(c, false);
+            return;
+        }
+
+        const ResponseBatch::Segment& segment = c.batch.segments()[c.segment];
+        if (segment.body_fd >= 0) {
+            c.file_offset = static_cast<off_t>(segment.body_offset);
+            send_file_body(c);
+            return;
+        }
+        ++c.segment;
+        send_segment(c);
+    }
+
+    // io_uring has no sendfile, so file bodies go out with sendfile(2) itself,
+    // the socket made non-blocking meanwhile, and a poll in the ring whenever it fills up
+    void send_file_body(Connection& c) {
+        if (c.closing) {
+            return;
+        }
+        const ResponseBatch::Segment& segment = c.batch.segments()[c.segment];
+        auto end = static_cast<off_t>(segment.body_offset + segment.body_size);
+        int flags = ::fcntl(c.fd, F_GETFL);
+        ::fcntl(c.fd, F_SETFL, flags | O_NONBLOCK);
+        while (c.file_offset < end) {
+            ssize_t n = ::sendfile(c.fd, segment.body_fd, &c.file_offset, static_cast<std::size_t>(end - c.file_offset));
+            if (n > 0 || (n < 0 && errno == EINTR)) {
+                continue;
+            }
+            int error = n < 0 ? errno : 0;
+            ::fcntl(c.fd, F_SETFL, flags);
+            if (error == EAGAIN) {
+                c.expiry = clock::now() + context.options.write_timeout;
+                c.timed_out = false;
+                io_uring_sqe& sqe = ring.prepare();
+                sqe.opcode = IORING_OP_POLL_ADD;
+                sqe.fd = c.fd;
+                sqe.poll32_events = POLLOUT;
+                sqe.user_data = tag(&c, Writable);
+                ++c.in_flight;
+                c.sending = true;
+                return;
+            }
+            std::cerr << "Error: " << (error != 0 ? std::strerror(error) : "file body shrank while sending") << std::endl;
+            close(c);
+            return;
+        }
+        ::fcntl(c.fd, F_SETFL, flags);
+        c.sending = false;
+        ++c.segment;
+        send_segment(c);
+    }
+
+    void finish_batch(Connection& c) {
+        auto written = clock::now();
+        if (c.first_write) {
+            context.metrics.first_byte(written - c.accepted);
+            c.first_write = false;
+        }
+        context.metrics.request_time(written - c.read_done, c.batch_requests);
+        c.batch_requests = 0;
+        c.batch.clear();
+        c.arena.reset();
+        if (!c.keep_alive) {
+            close(c);
+            return;
+        }
+        c.deadline.restart(written);
+        if (c.receiving) {
+            // Linked behind the last send, and already waiting
+            c.expiry = c.deadline.update(c.parser, c.buffer.size(), written);
+        } else {
+            receive(c);
+        }
+    }
+
+    // Cancels whatever a connection is waiting on once its deadline passes
+    void expire(clock::time_point now) {
+        for (const std::unique_ptr<Connection>& connection : connections) {
+            Connection& c = *connection;
+            if (c.closing || c.timed_out || (!c.receiving && !c.sending) || now < c.expiry) {
+                continue;
+            }
+            c.timed_out = true;
+            if (c.sending) {
+                // A linked receive is cancelled along with its send
+                cancel(tag(&c, Send));
+                cancel(tag(&c, Writable));
+            } else {
+                cancel(tag(&c, Receive));
+            }
+        }
+    }
+
+    void cancel(std::uint64_t user_data) {
+        io_uring_sqe& sqe = ring.prepare();
+        sqe.opcode = IORING_OP_ASYNC_CANCEL;
+        sqe.fd = -1;
+        sqe.addr = user_data;
+        sqe.user_data = tag(nullptr, Cancel);
+    }
+
+    // Marks c for freeing once the kernel is done with it, cancelling anything still in flight
+    void close(Connection& c) {
+        if (c.closing) {
+            return;
+        }
+        c.closing = true;
+        if (c.in_flight > 0) {
+            io_uring_sqe& sqe = ring.prepare();
+            sqe.opcode = IORING_OP_ASYNC_CANCEL;
+            sqe.fd = c.fd;
+            sqe.cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+            sqe.user_data = tag(nullptr, Cancel);
+        }
+    }
+
+    void destroy(Connection& c) {
+        ::close(c.fd);
+        context.metrics.connection_closed();
+        std::size_t index = c.index;
+        if (index + 1 != connections.size()) {
+            connections[index] = std::move(connections.back());
+            connections[index]->index = index;
+        }
+        connections.pop_back();
+    }
+
+    IoUring ring;
+    int listener;
+    ServerContext& context;
+    bool accepting = false;
+    bool cancelled_accept = false;
+    std::vector<std::unique_ptr<Connection>> connections;
+};
+
+}
+
+bool serve_io_uring(int num_threads, ServerContext& context, bool per_core) {
+    // Rings are created by the threads that use them; this one only checks the kernel supports what they need
+    try {
+        IoUring probe(8, 1, 1);
+    }
+    catch (std::system_error& e) {
+        std::cerr << "io_uring unavailable: " << e.what() << std::endl;
+        return false;
+    }
+
+    // Every listener is open before ready(), so a restart hands over all of them
+    std::vector<boost::asio::io_context> io_contexts(num_threads);
+    std::vector<tcp::acceptor> acceptors;
+    for (boost::asio::io_context& io_context : io_contexts) {
+        acceptors.push_back(open_acceptor(io_context, 7878, true));
+    }
+    Lifecycle& lifecycle = *context.lifecycle;
+    lifecycle.ready();
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < acceptors.size(); ++i) {
+        threads.emplace_back([&acceptor = acceptors[i], i, per_core, &context] {
+            try {
+                // Pinned before the ring exists, so its memory and the buffers are allocated on this core's node
+                std::optional<CoreLocal> core;
+                if (per_core) {
+                    core.emplace(i, context);
+                }
+                Worker worker(acceptor, core ? core->context() : context);
+                worker.run();
+            }
+            catch (std::exception& e) {
+                std::cerr << "Exception: " << e.what() << std::endl;
+            }
+        });
+    }
+    if (!lifecycle.drain([&context] { return context.metrics.open_connections() == 0; })) {
+        abandon_connections(context);
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    return true;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "Server.h"
+
+// --io-uring mode. As with --reuseport, every thread owns a listener on the
+// port and serves what it accepts itself, but each thread drives all its
+// connections through one io_uring: a multishot accept, receives into the
+// ring's provided buffers, and every keep-alive batch of responses sent with
+// the receive for the next request linked behind it. Everything a pass over
+// the completions starts goes to the kernel in the same io_uring_enter() that
+// waits for the next ones.
+//
+// With per_core, each thread is pinned to a core and serves from its own
+// CoreLocal replica of the context (--per-core).
+//
+// Returns false, having served nothing, if io_uring isn't usable here.
+bool serve_io_uring(int num_threads, ServerContext& context, bool per_core);
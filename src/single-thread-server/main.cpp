@@ -1,77 +1,150 @@
 // This C++ code is derived from the rust-lang book by Nicholas Matsakis and Aaron Turon.
 // Licensed under the MIT License. See LICENSE file for details.
 #include <iostream>
+#include <memory>
 #include <string>
-#include <fstream>
-#include <sstream>
+#include <utility>
 #include <vector>
 #include <boost/asio.hpp>
 #include <chrono>
 #include <thread>
-#include <iomanip>
+
+#include "HttpConnection.h"
+#include "HttpParser.h"
+#include "Lifecycle.h"
+#include "Listener.h"
+#include "ResponseCache.h"
+#include "Server.h"
+#include "StaticFiles.h"
+#include "Routes.h"
 
 using boost::asio::ip::tcp;
 
-std::string read_file_to_string(const std::string& filename) {
-    std::ifstream file(filename);
-    if (!file.is_open()) {
-        throw std::runtime_error("Could not open file " + filename);
-    }
+void handle_connection(tcp::socket socket, ServerContext& context, std::chrono::steady_clock::time_point accepted) {
+    context.log.connection();
+    context.metrics.connection_opened();
 
-    std::stringstream buffer;
-    buffer << file.rdbuf();
-    return buffer.str();
-}
-
-void handle_connection(tcp::socket socket) {
-    auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-    std::stringstream ss;
-    ss << std::put_time(std::localtime(&now), "%Y-%m-%d %X");
-    std::cout << "Thread ID: " << std::this_thread::get_id() << " - Handling request at " << ss.str() << std::endl;
     try {
-        boost::asio::streambuf buffer;
-        std::istream input_stream(&buffer);
-        boost::asio::read_until(socket, buffer, "\r\n");
-        std::string request_line;
-        std::getline(input_stream, request_line);
-        if (!request_line.empty() && request_line.back() == '\r') {
-            request_line.pop_back();
-        }
+        const ConnectionOptions& options = context.options;
+        ReceiveBuffer buffer;
+        ConnectionArena arena;
+        RequestParser parser(options.max_header_size, options.max_body_size);
+        ReadDeadline deadline(options);
+        std::size_t requests_served = 0;
+        bool keep_alive = true;
+        bool first_write = true;
 
-        std::string status_line;
-        std::string filename;
-        if (request_line == "GET / HTTP/1.1") {
-            status_line = "HTTP/1.1 200 OK";
-            filename = "../src/util/hello.html";
-        } else if (request_line == "GET /sleep HTTP/1.1") {
-            // Simulate a slow response by sleeping for 5 seconds
-            std::this_thread::sleep_for(std::chrono::seconds(5));
-            status_line = "HTTP/1.1 200 OK";
-            filename = "../src/util/hello.html";
-        } else {
-            status_line = "HTTP/1.1 404 NOT FOUND";
-            filename = "../src/util/404.html";
-        }
+        while (keep_alive) {
+            deadline.restart();
+            RequestParser::Result result = read_request(socket, buffer, parser, deadline);
+            if (result == RequestParser::Result::Incomplete) {
+                break;
+            }
+            auto read_done = std::chrono::steady_clock::now();
+
+            // Answer every request the client has pipelined so far, then send all the responses in one write.
+            // The last batch is gone by now, so its arena space can be reused.
+            arena.reset();
+            ResponseBatch batch(arena.get());
+            std::size_t batch_requests = 0;
+            while (keep_alive && result != RequestParser::Result::Incomplete) {
+                const Request& request = parser.request();
+                ++batch_requests;
+                if (result == RequestParser::Result::Error) {
+                    // There's no telling where a malformed request ends, so answer it and hang up
+                    keep_alive = false;
+                    batch.add(context.respond(request, 0, error_route(parser.error())), request, keep_alive);
+                    break;
+                }
+                keep_alive = request.keep_alive && ++requests_served < options.max_requests && !context.draining();
+
+                const Route& route = routes.find(request.method, request.path);
+                if (route.delay.count() > 0) {
+                    // Simulate a slow response by sleeping
+                    std::this_thread::sleep_for(route.delay);
+                }
+
+                batch.add(context.respond(request, parser.consumed(), route), request, keep_alive);
+                buffer.consume(parser.consumed());
+                parser.reset();
+                result = parser.parse(buffer.data());
+            }
+            write_batch(socket, batch, options.write_timeout);
 
-        std::string contents = read_file_to_string(filename);
-        std::string length = std::to_string(contents.size());
-        std::string response = status_line + "\r\nContent-Length: " + length + "\r\n\r\n" + contents;
-        boost::asio::write(socket, boost::asio::buffer(response));
+            auto written = std::chrono::steady_clock::now();
+            if (first_write) {
+                context.metrics.first_byte(written - accepted);
+                first_write = false;
+            }
+            context.metrics.request_time(written - read_done, batch_requests);
+        }
     }
     catch (std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
     }
+    context.metrics.connection_closed();
 }
 
-int main() {
+int main(int argc, char* argv[]) {
     try {
+        bool reload = false;
+        bool reuseport = false;
+        LogLevel log_level = LogLevel::Connections;
+        std::string docroot;
+        ConnectionOptions options;
+        // Only one client is served at a time, so waiting out a keep-alive client's usual idle time
+        // would stall everyone behind it. A client that sends its next request straight away keeps the
+        // connection; a slower one reconnects and waits its turn instead.
+        options.idle_timeout = std::chrono::milliseconds(100);
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--reload") {
+                reload = true;
+            } else if (arg.starts_with("--log=")) {
+                log_level = parse_log_level(arg.substr(6));
+            } else if (arg.starts_with("--docroot=")) {
+                docroot = arg.substr(10);
+            } else if (parse_connection_option(arg, options)) {
+                // Timeouts and size limits
+            } else if (arg == "--reuseport") {
+                // Lets several single-server processes share the port, with the kernel balancing between them
+                reuseport = true;
+            } else {
+                std::cerr << "Usage: " << argv[0] << " [--reuseport] [--reload] [--log=off|connections|requests]"
+                          << " [--docroot=<dir>] " << connection_options_usage << std::endl;
+                return 1;
+            }
+        }
+
+        Lifecycle lifecycle(argv, options.drain_timeout);
+
+        ResponseCache cache(reload);
+        cache.add("hello", "HTTP/1.1 200 OK", "../src/util/hello.html");
+        cache.add("not_found", "HTTP/1.1 404 NOT FOUND", "../src/util/404.html");
+        cache.add("bad_request", "HTTP/1.1 400 Bad Request", "../src/util/400.html");
+        cache.add("request_timeout", "HTTP/1.1 408 Request Timeout", "../src/util/408.html");
+        cache.add("body_too_large", "HTTP/1.1 413 Content Too Large", "../src/util/413.html");
+        cache.add("header_too_large", "HTTP/1.1 431 Request Header Fields Too Large", "../src/util/431.html");
+
+        AccessLog log(std::cout, log_level);
+        Metrics metrics(route_labels());
+        // Paths without a route of their own are looked up under the document root
+        std::unique_ptr<StaticFiles> files;
+        if (!docroot.empty()) {
+            files = std::make_unique<StaticFiles>(docroot);
+        }
+        ServerContext context{cache, log, metrics, files.get(), options, &lifecycle};
+
         boost::asio::io_context io_context;
-        tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v4(), 7878));
+        tcp::acceptor acceptor = open_acceptor(io_context, 7878, reuseport);
+
+        lifecycle.ready();
 
-        while (true) {
-            tcp::socket socket(io_context);
-            acceptor.accept(socket);
-            handle_connection(std::move(socket));
+        // Shutdown waits for nothing else: the connection being served, if any, has already finished
+        tcp::socket socket(io_context);
+        while (lifecycle.accept(acceptor, socket)) {
+            handle_connection(std::move(socket), context, std::chrono::steady_clock::now());
+            socket = tcp::socket(io_context);
         }
     }
     catch (std::exception& e) {
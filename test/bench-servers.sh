@@ -0,0 +1,21 @@
+#!/bin/sh
+# Runs the bench load generator against every server mode in turn, so their
+# numbers can be compared on the same machine. Run from the build directory;
+# any arguments are passed through to bench, e.g. --rate=5000 or --pipeline=8.
+THREADS=${THREADS:-4}
+DURATION=${DURATION:-10}
+
+for server in "./single-server" \
+              "./multi-server $THREADS" \
+              "./multi-server $THREADS --pool=work-stealing" \
+              "./multi-server $THREADS --reuseport" \
+              "./async-server $THREADS" \
+              "./coro-server $THREADS"; do
+    echo "== $server"
+    $server --log=off > /dev/null &
+    pid=$!
+    sleep 1
+    ./bench --duration="$DURATION" "$@"
+    kill "$pid"
+    wait "$pid" 2> /dev/null
+done
@@ -0,0 +1,52 @@
+# Compares two micro-benchmarks JSON files, benchmark by benchmark, on the
+# median real time of their repetitions (or the one run, without any).
+# Exits with 1 if any got more than --threshold percent slower.
+import argparse
+import json
+import sys
+
+
+def medians(path):
+    with open(path) as f:
+        benchmarks = json.load(f)["benchmarks"]
+    times = {}
+    for b in benchmarks:
+        if b.get("error_occurred"):
+            continue
+        if b.get("run_type") == "aggregate":
+            if b.get("aggregate_name") == "median":
+                times[b["run_name"]] = b["real_time"]
+        else:
+            times.setdefault(b["run_name"], b["real_time"])
+    return times
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("baseline")
+    parser.add_argument("current")
+    parser.add_argument("--threshold", type=float, default=10, help="percent slower that counts as a regression")
+    args = parser.parse_args()
+
+    baseline = medians(args.baseline)
+    current = medians(args.current)
+    regressions = []
+    width = max((len(name) for name in current), default=0)
+    for name, time in current.items():
+        if name not in baseline:
+            print(f"{name:<{width}}  {'new':>8}")
+            continue
+        change = (time - baseline[name]) / baseline[name] * 100
+        flag = ""
+        if change > args.threshold:
+            regressions.append(name)
+            flag = "  REGRESSION"
+        print(f"{name:<{width}}  {change:+7.1f}%{flag}")
+
+    if regressions:
+        print(f"{len(regressions)} benchmark(s) more than {args.threshold:g}% slower")
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
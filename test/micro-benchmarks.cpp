@@ -0,0 +1,261 @@
+// Microbenchmarks for the hot paths every server shares, plus whole requests
+// over loopback against the real servers. Run from the build directory, like
+// unit-tests; test/micro-benchmarks.sh records the results as JSON per commit
+// and compares them.
+#include <benchmark/benchmark.h>
+#include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "HttpConnection.h"
+#include "HttpParser.h"
+#include "ResponseCache.h"
+#include "Routes.h"
+#include "ThreadPool.h"
+#include "WorkStealingPool.h"
+
+extern char** environ;
+
+using boost::asio::ip::tcp;
+
+namespace {
+
+// What a browser sends for a page, give or take
+constexpr std::string_view browser_request =
+    "GET /index.html?lang=en HTTP/1.1\r\n"
+    "Host: localhost:7878\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+constexpr std::string_view minimal_request = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+void BM_parse_request(benchmark::State& state, std::string_view data) {
+    RequestParser parser;
+    for (auto _ : state) {
+        if (parser.parse(data) != RequestParser::Result::Complete) {
+            state.SkipWithError("request didn't parse");
+            break;
+        }
+        benchmark::DoNotOptimize(parser.request().header_count);
+        parser.reset();
+    }
+    state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * data.size()));
+}
+BENCHMARK_CAPTURE(BM_parse_request, minimal, minimal_request);
+BENCHMARK_CAPTURE(BM_parse_request, browser, browser_request);
+
+// A pipelined burst the way a server takes it: parse, consume, parse again
+void BM_parse_pipelined(benchmark::State& state) {
+    std::string data;
+    for (int i = 0; i < state.range(0); ++i) {
+        data += browser_request;
+    }
+    RequestParser parser;
+    for (auto _ : state) {
+        std::string_view rest = data;
+        while (parser.parse(rest) == RequestParser::Result::Complete) {
+            benchmark::DoNotOptimize(parser.request().path);
+            rest.remove_prefix(parser.consumed());
+            parser.reset();
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * data.size()));
+}
+BENCHMARK(BM_parse_pipelined)->Arg(16);
+
+void BM_router_find(benchmark::State& state, std::string_view path) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(&routes.find("GET", path));
+    }
+}
+BENCHMARK_CAPTURE(BM_router_find, root, std::string_view("/"));
+BENCHMARK_CAPTURE(BM_router_find, metrics, std::string_view("/metrics"));
+BENCHMARK_CAPTURE(BM_router_find, unmatched, std::string_view("/assets/site.css"));
+
+// Queueing a pipelined batch of cached responses, tails and all, on a fresh arena
+void BM_response_batch(benchmark::State& state) {
+    ResponseCache cache;
+    cache.add("hello", "HTTP/1.1 200 OK", "../src/util/hello.html");
+    auto response = cache.get("hello");
+    RequestParser parser;
+    parser.parse(minimal_request);
+    const Request& request = parser.request();
+
+    ConnectionArena arena;
+    for (auto _ : state) {
+        arena.reset();
+        ResponseBatch batch(arena.get());
+        for (int i = 0; i < state.range(0); ++i) {
+            batch.add(response, request, true);
+        }
+        benchmark::DoNotOptimize(batch.segments().data());
+        batch.clear();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_response_batch)->Arg(1)->Arg(16);
+
+// Tasks handed to one pool by every benchmark thread at once, counted as
+// done once a worker has run them, so the queue can't just fill up
+template<class Pool>
+void BM_pool_execute(benchmark::State& state) {
+    static Pool pool(4);
+    std::atomic<std::int64_t> done{0};
+    for (auto _ : state) {
+        pool.execute([&done] { done.fetch_add(1, std::memory_order_relaxed); });
+    }
+    while (done.load(std::memory_order_relaxed) < static_cast<std::int64_t>(state.iterations())) {
+        std::this_thread::yield();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_pool_execute, ThreadPool)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_pool_execute, WorkStealingPool)->ThreadRange(1, 8)->UseRealTime();
+
+bool port_open() {
+    boost::asio::io_context io_context;
+    tcp::socket socket(io_context);
+    boost::system::error_code ec;
+    socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), 7878), ec);
+    return !ec;
+}
+
+// One of the servers, started from the build directory and stopped with
+// SIGTERM, as a drain would stop it. Every server listens on 7878, so only
+// one can run at a time.
+class ServerProcess {
+public:
+    explicit ServerProcess(std::vector<std::string> args) : args(std::move(args)) {
+        if (port_open()) {
+            throw std::runtime_error("something is already listening on port 7878");
+        }
+        std::vector<char*> argv;
+        for (std::string& arg : this->args) {
+            argv.push_back(arg.data());
+        }
+        argv.push_back(nullptr);
+        // Startup banners would end up in the middle of --benchmark_format=json
+        posix_spawn_file_actions_t actions;
+        ::posix_spawn_file_actions_init(&actions);
+        ::posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+        int spawned = ::posix_spawn(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+        ::posix_spawn_file_actions_destroy(&actions);
+        if (spawned != 0) {
+            throw std::runtime_error("can't start " + this->args[0]);
+        }
+
+        auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (!port_open()) {
+            int status;
+            if (::waitpid(pid, &status, WNOHANG) == pid) {
+                pid = -1;
+                throw std::runtime_error(this->args[0] + " exited before it was ready");
+            }
+            if (std::chrono::steady_clock::now() > give_up) {
+                throw std::runtime_error(this->args[0] + " never started listening");
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    ServerProcess(const ServerProcess&) = delete;
+    ServerProcess& operator=(const ServerProcess&) = delete;
+
+    ~ServerProcess() {
+        if (pid > 0) {
+            ::kill(pid, SIGTERM);
+            ::waitpid(pid, nullptr, 0);
+        }
+    }
+
+    const std::vector<std::string>& command() const { return args; }
+
+private:
+    std::vector<std::string> args;
+    pid_t pid = -1;
+};
+
+// The server the loopback benchmarks are running against. Google Benchmark
+// calls them several times per run, so it's kept between calls and only
+// replaced when a benchmark wants another one.
+std::mutex server_mutex;
+std::unique_ptr<ServerProcess> server;
+
+void use_server(const std::vector<std::string>& args) {
+    std::lock_guard<std::mutex> lock(server_mutex);
+    if (!server || server->command() != args) {
+        server.reset();
+        server = std::make_unique<ServerProcess>(args);
+    }
+}
+
+// Reads one response whose length its Content-Length gives, keeping
+// anything after it in buffer
+void read_response(tcp::socket& socket, std::string& buffer) {
+    std::size_t head_end;
+    while ((head_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+        char chunk[4096];
+        buffer.append(chunk, socket.read_some(boost::asio::buffer(chunk)));
+    }
+    std::size_t length_at = buffer.find("Content-Length: ");
+    if (length_at == std::string::npos || length_at > head_end) {
+        throw std::runtime_error("response without a Content-Length");
+    }
+    std::size_t size = head_end + 4 + std::strtoul(buffer.c_str() + length_at + 16, nullptr, 10);
+    while (buffer.size() < size) {
+        char chunk[4096];
+        buffer.append(chunk, socket.read_some(boost::asio::buffer(chunk)));
+    }
+    buffer.erase(0, size);
+}
+
+// Requests for / over one keep-alive connection per benchmark thread,
+// each waiting for its response before sending the next
+void BM_loopback(benchmark::State& state, std::vector<std::string> args) {
+    try {
+        use_server(args);
+        boost::asio::io_context io_context;
+        tcp::socket socket(io_context);
+        socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), 7878));
+        socket.set_option(tcp::no_delay(true));
+        std::string buffer;
+        for (auto _ : state) {
+            boost::asio::write(socket, boost::asio::buffer(minimal_request));
+            read_response(socket, buffer);
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+    catch (std::exception& e) {
+        state.SkipWithError(e.what());
+    }
+}
+// More than the servers' max_requests per connection would have them hang up mid-run
+BENCHMARK_CAPTURE(BM_loopback, single_server, std::vector<std::string>{"./single-server", "--log=off"})
+    ->Iterations(50)->Repetitions(5)->UseRealTime();
+BENCHMARK_CAPTURE(BM_loopback, multi_server, std::vector<std::string>{"./multi-server", "4", "--log=off"})
+    ->Iterations(50)->Repetitions(5)->ThreadRange(1, 4)->UseRealTime();
+
+} // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Runs micro-benchmarks and saves the results as JSON named after the commit,
+# e.g. micro-benchmarks-1a2b3c4.json, so runs on different commits can be
+# compared. Run from the build directory, with nothing else on port 7878.
+# Given an earlier run's JSON, compares against it and fails if any
+# benchmark's median got more than THRESHOLD percent slower.
+REPETITIONS=${REPETITIONS:-5}
+THRESHOLD=${THRESHOLD:-10}
+
+commit=$(git rev-parse --short HEAD 2> /dev/null || echo unknown)
+if ! git diff --quiet HEAD 2> /dev/null; then
+    commit="$commit-dirty"
+fi
+out="micro-benchmarks-$commit.json"
+
+./micro-benchmarks --benchmark_repetitions="$REPETITIONS" --benchmark_report_aggregates_only=true \
+    --benchmark_out="$out" --benchmark_out_format=json || exit 1
+echo "Results in $out"
+
+if [ -n "$1" ]; then
+    python3 "$(dirname "$0")/compare-benchmarks.py" --threshold="$THRESHOLD" "$1" "$out"
+fi
@@ -1,8 +1,49 @@
 #define BOOST_TEST_MODULE ServerUnitTests
 #include <boost/test/included/unit_test.hpp>
 #include <boost/asio.hpp>
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <sstream>
 #include <thread>
 
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "AccessLog.h"
+#include "Compression.h"
+#include "CoreLocal.h"
+#include "Hpack.h"
+#include "Http2.h"
+#include "HttpConnection.h"
+#include "HttpParser.h"
+#ifdef HAVE_IO_URING
+#include "IoUring.h"
+#endif
+#include "Lifecycle.h"
+#include "Metrics.h"
+#include "Proxy.h"
+#include "ReceiveBuffer.h"
+#include "ResponseCache.h"
+#include "ResponseHead.h"
+#include "Routes.h"
+#include "StaticFiles.h"
+#include "Task.h"
+#include "ThreadPool.h"
+#include "Tls.h"
+#include "Upstream.h"
+#include "WorkStealingPool.h"
+
 using namespace boost::asio::ip;
 
 BOOST_AUTO_TEST_CASE(test_handle_connection_root) {
@@ -10,7 +51,7 @@ BOOST_AUTO_TEST_CASE(test_handle_connection_root) {
     tcp::socket socket(io_context);
     socket.connect(tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), 7878));
 
-    std::string request = "GET / HTTP/1.1\r\n\r\n";
+    std::string request = "GET / HTTP/1.1\r\nHost: a\r\n\r\n";
     boost::asio::write(socket, boost::asio::buffer(request));
 
     boost::asio::streambuf response;
@@ -31,7 +72,7 @@ BOOST_AUTO_TEST_CASE(test_handle_connection_404) {
     tcp::socket socket(io_context);
     socket.connect(tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), 7878));
 
-    std::string request = "GET /nonexistent HTTP/1.1\r\n\r\n";
+    std::string request = "GET /nonexistent HTTP/1.1\r\nHost: a\r\n\r\n";
     boost::asio::write(socket, boost::asio::buffer(request));
 
     boost::asio::streambuf response;
@@ -52,7 +93,7 @@ BOOST_AUTO_TEST_CASE(test_handle_connection_sleep) {
     tcp::socket socket(io_context);
     socket.connect(tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), 7878));
 
-    std::string request = "GET /sleep HTTP/1.1\r\n\r\n";
+    std::string request = "GET /sleep HTTP/1.1\r\nHost: a\r\n\r\n";
 
     auto start = std::chrono::steady_clock::now();
     boost::asio::write(socket, boost::asio::buffer(request));
@@ -74,3 +115,1412 @@ BOOST_AUTO_TEST_CASE(test_handle_connection_sleep) {
     BOOST_CHECK(elapsed_seconds.count() >= 5);
 }
 
+BOOST_AUTO_TEST_CASE(test_response_cache_reload) {
+    // The cache should serve the pre-serialized file and pick up edits only on reload
+    auto path = std::filesystem::temp_directory_path() / "response_cache_test.html";
+    std::ofstream(path) << "first";
+
+    ResponseCache cache(true, std::chrono::hours(1));
+    cache.add("page", "HTTP/1.1 200 OK", path.string());
+    BOOST_CHECK_EQUAL(cache.get("page")->bytes,
+                      "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=utf-8\r\nContent-Length: 5\r\n\r\nfirst");
+    BOOST_CHECK_EQUAL(cache.get("page")->body(), "first");
+
+    std::ofstream(path) << "second";
+    std::filesystem::last_write_time(path, std::filesystem::last_write_time(path) + std::chrono::seconds(1));
+    BOOST_CHECK_EQUAL(cache.get("page")->body(), "first");
+
+    cache.reload_changed();
+    BOOST_CHECK_EQUAL(cache.get("page")->body(), "second");
+    BOOST_CHECK_THROW(cache.get("missing"), std::out_of_range);
+
+    std::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(test_response_cache_precompresses) {
+    // Compressible files get gzip (and Brotli, when built in) variants picked by Accept-Encoding
+    auto path = std::filesystem::temp_directory_path() / "response_cache_compress.html";
+    std::string body;
+    for (int i = 0; i < 100; ++i) {
+        body += "<p>Hello, compression!</p>\n";
+    }
+    std::ofstream(path) << body;
+
+    ResponseCache cache;
+    cache.add("page", "HTTP/1.1 200 OK", path.string());
+    auto identity = cache.get("page", "");
+    BOOST_CHECK(identity->header().find("Vary: Accept-Encoding\r\n") != std::string_view::npos);
+    BOOST_CHECK_EQUAL(identity->body(), body);
+    BOOST_CHECK(cache.get("page", "gzip;q=0, identity") == identity);
+
+    auto gzipped = cache.get("page", "gzip, deflate");
+    BOOST_REQUIRE(gzipped != identity);
+    BOOST_CHECK(gzipped->header().find("Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n") != std::string_view::npos);
+    BOOST_CHECK_LT(gzipped->body_size, body.size());
+
+    std::string inflated(body.size(), '\0');
+    z_stream stream{};
+    BOOST_REQUIRE_EQUAL(inflateInit2(&stream, 15 + 16), Z_OK);
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(gzipped->body().data()));
+    stream.avail_in = static_cast<uInt>(gzipped->body().size());
+    stream.next_out = reinterpret_cast<Bytef*>(inflated.data());
+    stream.avail_out = static_cast<uInt>(inflated.size());
+    BOOST_CHECK_EQUAL(inflate(&stream, Z_FINISH), Z_STREAM_END);
+    inflateEnd(&stream);
+    BOOST_CHECK(inflated == body);
+
+    if (can_encode(Encoding::Brotli)) {
+        BOOST_CHECK(cache.get("page", "gzip, deflate, br") == identity->brotli);
+        BOOST_CHECK(cache.get("page", "br;q=0.5, gzip") == gzipped);
+    }
+
+    // Bodies that don't shrink are served as they are, without a Vary header
+    std::ofstream(path) << "x";
+    cache.add("tiny", "HTTP/1.1 200 OK", path.string());
+    BOOST_CHECK_EQUAL(cache.get("tiny", "gzip, br")->bytes,
+                      "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=utf-8\r\nContent-Length: 1\r\n\r\nx");
+
+    std::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(test_negotiate_encoding) {
+    BOOST_CHECK(negotiate_encoding("gzip, deflate, br", true, true) == Encoding::Brotli);
+    BOOST_CHECK(negotiate_encoding("gzip, deflate, br", false, true) == Encoding::Gzip);
+    BOOST_CHECK(negotiate_encoding("br;q=0.8, gzip;q=0.9", true, true) == Encoding::Gzip);
+    BOOST_CHECK(negotiate_encoding("GZIP", true, true) == Encoding::Gzip);
+    BOOST_CHECK(negotiate_encoding("*", true, true) == Encoding::Brotli);
+    BOOST_CHECK(negotiate_encoding("*;q=0, gzip", true, true) == Encoding::Gzip);
+    BOOST_CHECK(negotiate_encoding("gzip;q=0, br;q=0.000", true, true) == Encoding::Identity);
+    // A malformed weight counts as 1 rather than as whatever its characters add up to
+    BOOST_CHECK(negotiate_encoding("br;q=0.!9, gzip;q=0.5", true, true) == Encoding::Brotli);
+    BOOST_CHECK(negotiate_encoding("br;q=0.5, gzip;q=0.5000", true, true) == Encoding::Gzip);
+    BOOST_CHECK(negotiate_encoding("br;q=-1, gzip;q=0.5", true, true) == Encoding::Brotli);
+    BOOST_CHECK(negotiate_encoding("identity", true, true) == Encoding::Identity);
+    BOOST_CHECK(negotiate_encoding("deflate", true, true) == Encoding::Identity);
+}
+
+BOOST_AUTO_TEST_CASE(test_static_files) {
+    // Files under the root are served with validators; anything outside it, or missing, isn't served
+    auto root = std::filesystem::temp_directory_path() / "static_files_test";
+    std::filesystem::remove_all(root);
+    std::filesystem::create_directories(root / "docs");
+    std::ofstream(root / "docs" / "index.html") << "<h1>docs</h1>";
+    std::ofstream(root / "app.js") << "let x = 1;";
+    std::ofstream(root / "big.bin") << std::string(2048, 'b');
+    std::ofstream(root.parent_path() / "static_files_secret.txt") << "secret";
+    std::filesystem::create_symlink(root.parent_path() / "static_files_secret.txt", root / "link.txt");
+
+    StaticFiles files(root, 1024 * 1024, 1024);
+    BOOST_CHECK(files.resolve("/docs/") == std::filesystem::canonical(root / "docs" / "index.html"));
+    BOOST_CHECK(files.resolve("/%61pp.js") == std::filesystem::canonical(root / "app.js"));
+    BOOST_CHECK(!files.resolve("/../static_files_secret.txt"));
+    BOOST_CHECK(!files.resolve("/docs/%2e%2e/%2e%2e/static_files_secret.txt"));
+    BOOST_CHECK(!files.resolve("/link.txt"));
+    BOOST_CHECK(!files.resolve("/missing.html"));
+    BOOST_CHECK(!files.resolve("/app.js%00.html"));
+
+    auto get = [&files](const std::string& head) {
+        RequestParser parser;
+        BOOST_REQUIRE(parser.parse(head) == RequestParser::Result::Complete);
+        return files.get(parser.request());
+    };
+    auto response = get("GET /app.js HTTP/1.1\r\nHost: a\r\n\r\n");
+    BOOST_REQUIRE(response);
+    BOOST_CHECK_EQUAL(response->status(), 200);
+    BOOST_CHECK_EQUAL(response->body(), "let x = 1;");
+    BOOST_CHECK(response->header().find("Content-Type: text/javascript; charset=utf-8\r\n") != std::string_view::npos);
+    BOOST_CHECK(get("GET /app.js HTTP/1.1\r\nHost: a\r\n\r\n") == response);
+    BOOST_CHECK_GT(files.cached_bytes(), 10u);
+    // Spellings of the same path share its slot and mapping, and HEAD gets what GET does
+    std::size_t cached = files.cached_bytes();
+    BOOST_CHECK(get("GET /./app.js HTTP/1.1\r\nHost: a\r\n\r\n") == response);
+    BOOST_CHECK(get("GET //%61pp.js HTTP/1.1\r\nHost: a\r\n\r\n") == response);
+    BOOST_CHECK(get("HEAD /app.js HTTP/1.1\r\nHost: a\r\n\r\n") == response);
+    BOOST_CHECK_EQUAL(files.cached_bytes(), cached);
+
+    std::string_view header = response->header();
+    auto etag_start = header.find("ETag: ") + 6;
+    std::string etag(header.substr(etag_start, header.find("\r\n", etag_start) - etag_start));
+    auto modified_start = header.find("Last-Modified: ") + 15;
+    std::string modified(header.substr(modified_start, header.find("\r\n", modified_start) - modified_start));
+    BOOST_CHECK_EQUAL(get("GET /app.js HTTP/1.1\r\nHost: a\r\nIf-None-Match: \"x\", W/" + etag + "\r\n\r\n")->status(), 304);
+    BOOST_CHECK_EQUAL(get("GET /app.js HTTP/1.1\r\nHost: a\r\nIf-None-Match: \"x\"\r\n\r\n")->status(), 200);
+    BOOST_CHECK_EQUAL(get("GET /app.js HTTP/1.1\r\nHost: a\r\nIf-Modified-Since: " + modified + "\r\n\r\n")->status(), 304);
+    BOOST_CHECK_EQUAL(get("GET /app.js HTTP/1.1\r\nHost: a\r\n"
+                          "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n\r\n")->status(), 200);
+
+    // Bigger than max_file_size, so it isn't mapped and goes out with sendfile
+    auto big = get("GET /big.bin HTTP/1.1\r\nHost: a\r\n\r\n");
+    BOOST_REQUIRE(big);
+    BOOST_CHECK(big->has_file_body());
+    BOOST_CHECK_EQUAL(big->body_size, 2048u);
+    BOOST_CHECK(!get("GET /nope HTTP/1.1\r\nHost: a\r\n\r\n"));
+    BOOST_CHECK(!get("POST /app.js HTTP/1.1\r\nHost: a\r\n\r\n"));
+
+    BOOST_CHECK_EQUAL(format_http_date(784111777), "Sun, 06 Nov 1994 08:49:37 GMT");
+    BOOST_CHECK(parse_http_date("Sun, 06 Nov 1994 08:49:37 GMT") == std::optional<std::time_t>(784111777));
+    BOOST_CHECK(!parse_http_date("Sunday, 06-Nov-94 08:49:37 GMT"));
+
+    std::filesystem::remove_all(root);
+    std::filesystem::remove(root.parent_path() / "static_files_secret.txt");
+}
+
+BOOST_AUTO_TEST_CASE(test_parse_range) {
+    using Status = ByteRange::Status;
+    auto check = [](std::string_view header, Status status, std::size_t offset = 0, std::size_t length = 0) {
+        ByteRange range = parse_range(header, 1000);
+        BOOST_CHECK(range.status == status);
+        if (status == Status::Partial) {
+            BOOST_CHECK_EQUAL(range.offset, offset);
+            BOOST_CHECK_EQUAL(range.length, length);
+        }
+    };
+    check("bytes=0-499", Status::Partial, 0, 500);
+    check("bytes=500-", Status::Partial, 500, 500);
+    check("bytes=-200", Status::Partial, 800, 200);
+    check("bytes=-5000", Status::Partial, 0, 1000);
+    check("bytes=900-5000", Status::Partial, 900, 100);
+    check("bytes=1000-", Status::Unsatisfiable);
+    check("bytes=-0", Status::Unsatisfiable);
+    check("bytes=0-1,5-6", Status::Whole);
+    check("bytes=5-1", Status::Whole);
+    check("items=0-1", Status::Whole);
+    check("bytes=x-", Status::Whole);
+}
+
+BOOST_AUTO_TEST_CASE(test_static_files_ranges) {
+    // Ranges come out of the mapping for small files and via sendfile offsets for big ones
+    auto root = std::filesystem::temp_directory_path() / "static_files_range_test";
+    std::filesystem::remove_all(root);
+    std::filesystem::create_directories(root);
+    std::string contents;
+    for (int i = 0; i < 4096; ++i) {
+        contents += static_cast<char>('a' + i % 26);
+    }
+    std::ofstream(root / "small.txt") << contents.substr(0, 100);
+    std::ofstream(root / "big.bin") << contents;
+
+    StaticFiles files(root, 1024 * 1024, 1024);
+    auto get = [&files](const std::string& head) {
+        RequestParser parser;
+        BOOST_REQUIRE(parser.parse(head) == RequestParser::Result::Complete);
+        return files.get(parser.request());
+    };
+
+    auto small = get("GET /small.txt HTTP/1.1\r\nHost: a\r\nRange: bytes=10-19\r\n\r\n");
+    BOOST_CHECK_EQUAL(small->status(), 206);
+    BOOST_CHECK_EQUAL(small->body(), contents.substr(10, 10));
+    BOOST_CHECK(small->header().find("Content-Range: bytes 10-19/100\r\nContent-Length: 10\r\n") != std::string_view::npos);
+    BOOST_CHECK_EQUAL(get("GET /small.txt HTTP/1.1\r\nHost: a\r\nRange: bytes=100-\r\n\r\n")->status(), 416);
+    BOOST_CHECK_EQUAL(get("GET /small.txt HTTP/1.1\r\nHost: a\r\nRange: bytes=0-1\r\nIf-Range: \"stale\"\r\n\r\n")->status(),
+                      200);
+    auto whole = get("GET /small.txt HTTP/1.1\r\nHost: a\r\n\r\n");
+    BOOST_CHECK(whole->header().find("Accept-Ranges: bytes\r\n") != std::string_view::npos);
+
+    std::string_view header = whole->header();
+    auto etag_start = header.find("ETag: ") + 6;
+    std::string etag(header.substr(etag_start, header.find("\r\n", etag_start) - etag_start));
+    BOOST_CHECK_EQUAL(get("GET /small.txt HTTP/1.1\r\nHost: a\r\nRange: bytes=0-1\r\nIf-Range: " + etag + "\r\n\r\n")
+                          ->status(), 206);
+
+    auto big = get("GET /big.bin HTTP/1.1\r\nHost: a\r\nRange: bytes=-96\r\n\r\n");
+    BOOST_REQUIRE(big->has_file_body());
+    BOOST_CHECK_EQUAL(big->body_offset, 4000u);
+    BOOST_CHECK_EQUAL(big->body_size, 96u);
+
+    // Only the requested slice goes out on the wire
+    boost::asio::io_context io_context;
+    tcp::acceptor acceptor(io_context, tcp::endpoint(address_v4::loopback(), 0));
+    tcp::socket client(io_context);
+    client.connect(acceptor.local_endpoint());
+    tcp::socket server = acceptor.accept();
+    ResponseBatch batch;
+    RequestParser parser;
+    parser.parse("GET /big.bin HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n");
+    batch.add(big, parser.request(), false);
+    std::thread writer([&] { write_batch(server, batch); server.close(); });
+    std::string received;
+    boost::system::error_code ec;
+    boost::asio::read(client, boost::asio::dynamic_buffer(received), ec);
+    writer.join();
+    BOOST_CHECK(received.ends_with("\r\n\r\n" + contents.substr(4000)));
+
+    // A HEAD gets the same head and no body, mapped or sent from the file
+    ResponseBatch head_batch;
+    RequestParser head_parser;
+    head_parser.parse("HEAD /big.bin HTTP/1.1\r\nHost: a\r\n\r\n");
+    head_batch.add(big, head_parser.request(), true);
+    head_batch.add(get("HEAD /small.txt HTTP/1.1\r\nHost: a\r\n\r\n"), head_parser.request(), true);
+    BOOST_REQUIRE_EQUAL(head_batch.segments().size(), 1u);
+    BOOST_CHECK_EQUAL(head_batch.segments()[0].body_fd, -1);
+    BOOST_CHECK_EQUAL(head_batch.segments()[0].buffers.size(), 4u);
+
+    std::filesystem::remove_all(root);
+}
+
+BOOST_AUTO_TEST_CASE(test_static_files_lru_eviction) {
+    // The cache never holds more than its size in mapped files, dropping the least recently used first
+    auto root = std::filesystem::temp_directory_path() / "static_files_lru_test";
+    std::filesystem::remove_all(root);
+    std::filesystem::create_directories(root);
+    for (char name : std::string("abc")) {
+        std::ofstream(root / std::string(1, name)) << std::string(1000, name);
+    }
+
+    StaticFiles files(root, 3000);
+    std::map<std::string, std::shared_ptr<const CachedResponse>> first;
+    auto get = [&files](const std::string& path) {
+        std::string head = "GET " + path + " HTTP/1.1\r\nHost: a\r\n\r\n";
+        RequestParser parser;
+        parser.parse(head);
+        return files.get(parser.request());
+    };
+    for (std::string path : {"/a", "/b", "/a", "/c"}) {
+        first.emplace(path, get(path));
+        BOOST_REQUIRE(first[path]);
+        BOOST_CHECK_LE(files.cached_bytes(), 3000u);
+    }
+    // a was used more recently than b, so b went to make room for c
+    BOOST_CHECK(get("/a") == first["/a"]);
+    BOOST_CHECK(get("/c") == first["/c"]);
+    BOOST_CHECK(get("/b") != first["/b"]);
+    BOOST_CHECK_EQUAL(get("/b")->body(), std::string(1000, 'b'));
+
+    std::filesystem::remove_all(root);
+}
+
+BOOST_AUTO_TEST_CASE(test_request_parser_pipelining_and_keep_alive) {
+    // Two pipelined requests, the second still arriving
+    std::string pipelined = "GET /a?x=1 HTTP/1.1\r\nHost: a\r\n\r\nGET /sleep HTTP/1.1\r\n";
+    RequestParser parser;
+    BOOST_CHECK(parser.parse(pipelined) == RequestParser::Result::Complete);
+    BOOST_CHECK_EQUAL(parser.consumed(), 32u);
+    BOOST_CHECK_EQUAL(parser.request().method, "GET");
+    BOOST_CHECK_EQUAL(parser.request().path, "/a");
+    BOOST_CHECK_EQUAL(parser.request().query, "x=1");
+    BOOST_CHECK_EQUAL(parser.request().header("host"), "a");
+    BOOST_CHECK(parser.request().keep_alive);
+
+    std::string rest = pipelined.substr(parser.consumed());
+    parser.reset();
+    BOOST_CHECK(parser.parse(rest) == RequestParser::Result::Incomplete);
+    rest += "Host: a\r\n\r\n";
+    BOOST_CHECK(parser.parse(rest) == RequestParser::Result::Complete);
+    BOOST_CHECK_EQUAL(parser.request().path, "/sleep");
+
+    // Empty lines before a request line are skipped and consumed with it, even split across reads
+    std::string padded = "\r\n\r";
+    parser.reset();
+    BOOST_CHECK(parser.parse(padded) == RequestParser::Result::Incomplete);
+    padded += "\nGET /b HTTP/1.1\r\nHost: a\r\n\r\n";
+    BOOST_CHECK(parser.parse(padded) == RequestParser::Result::Complete);
+    BOOST_CHECK_EQUAL(parser.request().path, "/b");
+    BOOST_CHECK_EQUAL(parser.consumed(), padded.size());
+
+    // HTTP/1.1 persists unless told otherwise; HTTP/1.0 only when asked to
+    auto keep_alive = [](std::string_view request) {
+        RequestParser parser;
+        BOOST_REQUIRE(parser.parse(request) == RequestParser::Result::Complete);
+        return parser.request().keep_alive;
+    };
+    BOOST_CHECK(!keep_alive("GET / HTTP/1.1\r\nHost: a\r\nconnection: Upgrade, Close\r\n\r\n"));
+    BOOST_CHECK(!keep_alive("GET / HTTP/1.0\r\n\r\n"));
+    BOOST_CHECK(keep_alive("GET / HTTP/1.0\r\nConnection: keep-alive\r\n\r\n"));
+}
+
+BOOST_AUTO_TEST_CASE(test_request_parser_bodies_and_errors) {
+    RequestParser parser;
+    std::string request = "POST /submit HTTP/1.1\r\nHost: a\r\nContent-Length: 5\r\n\r\nhel";
+    BOOST_CHECK(parser.parse(request) == RequestParser::Result::Incomplete);
+    request += "loGET";
+    BOOST_CHECK(parser.parse(request) == RequestParser::Result::Complete);
+    BOOST_CHECK_EQUAL(parser.request().body, "hello");
+    BOOST_CHECK_EQUAL(parser.consumed(), request.size() - 3);
+
+    parser.reset();
+    std::string chunked = "POST / HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\n\r\n"
+                          "5;ext=1\r\nhello\r\n6\r\n world\r\n0\r\nTrailer: x\r\n\r\n";
+    BOOST_CHECK(parser.parse(chunked.substr(0, chunked.size() - 2)) == RequestParser::Result::Incomplete);
+    BOOST_CHECK(parser.parse(chunked) == RequestParser::Result::Complete);
+    BOOST_CHECK_EQUAL(parser.request().body, "hello world");
+    BOOST_CHECK_EQUAL(parser.consumed(), chunked.size());
+
+    auto result = [](std::string_view request) {
+        RequestParser parser(64);
+        return parser.parse(request);
+    };
+    BOOST_CHECK(result("GET /\r\n\r\n") == RequestParser::Result::Error);
+    BOOST_CHECK(result("GET / HTTP/2.0\r\n\r\n") == RequestParser::Result::Error);
+    BOOST_CHECK(result("GET / HTTP/1.1\r\nHost: a\r\nX : b\r\n\r\n") == RequestParser::Result::Error);
+    BOOST_CHECK(result("GET / HTTP/1.1\r\nHost: a\r\nA: b\r\n continued\r\n\r\n") == RequestParser::Result::Error);
+    BOOST_CHECK(result("GET / HTTP/1.1\r\nHost: a\r\nContent-Length: 1x\r\n\r\n") == RequestParser::Result::Error);
+    BOOST_CHECK(result("GET / HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: gzip\r\n\r\n") == RequestParser::Result::Error);
+    BOOST_CHECK(result("GET / HTTP/1.1\r\nHost: a\r\nX: " + std::string(100, 'a')) == RequestParser::Result::Error);
+    // HTTP/1.1 requests name exactly one host; HTTP/1.0 ones can leave it out, but not name two
+    BOOST_CHECK(result("GET / HTTP/1.1\r\n\r\n") == RequestParser::Result::Error);
+    BOOST_CHECK(result("GET / HTTP/1.1\r\nHost: a\r\nhost: b\r\n\r\n") == RequestParser::Result::Error);
+    BOOST_CHECK(result("GET / HTTP/1.0\r\nHost: a\r\nHost: a\r\n\r\n") == RequestParser::Result::Error);
+    BOOST_CHECK(result("GET / HTTP/1.0\r\n\r\n") == RequestParser::Result::Complete);
+
+    // Framing a request two ways is how it gets smuggled past a proxy that reads the other one
+    auto framing = [](std::string_view request) {
+        RequestParser parser;
+        RequestParser::Result result = parser.parse(request);
+        return result == RequestParser::Result::Error ? std::string("error") : std::string(parser.request().body);
+    };
+    BOOST_CHECK_EQUAL(framing("POST / HTTP/1.1\r\nHost: a\r\nContent-Length: 9\r\nContent-Length: 0\r\n\r\nGET / HTTP"),
+                      "error");
+    BOOST_CHECK_EQUAL(framing("POST / HTTP/1.1\r\nHost: a\r\nContent-Length: 2\r\ncontent-length: 2\r\n\r\nab"), "ab");
+    BOOST_CHECK_EQUAL(framing("POST / HTTP/1.1\r\nHost: a\r\nContent-Length: 3\r\nTransfer-Encoding: chunked\r\n\r\n"
+                              "0\r\n\r\n"),
+                      "error");
+    BOOST_CHECK_EQUAL(framing("POST / HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\nContent-Length: 3\r\n\r\n"
+                              "0\r\n\r\n"),
+                      "error");
+}
+
+BOOST_AUTO_TEST_CASE(test_request_parser_error_kinds) {
+    // Each way a request can fail maps to its own status code
+    auto error = [](std::string_view request) {
+        RequestParser parser(64, 16);
+        parser.parse(request);
+        return parser.error();
+    };
+    using Error = RequestParser::Error;
+    BOOST_CHECK(error("GET / HTTP/1.1\r\nHost: a\r\n\r\n") == Error::None);
+    BOOST_CHECK(error("GET /\r\n\r\n") == Error::Malformed);
+    BOOST_CHECK(error("GET / HTTP/1.1\r\nHost: a\r\nX: " + std::string(100, 'a')) == Error::HeadTooLarge);
+    BOOST_CHECK(error("GET / HTTP/1.1\r\nHost: a\r\nX: " + std::string(60, 'a') + "\r\n\r\n") == Error::HeadTooLarge);
+    BOOST_CHECK(error("POST / HTTP/1.1\r\nHost: a\r\nContent-Length: 17\r\n\r\n") == Error::BodyTooLarge);
+    BOOST_CHECK(error("POST / HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\n\r\n11\r\n") == Error::BodyTooLarge);
+    // A chunk size near SIZE_MAX mustn't wrap the bounds checks around and swallow what follows
+    BOOST_CHECK(error("POST / HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\n\r\n"
+                      "a\r\n0123456789\r\nfffffffffffffffe\r\n0\r\n\r\n") == Error::BodyTooLarge);
+    BOOST_CHECK(error("POST / HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\n\r\nffffffffffffffff\r\n\r\n")
+                == Error::BodyTooLarge);
+    BOOST_CHECK(&error_route(Error::Timeout) == &request_timeout_route);
+    BOOST_CHECK(&error_route(Error::Malformed) == &bad_request_route);
+
+    RequestParser parser;
+    BOOST_CHECK(parser.parse("GET / HTTP/1.1\r\nHost: a\r\n") == RequestParser::Result::Incomplete);
+    BOOST_CHECK(!parser.head_complete());
+    BOOST_CHECK(parser.time_out() == RequestParser::Result::Error);
+    BOOST_CHECK(parser.error() == Error::Timeout);
+    parser.reset();
+    BOOST_CHECK(parser.error() == Error::None);
+}
+
+BOOST_AUTO_TEST_CASE(test_read_deadline_stages) {
+    // The deadline moves from idle to header to body as a request arrives, but not on every byte
+    ConnectionOptions options;
+    BOOST_REQUIRE(parse_connection_option("--idle-timeout=100", options));
+    BOOST_REQUIRE(parse_connection_option("--header-timeout=200", options));
+    BOOST_REQUIRE(parse_connection_option("--body-timeout=300", options));
+    BOOST_REQUIRE(parse_connection_option("--max-header-size=4096", options));
+    BOOST_CHECK(!parse_connection_option("--reload", options));
+    BOOST_CHECK_EQUAL(options.max_header_size, 4096u);
+
+    using namespace std::chrono_literals;
+    auto start = std::chrono::steady_clock::now();
+    ReadDeadline deadline(options);
+    RequestParser parser;
+    deadline.restart(start);
+    BOOST_CHECK(deadline.update(parser, 0, start + 50ms) == start + 100ms);
+    BOOST_CHECK(!deadline.mid_request());
+
+    std::string request = "POST / HTTP/1.1\r\nHost: a\r\n";
+    parser.parse(request);
+    BOOST_CHECK(deadline.update(parser, request.size(), start + 60ms) == start + 260ms);
+    BOOST_CHECK(deadline.mid_request());
+    request += "X: y\r\n";
+    parser.parse(request);
+    BOOST_CHECK(deadline.update(parser, request.size(), start + 150ms) == start + 260ms);
+
+    request += "Content-Length: 5\r\n\r\nab";
+    parser.parse(request);
+    BOOST_CHECK(deadline.update(parser, request.size(), start + 200ms) == start + 500ms);
+    BOOST_CHECK(deadline.update(parser, request.size(), start + 400ms) == start + 500ms);
+
+    deadline.restart(start + 450ms);
+    BOOST_CHECK(!deadline.mid_request());
+}
+
+// Writes a throwaway self-signed P-256 certificate and its key to cert and key
+static void write_test_certificate(const std::filesystem::path& cert, const std::filesystem::path& key) {
+    EVP_PKEY* pkey = EVP_EC_gen("P-256");
+    X509* x509 = X509_new();
+    ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+    X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+    X509_gmtime_adj(X509_getm_notAfter(x509), 3600);
+    X509_set_pubkey(x509, pkey);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(x509), "CN", MBSTRING_ASC,
+                               reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+    X509_set_issuer_name(x509, X509_get_subject_name(x509));
+    X509_sign(x509, pkey, EVP_sha256());
+    FILE* file = std::fopen(cert.c_str(), "w");
+    PEM_write_X509(file, x509);
+    std::fclose(file);
+    file = std::fopen(key.c_str(), "w");
+    PEM_write_PrivateKey(file, pkey, nullptr, nullptr, 0, nullptr, nullptr);
+    std::fclose(file);
+    X509_free(x509);
+    EVP_PKEY_free(pkey);
+}
+
+BOOST_AUTO_TEST_CASE(test_tls_session_resumes_and_sends_file_bodies) {
+    // The second connection resumes the first one's session, and a file body arrives intact either way
+    auto directory = std::filesystem::temp_directory_path();
+    write_test_certificate(directory / "tls_test_cert.pem", directory / "tls_test_key.pem");
+    auto path = directory / "tls_test_body.bin";
+    std::string body(100 * 1024, 'x');
+    std::ofstream(path, std::ios::binary) << body;
+    ResponseCache cache;
+    cache.add("big", "HTTP/1.1 200 OK", path.string());
+
+    TlsOptions options;
+    options.certificate = (directory / "tls_test_cert.pem").string();
+    options.private_key = (directory / "tls_test_key.pem").string();
+    TlsServer server(options);
+
+    boost::asio::io_context io_context;
+    tcp::acceptor acceptor(io_context, tcp::endpoint(address_v4::loopback(), 0));
+    boost::asio::ssl::context client_context(boost::asio::ssl::context::tls_client);
+    SSL_SESSION* saved = nullptr;
+    for (int round = 0; round < 2; ++round) {
+        boost::asio::ssl::stream<tcp::socket> client(io_context, client_context);
+        SSL_set_alpn_protos(client.native_handle(), reinterpret_cast<const unsigned char*>("\x06spdy/3\x08http/1.1"), 16);
+        if (saved) {
+            SSL_set_session(client.native_handle(), saved);
+        }
+        client.next_layer().connect(acceptor.local_endpoint());
+
+        std::string protocol;
+        std::thread worker([&] {
+            tcp::socket socket = acceptor.accept();
+            auto session = server.accept(socket, std::chrono::seconds(5));
+            BOOST_REQUIRE(session);
+            protocol = session->protocol();
+            ReceiveBuffer buffer;
+            RequestParser parser;
+            ReadDeadline deadline{ConnectionOptions{}};
+            BOOST_CHECK(session->read_request(buffer, parser, deadline) == RequestParser::Result::Complete);
+            ResponseBatch batch;
+            batch.add(cache.get("big"), parser.request(), false);
+            session->write_batch(socket, batch, std::chrono::seconds(5));
+        });
+        client.handshake(boost::asio::ssl::stream_base::client);
+        boost::asio::write(client, boost::asio::buffer(std::string_view("GET / HTTP/1.1\r\nHost: a\r\n\r\n")));
+        std::string received;
+        boost::system::error_code ec;
+        boost::asio::read(client, boost::asio::dynamic_buffer(received), ec);
+        // Otherwise OpenSSL marks the session unfit for resumption when the client is freed
+        client.shutdown(ec);
+        worker.join();
+
+        BOOST_CHECK_EQUAL(protocol, "http/1.1");
+        BOOST_CHECK(received.ends_with("Connection: close\r\n\r\n" + body));
+        BOOST_CHECK_EQUAL(SSL_session_reused(client.native_handle()), round);
+        if (saved) {
+            SSL_SESSION_free(saved);
+        }
+        saved = SSL_get1_session(client.native_handle());
+    }
+    SSL_SESSION_free(saved);
+
+    TlsStats stats = server.stats();
+    BOOST_CHECK_EQUAL(stats.full, 1u);
+    BOOST_CHECK_EQUAL(stats.resumed, 1u);
+    BOOST_CHECK_EQUAL(stats.failed, 0u);
+    std::filesystem::remove(path);
+}
+
+std::string hex_bytes(std::string_view hex) {
+    std::string bytes;
+    for (std::size_t i = 0; i + 1 < hex.size(); i += 2) {
+        bytes += static_cast<char>(std::stoi(std::string(hex.substr(i, 2)), nullptr, 16));
+    }
+    return bytes;
+}
+
+BOOST_AUTO_TEST_CASE(test_hpack_decodes_rfc_examples) {
+    // RFC 7541 C.4: three Huffman-coded requests, the later ones referring to fields the earlier ones added
+    HpackDecoder decoder;
+    std::vector<HeaderField> fields;
+    BOOST_REQUIRE(decoder.decode(hex_bytes("828684418cf1e3c2e5f23a6ba0ab90f4ff"), fields));
+    BOOST_REQUIRE(decoder.decode(hex_bytes("828684be5886a8eb10649cbf"), fields));
+    BOOST_REQUIRE(decoder.decode(hex_bytes("828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf"), fields));
+    std::vector<std::pair<std::string, std::string>> expected{
+        {":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"},
+        {":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"},
+        {"cache-control", "no-cache"},
+        {":method", "GET"}, {":scheme", "https"}, {":path", "/index.html"}, {":authority", "www.example.com"},
+        {"custom-key", "custom-value"},
+    };
+    BOOST_REQUIRE_EQUAL(fields.size(), expected.size());
+    for (std::size_t i = 0; i < fields.size(); ++i) {
+        BOOST_CHECK_EQUAL(fields[i].name, expected[i].first);
+        BOOST_CHECK_EQUAL(fields[i].value, expected[i].second);
+    }
+
+    // What the encoder remembers costs a byte the next time; a list past the limit is told apart from garbage
+    HpackEncoder encoder;
+    std::string first, second;
+    encoder.begin(first);
+    encoder.encode("vary", "Accept-Encoding", first);
+    encoder.begin(second);
+    encoder.encode("vary", "Accept-Encoding", second);
+    BOOST_CHECK_EQUAL(second.size(), 1u);
+    fields.clear();
+    HpackDecoder small;
+    BOOST_CHECK(small.decode(first, fields) && small.decode(second, fields));
+    BOOST_CHECK(fields.size() == 2 && fields[1].value == "Accept-Encoding");
+    BOOST_CHECK(!small.decode(first, fields, 10) && small.list_too_large());
+    BOOST_CHECK(!HpackDecoder().decode("\xff", fields));
+}
+
+std::string http2_frame(std::uint8_t type, std::uint8_t flags, std::uint32_t stream, std::string_view payload) {
+    std::string frame{static_cast<char>(payload.size() >> 16), static_cast<char>(payload.size() >> 8),
+                      static_cast<char>(payload.size()), static_cast<char>(type), static_cast<char>(flags),
+                      static_cast<char>(stream >> 24), static_cast<char>(stream >> 16), static_cast<char>(stream >> 8),
+                      static_cast<char>(stream)};
+    return frame + std::string(payload);
+}
+
+struct Http2Frame {
+    std::uint8_t type;
+    std::uint8_t flags;
+    std::uint32_t stream;
+    std::string payload;
+};
+
+std::vector<Http2Frame> http2_frames(std::string_view data) {
+    std::vector<Http2Frame> frames;
+    while (data.size() >= 9) {
+        auto byte = [&](std::size_t i) { return static_cast<std::uint32_t>(static_cast<unsigned char>(data[i])); };
+        std::size_t size = byte(0) << 16 | byte(1) << 8 | byte(2);
+        frames.push_back({static_cast<std::uint8_t>(byte(3)), static_cast<std::uint8_t>(byte(4)),
+                          (byte(5) << 24 | byte(6) << 16 | byte(7) << 8 | byte(8)) & 0x7fffffff,
+                          std::string(data.substr(9, size))});
+        data.remove_prefix(9 + size);
+    }
+    return frames;
+}
+
+BOOST_AUTO_TEST_CASE(test_http2_session_bounds_replies_to_a_ping_flood) {
+    // A client that pings and never reads gets cut off rather than having its acks queued forever
+    Http2Session session;
+    BOOST_REQUIRE(session.receive(std::string(http2_preface) + http2_frame(0x4, 0, 0, "")));
+    std::string pings;
+    for (int i = 0; i < 1000; ++i) {
+        pings += http2_frame(0x6, 0, 0, "12345678");
+    }
+    bool open = true;
+    for (int i = 0; i < 1000 && open; ++i) {
+        open = session.receive(pings);
+        BOOST_REQUIRE_LT(session.output().size(), 512u * 1024);
+    }
+    BOOST_CHECK(!open);
+    BOOST_CHECK(session.finished());
+    std::vector<Http2Frame> frames = http2_frames(session.output());
+    BOOST_REQUIRE(!frames.empty());
+    BOOST_CHECK_EQUAL(frames.back().type, 0x7);
+    BOOST_CHECK_EQUAL(frames.back().payload.substr(4), std::string("\0\0\0\x0b", 4));
+}
+
+BOOST_AUTO_TEST_CASE(test_http2_session_multiplexes_streams) {
+    // Two streams answered out of order: the more urgent one's body goes first, and each ends its stream
+    ResponseCache cache;
+    cache.add("hello", "HTTP/1.1 200 OK", "../src/util/hello.html");
+    Http2Session session;
+    HpackEncoder client;
+    std::string first, second;
+    client.begin(first);
+    for (auto [name, value] : {std::pair{":method", "GET"}, {":scheme", "http"}, {":path", "/a?x=1"},
+                               {":authority", "example.com"}}) {
+        client.encode(name, value, first);
+    }
+    client.begin(second);
+    for (auto [name, value] : {std::pair{":method", "GET"}, {":scheme", "http"}, {":path", "/b"},
+                               {":authority", "example.com"}, {"priority", "u=0"}}) {
+        client.encode(name, value, second);
+    }
+    std::string input = std::string(http2_preface) + http2_frame(0x4, 0, 0, "") + http2_frame(0x1, 0x5, 1, first)
+                        + http2_frame(0x1, 0x5, 3, second) + http2_frame(0x6, 0, 0, "12345678");
+    // A byte at a time, since frames can arrive split anywhere
+    for (char c : input) {
+        BOOST_REQUIRE(session.receive(std::string_view(&c, 1)));
+    }
+    BOOST_REQUIRE(session.take_requests() == std::vector<std::uint32_t>({1, 3}));
+    BOOST_CHECK_EQUAL(session.request(1).path, "/a");
+    BOOST_CHECK_EQUAL(session.request(1).query, "x=1");
+    BOOST_CHECK_EQUAL(session.request(1).header("Host"), "example.com");
+    BOOST_CHECK(session.problem(3) == Http2Session::Problem::None);
+
+    session.respond(1, cache.get("hello"));
+    session.respond(3, cache.get("hello"));
+    session.produce(1024 * 1024);
+    std::vector<Http2Frame> frames = http2_frames(session.output());
+    session.sent(session.output().size());
+    BOOST_CHECK_EQUAL(session.open_streams(), 0u);
+
+    std::vector<std::uint32_t> data_streams;
+    HpackDecoder decoder;
+    std::string body;
+    for (const Http2Frame& frame : frames) {
+        if (frame.type == 0x1) {
+            std::vector<HeaderField> fields;
+            BOOST_REQUIRE(decoder.decode(frame.payload, fields));
+            BOOST_CHECK(fields.at(0).name == ":status" && fields[0].value == "200");
+        } else if (frame.type == 0x0) {
+            BOOST_CHECK(frame.flags & 0x1);
+            data_streams.push_back(frame.stream);
+            body = frame.payload;
+        }
+    }
+    BOOST_CHECK(frames.at(0).type == 0x4 && frames.at(0).flags == 0);
+    BOOST_CHECK(std::any_of(frames.begin(), frames.end(), [](const Http2Frame& frame) {
+        return frame.type == 0x6 && frame.flags == 0x1 && frame.payload == "12345678";
+    }));
+    BOOST_CHECK(data_streams == std::vector<std::uint32_t>({3, 1}));
+    BOOST_CHECK(body == cache.get("hello")->body());
+
+    // Streams are the client's to open with odd ids only; breaking that ends the connection with a GOAWAY
+    BOOST_CHECK(!session.receive(http2_frame(0x1, 0x5, 2, first)));
+    BOOST_CHECK(session.finished());
+    frames = http2_frames(session.output());
+    BOOST_REQUIRE(!frames.empty());
+    BOOST_CHECK(frames.back().type == 0x7 && frames.back().payload.substr(4) == std::string("\0\0\0\x01", 4));
+}
+
+BOOST_AUTO_TEST_CASE(test_read_request_times_out) {
+    // A client that starts a request and stalls gets a Timeout error; one that sends nothing is just dropped
+    boost::asio::io_context io_context;
+    tcp::acceptor acceptor(io_context, tcp::endpoint(address_v4::loopback(), 0));
+    tcp::socket client(io_context);
+    client.connect(acceptor.local_endpoint());
+    tcp::socket server = acceptor.accept();
+
+    ConnectionOptions options;
+    options.idle_timeout = std::chrono::milliseconds(20);
+    options.header_timeout = std::chrono::milliseconds(20);
+    ReceiveBuffer buffer;
+    RequestParser parser;
+    ReadDeadline deadline(options);
+    BOOST_CHECK(read_request(server, buffer, parser, deadline) == RequestParser::Result::Incomplete);
+
+    boost::asio::write(client, boost::asio::buffer(std::string_view("GET / HTTP/1.1\r\nHost: a\r\n")));
+    deadline.restart();
+    BOOST_CHECK(read_request(server, buffer, parser, deadline) == RequestParser::Result::Error);
+    BOOST_CHECK(parser.error() == RequestParser::Error::Timeout);
+}
+
+BOOST_AUTO_TEST_CASE(test_lifecycle_stop_and_drain) {
+    // Stopping wakes a blocked accept, runs the stop callbacks, and bounds the drain
+    Lifecycle lifecycle(nullptr, std::chrono::milliseconds(50));
+    boost::asio::io_context io_context;
+    tcp::acceptor acceptor(io_context, tcp::endpoint(address_v4::loopback(), 0));
+    tcp::socket client(io_context);
+    client.connect(acceptor.local_endpoint());
+    tcp::socket socket(io_context);
+    BOOST_CHECK(lifecycle.accept(acceptor, socket));
+
+    std::atomic<int> callbacks = 0;
+    lifecycle.on_stop([&callbacks] { ++callbacks; });
+    std::thread stopper([&lifecycle] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        lifecycle.stop();
+    });
+    tcp::socket next(io_context);
+    BOOST_CHECK(!lifecycle.accept(acceptor, next));
+    stopper.join();
+    BOOST_CHECK(lifecycle.stopping());
+    BOOST_CHECK_EQUAL(callbacks.load(), 1);
+
+    BOOST_CHECK(lifecycle.drain([] { return true; }));
+    auto start = std::chrono::steady_clock::now();
+    BOOST_CHECK(!lifecycle.drain([] { return false; }));
+    BOOST_CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+
+    // A second stop, like a second SIGTERM, ends a drain straight away
+    lifecycle.stop();
+    BOOST_CHECK_EQUAL(callbacks.load(), 1);
+    BOOST_CHECK(!lifecycle.drain([] { return false; }));
+}
+
+#ifdef HAVE_IO_URING
+BOOST_AUTO_TEST_CASE(test_io_uring_provided_buffer_receives) {
+    // Each receive lands in a buffer from the ring; recycling one makes it available again
+    std::unique_ptr<IoUring> ring;
+    try {
+        ring = std::make_unique<IoUring>(8, 2, 16);
+    }
+    catch (std::system_error& e) {
+        BOOST_TEST_MESSAGE("io_uring unavailable, skipping: " << e.what());
+        return;
+    }
+    int sockets[2];
+    BOOST_REQUIRE_EQUAL(::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+
+    std::vector<std::string> received;
+    for (std::string_view message : {"first", "second", "third"}) {
+        BOOST_REQUIRE_EQUAL(::write(sockets[1], message.data(), message.size()), static_cast<ssize_t>(message.size()));
+        io_uring_sqe& sqe = ring->prepare();
+        sqe.opcode = IORING_OP_RECV;
+        sqe.fd = sockets[0];
+        sqe.flags = IOSQE_BUFFER_SELECT;
+        sqe.buf_group = IoUring::buffer_group;
+        sqe.user_data = 42;
+        ring->submit_and_wait(std::chrono::seconds(1));
+        ring->for_each_completion([&](const io_uring_cqe& cqe) {
+            BOOST_CHECK_EQUAL(cqe.user_data, 42u);
+            BOOST_REQUIRE_GT(cqe.res, 0);
+            auto id = static_cast<std::uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            received.emplace_back(ring->buffer(id), static_cast<std::size_t>(cqe.res));
+            ring->recycle(id);
+        });
+    }
+    BOOST_CHECK((received == std::vector<std::string>{"first", "second", "third"}));
+    ::close(sockets[0]);
+    ::close(sockets[1]);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(test_upstream_response_framing) {
+    ResponseHeadParser parser;
+    std::string response = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nConnection: keep-alive\r\n\r\nhello";
+    BOOST_CHECK(parser.parse(std::string_view(response).substr(0, 20), false) == ResponseHeadParser::Result::Incomplete);
+    BOOST_REQUIRE(parser.parse(response, false) == ResponseHeadParser::Result::Complete);
+    BOOST_CHECK_EQUAL(parser.status(), 200);
+    BOOST_CHECK_EQUAL(parser.reason(), "OK");
+    BOOST_CHECK_EQUAL(parser.head_size(), response.size() - 5);
+    BOOST_CHECK(parser.framing() == ResponseHeadParser::Framing::Length);
+    BOOST_CHECK_EQUAL(parser.content_length(), 5);
+    BOOST_CHECK(parser.keep_alive());
+    BOOST_CHECK_EQUAL(parser.header_count(), 2);
+
+    // The same response to a HEAD has no body, whatever its Content-Length says
+    parser.reset();
+    BOOST_REQUIRE(parser.parse(response, true) == ResponseHeadParser::Result::Complete);
+    BOOST_CHECK(parser.framing() == ResponseHeadParser::Framing::None);
+
+    parser.reset();
+    BOOST_REQUIRE(parser.parse("HTTP/1.1 200 OK\r\nTransfer-Encoding: gzip, chunked\r\n\r\n", false)
+                  == ResponseHeadParser::Result::Complete);
+    BOOST_CHECK(parser.framing() == ResponseHeadParser::Framing::Chunked);
+
+    // Neither length nor chunks: the body runs until the backend closes, so the connection can't be reused
+    parser.reset();
+    BOOST_REQUIRE(parser.parse("HTTP/1.0 200 OK\r\n\r\n", false) == ResponseHeadParser::Result::Complete);
+    BOOST_CHECK(parser.framing() == ResponseHeadParser::Framing::Close);
+    BOOST_CHECK(!parser.keep_alive());
+
+    parser.reset();
+    BOOST_REQUIRE(parser.parse("HTTP/1.1 100 Continue\r\n\r\n", false) == ResponseHeadParser::Result::Complete);
+    BOOST_CHECK_EQUAL(parser.status(), 100);
+    BOOST_CHECK(parser.framing() == ResponseHeadParser::Framing::None);
+
+    parser.reset();
+    BOOST_CHECK(parser.parse("HTTP/1.1 20 OK\r\n\r\n", false) == ResponseHeadParser::Result::Error);
+    parser.reset();
+    BOOST_CHECK(parser.parse("HTTP/1.1 200 OK\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\n", false)
+                == ResponseHeadParser::Result::Error);
+
+    BOOST_CHECK(is_hop_by_hop("connection"));
+    BOOST_CHECK(is_hop_by_hop("Transfer-Encoding"));
+    BOOST_CHECK(!is_hop_by_hop("Content-Length"));
+}
+
+BOOST_AUTO_TEST_CASE(test_chunked_scanner_finds_the_end) {
+    std::string body = "5;name=value\r\nhello\r\n10\r\n0123456789abcdef\r\n0\r\nTrailer: x\r\n\r\n";
+    std::string next = "HTTP/1.1 200 OK\r\n";
+
+    // Fed a byte at a time it still stops exactly at the end of the body
+    ChunkedScanner bytewise;
+    std::string all = body + next;
+    std::size_t taken = 0;
+    for (std::size_t i = 0; i < all.size() && !bytewise.done(); ++i) {
+        taken += bytewise.scan(std::string_view(all).substr(i, 1));
+    }
+    BOOST_CHECK(bytewise.done());
+    BOOST_CHECK_EQUAL(taken, body.size());
+
+    ChunkedScanner whole;
+    BOOST_CHECK_EQUAL(whole.scan(all), body.size());
+    BOOST_CHECK(whole.done());
+
+    ChunkedScanner bad;
+    bad.scan("5\r\nhelloXX");
+    BOOST_CHECK(bad.failed());
+    ChunkedScanner no_size;
+    no_size.scan("\r\n");
+    BOOST_CHECK(no_size.failed());
+}
+
+BOOST_AUTO_TEST_CASE(test_upstream_pool_balancing) {
+    ProxyOptions options;
+    BOOST_REQUIRE(parse_proxy_option("--proxy=/api=127.0.0.1:9001,127.0.0.1:9002,127.0.0.1:9003", options));
+    BOOST_CHECK(!parse_proxy_option("--reload", options));
+    BOOST_CHECK_THROW(parse_proxy_option("--proxy-balance=random", options), std::invalid_argument);
+    BOOST_CHECK_EQUAL(options.prefix, "/api");
+    BOOST_CHECK_EQUAL(options.backends.size(), 3);
+
+    boost::asio::io_context io_context;
+    {
+        UpstreamPool pool(io_context, options);
+        BOOST_CHECK(pool.matches("/api/users"));
+        BOOST_CHECK(pool.matches("/api"));
+        BOOST_CHECK(pool.matches("/api?q=1"));
+        BOOST_CHECK(!pool.matches("/"));
+        BOOST_CHECK(!pool.matches("/apiary"));
+
+        // Round-robin skips the backend that's down, and its turn goes to the next one
+        pool.backend(1).healthy = false;
+        std::vector<std::string> order;
+        for (int i = 0; i < 4; ++i) {
+            UpstreamPool::Backend* backend = pool.acquire();
+            BOOST_REQUIRE(backend != nullptr);
+            order.push_back(backend->name);
+            pool.release(*backend, std::nullopt);
+        }
+        BOOST_CHECK(order == (std::vector<std::string>{"127.0.0.1:9001", "127.0.0.1:9003", "127.0.0.1:9001",
+                                                        "127.0.0.1:9003"}));
+        pool.backend(0).healthy = false;
+        pool.backend(2).healthy = false;
+        BOOST_CHECK(pool.acquire() == nullptr);
+    }
+
+    BOOST_REQUIRE(parse_proxy_option("--proxy-balance=least-connections", options));
+    UpstreamPool pool(io_context, options);
+    // Whichever has the fewest requests in flight gets the next one
+    UpstreamPool::Backend* first = pool.acquire();
+    UpstreamPool::Backend* second = pool.acquire();
+    UpstreamPool::Backend* third = pool.acquire();
+    BOOST_CHECK(first != second && second != third && first != third);
+    pool.release(*second, std::nullopt);
+    BOOST_CHECK_EQUAL(pool.acquire(), second);
+    // A failed request takes its backend out of rotation
+    pool.release(*first, std::nullopt, true);
+    BOOST_CHECK(!first->healthy);
+}
+
+BOOST_AUTO_TEST_CASE(test_proxy_retries_only_what_is_safe_to_repeat) {
+    // A backend that answers the first request on a connection, then reads the
+    // next one and hangs up without answering, as if it crashed after acting on it.
+    // Any other connection gets its one request answered.
+    auto run = [](std::string_view method) {
+        boost::asio::io_context backend_context;
+        tcp::acceptor backend(backend_context, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+        std::atomic<int> received{0};
+        std::thread server([&] {
+            auto read_request = [&](tcp::socket& socket) {
+                boost::asio::streambuf data;
+                boost::system::error_code ec;
+                boost::asio::read_until(socket, data, "\r\n\r\n", ec);
+                if (!ec) {
+                    ++received;
+                }
+                return !ec;
+            };
+            std::string_view ok = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+            tcp::socket first = backend.accept();
+            read_request(first);
+            boost::asio::write(first, boost::asio::buffer(ok));
+            read_request(first);
+            first.close();
+
+            boost::system::error_code ec;
+            backend.non_blocking(true);
+            auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+            while (std::chrono::steady_clock::now() < give_up) {
+                tcp::socket retry = backend.accept(ec);
+                if (!ec) {
+                    retry.non_blocking(false);
+                    if (read_request(retry)) {
+                        boost::asio::write(retry, boost::asio::buffer(ok));
+                    }
+                    break;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+        });
+
+        ProxyOptions options;
+        BOOST_REQUIRE(parse_proxy_option("--proxy=/api=127.0.0.1:" + std::to_string(backend.local_endpoint().port()),
+                                         options));
+        boost::asio::io_context io_context;
+        UpstreamPool pool(io_context, options);
+        tcp::acceptor listener(io_context, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+        tcp::socket peer(io_context);
+        peer.connect(listener.local_endpoint());
+        tcp::socket client = listener.accept();
+
+        auto exchange = [&](std::string text) {
+            RequestParser parser;
+            BOOST_REQUIRE(parser.parse(text) == RequestParser::Result::Complete);
+            ProxyExchange::Outcome outcome;
+            ProxyExchange::start(client, pool, parser.request(), true, std::chrono::seconds(1),
+                                 [&](const ProxyExchange::Outcome& result) { outcome = result; });
+            io_context.restart();
+            io_context.run();
+            return outcome;
+        };
+        BOOST_CHECK(exchange("GET /api/a HTTP/1.1\r\nHost: a\r\n\r\n").relayed);
+        ProxyExchange::Outcome second =
+            exchange(std::string(method) + " /api/b HTTP/1.1\r\nHost: a\r\nContent-Length: 4\r\n\r\nbody");
+        pool.stop();
+        server.join();
+        return std::make_pair(second, received.load());
+    };
+
+    // The POST reached the backend, so it isn't sent again
+    auto [post, post_received] = run("POST");
+    BOOST_CHECK(!post.relayed);
+    BOOST_CHECK_EQUAL(post.status, 502);
+    BOOST_CHECK_EQUAL(post_received, 2);
+
+    auto [put, put_received] = run("PUT");
+    BOOST_CHECK(put.relayed);
+    BOOST_CHECK_EQUAL(put.status, 200);
+    BOOST_CHECK_EQUAL(put_received, 3);
+}
+
+BOOST_AUTO_TEST_CASE(test_find_char) {
+    // Matches in the SIMD blocks and in the scalar tail
+    std::string data(40, 'a');
+    BOOST_CHECK(find_char(data.data(), data.data() + data.size(), '\r') == data.data() + data.size());
+    for (std::size_t i : {0u, 15u, 16u, 31u, 39u}) {
+        std::string s = data;
+        s[i] = '\r';
+        BOOST_CHECK_EQUAL(find_char(s.data(), s.data() + s.size(), '\r') - s.data(), static_cast<std::ptrdiff_t>(i));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_router_dispatch) {
+    // Lookups work at compile time and fall back on any mismatch of method or path
+    static_assert(routes.find("GET", "/sleep").delay == std::chrono::seconds(5));
+    static_assert(routes.find("POST", "/").response == "not_found");
+    static_assert(&routes.find("HEAD", "/metrics") == &routes.find("GET", "/metrics"));
+    static_assert(&routes.find("HEAD", "/sleep") == &routes.find("GET", "/sleep"));
+
+    constexpr Router many(std::array{
+        Route{"GET", "/a", "a"}, Route{"GET", "/b", "b"}, Route{"POST", "/a", "c"},
+        Route{"GET", "/status", "d"}, Route{"DELETE", "/a/b/c", "e"},
+    }, Route{"", "", "none"});
+    BOOST_CHECK_EQUAL(many.find("GET", "/a").response, "a");
+    BOOST_CHECK_EQUAL(many.find("POST", "/a").response, "c");
+    BOOST_CHECK_EQUAL(many.find("DELETE", "/a/b/c").response, "e");
+    BOOST_CHECK_EQUAL(many.find("GET", "/status/").response, "none");
+    BOOST_CHECK_EQUAL(many.find("GET", "").response, "none");
+    // HEAD goes wherever GET does, and nowhere else
+    BOOST_CHECK_EQUAL(many.find("HEAD", "/b").response, "b");
+    BOOST_CHECK_EQUAL(many.find("HEAD", "/a/b/c").response, "none");
+    BOOST_CHECK_EQUAL(routes.find("HEAD", "/").response, "hello");
+}
+
+BOOST_AUTO_TEST_CASE(test_core_local_replicates_the_cache) {
+    ResponseCache cache;
+    cache.add("hello", "HTTP/1.1 200 OK", "../src/util/hello.html");
+    AccessLog log(std::cout, LogLevel::Off);
+    Metrics metrics({"hello"});
+    ConnectionOptions options;
+    ServerContext shared{cache, log, metrics, nullptr, options, nullptr};
+
+    std::vector<int> cpus = allowed_cpus();
+    BOOST_REQUIRE(!cpus.empty());
+    std::thread([&] {
+        CoreLocal core(cpus.size(), shared);
+        BOOST_CHECK_EQUAL(core.cpu(), cpus[0]);
+        BOOST_CHECK_EQUAL(::sched_getcpu(), cpus[0]);
+
+        auto original = cache.get("hello");
+        auto replica = core.context().cache.get("hello");
+        BOOST_CHECK_NE(original.get(), replica.get());
+        BOOST_CHECK_EQUAL(original->bytes, replica->bytes);
+        BOOST_CHECK_EQUAL(&core.context().metrics, &metrics);
+    }).join();
+}
+
+BOOST_AUTO_TEST_CASE(test_access_log_drains_every_thread) {
+    ResponseCache cache;
+    cache.add("not_found", "HTTP/1.1 404 NOT FOUND", "../src/util/404.html");
+    RequestParser parser;
+    parser.parse("GET /missing HTTP/1.1\r\nHost: a\r\n\r\n");
+
+    std::ostringstream out;
+    {
+        AccessLog log(out, LogLevel::Requests);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; ++i) {
+            threads.emplace_back([&] {
+                for (int j = 0; j < 100; ++j) {
+                    log.connection();
+                    log.request(parser.request(), *cache.get("not_found"));
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        BOOST_CHECK_EQUAL(log.dropped(), 0u);
+    }
+    std::string text = out.str();
+    BOOST_CHECK_EQUAL(std::count(text.begin(), text.end(), '\n'), 800);
+    {
+        // Threads that have exited hand their rings on, as an adaptive pool's retiring workers do
+        std::ostringstream churn;
+        AccessLog log(churn, LogLevel::Connections);
+        for (int i = 0; i < 20; ++i) {
+            std::thread([&] { log.connection(); }).join();
+        }
+        BOOST_CHECK_EQUAL(log.ring_count(), 1u);
+        log.flush();
+        std::string lines = churn.str();
+        BOOST_CHECK_EQUAL(std::count(lines.begin(), lines.end(), '\n'), 20);
+    }
+    BOOST_CHECK_EQUAL(std::count(text.begin(), text.end(), '"'), 800);
+    BOOST_CHECK(text.find("\"GET /missing\" 404 ") != std::string::npos);
+
+    std::ostringstream quiet;
+    {
+        AccessLog log(quiet, LogLevel::Connections);
+        log.request(parser.request(), *cache.get("not_found"));
+    }
+    {
+        AccessLog log(quiet, LogLevel::Off);
+        log.connection();
+    }
+    BOOST_CHECK(quiet.str().empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_metrics_sum_shards) {
+    Metrics metrics({"GET /", "unmatched"});
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([&metrics] {
+            for (int j = 0; j < 1000; ++j) {
+                metrics.connection_opened();
+                metrics.request(0, 200, 20, 100);
+                metrics.request(1, 418, 10, 50);
+                metrics.request_time(std::chrono::microseconds(j));
+                metrics.connection_closed();
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    metrics.connection_opened();
+    metrics.first_byte(std::chrono::seconds(100));
+    metrics.add_gauge("answer", "The answer.", [] { return 42.0; });
+
+    std::string text = metrics.render();
+    BOOST_CHECK(text.find("http_requests_total{route=\"GET /\",status=\"200\"} 4000\n") != std::string::npos);
+    BOOST_CHECK(text.find("http_requests_total{route=\"unmatched\",status=\"other\"} 4000\n") != std::string::npos);
+    BOOST_CHECK(text.find("http_connections_total 4001\n") != std::string::npos);
+    BOOST_CHECK(text.find("http_connections_in_flight 1\n") != std::string::npos);
+    BOOST_CHECK(text.find("http_request_bytes_total 120000\n") != std::string::npos);
+    BOOST_CHECK(text.find("http_response_bytes_total 600000\n") != std::string::npos);
+    // 0..3 us land in exact buckets; 1000 us is in [896, 1024)
+    BOOST_CHECK(text.find("http_request_duration_seconds_bucket{le=\"0.000001\"} 4\n") != std::string::npos);
+    BOOST_CHECK(text.find("http_request_duration_seconds_bucket{le=\"0.000896\"} 3584\n") != std::string::npos);
+    BOOST_CHECK(text.find("http_request_duration_seconds_count 4000\n") != std::string::npos);
+    // Anything past the largest bucket is still counted under +Inf
+    BOOST_CHECK(text.find("http_first_byte_seconds_bucket{le=\"50.331648\"} 0\n") != std::string::npos);
+    BOOST_CHECK(text.find("http_first_byte_seconds_bucket{le=\"+Inf\"} 1\n") != std::string::npos);
+    BOOST_CHECK(text.find("answer 42") != std::string::npos);
+
+    auto response = metrics.response();
+    BOOST_CHECK_EQUAL(response->status(), 200);
+    BOOST_CHECK_EQUAL(response->body_size, response->body().size());
+}
+
+BOOST_AUTO_TEST_CASE(test_receive_buffer_recycles_blocks) {
+    const char* block;
+    {
+        ReceiveBuffer buffer;
+        auto space = buffer.prepare(4096);
+        block = static_cast<const char*>(space.data());
+        std::memcpy(space.data(), "GET / HTTP/1.1\r\n\r\n", 18);
+        buffer.commit(18);
+        BOOST_CHECK_EQUAL(buffer.data(), "GET / HTTP/1.1\r\n\r\n");
+        buffer.consume(4);
+        BOOST_CHECK_EQUAL(buffer.data().substr(0, 1), "/");
+    }
+    // The next connection on this thread gets the same block back
+    ReceiveBuffer buffer;
+    BOOST_CHECK(static_cast<const char*>(buffer.prepare(1).data()) == block);
+
+    // Filling past the block moves to a bigger buffer, keeping what's unconsumed
+    buffer.commit(1);
+    std::string body(ReceiveBuffer::block_size, 'x');
+    auto space = buffer.prepare(body.size());
+    std::memcpy(space.data(), body.data(), body.size());
+    buffer.commit(body.size());
+    BOOST_CHECK_EQUAL(buffer.size(), body.size() + 1);
+    BOOST_CHECK(buffer.data().substr(1) == body);
+}
+
+BOOST_AUTO_TEST_CASE(test_response_batch_uses_arena) {
+    // Queueing a pipelined burst fits in the inline arena, so it never reaches an upstream allocator
+    ResponseCache cache;
+    cache.add("not_found", "HTTP/1.1 404 NOT FOUND", "../src/util/404.html");
+    RequestParser parser;
+    parser.parse("GET / HTTP/1.1\r\nHost: a\r\n\r\n");
+
+    alignas(std::max_align_t) std::byte storage[ConnectionArena::inline_size];
+    std::pmr::monotonic_buffer_resource arena(storage, sizeof(storage), std::pmr::null_memory_resource());
+    for (int round = 0; round < 3; ++round) {
+        ResponseBatch batch(&arena);
+        for (int i = 0; i < 16; ++i) {
+            batch.add(cache.get("not_found"), parser.request(), true);
+        }
+        BOOST_CHECK_EQUAL(batch.segments().size(), 1u);
+        BOOST_CHECK_EQUAL(batch.segments()[0].buffers.size(), 48u);
+        batch.clear();
+        arena.release();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_response_batch_sendfile) {
+    // A body above the sendfile threshold should reach the client intact after the in-memory header
+    auto path = std::filesystem::temp_directory_path() / "response_batch_test.bin";
+    std::string body(256 * 1024, 'x');
+    std::ofstream(path, std::ios::binary) << body;
+
+    ResponseCache cache;
+    cache.add("big", "HTTP/1.1 200 OK", path.string());
+    BOOST_CHECK(cache.get("big")->has_file_body());
+
+    boost::asio::io_context io_context;
+    tcp::acceptor acceptor(io_context, tcp::endpoint(address_v4::loopback(), 0));
+    tcp::socket client(io_context);
+    client.connect(acceptor.local_endpoint());
+    tcp::socket server = acceptor.accept();
+
+    ResponseBatch batch;
+    RequestParser parser;
+    parser.parse("GET / HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n");
+    batch.add(cache.get("big"), parser.request(), parser.request().keep_alive);
+    std::thread writer([&] { write_batch(server, batch); server.close(); });
+
+    std::string received;
+    boost::system::error_code ec;
+    boost::asio::read(client, boost::asio::dynamic_buffer(received), ec);
+    writer.join();
+
+    // The cached head, then the batch's Server, Date and Connection lines
+    std::string header = "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nVary: Accept-Encoding\r\n"
+                         "Content-Length: 262144\r\nServer: cpp-web-servers\r\nDate: ";
+    std::string tail = " GMT\r\nConnection: close\r\n\r\n";
+    BOOST_CHECK(ec == boost::asio::error::eof);
+    BOOST_REQUIRE(received.size() == header.size() + DateClock::size + tail.size() - 4 + body.size());
+    BOOST_CHECK(received.starts_with(header));
+    std::optional<std::time_t> date = parse_http_date(received.substr(header.size(), DateClock::size));
+    BOOST_REQUIRE(date);
+    BOOST_CHECK(std::abs(*date - std::time(nullptr)) <= 2);
+    BOOST_CHECK(received.substr(header.size() + DateClock::size - 4) == tail + body);
+
+    std::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(test_date_clock_reads_whole_values) {
+    // Readers racing the once-a-second update always get a complete date, never half of two
+    std::atomic<bool> torn{false};
+    std::vector<std::thread> readers;
+    auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(1200);
+    for (int i = 0; i < 4; ++i) {
+        readers.emplace_back([&] {
+            while (std::chrono::steady_clock::now() < until) {
+                if (!parse_http_date(DateClock::instance().now())) {
+                    torn = true;
+                }
+            }
+        });
+    }
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+    BOOST_CHECK(!torn);
+
+    std::string digits = "Content-Length: ";
+    append_decimal(digits, 0);
+    append_decimal(digits, 18446744073709551615u);
+    BOOST_CHECK_EQUAL(digits, "Content-Length: 018446744073709551615");
+}
+
+BOOST_AUTO_TEST_CASE(test_work_stealing_pool_runs_every_task) {
+    // Tasks submitted from outside and from inside workers all run before the pool is destroyed
+    std::atomic<int> count{0};
+    {
+        WorkStealingPool pool(4);
+        for (int i = 0; i < 10000; ++i) {
+            pool.execute([&pool, &count] {
+                count.fetch_add(1);
+                pool.execute([&count] { count.fetch_add(1); });
+            });
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    BOOST_CHECK_EQUAL(count.load(), 20000);
+}
+
+BOOST_AUTO_TEST_CASE(test_pool_worker_busy_and_idle_time) {
+    // Per-worker slots are whole cache lines, so no two workers' clocks share one
+    static_assert(sizeof(WorkerClock) <= cache_line_size);
+
+    auto check = [](auto& pool) {
+        std::atomic<bool> release{false};
+        pool.execute([&release] {
+            while (!release.load()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        BOOST_CHECK_EQUAL(pool.busy(), 1);
+
+        // One worker has been running the task for the last 50ms, the other waiting all along
+        std::vector<WorkerTimes> times = pool.worker_times();
+        BOOST_REQUIRE_EQUAL(times.size(), 2);
+        std::sort(times.begin(), times.end(), [](const WorkerTimes& a, const WorkerTimes& b) { return a.busy > b.busy; });
+        BOOST_CHECK(times[0].busy >= std::chrono::milliseconds(40));
+        BOOST_CHECK(times[1].busy < std::chrono::milliseconds(10));
+        BOOST_CHECK(times[1].idle >= std::chrono::milliseconds(40));
+
+        release = true;
+        for (int i = 0; i < 1000 && pool.busy() > 0; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        BOOST_CHECK_EQUAL(pool.busy(), 0);
+    };
+    ThreadPool fifo(2);
+    check(fifo);
+    WorkStealingPool stealing(2);
+    check(stealing);
+}
+
+BOOST_AUTO_TEST_CASE(test_thread_pool_grows_and_shrinks) {
+    PoolSizing sizing;
+    sizing.max_threads = 3;
+    sizing.target_wait = std::chrono::milliseconds(5);
+    sizing.idle_timeout = std::chrono::milliseconds(100);
+    ThreadPool pool(1, 0, OverflowPolicy::Block, sizing);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK_EQUAL(pool.worker_times().size(), 3);
+
+    // Three tasks that hold their workers: the queued ones wait past the target, so the pool grows to fit them
+    std::atomic<bool> release{false};
+    std::atomic<int> started{0};
+    for (int i = 0; i < 3; ++i) {
+        pool.execute([&] {
+            started.fetch_add(1);
+            while (!release.load()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+    }
+    for (int i = 0; i < 1000 && started.load() < 3; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    BOOST_CHECK_EQUAL(started.load(), 3);
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+    BOOST_CHECK_EQUAL(pool.resize_stats().grown, 2);
+
+    // Once idle for the timeout, the extra workers retire, down to the one it started with
+    release = true;
+    for (int i = 0; i < 2000 && pool.size() > 1; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK_EQUAL(pool.resize_stats().shrunk, 2);
+
+    // And it still runs tasks
+    std::atomic<bool> ran{false};
+    pool.execute([&ran] { ran = true; });
+    for (int i = 0; i < 1000 && !ran.load(); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    BOOST_CHECK(ran.load());
+}
+
+BOOST_AUTO_TEST_CASE(test_task_move_only_callables) {
+    // A socket-sized move-only capture lives inline; anything bigger goes to the heap
+    static_assert(Task::stores_inline<decltype([s = tcp::socket(std::declval<boost::asio::io_context&>())] {})>);
+    static_assert(!Task::stores_inline<decltype([big = std::array<char, 256>()] {})>);
+
+    auto counter = std::make_shared<int>(0);
+    Task small([owned = std::make_unique<int>(1), counter] { *counter += *owned; });
+    Task large([padding = std::array<char, 256>(), counter] { *counter += 10; });
+
+    Task moved = std::move(small);
+    BOOST_CHECK(!small);
+    moved();
+    large();
+    BOOST_CHECK_EQUAL(*counter, 11);
+
+    moved = std::move(large);
+    moved();
+    BOOST_CHECK_EQUAL(*counter, 21);
+    moved = Task();
+    BOOST_CHECK_EQUAL(counter.use_count(), 1);
+
+    std::atomic<int> ran{0};
+    {
+        ThreadPool pool(2);
+        pool.execute([owned = std::make_unique<int>(5), &ran] { ran += *owned; });
+    }
+    BOOST_CHECK_EQUAL(ran.load(), 5);
+}
+
+BOOST_AUTO_TEST_CASE(test_thread_pool_overflow_policies) {
+    // With the only worker held up and the one queue slot taken, the next task trips the overflow policy
+    std::atomic<bool> started{false};
+    std::atomic<bool> release{false};
+    std::atomic<int> ran{0};
+    auto fill = [&](ThreadPool& pool) {
+        started = false;
+        release = false;
+        ran = 0;
+        pool.execute([&] { started = true; while (!release) std::this_thread::yield(); ran += 1; });
+        while (!started) std::this_thread::yield();
+        BOOST_CHECK(pool.execute([&ran] { ran += 10; }));
+    };
+
+    {
+        ThreadPool pool(1, 1, OverflowPolicy::Reject);
+        fill(pool);
+        BOOST_CHECK(!pool.execute([&ran] { ran += 100; }));
+        BOOST_CHECK_EQUAL(pool.overflow_stats().rejected, 1u);
+        release = true;
+    }
+    BOOST_CHECK_EQUAL(ran.load(), 11);
+
+    {
+        ThreadPool pool(1, 1, OverflowPolicy::DropOldest);
+        fill(pool);
+        BOOST_CHECK(pool.execute([&ran] { ran += 100; }));
+        BOOST_CHECK_EQUAL(pool.overflow_stats().dropped, 1u);
+        release = true;
+    }
+    BOOST_CHECK_EQUAL(ran.load(), 101);
+}
+
+BOOST_AUTO_TEST_CASE(test_thread_pool_priority_lanes) {
+    // High tasks run before every Normal one queued ahead of them and don't count against the queue limit
+    std::atomic<bool> started{false};
+    std::atomic<bool> release{false};
+    std::mutex order_mutex;
+    std::vector<int> order;
+    auto record = [&](int n) { return [&, n] { std::lock_guard<std::mutex> lock(order_mutex); order.push_back(n); }; };
+    {
+        ThreadPool pool(1, 1, OverflowPolicy::Reject);
+        pool.execute([&] { started = true; while (!release) std::this_thread::yield(); });
+        while (!started) std::this_thread::yield();
+        BOOST_CHECK(pool.execute(record(1)));
+        BOOST_CHECK(!pool.execute(record(2)));
+        BOOST_CHECK(pool.execute(record(3), Priority::High));
+        BOOST_CHECK(pool.execute(record(4), Priority::High));
+        BOOST_CHECK_EQUAL(pool.queued(), 3u);
+        release = true;
+    }
+    BOOST_CHECK(order == std::vector<int>({3, 4, 1}));
+}